@@ -8,9 +8,34 @@
 
 #include "include/WFS.h" // Wavefront Sensor driver's header file
 #include "include/TLDFMX.h"
+#include "src/recon.h"
+#include "src/zonal.h"
+#include "src/linalg.h"
+#include "src/control.h"
+#include "src/rtloop.h"
+#include "src/pipeline.h"
+#include "src/exposure.h"
+#include "src/centroid.h"
+#include "src/zfit.h"
+#include "src/spsc.h"
+#include "src/console.h"
+#include "src/telemetry.h"
+#include "src/hal.h"
+#include "src/sim.h"
+#include "src/capture.h"
+#include "src/calib.h"
+#include "src/calcache.h"
+#include "src/config.h"
+#include "src/startup.h"
+#include "src/alog.h"
+#include "src/tiptilt.h"
+#include "src/mrate.h"
+#include "src/vbox.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#include <math.h>
 #include <pthread.h>
 
 
@@ -24,6 +49,14 @@
 #define  DEVICE_OFFSET_WFS30           (0x00400) // device IDs of WFS30 instruments start at 1024 decimal
 #define  DEVICE_OFFSET_WFS40           (0x00800) // device IDs of WFS40 instruments start at 2048 decimal
 
+#if defined(_MSC_VER)
+#define  NORETURN                      __declspec(noreturn)
+#define  THREAD_LOCAL                  __declspec(thread)
+#else
+#define  NORETURN                      __attribute__((noreturn))
+#define  THREAD_LOCAL                  __thread
+#endif
+
 // settings for this sample program, you may adapt settings to your preferences
 #define  OPTION_OFF                    (0)
 #define  OPTION_ON                     (1)
@@ -41,7 +74,8 @@
 #define  SAMPLE_PUPIL_DIAMETER_X       (2.0) // in mm, needs to fit to selected camera resolution
 #define  SAMPLE_PUPIL_DIAMETER_Y       (2.0)
 
-#define  SAMPLE_IMAGE_READINGS         (10) // trials to read a exposed spotfield image
+#define  SAMPLE_EXPOS_SEARCH_FRAMES    (8)  // frames the exposure search may take before it falls back to the camera's auto exposure
+#define  SAMPLE_EXPOS_FILE_NAME        "WFS-DMH_exposure.txt" // last good exposure and gain, the next search starts there
 
 #define  SAMPLE_OPTION_DYN_NOISE_CUT   OPTION_ON   // use dynamic noise cut features  
 #define  SAMPLE_OPTION_CALC_SPOT_DIAS  OPTION_OFF  // don't calculate spot diameters
@@ -51,7 +85,10 @@
 #define  SAMPLE_OPTION_HIGHSPEED       OPTION_ON   // use highspeed mode (only for WFS10 and WFS20 instruments)
 #define  SAMPLE_OPTION_HS_ADAPT_CENTR  OPTION_ON   // adapt centroids in highspeed mode to previously measured centroids
 #define  SAMPLE_HS_NOISE_LEVEL         (30)        // cut lower 30 digits in highspeed mode
-#define  SAMPLE_HS_ALLOW_AUTOEXPOS     (1)         // allow autoexposure in highspeed mode (runs somewhat slower)
+#define  SAMPLE_HS_ALLOW_AUTOEXPOS     OPTION_OFF  // no camera autoexposure in highspeed mode, the exposure tuner (expo_update) keeps control
+#define  SAMPLE_EXPOS_TUNE_EVERY       (25)        // frames between two looks of the exposure tuner at the image
+#define  SAMPLE_HS_CHECK_EVERY         (50)        // check every n frames that the spots are still inside their highspeed windows
+#define  SAMPLE_HS_RETRY_EVERY         (200)       // after a fallback to full-frame mode, re-arm highspeed mode after n frames
 
 #define  SAMPLE_WAVEFRONT_TYPE         WAVEFRONT_MEAS // calculate measured wavefront
 
@@ -60,11 +97,89 @@
 #define  SAMPLE_PRINTOUT_SPOTS         (5)  // printout results for first 5 x 5 spots only
 
 #define  SAMPLE_OUTPUT_FILE_NAME       "WFS_sample_output.txt"
+#define  SAMPLE_CONFIG_FILE_NAME       "WFS-DMH.cfg" // read at startup unless a configuration file is named on the command line
+#define  SAMPLE_MAX_INSTRUMENTS        (16)  // devices listed by the selection
 
 #define VAL_ESC_VKEY                   (3L << 8)
 
 #define  MAX_SEGMENTS	(40)
 
+#define  LOOP_RECON_TLDFMX             (0)   // voltages from TLDFMX_get_flat_wavefront every iteration
+#define  LOOP_RECON_NATIVE             (1)   // voltages from the measured control matrix (src/recon.c)
+#define  LOOP_RECON_ZONAL              (2)   // voltages straight from spot deviations, no Zernike fit (src/zonal.c)
+
+#define  STARTUP_ERR_UNUSABLE_IMAGE    (1)   // neither the exposure search nor the auto exposure gave a well exposed image
+#define  STARTUP_ERR_NO_MLA            (2)   // no microlens array matches config.mla_name, or several and none named
+
+#define  LOOP_CMD_TARGET               (0)   // operator -> loop: new Zernike target vector
+#define  LOOP_CMD_PAUSE                (1)   // hold the mirror, keep measuring
+#define  LOOP_CMD_RESUME               (2)
+#define  LOOP_CMD_GAIN                 (3)   // integral gain of one channel or all (channel -1)
+#define  LOOP_CMD_QUIT                 (4)
+#define  LOOP_CMD_REPORT               (5)   // hand the operator a report at the next iteration
+#define  LOOP_CMD_CAPTURE              (6)   // start (value 1) or stop (value 0) recording raw frames
+
+#define  LOOP_EVENT_STATUS             (0)   // loop -> operator: periodic status
+#define  LOOP_EVENT_CONVERGED          (1)   // residual inside the lock band after a target change
+#define  LOOP_EVENT_LOCK_LOST          (2)   // loop failed to lock for more than 10 iterations
+
+#define  SAMPLE_LOOPS                  (1)     // closed loops in this process, one WFS/DM pair, one core and one set of files each
+#define  ENGINE_MAX_LOOPS              MAX_WFS_DEVICES // cameras the WFS driver runs at the same time
+#define  SAMPLE_LOOP_RECONSTRUCTOR     LOOP_RECON_NATIVE
+#define  SAMPLE_BACKEND                HAL_BACKEND_THORLABS // HAL_BACKEND_SIM runs the loop on the simulated optical bench (src/sim.c), HAL_BACKEND_REPLAY on recorded frames
+#define  SAMPLE_BIAS_VOLTAGE           (50.0)  // segment voltages the calibration and the loop start from
+#define  SAMPLE_DM_RELAX               OPTION_OFF // relax mirror and tilt arms at startup, runs next to the WFS camera setup
+#define  SAMPLE_POKE_VOLTAGE           (10.0)  // push-pull amplitude in V for the interaction matrix, keep it lower with Hadamard patterns
+#define  SAMPLE_CALIB_SCHEME           CALIB_SCHEME_POKE // CALIB_SCHEME_HADAMARD moves all segments per pattern: 1 frame there ~ 64 frames per poke
+#define  SAMPLE_CALIB_FRAMES           (4)     // frames averaged at every push and every pull
+#define  SAMPLE_CALIB_SETTLE_FRAMES    (1)     // frames dropped after every pattern change while the mirror settles
+#define  SAMPLE_CALIB_NOISE_FRAMES     (8)     // frames at the bias for the noise estimate
+#define  SAMPLE_RECON_RCOND            RECON_DEFAULT_RCOND
+#define  SAMPLE_CALCACHE_PREFIX        "WFS-DMH_cal" // calibration cache, one file per WFS serial, DM serial and MLA
+#define  SAMPLE_CALCACHE_CHECK_PATTERNS (2)    // Hadamard patterns pushed and pulled to check a cached calibration
+#define  SAMPLE_CALCACHE_TOLERANCE     (0.3)   // largest relative difference of their response to the cached matrix
+#define  SAMPLE_CALCACHE_DRIFT_UM      (0.05)  // largest rms drift of Z4..Z15 at the bias from the cached reference
+#define  SAMPLE_CALCACHE_DRIFT_PX      (1.0)   // largest rms drift of the spots from the cached reference positions
+#define  SAMPLE_CALCACHE_LOST          (0.05)  // largest fraction of the cached lenslets that may have lost their spot
+
+#define  SAMPLE_ZERNIKE_PROJECTION     OPTION_ON // native/zonal paths: Zernikes from a cached projection matrix (src/zfit.c) instead of WFS_ZernikeLsf
+#define  SAMPLE_CENTROID_ENGINE        OPTION_ON // zonal path: centroids from the raw image (src/centroid.c) instead of WFS_CalcSpotsCentrDiaIntens
+#define  SAMPLE_CENTROID_THRESHOLD     CENT_DEFAULT_THRESHOLD
+
+#define  SAMPLE_ZONAL_GAIN             (0.4)   // integral gain of every segment in the zonal path
+#define  SAMPLE_ZONAL_LEAK             (0.005)
+#define  SAMPLE_PROJECTION_ITERATIONS  (8)     // active-set iterations per frame onto the segment voltage range (src/vbox.c), 0 clips each segment
+
+#define  SAMPLE_LOOP_RATE_HZ           (20.0)  // fixed loop rate, 0 runs as fast as possible
+#define  SAMPLE_LOOP_RT_PRIORITY       (0)     // SCHED_FIFO priority of the loop thread, 0 keeps normal scheduling
+#define  SAMPLE_LOOP_CPU               (-1)    // pin the loop thread to this core, further loops to the following ones, -1 for no pinning
+#define  SAMPLE_LOOP_REPORT_EVERY      (500)   // print loop timing every n high-order corrections
+#define  SAMPLE_LOOP_PIPELINED         OPTION_OFF // expose frame N+1 while frame N is corrected: more throughput, one frame more delay
+#define  SAMPLE_MULTIRATE              ""      // native path: Z4 .. Z15 in groups "first-last:divisor:depth", e.g. "4-6:1:1,7-10:2:2,11-15:4:4", "" for one rate
+#define  SAMPLE_BUDGET_ACQUIRE_US      (30000.0) // per stage time budgets, overruns are counted
+#define  SAMPLE_BUDGET_MEASURE_US      (10000.0)
+#define  SAMPLE_BUDGET_RECONSTRUCT_US  (1000.0)
+#define  SAMPLE_BUDGET_ACTUATE_US      (5000.0)
+#define  SAMPLE_BUDGET_TILT_US         (2000.0) // tilt arm update and TLDFM_set_tilt_voltages, with tip/tilt on
+#define  SAMPLE_CHANNEL_DEPTH          (16)    // messages in each direction between the operator and the loop
+#define  SAMPLE_OPERATOR_POLL_MS       (10.0)  // operator console looks for input and loop events at this interval
+#define  SAMPLE_TELEMETRY              OPTION_ON // record every loop iteration to SAMPLE_TELEMETRY_FILE_NAME
+#define  SAMPLE_TELEMETRY_FILE_NAME    "WFS-DMH_telemetry.bin"
+#define  SAMPLE_TELEMETRY_RECORDS      (1 << 20) // ring size, 445 MB: ~14 h at 20 Hz, ~17 min at 1 kHz
+#define  SAMPLE_CAPTURE                OPTION_OFF // record raw frames from the start, the console 'c 1' / 'c 0' starts and stops it any time
+#define  SAMPLE_CAPTURE_FILE_NAME      "WFS-DMH_capture.bin"
+#define  SAMPLE_CAPTURE_DEPTH          (32)    // frames that may wait for the disk before new ones are dropped
+#define  SAMPLE_REPLAY_FILE_NAME       SAMPLE_CAPTURE_FILE_NAME // frames served by HAL_BACKEND_REPLAY, over and over
+#define  SAMPLE_TIPTILT                OPTION_OFF // drive the DMH tilt arms from the beam tilt on every frame (src/tiptilt.c)
+#define  SAMPLE_TIPTILT_SOURCE         TT_SOURCE_SPOTS // mean spot deviation, or TT_SOURCE_BEAM for the beam centroid
+#define  SAMPLE_TIPTILT_GAIN           (0.6)   // integral gain of both axes, the Zernike 2 / 3 console gains change them
+#define  SAMPLE_TIPTILT_LEAK           (0.001)
+#define  SAMPLE_TIPTILT_HO_EVERY       (2)     // with tip/tilt on, the high-order loop corrects every n-th frame only
+#define  SAMPLE_TIPTILT_POKE_VOLTAGE   (10.0)  // push-pull amplitude of the tilt arm calibration, V
+#define  SAMPLE_LOG_FILE_NAME          "WFS-DMH_log.txt" // every loop message with its time, the configuration can set "" for none
+#define  SAMPLE_LOG_CONSOLE_HZ         (2.0)   // console lines per second of each loop message, the log file gets all of them
+#define  SAMPLE_LOG_DEPTH              (1024)  // loop messages per thread that may wait for the log writer before new ones are dropped
+
 typedef struct
 {
 	ViUInt8 firstHighByte;
@@ -79,13 +194,129 @@ typedef union
 	ViUInt32                 dwordRepresentation;
 } SAMPLE_dword_t;
 
+typedef struct session session_t;   // one closed loop, see below
+
 typedef struct{
-	long unsigned int*	WFS_handle;
-	ViSession* handle;
-	float* target;
-	int*	thflag;
+	hal_sensor_t*	sensor;
+	hal_mirror_t*	mirror;
+	session_t* session;        // devices of this loop, TLDFMX reconstructor, error messages and files
+	float* target;             // target the loop starts with, later ones arrive through to_loop
+	spsc_t*	to_loop;           // operator -> loop commands (loop_cmd_t)
+	spsc_t*	from_loop;         // loop -> operator events (loop_event_t)
+	recon_t*	recon;     // control matrix, used with LOOP_RECON_NATIVE and LOOP_RECON_ZONAL
+	zonal_t*	zonal;     // slope control matrix, only used with LOOP_RECON_ZONAL
+	ViReal64*	voltage;   // segment voltages the loop starts from
+	ViReal64	seg_min, seg_max;
+	int	highspeed;         // run the camera in highspeed mode (WFS10 / WFS20 only)
+	cent_grid_t*	grid;      // centroiding engine, NULL to use the driver's centroids
+	zfit_t*	zfit;              // Zernike projection, NULL to use WFS_ZernikeLsf
+	tt_t*	tiptilt;           // tilt arm controller, NULL when tip/tilt is not offloaded
+	mrate_t*	mrate;     // mode groups at their own rates, NULL when all modes are corrected on every frame
 } threadArgs;
 
+typedef struct
+{
+	int               type;          // LOOP_CMD_*
+	float             target[16];    // LOOP_CMD_TARGET
+	int               channel;       // LOOP_CMD_GAIN: Zernike number (modal) or segment number (zonal), -1 for all
+	double            value;         // LOOP_CMD_GAIN, LOOP_CMD_CAPTURE
+} loop_cmd_t;
+
+typedef struct
+{
+	int               type;          // LOOP_EVENT_*
+	long              iteration;
+	double            residual_rms;  // um, Z4 .. Z15
+} loop_event_t;
+
+typedef struct
+{
+	float             zernike[16];                          // measured Zernikes, modal and TLDFMX path
+	float             deviation_x[MAX_SPOTS_Y][MAX_SPOTS_X]; // spot deviations, zonal path
+	float             deviation_y[MAX_SPOTS_Y][MAX_SPOTS_X];
+	double            t_ns;                                 // acquisition start
+	double            acquire_ns, measure_ns;               // stage times, taken with the frame so they pipeline with it
+	double            tilt[TT_AXES];                        // tip/tilt signal, TT_SOURCE_* units
+	int               tilt_ok;                              // tilt holds a measurement
+	int               high_order;                           // the high-order loop corrects from this frame
+	long              ho_frame;                             // high-order frame number, the multi-rate schedule runs on it
+	long              group_frame[MRATE_MAX_GROUPS];        // multi-rate: ho_frame the last mean of every group is from, zernike holds these means
+	double            exposure;                             // ms, the frame was exposed with
+	double            gain;
+	int               highspeed;                            // the frame was taken in highspeed mode
+} loop_frame_t;
+
+typedef struct
+{
+	int               correct, acquire;  // alog channels of the control thread and of the thread taking the frames
+	int               zernike, first_closed, hs_on, hs_failed, hs_fallback, capture_on, capture_off, capture_failed;
+} loop_log_t;
+
+typedef struct
+{
+	int               want;           // control thread -> acquisition side: the control half is taken, add yours; spsc_flag_load / spsc_flag_store
+	int               posted;         // set by the acquisition side once both halves are taken, cleared by the operator once printed
+	rt_sched_t        rt;             // acquisition half: copies of the state of the thread taking the frames
+	double            exposure;
+	long              expo_changes;
+	double            expo_peak, expo_saturated_pct;
+	int               hs_active;
+	long              hs_fallbacks;
+	mrate_t           mrate;          // counters only, no sums
+	rt_sched_t        rt_correct;     // control half: copies of the state of the control thread
+	pipeline_stats_t  pipe;
+	vbox_t            vbox;           // counters only
+	long              tt_updates;
+	double            tt_error[TT_AXES];
+	double            tt_voltage[HAL_MAX_TILT];
+	long              tt_saturated;
+} loop_report_t;
+
+typedef struct
+{
+	threadArgs        *args;
+	loop_log_t        *log;          // channels and messages of this loop
+	ctrl_t            ctrl;
+	vbox_t            vbox;          // voltages outside the segment range are projected onto it, not clipped
+	rt_sched_t        rt;            // paces acquisition, times acquire and measure
+	rt_sched_t        rt_correct;    // times reconstruct and actuate when pipelined
+	rt_sched_t        *rt_corr;      // &rt when sequential, &rt_correct when pipelined
+	int               st_acquire, st_measure, st_tilt, st_reconstruct, st_actuate; // st_tilt -1 without tip/tilt
+	long              frames;         // frames taken, the high-order loop runs on every config.tiptilt_ho_every-th
+	long              corrections;    // high-order corrections
+	long              ho_frames;      // high-order frames, including those only averaged by the multi-rate groups
+	double            residual[RECON_MODES]; // multi-rate: last averaged residual of every mode
+	int               mr_source;      // what the multi-rate sums hold: projection generation, -1 for the driver's Zernikes
+	double            mr_mean[2 * MAX_SPOTS_X * MAX_SPOTS_Y]; // mean slopes of a group that is due
+	float             mr_zernike[16]; // last mean of every group, acquisition side
+	long              mr_frame[MRATE_MAX_GROUPS];   // ho_frame of these means, acquisition side
+	long              mr_applied[MRATE_MAX_GROUPS]; // ho_frame of the mean every group last stepped on, control side
+	pipeline_t        pipe;
+	expo_tuner_t      expo;
+	double            exposure;       // exposure time of the next frame, ms, acquisition side only: frames carry their own
+	double            gain;           // camera master gain, acquisition side only
+	int               hs_active;      // camera is in highspeed mode, acquisition side only
+	long              hs_frames;      // frames since the last window check or fallback
+	long              hs_fallbacks;
+	float             target[16];     // owned by the control thread, replaced as a whole from to_loop
+	float             lastTarget[16];
+	double            ctrlVoltage[60];
+	int               counter;
+	int               recorder;
+	int               converged;      // CONVERGED already reported for the current target
+	int               lock_lost;      // LOCK_LOST already reported
+	int               closed;         // the first correction reached the mirror
+	int               paused;         // operator holds the mirror
+	int               quit;
+	int               stop;           // tells the acquisition thread to end, spsc_flag_load / spsc_flag_store
+	tlm_t             tlm;
+	int               tlm_on;
+	capture_writer_t  cap;
+	int               cap_open;
+	int               cap_request;    // set by the control thread, acted on where frames are taken, spsc_flag_load / spsc_flag_store
+	int               capturing;
+} loop_state_t;
+
 /*=============================================================================
  Callbacks
 =============================================================================*/
@@ -106,6 +337,7 @@ typedef struct
 	char              instrument_name[WFS_BUFFER_SIZE];
 	char              serial_number_wfs[WFS_BUFFER_SIZE];
 	char              serial_number_cam[WFS_BUFFER_SIZE];
+	char              serial_number_dm[WFS_BUFFER_SIZE];
 	
 	long int               mla_cnt;
 	int               selected_mla;
@@ -122,22 +354,129 @@ typedef struct
 	long int               spots_x;
 	long int               spots_y;
 
+	int               hs_win_count_x, hs_win_count_y;   // highspeed windows data
+	int               hs_win_size_x, hs_win_size_y;
+	int               hs_win_start_x[MAX_SPOTS_X], hs_win_start_y[MAX_SPOTS_Y];
+
 }  instr_t;
 
+/*---------------------------------------------------------------------------
+ One closed loop: its WFS and DMH, their HAL tables, the calibration, the
+ channels to the operator and the loop state. Loops share no state, a loop
+ thread only touches its own session.
+---------------------------------------------------------------------------*/
+struct session
+{
+	int               index;          // 0 .. engine.n - 1
+	char              label[16];      // "Loop 2: " in front of its messages with several loops, "" with one
+	char              wfs_serial[CONFIG_STRING_LENGTH]; // item of config.wfs_serial / dm_serial for this loop
+	char              dm_serial[CONFIG_STRING_LENGTH];
+	int               cpu;            // core of the loop thread, -1 for no pinning
+	instr_t           instr;          // all WFS related data, the sensor context of the Thorlabs backend
+	ViSession         dm;             // DMH driver session, VI_NULL until opened
+	int               geometry_generation; // bumped on every pupil or MLA change, a Zernike projection built for an older one is rebuilt
+	float             target[16];     // target the loop starts on
+	char              telemetry_file[CONFIG_STRING_LENGTH];
+	char              capture_file[CONFIG_STRING_LENGTH];
+	char              capture_on_text[2 * CONFIG_STRING_LENGTH + 64]; // loop messages naming capture_file, its % doubled
+	char              capture_failed_text[2 * CONFIG_STRING_LENGTH + 64];
+	
+	hal_sensor_t      *sensor;
+	hal_mirror_t      *mirror;
+	hal_sensor_t      wfs_sensor;     // backends, one of them is used
+	hal_mirror_t      dmh_mirror;
+	sim_optics_t      sim;
+	replay_t          replay;
+	ViReal64          voltage[MAX_SEGMENTS]; // bias of the calibration, the loop starts from it
+	recon_t           recon;
+	zonal_t           zonal;
+	zfit_t            zfit;
+	cent_grid_t       centroid_grid;
+	tt_t              tiptilt;
+	mrate_t           mrate;
+	
+	spsc_t            to_loop, from_loop;
+	threadArgs        args;
+	loop_log_t        log;
+	loop_state_t      ls;
+	loop_report_t     report;         // the loop's report to the operator thread, one at a time
+	loop_report_t     last_report;    // taken when the loop ends, printed once every loop has ended
+	loop_frame_t      frames[2];      // the sequential loop uses frames[0] only
+	pthread_t         thread;
+	
+	pthread_mutex_t   busy_lock;      // the loop's threads against engine_exit closing its drivers
+	pthread_cond_t    busy_changed;
+	int               busy;           // threads of this loop between session_busy_begin and session_busy_end
+	int               exiting;        // engine_exit runs, no thread of this loop starts another driver call
+};
+
+typedef struct
+{
+	session_t         session[ENGINE_MAX_LOOPS];
+	int               n;              // config.loops
+	pthread_mutex_t   exit_lock;      // the first fatal error closes the devices, a second one waits for the exit
+	pthread_mutex_t   expo_lock;      // the loops search their exposure at the same time, one file keeps them all
+} engine_t;
+
 
 /*===============================================================================================================================
   Function Prototypes
 ===============================================================================================================================*/
-void handle_errors (int);
-int select_instrument (int *selection, ViChar resourceName[]);
-int select_mla (int *selection);
+void handle_errors (session_t *s, int err);
+int select_instrument (session_t *s, int *selection, ViChar resourceName[]);
+int select_mla (session_t *s, int *selection);
 
 void waitKeypress (void);
-void error_exit (ViSession handle, ViStatus err);
-ViStatus select_instrument_DMH (ViChar** resource);
-
-void get_Zernike_list (void);
+int find_exposure (hal_sensor_t *sensor, const char *serial);
+void thorlabs_sensor (session_t *s, hal_sensor_t *sensor);
+void config_sample_defaults (config_t *cfg);
+int camera_resolution (session_t *s, const int xpixel[], const int ypixel[], int count, int default_index);
+NORETURN void error_exit (session_t *s, ViStatus err);
+ViStatus select_instrument_DMH (session_t *s, ViChar** resource, ViChar serial[]);
+
+void session_init (session_t *s, int index);
+void session_open (session_t *s);
+void session_close (session_t *s);
+void session_close_drivers (session_t *s);
+void session_busy_begin (session_t *s);
+void session_busy_end (session_t *s);
+void session_file_name (const session_t *s, const char *name, char buf[], int size);
+NORETURN void engine_exit (int status);
+
+void *operator_thread (void *Args);
+void operator_send (spsc_t *to_loop, loop_cmd_t *cmd);
+void operator_command (session_t *s, const console_cmd_t *cc, loop_cmd_t *cmd, const loop_event_t *status);
+void thorlabs_open (session_t *s);
+void thorlabs_backend (session_t *s);
+int  measure_interaction_matrix (session_t *s, recon_t *rc, zonal_t *zn, const cent_grid_t *grid, zfit_t *zf, ViReal64 bias[], double ref[]);
+int  check_calibration (session_t *s, const recon_t *rc, const zonal_t *zn, const cent_grid_t *grid, zfit_t *zf, ViReal64 bias[], const double ref[], int n_ref);
+void measure_calib_frame (session_t *s, const zonal_t *zn, const cent_grid_t *grid, zfit_t *zf, double meas[]);
+void measure_zernikes (session_t *s, zfit_t *zf, float deviation_x[], float deviation_y[], float zernike[], double tilt[]);
+int  zernike_projection (session_t *s, zfit_t *zf, float deviation_x[], float deviation_y[]);
+void measure_groups (loop_state_t *ls, loop_frame_t *fr, double tilt[]);
+void measure_deviations (session_t *s, const cent_grid_t *grid, float deviation_x[], float deviation_y[], double tilt[]);
+int  measure_tilt (session_t *s, const cent_grid_t *grid, int source, double tilt[]);
+int  measure_tiptilt_response (session_t *s, const cent_grid_t *grid, tt_t *tt);
+void tiptilt_correct (loop_state_t *ls, const loop_frame_t *fr);
+void update_zonal_target (zonal_t *zn, const recon_t *rc, const float target[]);
 void *Loop(void * Argstruct);
+void loop_measure (loop_state_t *ls, loop_frame_t *fr);
+void loop_correct (loop_state_t *ls, loop_frame_t *fr);
+void loop_poll_commands (loop_state_t *ls);
+void loop_send_event (loop_state_t *ls, int type, double residual_rms);
+void *loop_acquire_thread (void *Args);
+void highspeed_service (loop_state_t *ls);
+void highspeed_arm (loop_state_t *ls);
+void exposure_init (loop_state_t *ls);
+void exposure_service (loop_state_t *ls);
+void loop_report (loop_state_t *ls);
+void loop_report_acquire (loop_state_t *ls);
+void loop_report_take_acquire (loop_state_t *ls, loop_report_t *rp);
+void loop_report_take_correct (loop_state_t *ls, loop_report_t *rp);
+void loop_report_print (const session_t *s, const loop_report_t *rp);
+void loop_telemetry (loop_state_t *ls, const loop_frame_t *fr, const double residual[], int clamped, int flags);
+void loop_capture (loop_state_t *ls, const loop_frame_t *fr);
+void loop_log_start (void);
 
 /*===============================================================================================================================
   Global Variables
@@ -155,150 +494,555 @@ const int   cam_wfs40_ypixel[] = {  2048, 1536, 1024, 768, 512, 360, 1024, 768,
 
 const int   zernike_modes[] = { 1, 3, 6, 10, 15, 21, 28, 36, 45, 55, 66 }; // converts Zernike order to Zernike modes
 
-instr_t     instr = { 0 };    // all instrument related data are stored in this structure
+config_t    config;           // SAMPLE_* defaults, overridden by the configuration file and the command line
+engine_t    engine;           // the closed loops of this process, every instrument related data is in its session
 
-int         hs_win_count_x,hs_win_count_y,hs_win_size_x,hs_win_size_y; // highspeed windows data
-int         hs_win_start_x[MAX_SPOTS_X],hs_win_start_y[MAX_SPOTS_Y];
-ViSession instrHdl = VI_NULL;
-float	target_zernike[16];
+double      t_program_start_ns;   // time to first closed loop is counted from here
+THREAD_LOCAL session_t *thread_busy_session; // session whose drivers this thread is using, NULL if none
+alog_t      alog;                 // loop messages of all loops, formatted and written by the log thread
+const char *loop_tlm_stages[] = { "acquire", "measure", "reconstruct", "actuate", "tilt" };
+
+// loop controller for Z4 .. Z15: integral gain, leak, proportional gain, derivative gain
+// low orders take large steps, the noisier high orders are integrated more slowly
+const ctrl_param_t loop_ctrl_param[RECON_MODES] = {
+	{ 0.5, 0.005, 0.0, 0.0 }, { 0.5, 0.005, 0.0, 0.0 }, { 0.5, 0.005, 0.0, 0.0 },                            // Z4 .. Z6
+	{ 0.4, 0.005, 0.0, 0.0 }, { 0.4, 0.005, 0.0, 0.0 }, { 0.4, 0.005, 0.0, 0.0 }, { 0.4, 0.005, 0.0, 0.0 },  // Z7 .. Z10
+	{ 0.3, 0.01,  0.0, 0.0 }, { 0.3, 0.01,  0.0, 0.0 }, { 0.3, 0.01,  0.0, 0.0 }, { 0.3, 0.01,  0.0, 0.0 },  // Z11 .. Z14
+	{ 0.3, 0.01,  0.0, 0.0 } };                                                                              // Z15
 
 /*===============================================================================================================================
   Code
 ===============================================================================================================================*/
-void main (void)
+void main (int argc, char *argv[])
 {
-	long int               err;
-	int               i,j,cnt;
-	int               rows, cols;   // image height and width, depending on camera resolution
-	int               selection;
-	unsigned char     *ImageBuffer; // pointer to the camera image buffer
+	long int          err;
+	pthread_t         console_id;
+	int               i;
 	
-	double            expos_act, master_gain_act;
-	double            beam_centroid_x, beam_centroid_y;
-	double            beam_diameter_x, beam_diameter_y;
+	t_program_start_ns = rt_now_ns();
+	pthread_mutex_init(&engine.exit_lock, NULL);
+	pthread_mutex_init(&engine.expo_lock, NULL);
 	
-	float             centroid_x[MAX_SPOTS_Y][MAX_SPOTS_X];
-	float             centroid_y[MAX_SPOTS_Y][MAX_SPOTS_X];
-
-	float             deviation_x[MAX_SPOTS_Y][MAX_SPOTS_X];
-	float             deviation_y[MAX_SPOTS_Y][MAX_SPOTS_X];
-
-	float             wavefront[MAX_SPOTS_Y][MAX_SPOTS_X];
+	// the configuration file and the command line replace the interactive selection and the SAMPLE_* settings
+	config_sample_defaults(&config);
+	if(err = config_args(&config, argc, argv, SAMPLE_CONFIG_FILE_NAME))
+	{
+		if(err == CONFIG_HELP)
+			config_help();
+		exit((err == CONFIG_HELP) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	printf("Configuration:\n");
+	config_print(&config, stdout);
+	if(config.loops < 1 || config.loops > ENGINE_MAX_LOOPS)
+	{
+		printf("loops = %d, one process runs 1 .. %d loops.\n", config.loops, ENGINE_MAX_LOOPS);
+		exit(EXIT_FAILURE);
+	}
+	engine.n = config.loops;
+	for(i = 0; i < engine.n; i++)
+		session_init(&engine.session[i], i);
 	
-	float             zernike_um[MAX_ZERNIKE_MODES+1];             // index runs from 1 - MAX_ZERNIKE_MODES
-	float             zernike_orders_rms_um[MAX_ZERNIKE_ORDERS+1]; // index runs from 1 - MAX_ZERNIKE_MODES
-	double            roc_mm;
+	// one loop after the other: the device selection may ask the operator, and the calibration helpers share their frame buffers
+	for(i = 0; i < engine.n; i++)
+		session_open(&engine.session[i]);
 	
-	long int               zernike_order;
+	loop_log_start();
+	// every loop starts on the configured target on its own thread and core, the operator console sends new targets while they run
+	for(i = 0; i < engine.n; i++)
+	{
+		if(pthread_create(&engine.session[i].thread, NULL, Loop, (void*) &engine.session[i].args))
+		{
+			printf("Could not start the loop threads.\n");
+			error_exit(&engine.session[i], TL_ERROR_SYSTEM_ERROR);
+		}
+	}
+	if(pthread_create(&console_id, NULL, operator_thread, (void*) &engine))
+	{
+		printf("Could not start the operator console.\n");
+		error_exit(NULL, TL_ERROR_SYSTEM_ERROR);
+	}
+	for(i = 0; i < engine.n; i++)
+		pthread_join(engine.session[i].thread, NULL);
+	pthread_join(console_id, NULL);
+	alog_stop(&alog);
+	for(i = 0; i < engine.n; i++)
+		loop_report_print(&engine.session[i], &engine.session[i].last_report);
+	alog_report(&alog, stdout);
+
+	// Close instruments, important to release allocated driver data!
+	for(i = 0; i < engine.n; i++)
+		session_close(&engine.session[i]);
+}
+
+
+/*---------------------------------------------------------------------------
+ Settings of loop index from the configuration, no device is touched yet.
+ Exits if the mode groups do not parse, before any loop opened a device.
+---------------------------------------------------------------------------*/
+void session_init (session_t *s, int index)
+{
+	memset(s, 0, sizeof(*s));
+	pthread_mutex_init(&s->busy_lock, NULL);
+	pthread_cond_init(&s->busy_changed, NULL);
+	s->index = index;
+	s->dm    = VI_NULL;
+	if(engine.n > 1)
+		snprintf(s->label, sizeof(s->label), "Loop %d: ", index + 1);
+	config_loop_serials(&config, index, s->wfs_serial, s->dm_serial, sizeof(s->wfs_serial));
+	s->cpu = (config.loop_cpu >= 0) ? config.loop_cpu + index : -1;
+	memcpy(s->target, config.target, sizeof(s->target));
+	session_file_name(s, SAMPLE_TELEMETRY_FILE_NAME, s->telemetry_file, sizeof(s->telemetry_file));
+	session_file_name(s, SAMPLE_CAPTURE_FILE_NAME, s->capture_file, sizeof(s->capture_file));
+	for(int i = 0; i < MAX_SEGMENTS; i++)
+		s->voltage[i] = SAMPLE_BIAS_VOLTAGE;
 	
-	double            wavefront_min, wavefront_max, wavefront_diff, wavefront_mean, wavefront_rms, wavefront_weighted_rms;
-	ViChar            resourceName[256];
-	FILE              *fp;
-	int               key;
-	int	thread_flag = 0;
+	mrate_init(&s->mrate, RECON_MODES);
+	if(config.multirate[0] && (mrate_parse(&s->mrate, config.multirate, RECON_FIRST_MODE) || !mrate_covers(&s->mrate)))
+	{
+		printf("multirate = %s does not split Z%d .. Z%d into groups of first-last:divisor:depth.\n", config.multirate, RECON_FIRST_MODE, RECON_FIRST_MODE + RECON_MODES - 1);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+ File of this loop: name itself with one loop, with several the loop number
+ goes in front of the extension, e.g. "WFS-DMH_capture_2.bin"
+---------------------------------------------------------------------------*/
+void session_file_name (const session_t *s, const char *name, char buf[], int size)
+{
+	const char *dot = strrchr(name, '.');
 	
+	if(engine.n == 1)
+		snprintf(buf, size, "%s", name);
+	else
+		snprintf(buf, size, "%.*s_%d%s", dot ? (int)(dot - name) : (int)strlen(name), name, s->index + 1, dot ? dot : "");
+}
 
-	// ViStatus  err = VI_SUCCESS;
+
+/*---------------------------------------------------------------------------
+ Bring up one loop: open its backend, load or measure its calibration,
+ measure the tilt arms and fill the arguments of its loop thread
+---------------------------------------------------------------------------*/
+void session_open (session_t *s)
+{
+	long int          err;
+	hal_sensor_t      *sensor;
+	hal_mirror_t      *mirror;
+	
+	if(engine.n > 1)
+		printf("\nLoop %d of %d, WFS %s, DMH %s, core %d.\n", s->index + 1, engine.n, s->wfs_serial[0] ? s->wfs_serial : "to be selected",
+		       s->dm_serial[0] ? s->dm_serial : "to be selected", s->cpu);
+	if(config.backend == HAL_BACKEND_SIM)
+	{
+		sim_optics_config_t cfg;
+		
+		sim_optics_defaults(&cfg);
+		cfg.pupil_diameter_mm = config.pupil_diameter_x;
+		if(config.reconstructor == LOOP_RECON_TLDFMX || sim_optics_init(&s->sim, &cfg))
+		{
+			printf("The simulated bench needs LOOP_RECON_NATIVE or LOOP_RECON_ZONAL.\n");
+			engine_exit(EXIT_FAILURE);
+		}
+		// the rest of the program reads the camera and MLA data from instr
+		s->instr.spots_x          = s->sim.grid.n_x;
+		s->instr.spots_y          = s->sim.grid.n_y;
+		s->instr.cam_pitch_um     = cfg.cam_pitch_um;
+		s->instr.lenslet_pitch_um = cfg.lenslet_pitch_um;
+		s->instr.lenslet_f_um     = cfg.lenslet_f_um;
+		strcpy(s->instr.serial_number_wfs, "SIM");
+		strcpy(s->instr.serial_number_dm, "SIM");
+		sensor = &s->sim.sensor;
+		mirror = &s->sim.mirror;
+	}
+	else if(config.backend == HAL_BACKEND_REPLAY)
+	{
+		if(config.reconstructor == LOOP_RECON_TLDFMX || replay_open(&s->replay, config.replay_file, 1))
+		{
+			printf("Could not replay %s, the replay needs LOOP_RECON_NATIVE or LOOP_RECON_ZONAL.\n", config.replay_file);
+			engine_exit(EXIT_FAILURE);
+		}
+		printf("Replaying %ld frames from %s.\n", s->replay.n_frames, config.replay_file);
+		s->instr.spots_x              = s->replay.header->spots_x;
+		s->instr.spots_y              = s->replay.header->spots_y;
+		s->instr.cam_pitch_um         = s->replay.header->cam_pitch_um;
+		s->instr.lenslet_pitch_um     = s->replay.header->lenslet_pitch_um;
+		s->instr.lenslet_f_um         = s->replay.header->lenslet_f_um;
+		s->instr.center_spot_offset_x = s->replay.header->center_spot_offset_x;
+		s->instr.center_spot_offset_y = s->replay.header->center_spot_offset_y;
+		strcpy(s->instr.serial_number_wfs, "REPLAY");
+		strcpy(s->instr.serial_number_dm, "REPLAY");
+		sensor = &s->replay.sensor;
+		mirror = &s->replay.mirror;
+	}
+	else
+	{
+		thorlabs_open(s);
+		thorlabs_backend(s);
+		printf("Devices ready %.1f ms after program start.\n", (rt_now_ns() - t_program_start_ns) * 1e-6);
+		sensor = &s->wfs_sensor;
+		mirror = &s->dmh_mirror;
+	}
+	s->sensor = sensor;
+	s->mirror = mirror;
+	printf("\nSensor: %s, mirror: %s (%d segments, %.0f .. %.0f V).\n", sensor->name, mirror->name, mirror->n_segments, mirror->seg_min, mirror->seg_max);
 	
-	ViChar    *rscPtr;
-	ViInt32   zernikeCount, systemMeasurementSteps, relaxSteps;
-	ViReal64  minZernikeAmplitude, maxZernikeAmplitude, voltage = 50.0;
-	ViReal64  mirrorPattern[MAX_SEGMENTS];
-	ViInt32 remainingSteps;
-	ViReal64 nextMirrorPattern[50];
+	// the zonal path keeps the modal matrix as well, it converts Zernike targets into slope targets
+	int use_zonal = (config.reconstructor == LOOP_RECON_ZONAL);
 	
-	for(ViInt32 i = 0; MAX_SEGMENTS > i; ++i)
+	// the zonal path may find the spots itself, the lenslet grid is laid out once from the MLA data
+	cent_grid_t *grid = NULL;
+	if(use_zonal && SAMPLE_CENTROID_ENGINE)
 	{
-		mirrorPattern[i] = voltage;
+		unsigned char *image;
+		int rows, columns;
+		if(err = sensor->take_image (sensor->ctx))
+			handle_errors(s, err);
+		if(err = sensor->get_image (sensor->ctx, &image, &rows, &columns))
+			handle_errors(s, err);
+		if(cent_grid_init(&s->centroid_grid, columns, rows, s->instr.cam_pitch_um, s->instr.lenslet_pitch_um, s->instr.center_spot_offset_x, s->instr.center_spot_offset_y, SAMPLE_CENTROID_THRESHOLD) > 0)
+		{
+			grid = &s->centroid_grid;
+			printf("\nCentroiding engine: %d x %d lenslet windows of %d pixels, %s kernel.\n", grid->n_x, grid->n_y, grid->win, grid->simd ? "AVX2" : "scalar");
+		}
+		else
+			printf("\nNo lenslet grid fits the image, using the driver's centroids.\n");
 	}
 	
-	// Show all and select one WFS instrument
-	if(select_instrument(&instr.selected_id, resourceName) == 0)
+	// the projection is built on first use and again after every pupil or MLA change
+	zfit_t *zf = NULL;
+	
+	// the native reconstructor needs the control matrix, which is measured once per setup and then reused from the cache
+	if(config.reconstructor != LOOP_RECON_TLDFMX)
 	{
-		printf("\nNo WFS selected. Press <ENTER> to exit.\n");
-		fflush(stdin);
-		getchar();
-		return; // program ends here if no instrument selected
+		if(recon_init(&s->recon, RECON_MODES, MAX_SEGMENTS))
+			error_exit(s, TL_ERROR_ALLOC);
+		if(SAMPLE_ZERNIKE_PROJECTION)
+		{
+			if(zfit_init(&s->zfit, MAX_SPOTS_X * MAX_SPOTS_Y, MAX_SPOTS_X))
+				error_exit(s, TL_ERROR_ALLOC);
+			zf = &s->zfit;
+		}
+		if(use_zonal && zonal_init(&s->zonal, MAX_SEGMENTS, MAX_SPOTS_X * MAX_SPOTS_Y, MAX_SPOTS_X))
+			error_exit(s, TL_ERROR_ALLOC);
+		
+		// the cache is looked up by serials and MLA and only used after a quick check against the live system
+		const double   pupil[4] = { config.pupil_centroid_x, config.pupil_centroid_y, config.pupil_diameter_x, config.pupil_diameter_y };
+		static double  cal_ref[RECON_MODES + 2 * MAX_SPOTS_X * MAX_SPOTS_Y];
+		calcache_key_t cal_key;
+		char           cal_path[512];
+		int            n_ref = 0, cached;
+		double         age_s;
+		
+		calcache_key_init(&cal_key, s->instr.serial_number_wfs, s->instr.serial_number_dm, s->instr.selected_mla, s->instr.spots_x, s->instr.spots_y,
+		                  MAX_SEGMENTS, config.reconstructor, pupil, s->voltage);
+		calcache_path(cal_path, sizeof(cal_path), SAMPLE_CALCACHE_PREFIX, &cal_key);
+		cached = calcache_load(cal_path, &cal_key, &s->recon, use_zonal ? &s->zonal : NULL, cal_ref, RECON_MODES + 2 * MAX_SPOTS_X * MAX_SPOTS_Y, &n_ref, &age_s);
+		if(cached == CALCACHE_OK)
+		{
+			printf("\nCalibration loaded from %s, measured %.1f h ago (rank %d).\n", cal_path, age_s / 3600.0, s->recon.rank);
+			if(use_zonal)
+				printf("Slope control matrix of %d lenslets, rank %d.\n", s->zonal.n_sub, s->zonal.rank);
+			// the replayed mirror does not move, there is nothing to check against
+			if(config.backend != HAL_BACKEND_REPLAY && check_calibration(s, &s->recon, use_zonal ? &s->zonal : NULL, grid, zf, s->voltage, cal_ref, n_ref))
+			{
+				printf("The cached calibration does not fit the system any more.\n");
+				cached = CALCACHE_MISMATCH;
+			}
+		}
+		else if(cached == CALCACHE_MISMATCH)
+			printf("\n%s was measured for another camera resolution, pupil, reconstructor or bias.\n", cal_path);
+		else if(cached == CALCACHE_CORRUPT)
+			printf("\n%s is damaged.\n", cal_path);
+		
+		if(cached != CALCACHE_OK)
+		{
+			printf("\nMeasuring interaction matrix of %d segments.\n", MAX_SEGMENTS);
+			n_ref = measure_interaction_matrix(s, &s->recon, use_zonal ? &s->zonal : NULL, grid, zf, s->voltage, cal_ref);
+			if(recon_compute(&s->recon, SAMPLE_RECON_RCOND) < 0 || (use_zonal && zonal_compute(&s->zonal, SAMPLE_RECON_RCOND) < 0))
+			{
+				printf("\nControl matrix inversion failed.\n");
+				error_exit(s, TLDFMX_ERROR_ITERATION);
+			}
+			printf("Control matrix computed with rank %d of %d.\n", s->recon.rank, RECON_MODES);
+			if(use_zonal)
+				printf("Slope control matrix computed from %d lenslets with rank %d.\n", s->zonal.n_sub, s->zonal.rank);
+			if((err = calcache_save(cal_path, &cal_key, &s->recon, use_zonal ? &s->zonal : NULL, cal_ref, n_ref)) == CALCACHE_UNUSABLE)
+				printf("Calibration not stored, its rank is 0 or it is not finite.\n");
+			else if(err)
+				printf("Could not store calibration in %s.\n", cal_path);
+			else
+				printf("Calibration stored in %s.\n", cal_path);
+		}
 	}
 	
-    err = select_instrument_DMH(&rscPtr);
-		if(VI_SUCCESS != err)
+	// tip/tilt goes to the tilt arms, their response is measured on every start, a few frames per arm
+	tt_t *tt = NULL;
+	if(config.tiptilt)
+	{
+		ViReal64 tilt_bias[HAL_MAX_TILT];
+		ctrl_param_t tt_param = { config.tiptilt_gain, config.tiptilt_leak, 0.0, 0.0 };
+		int source = config.tiptilt_source;
+		
+		if(config.tiptilt_ho_every < 1)
+			config.tiptilt_ho_every = 1;
+		if(source == TT_SOURCE_BEAM && !sensor->beam_centroid)
+		{
+			printf("\n%s has no beam centroid, tip/tilt is measured from the spots.\n", sensor->name);
+			source = TT_SOURCE_SPOTS;
+		}
+		for(int a = 0; a < HAL_MAX_TILT; a++)
+			tilt_bias[a] = 0.5 * (mirror->tilt_min + mirror->tilt_max);
+		if(!mirror->set_tilt || tt_init(&s->tiptilt, mirror->n_tilt, source, tilt_bias, mirror->tilt_min, mirror->tilt_max, tt_param))
+			printf("\n%s has no tilt arms, tip/tilt is not offloaded.\n", mirror->name);
+		else
 		{
-			error_exit(instrHdl, err);  // Something went wrong
+			printf("\nMeasuring tip/tilt response of %d tilt arms.\n", s->tiptilt.n_tilt);
+			if(measure_tiptilt_response(s, grid, &s->tiptilt))
+				printf("The tilt arms do not move the %s along both axes, tip/tilt is not offloaded.\n", (source == TT_SOURCE_BEAM) ? "beam centroid" : "spots");
+			else
+			{
+				tt = &s->tiptilt;
+				printf("Tip/tilt on every frame, high-order correction on every %d.\n", config.tiptilt_ho_every);
+			}
 		}
-		if(!rscPtr)
+	}
+	
+	// the mode groups step the modal controller channel by channel, the other paths correct all modes on every frame
+	mrate_t *mr = NULL;
+	if(s->mrate.n_groups)
+	{
+		if(config.reconstructor != LOOP_RECON_NATIVE)
+			printf("\nMulti-rate groups need the native reconstructor, all modes are corrected on every frame.\n");
+		else
 		{
-			exit(EXIT_SUCCESS);     // None found
+			if(mrate_alloc(&s->mrate, 2 * MAX_SPOTS_X * MAX_SPOTS_Y))
+				error_exit(s, TL_ERROR_ALLOC);
+			mr = &s->mrate;
+			printf("\n");
+			for(int g = 0; g < mr->n_groups; g++)
+				printf("Z%d .. Z%d: corrected every %d frames from the mean of the last %d.\n", mr->group[g].first + RECON_FIRST_MODE,
+				       mr->group[g].first + mr->group[g].count - 1 + RECON_FIRST_MODE, mr->group[g].divisor, mr->group[g].depth);
 		}
-	// Open the Wavefront Sensor instrument
-	//if(err = WFS_init (instr.selected_id, &instr.handle))
-	if(err = WFS_init (resourceName, VI_FALSE, VI_FALSE, &instr.handle)) 
-		handle_errors(err);
+	}
+	
+	if(spsc_init(&s->to_loop, SAMPLE_CHANNEL_DEPTH, sizeof(loop_cmd_t)) || spsc_init(&s->from_loop, SAMPLE_CHANNEL_DEPTH, sizeof(loop_event_t)))
+		error_exit(s, TL_ERROR_ALLOC);
+	s->args.sensor = sensor;
+	s->args.mirror = mirror;
+	s->args.session = s;
+	s->args.target = s->target;
+	s->args.to_loop = &s->to_loop;
+	s->args.from_loop = &s->from_loop;
+	s->args.recon = &s->recon;
+	s->args.zonal = &s->zonal;
+	s->args.voltage = s->voltage;
+	s->args.seg_min = mirror->seg_min;
+	s->args.seg_max = mirror->seg_max;
+	s->args.grid = grid;
+	s->args.zfit = zf;
+	s->args.tiptilt = tt;
+	s->args.mrate = mr;
+	// highspeed windows hand back the driver's centroids, the engine needs the full image
+	s->args.highspeed = SAMPLE_OPTION_HIGHSPEED && !grid && sensor->highspeed && ((s->instr.selected_id & DEVICE_OFFSET_WFS10) || (s->instr.selected_id & DEVICE_OFFSET_WFS20));
+}
+
+
+/*---------------------------------------------------------------------------
+ Release the backend of a loop that has ended
+---------------------------------------------------------------------------*/
+void session_close (session_t *s)
+{
+	if(config.backend == HAL_BACKEND_SIM)
+		sim_optics_free(&s->sim);
+	else if(config.backend == HAL_BACKEND_REPLAY)
+		replay_close(&s->replay);
+	else
+		session_close_drivers(s);
+}
 
-    err = TLDFMX_init(rscPtr, VI_TRUE, VI_TRUE, &instrHdl);
-	    if(err) error_exit(instrHdl, err);
 
-    err = TLDFM_enable_hysteresis_compensation (instrHdl, 2, 1);
-	    if(err) error_exit(instrHdl, err);
+/*---------------------------------------------------------------------------
+ Close the driver sessions of a loop, required to release allocated driver
+ data. Whatever was not opened yet is skipped, a second call closes nothing.
+---------------------------------------------------------------------------*/
+void session_close_drivers (session_t *s)
+{
+	if(VI_NULL != s->dm)
+	{
+		TLDFMX_close(s->dm);
+		s->dm = VI_NULL;
+	}
+	if(s->instr.handle)
+	{
+		WFS_close(s->instr.handle);
+		s->instr.handle = 0;
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+ A thread of loop s is about to use its drivers, until session_busy_end.
+ Once engine_exit runs, the thread waits here for the exit instead.
+---------------------------------------------------------------------------*/
+void session_busy_begin (session_t *s)
+{
+	pthread_mutex_lock(&s->busy_lock);
+	while(s->exiting)
+		pthread_cond_wait(&s->busy_changed, &s->busy_lock);
+	s->busy++;
+	thread_busy_session = s;
+	pthread_mutex_unlock(&s->busy_lock);
+}
+
+
+void session_busy_end (session_t *s)
+{
+	pthread_mutex_lock(&s->busy_lock);
+	s->busy--;
+	thread_busy_session = NULL;
+	pthread_cond_broadcast(&s->busy_changed);
+	pthread_mutex_unlock(&s->busy_lock);
+}
+
+
+/*---------------------------------------------------------------------------
+ End the program from any loop: the drivers of every loop are closed first.
+ No loop thread starts another driver call, and the handles are closed only
+ once every loop thread has left the calls it is in. A loop failing while
+ another one is closing them waits here for the exit.
+---------------------------------------------------------------------------*/
+void engine_exit (int status)
+{
+	session_t *self = thread_busy_session;
+	
+	// this thread fails inside its own driver calls, it is not waited for
+	for(int i = 0; i < engine.n; i++){
+		session_t *s = &engine.session[i];
+		pthread_mutex_lock(&s->busy_lock);
+		s->exiting = 1;
+		if(s == self){
+			s->busy--;
+			thread_busy_session = NULL;
+		}
+		pthread_mutex_unlock(&s->busy_lock);
+	}
+	pthread_mutex_lock(&engine.exit_lock);
+	for(int i = 0; i < engine.n; i++){
+		session_t *s = &engine.session[i];
+		pthread_mutex_lock(&s->busy_lock);
+		while(s->busy > 0)
+			pthread_cond_wait(&s->busy_changed, &s->busy_lock);
+		pthread_mutex_unlock(&s->busy_lock);
+		session_close_drivers(s);
+	}
+	waitKeypress();
+	exit(status);
+}
+
+
+
+/*---------------------------------------------------------------------------
+ Startup steps of the Thorlabs backend. The WFS chain (init, MLA, camera,
+ exposure) and the DMH chain (init, hysteresis, relax) share nothing and
+ run side by side, see thorlabs_open. Every step returns the driver error
+ and leaves reporting it to the caller.
+---------------------------------------------------------------------------*/
+typedef struct
+{
+	session_t *session;
+	ViChar    resource_wfs[WFS_BUFFER_SIZE];
+	ViChar    *resource_dm;
+	int       mla_asked;   // the WFS was opened and the operator chose the MLA before the graph ran
+} thorlabs_startup_t;
+
+
+int startup_wfs_init (void *ctx)
+{
+	thorlabs_startup_t *ts = (thorlabs_startup_t *)ctx;
+	session_t *s = ts->session;
+	
+	// Open the Wavefront Sensor instrument
+	return WFS_init (ts->resource_wfs, VI_FALSE, VI_FALSE, &s->instr.handle);
+}
+
 
-	// Select a microlens array (MLA)
-	if(select_mla(&instr.selected_mla) < 0)
+int startup_wfs_mla (void *ctx)
+{
+	thorlabs_startup_t *ts = (thorlabs_startup_t *)ctx;
+	session_t *s = ts->session;
+	int err;
+	
+	// Select a microlens array (MLA) by name, or the only one there is
+	if(!ts->mla_asked)
 	{
-		printf("\nNo MLA selected. Press <ENTER> to exit.\n");
-		fflush(stdin);
-		getchar();
-		return;
+		if(err = select_mla(s, &s->instr.selected_mla))
+			return err;
+		if(s->instr.selected_mla < 0)
+			return STARTUP_ERR_NO_MLA;
 	}
 	
 	// Activate desired MLA
-	if(err = WFS_SelectMla (instr.handle, instr.selected_mla))
-		handle_errors(err);
+	if(err = WFS_SelectMla (s->instr.handle, s->instr.selected_mla))
+		return err;
+	s->geometry_generation++;
+	return VI_SUCCESS;
+}
 
-	
+
+int startup_wfs_camera (void *ctx)
+{
+	session_t *s = ((thorlabs_startup_t *)ctx)->session;
+	int err, res;
 	
 	// Configure WFS camera, use a pre-defined camera resolution
-	if((instr.selected_id & DEVICE_OFFSET_WFS10) == 0 && (instr.selected_id & DEVICE_OFFSET_WFS20) == 0 && (instr.selected_id & DEVICE_OFFSET_WFS30) == 0 && (instr.selected_id & DEVICE_OFFSET_WFS40) == 0) // WFS150/300 instrument
+	if((s->instr.selected_id & DEVICE_OFFSET_WFS10) == 0 && (s->instr.selected_id & DEVICE_OFFSET_WFS20) == 0 && (s->instr.selected_id & DEVICE_OFFSET_WFS30) == 0 && (s->instr.selected_id & DEVICE_OFFSET_WFS40) == 0) // WFS150/300 instrument
 	{   
-		printf("\n\nConfigure WFS camera with resolution index %d (%d x %d pixels).\n", SAMPLE_CAMERA_RESOL_WFS, cam_wfs_xpixel[SAMPLE_CAMERA_RESOL_WFS], cam_wfs_ypixel[SAMPLE_CAMERA_RESOL_WFS]);
+		res = camera_resolution(s, cam_wfs_xpixel, cam_wfs_ypixel, sizeof(cam_wfs_xpixel) / sizeof(int), SAMPLE_CAMERA_RESOL_WFS);
+		printf("\n\nConfigure WFS camera with resolution index %d (%d x %d pixels).\n", res, cam_wfs_xpixel[res], cam_wfs_ypixel[res]);
 		
-		if(err = WFS_ConfigureCam (instr.handle, SAMPLE_PIXEL_FORMAT, SAMPLE_CAMERA_RESOL_WFS, &instr.spots_x, &instr.spots_y))
-			handle_errors(err);
+		if(err = WFS_ConfigureCam (s->instr.handle, SAMPLE_PIXEL_FORMAT, res, &s->instr.spots_x, &s->instr.spots_y))
+			return err;
 	}
 	
-	if(instr.selected_id & DEVICE_OFFSET_WFS10) // WFS10 instrument
+	if(s->instr.selected_id & DEVICE_OFFSET_WFS10) // WFS10 instrument
 	{
-		printf("\n\nConfigure WFS10 camera with resolution index %d (%d x %d pixels).\n", SAMPLE_CAMERA_RESOL_WFS10, cam_wfs10_xpixel[SAMPLE_CAMERA_RESOL_WFS10], cam_wfs10_ypixel[SAMPLE_CAMERA_RESOL_WFS10]);
+		res = camera_resolution(s, cam_wfs10_xpixel, cam_wfs10_ypixel, sizeof(cam_wfs10_xpixel) / sizeof(int), SAMPLE_CAMERA_RESOL_WFS10);
+		printf("\n\nConfigure WFS10 camera with resolution index %d (%d x %d pixels).\n", res, cam_wfs10_xpixel[res], cam_wfs10_ypixel[res]);
 	
-		if(err = WFS_ConfigureCam (instr.handle, SAMPLE_PIXEL_FORMAT, SAMPLE_CAMERA_RESOL_WFS10, &instr.spots_x, &instr.spots_y))
-			handle_errors(err);
+		if(err = WFS_ConfigureCam (s->instr.handle, SAMPLE_PIXEL_FORMAT, res, &s->instr.spots_x, &s->instr.spots_y))
+			return err;
 	}
 	
-	if(instr.selected_id & DEVICE_OFFSET_WFS20) // WFS20 instrument
+	if(s->instr.selected_id & DEVICE_OFFSET_WFS20) // WFS20 instrument
 	{
-		printf("\n\nConfigure WFS20 camera with resolution index %d (%d x %d pixels).\n", SAMPLE_CAMERA_RESOL_WFS20, cam_wfs20_xpixel[SAMPLE_CAMERA_RESOL_WFS20], cam_wfs20_ypixel[SAMPLE_CAMERA_RESOL_WFS20]);
+		res = camera_resolution(s, cam_wfs20_xpixel, cam_wfs20_ypixel, sizeof(cam_wfs20_xpixel) / sizeof(int), SAMPLE_CAMERA_RESOL_WFS20);
+		printf("\n\nConfigure WFS20 camera with resolution index %d (%d x %d pixels).\n", res, cam_wfs20_xpixel[res], cam_wfs20_ypixel[res]);
 	
-		if(err = WFS_ConfigureCam (instr.handle, SAMPLE_PIXEL_FORMAT, SAMPLE_CAMERA_RESOL_WFS20, &instr.spots_x, &instr.spots_y))
-			handle_errors(err);
+		if(err = WFS_ConfigureCam (s->instr.handle, SAMPLE_PIXEL_FORMAT, res, &s->instr.spots_x, &s->instr.spots_y))
+			return err;
 	}
 	
-	if(instr.selected_id & DEVICE_OFFSET_WFS30) // WFS30 instrument
+	if(s->instr.selected_id & DEVICE_OFFSET_WFS30) // WFS30 instrument
 	{
-		printf("\n\nConfigure WFS30 camera with resolution index %d (%d x %d pixels).\n", SAMPLE_CAMERA_RESOL_WFS30, cam_wfs30_xpixel[SAMPLE_CAMERA_RESOL_WFS30], cam_wfs30_ypixel[SAMPLE_CAMERA_RESOL_WFS30]);
+		res = camera_resolution(s, cam_wfs30_xpixel, cam_wfs30_ypixel, sizeof(cam_wfs30_xpixel) / sizeof(int), SAMPLE_CAMERA_RESOL_WFS30);
+		printf("\n\nConfigure WFS30 camera with resolution index %d (%d x %d pixels).\n", res, cam_wfs30_xpixel[res], cam_wfs30_ypixel[res]);
 	
-		if(err = WFS_ConfigureCam (instr.handle, SAMPLE_PIXEL_FORMAT, SAMPLE_CAMERA_RESOL_WFS30, &instr.spots_x, &instr.spots_y))
-			handle_errors(err);
+		if(err = WFS_ConfigureCam (s->instr.handle, SAMPLE_PIXEL_FORMAT, res, &s->instr.spots_x, &s->instr.spots_y))
+			return err;
 	}
 	
-	if(instr.selected_id & DEVICE_OFFSET_WFS40) // WFS40 instrument
+	if(s->instr.selected_id & DEVICE_OFFSET_WFS40) // WFS40 instrument
 	{
-		printf("\n\nConfigure WFS40 camera with resolution index %d (%d x %d pixels).\n", SAMPLE_CAMERA_RESOL_WFS40, cam_wfs40_xpixel[SAMPLE_CAMERA_RESOL_WFS40], cam_wfs40_ypixel[SAMPLE_CAMERA_RESOL_WFS40]);
+		res = camera_resolution(s, cam_wfs40_xpixel, cam_wfs40_ypixel, sizeof(cam_wfs40_xpixel) / sizeof(int), SAMPLE_CAMERA_RESOL_WFS40);
+		printf("\n\nConfigure WFS40 camera with resolution index %d (%d x %d pixels).\n", res, cam_wfs40_xpixel[res], cam_wfs40_ypixel[res]);
 	
-		if(err = WFS_ConfigureCam (instr.handle, SAMPLE_PIXEL_FORMAT, SAMPLE_CAMERA_RESOL_WFS40, &instr.spots_x, &instr.spots_y))
-			handle_errors(err);
+		if(err = WFS_ConfigureCam (s->instr.handle, SAMPLE_PIXEL_FORMAT, res, &s->instr.spots_x, &s->instr.spots_y))
+			return err;
 	}
 	
 
-	printf("Camera is configured to detect %d x %d lenslet spots.\n\n", instr.spots_x, instr.spots_y);
+	printf("Camera is configured to detect %d x %d lenslet spots.\n\n", s->instr.spots_x, s->instr.spots_y);
 	
 	
 	// set camera exposure time and gain if you don't want to use auto exposure
@@ -306,265 +1050,746 @@ void main (void)
 	
 	// set WFS internal reference plane
 	printf("\nSet WFS to internal reference plane.\n");
-	if(err = WFS_SetReferencePlane (instr.handle, SAMPLE_REF_PLANE))
-		handle_errors(err);
+	if(err = WFS_SetReferencePlane (s->instr.handle, SAMPLE_REF_PLANE))
+		return err;
 	
 	
 	// define pupil
 	printf("\nDefine pupil to:\n");
-	printf("Centroid_x = %6.3f\n", SAMPLE_PUPIL_CENTROID_X);
-	printf("Centroid_y = %6.3f\n", SAMPLE_PUPIL_CENTROID_Y);
-	printf("Diameter_x = %6.3f\n", SAMPLE_PUPIL_DIAMETER_X);
-	printf("Diameter_y = %6.3f\n", SAMPLE_PUPIL_DIAMETER_Y);
+	printf("Centroid_x = %6.3f\n", config.pupil_centroid_x);
+	printf("Centroid_y = %6.3f\n", config.pupil_centroid_y);
+	printf("Diameter_x = %6.3f\n", config.pupil_diameter_x);
+	printf("Diameter_y = %6.3f\n", config.pupil_diameter_y);
 
-	if(err = WFS_SetPupil (instr.handle, SAMPLE_PUPIL_CENTROID_X, SAMPLE_PUPIL_CENTROID_Y, SAMPLE_PUPIL_DIAMETER_X, SAMPLE_PUPIL_DIAMETER_Y))
-		handle_errors(err);
-	
-	printf("\nRead camera images:\n");
-	
-	printf("Image No.     Status     ->   newExposure[ms]   newGainFactor\n");
-	
-	// do some trials to read a well exposed image
-	for(cnt = 0; cnt < SAMPLE_IMAGE_READINGS; cnt++)
-	{
-		// take a camera image with auto exposure, note that there may several function calls required to get an optimal exposed image
-		if(err = WFS_TakeSpotfieldImageAutoExpos (instr.handle, &expos_act, &master_gain_act))
-			handle_errors(err);
-	
-		printf("    %d     ", cnt);
+	if(err = WFS_SetPupil (s->instr.handle, config.pupil_centroid_x, config.pupil_centroid_y, config.pupil_diameter_x, config.pupil_diameter_y))
+		return err;
+	s->geometry_generation++;
+	return VI_SUCCESS;
+}
+
+
+/*---------------------------------------------------------------------------
+ Exposure search and the first measurement. Returns
+ STARTUP_ERR_UNUSABLE_IMAGE if no usable image was found.
+---------------------------------------------------------------------------*/
+int startup_wfs_exposure (void *ctx)
+{
+	session_t *s = ((thorlabs_startup_t *)ctx)->session;
+	int               err, i;
+	double            beam_centroid_x, beam_centroid_y;
+	double            beam_diameter_x, beam_diameter_y;
+	static float      centroid_x[MAX_SPOTS_Y][MAX_SPOTS_X];
+	static float      centroid_y[MAX_SPOTS_Y][MAX_SPOTS_X];
+	static float      deviation_x[MAX_SPOTS_Y][MAX_SPOTS_X];
+	static float      deviation_y[MAX_SPOTS_Y][MAX_SPOTS_X];
+	static float      wavefront[MAX_SPOTS_Y][MAX_SPOTS_X];
+	float             zernike_um[MAX_ZERNIKE_MODES+1];             // index runs from 1 - MAX_ZERNIKE_MODES
+	float             zernike_orders_rms_um[MAX_ZERNIKE_ORDERS+1]; // index runs from 1 - MAX_ZERNIKE_MODES
+	double            roc_mm;
+	ViInt32           zernike_order;
+	double            wavefront_min, wavefront_max, wavefront_diff, wavefront_mean, wavefront_rms, wavefront_weighted_rms;
+	hal_sensor_t      sensor;  // the mirror may not be open yet, only the sensor half of the backend
 	
-		// check instrument status for non-optimal image exposure
-		if(err = WFS_GetStatus (instr.handle, &instr.status))
-			handle_errors(err);   
+	thorlabs_sensor(s, &sensor);
+	if((err = find_exposure(&sensor, s->instr.serial_number_wfs)) < 0)
+		return err;
 	
-		if(instr.status & WFS_STATBIT_PTH) printf("Power too high!    ");
-		 else
-		if(instr.status & WFS_STATBIT_PTL) printf("Power too low!     ");
-		 else
-		if(instr.status & WFS_STATBIT_HAL) printf("High ambient light!");
-		 else
-			printf(                                "OK                 ");
-		
-		printf("     %6.3f          %6.3f\n", expos_act, master_gain_act);
-		
-		if( !(instr.status & WFS_STATBIT_PTH) && !(instr.status & WFS_STATBIT_PTL) && !(instr.status & WFS_STATBIT_HAL) )
-			break; // image well exposed and is usable
-	}
+	// check instrument status for non-optimal image exposure
+	if(err = WFS_GetStatus (s->instr.handle, &s->instr.status))
+		return err;
+	if(s->instr.status & WFS_STATBIT_PTH) printf("Power too high!\n");
+	if(s->instr.status & WFS_STATBIT_PTL) printf("Power too low!\n");
+	if(s->instr.status & WFS_STATBIT_HAL) printf("High ambient light!\n");
 	
-
-	// close program if no well exposed image is feasible
-	if( (instr.status & WFS_STATBIT_PTH) || (instr.status & WFS_STATBIT_PTL) ||(instr.status & WFS_STATBIT_HAL) )
-	{
-		printf("\nSample program will be closed because of unusable image quality, press <ENTER>.");
-		WFS_close(instr.handle); // required to release allocated driver data
-        error_exit(instrHdl, 0);
-		fflush(stdin);
-		getchar();
-		exit(1);
-	}
+	// no well exposed image is feasible
+	if( (s->instr.status & WFS_STATBIT_PTH) || (s->instr.status & WFS_STATBIT_PTL) ||(s->instr.status & WFS_STATBIT_HAL) )
+		return STARTUP_ERR_UNUSABLE_IMAGE;
 	
 
 	// calculate all spot centroid positions using dynamic noise cut option
-	if(err = WFS_CalcSpotsCentrDiaIntens (instr.handle, SAMPLE_OPTION_DYN_NOISE_CUT, SAMPLE_OPTION_CALC_SPOT_DIAS))
-		handle_errors(err);
+	if(err = WFS_CalcSpotsCentrDiaIntens (s->instr.handle, SAMPLE_OPTION_DYN_NOISE_CUT, SAMPLE_OPTION_CALC_SPOT_DIAS))
+		return err;
 
 	// get centroid result arrays
-	if(err = WFS_GetSpotCentroids (instr.handle, *centroid_x, *centroid_y))
-		handle_errors(err);
+	if(err = WFS_GetSpotCentroids (s->instr.handle, *centroid_x, *centroid_y))
+		return err;
 
 	// get centroid and diameter of the optical beam, you may use this beam data to define a pupil variable in position and size
 	// for WFS20: this is based on centroid intensties calculated by WFS_CalcSpotsCentrDiaIntens()
-	if(err = WFS_CalcBeamCentroidDia (instr.handle, &beam_centroid_x, &beam_centroid_y, &beam_diameter_x, &beam_diameter_y))
-		handle_errors(err);
+	if(err = WFS_CalcBeamCentroidDia (s->instr.handle, &beam_centroid_x, &beam_centroid_y, &beam_diameter_x, &beam_diameter_y))
+		return err;
 	// calculate spot deviations to internal reference
-	if(err = WFS_CalcSpotToReferenceDeviations (instr.handle, SAMPLE_OPTION_CANCEL_TILT))
-		handle_errors(err);
+	if(err = WFS_CalcSpotToReferenceDeviations (s->instr.handle, SAMPLE_OPTION_CANCEL_TILT))
+		return err;
 	
 	// get spot deviations
-	if(WFS_GetSpotDeviations (instr.handle, *deviation_x, *deviation_y))
-		handle_errors(err);
+	if(err = WFS_GetSpotDeviations (s->instr.handle, *deviation_x, *deviation_y))
+		return err;
 	
 	// calculate and printout measured wavefront
-	if(err = WFS_CalcWavefront (instr.handle, SAMPLE_WAVEFRONT_TYPE, SAMPLE_OPTION_LIMIT_TO_PUPIL, *wavefront))
-		handle_errors(err);
+	if(err = WFS_CalcWavefront (s->instr.handle, SAMPLE_WAVEFRONT_TYPE, SAMPLE_OPTION_LIMIT_TO_PUPIL, *wavefront))
+		return err;
 	
 	// calculate wavefront statistics within defined pupil
-	if(err = WFS_CalcWavefrontStatistics (instr.handle, &wavefront_min, &wavefront_max, &wavefront_diff, &wavefront_mean, &wavefront_rms, &wavefront_weighted_rms))
-		handle_errors(err);
+	if(err = WFS_CalcWavefrontStatistics (s->instr.handle, &wavefront_min, &wavefront_max, &wavefront_diff, &wavefront_mean, &wavefront_rms, &wavefront_weighted_rms))
+		return err;
 	
 
 	// calculate Zernike coefficients
-	printf("\nZernike fit up to order %d:\n",SAMPLE_ZERNIKE_ORDERS);
-	zernike_order = SAMPLE_ZERNIKE_ORDERS; // pass 0 to function for auto Zernike order, choosen order is returned
-	if(err = WFS_ZernikeLsf (instr.handle, &zernike_order, zernike_um, zernike_orders_rms_um, &roc_mm)) // calculates also deviation from centroid data for wavefront integration
-		handle_errors(err);
+	printf("\nZernike fit up to order %d:\n",config.zernike_order);
+	zernike_order = config.zernike_order; // pass 0 to function for auto Zernike order, choosen order is returned
+	if(err = WFS_ZernikeLsf (s->instr.handle, &zernike_order, zernike_um, zernike_orders_rms_um, &roc_mm)) // calculates also deviation from centroid data for wavefront integration
+		return err;
 		
 	printf("\nZernike Mode    Coefficient\n");
-	for(i=0; i < zernike_modes[SAMPLE_ZERNIKE_ORDERS]; i++)
+	for(i=0; i < zernike_modes[config.zernike_order]; i++)
 	{
 		printf("  %2d         %9.3f\n",i, zernike_um[i]);
 	}
+	return VI_SUCCESS;
+}
 
-	
-	if(err = TLDFMX_measure_system_parameters (instrHdl, VI_TRUE, zernike_um, nextMirrorPattern,&remainingSteps))
-		error_exit(instrHdl, err);
-	
-	if(err = TLDFM_set_segment_voltages (instrHdl, nextMirrorPattern))
-		error_exit(instrHdl, err);
-
-	while (remainingSteps){
-		if(err = WFS_TakeSpotfieldImageAutoExpos (instr.handle, &expos_act, &master_gain_act))
-				handle_errors(err);
 
-		zernike_order = SAMPLE_ZERNIKE_ORDERS; // pass 0 to function for auto Zernike order, choosen order is returned
-		if(err = WFS_ZernikeLsf (instr.handle, &zernike_order, zernike_um, zernike_orders_rms_um, &roc_mm)) // calculates also deviation from centroid data for wavefront integration
-			handle_errors(err);
-		
-		if(err = TLDFMX_measure_system_parameters (instrHdl, VI_FALSE, zernike_um, nextMirrorPattern,&remainingSteps))
-			error_exit(instrHdl, err);
-	
-		if(err = TLDFM_set_segment_voltages (instrHdl, nextMirrorPattern))
-			error_exit(instrHdl, err);
-	}
-	
-	get_Zernike_list();
-	pthread_t thread_id;
-	threadArgs loopArgs;
-	loopArgs.WFS_handle = &instr.handle;
-	loopArgs.handle = &instrHdl;
-	loopArgs.target = target_zernike;
-	loopArgs.thflag = &thread_flag;
+int startup_dm_init (void *ctx)
+{
+	thorlabs_startup_t *ts = (thorlabs_startup_t *)ctx;
+	session_t *s = ts->session;
 	
-	pthread_create(&thread_id, NULL, Loop, (void*) &loopArgs);
-	if (thread_flag){
-		printf("The Zernike amplitudes are achieved. Enter new Zernikes.\n");
-		get_Zernike_list();
-		thread_flag = 0;
-	}
-
-	// Close instrument, important to release allocated driver data!
-	WFS_close(instr.handle);
+	return TLDFMX_init(ts->resource_dm, VI_TRUE, VI_TRUE, &s->dm);
 }
 
 
-
-/*===============================================================================================================================
-  Handle Errors
-  This function retrieves the appropriate text to the given error number and closes the connection in case of an error
-===============================================================================================================================*/
-void handle_errors (int err)
+int startup_dm_hysteresis (void *ctx)
 {
-	char buf[WFS_ERR_DESCR_BUFFER_SIZE];
-
-	if(!err) return;
+	session_t *s = ((thorlabs_startup_t *)ctx)->session;
+	return TLDFM_enable_hysteresis_compensation (s->dm, T_BOTH, VI_TRUE);
+}
 
-	// Get error string
-	WFS_error_message (instr.handle, err, buf);
 
-	if(err < 0) // errors
+/*---------------------------------------------------------------------------
+ Relax the mirror and the tilt arms with the TLDFMX relax patterns, the
+ driver reloads the voltages from before at the last step
+---------------------------------------------------------------------------*/
+int startup_dm_relax (void *ctx)
+{
+	session_t *s = ((thorlabs_startup_t *)ctx)->session;
+	int       err;
+	ViUInt32  tilt_count;
+	ViUInt32  part;
+	ViInt32   remaining;
+	ViReal64  mirror_pattern[MAX_SEGMENTS], arm_pattern[MAX_SEGMENTS];
+	ViBoolean first = VI_TRUE;
+	
+	if(err = TLDFM_get_tilt_count (s->dm, &tilt_count))
+		return err;
+	part = tilt_count ? T_BOTH : T_MIRROR;
+	do
 	{
-		printf("\nWavefront Sensor Error: %s\n", buf);
-
-		// close instrument after an error has occured
-		printf("\nSample program will be closed because of the occured error, press <ENTER>.");
-		WFS_close(instr.handle); // required to release allocated driver data
-		if(VI_NULL != instrHdl)
-		{
-			TLDFMX_close(instrHdl);
-		}
-		fflush(stdin);
-		getchar();
-		exit(1);
+		if(err = TLDFMX_relax (s->dm, part, first, VI_TRUE, mirror_pattern, arm_pattern, &remaining))
+			return err;
+		if(err = TLDFM_set_segment_voltages (s->dm, mirror_pattern))
+			return err;
+		if(tilt_count && (err = TLDFM_set_tilt_voltages (s->dm, arm_pattern)))
+			return err;
+		first = VI_FALSE;
 	}
+	while(remaining > 0);
+	printf("\nMirror relaxed.\n");
+	return VI_SUCCESS;
 }
 
 
-
-/*===============================================================================================================================
-	Select Instrument
-===============================================================================================================================*/
-int select_instrument (int *selection, ViChar resourceName[])
+/*---------------------------------------------------------------------------
+ TLDFMX system parameters, needs the exposed WFS and the ready DMH
+---------------------------------------------------------------------------*/
+int startup_tldfmx_system (void *ctx)
 {
-	int            i,err;
-	long int 	instr_cnt;
-	ViInt32        device_id;
-	long int            in_use;
+	session_t *s = ((thorlabs_startup_t *)ctx)->session;
+	int       err;
+	float     zernike_um[MAX_ZERNIKE_MODES+1];
+	ViInt32   zernike_order;
+	ViInt32   remainingSteps;
+	ViReal64  nextMirrorPattern[MAX_SEGMENTS];
+	double    expos_act, master_gain_act;
+	
+	zernike_order = config.zernike_order;
+	if(err = WFS_ZernikeLsf (s->instr.handle, &zernike_order, zernike_um, NULL, NULL))
+		return err;
+	if(err = TLDFMX_measure_system_parameters (s->dm, VI_TRUE, zernike_um, nextMirrorPattern,&remainingSteps))
+		return err;
+	
+	if(err = TLDFM_set_segment_voltages (s->dm, nextMirrorPattern))
+		return err;
+
+	while (remainingSteps){
+		if(err = WFS_TakeSpotfieldImageAutoExpos (s->instr.handle, &expos_act, &master_gain_act))
+			return err;
+
+		zernike_order = config.zernike_order; // pass 0 to function for auto Zernike order, choosen order is returned
+		if(err = WFS_ZernikeLsf (s->instr.handle, &zernike_order, zernike_um, NULL, NULL)) // calculates also deviation from centroid data for wavefront integration
+			return err;
+		
+		if(err = TLDFMX_measure_system_parameters (s->dm, VI_FALSE, zernike_um, nextMirrorPattern,&remainingSteps))
+			return err;
+	
+		if(err = TLDFM_set_segment_voltages (s->dm, nextMirrorPattern))
+			return err;
+	}
+	return VI_SUCCESS;
+}
+
+
+/*---------------------------------------------------------------------------
+ Open and configure the Thorlabs WFS and DMH, take a first well exposed
+ image and, for the TLDFMX reconstructor, measure the system parameters.
+ The devices are selected first (that may ask the operator), then the
+ steps of both run as a dependency graph:
+
+   wfs_init -> wfs_mla -> wfs_camera -> wfs_exposure --+
+   dm_init -> dm_hysteresis [-> dm_relax] -------------+-> tldfmx_system
+
+ When the operator has to choose the MLA, the WFS is opened and the MLA
+ chosen here on the calling thread and the graph starts at wfs_mla. No
+ step prompts or exits, their errors are reported here once all ended.
+---------------------------------------------------------------------------*/
+void thorlabs_open (session_t *s)
+{
+	long int            err;
+	int                 failed;
+	int                 st_wfs_init = -1, st_wfs_mla, st_wfs_camera, st_wfs_exposure;
+	int                 st_dm_init, st_dm_hysteresis, st_dm_relax = -1, dm_ready;
+	static thorlabs_startup_t ts;
+	static startup_t    graph;
+	
+	// Show all and select one WFS instrument
+	ts.session = s;
+	if(select_instrument(s, &s->instr.selected_id, ts.resource_wfs) == 0)
+	{
+		printf("\n%sNo WFS selected.\n", s->label);
+		engine_exit(config.headless ? EXIT_FAILURE : EXIT_SUCCESS); // program ends here if no instrument selected
+	}
+	
+	ts.resource_dm = NULL;
+	err = select_instrument_DMH(s, &ts.resource_dm, s->instr.serial_number_dm);
+	if(VI_SUCCESS != err)
+	{
+		error_exit(s, err);  // Something went wrong
+	}
+	if(!ts.resource_dm)
+	{
+		engine_exit(config.headless ? EXIT_FAILURE : EXIT_SUCCESS);     // None found
+	}
+	
+	// the operator's MLA choice needs the open WFS, and must not wait on a thread of the graph
+	ts.mla_asked = !config.mla_name[0] && !config.headless;
+	if(ts.mla_asked)
+	{
+		if(err = startup_wfs_init (&ts))
+			handle_errors(s, err);
+		if(err = select_mla(s, &s->instr.selected_mla))
+			handle_errors(s, err);
+		if(s->instr.selected_mla < 0)
+		{
+			printf("\nNo MLA selected.\n");
+			engine_exit(EXIT_SUCCESS);
+		}
+	}
+	
+	startup_init(&graph);
+	if(!ts.mla_asked)
+		st_wfs_init  = startup_add(&graph, "wfs_init",      startup_wfs_init,      &ts, 0);
+	st_dm_init       = startup_add(&graph, "dm_init",       startup_dm_init,       &ts, 0);
+	st_wfs_mla       = startup_add(&graph, "wfs_mla",       startup_wfs_mla,       &ts, ts.mla_asked ? 0 : STARTUP_AFTER(st_wfs_init));
+	st_dm_hysteresis = startup_add(&graph, "dm_hysteresis", startup_dm_hysteresis, &ts, STARTUP_AFTER(st_dm_init));
+	st_wfs_camera    = startup_add(&graph, "wfs_camera",    startup_wfs_camera,    &ts, STARTUP_AFTER(st_wfs_mla));
+	dm_ready = STARTUP_AFTER(st_dm_hysteresis);
+	if(config.dm_relax)
+	{
+		st_dm_relax = startup_add(&graph, "dm_relax", startup_dm_relax, &ts, STARTUP_AFTER(st_dm_hysteresis));
+		dm_ready |= STARTUP_AFTER(st_dm_relax);
+	}
+	st_wfs_exposure  = startup_add(&graph, "wfs_exposure",  startup_wfs_exposure,  &ts, STARTUP_AFTER(st_wfs_camera));
+	if(config.reconstructor == LOOP_RECON_TLDFMX)
+		startup_add(&graph, "tldfmx_system", startup_tldfmx_system, &ts, STARTUP_AFTER(st_wfs_exposure) | dm_ready);
+	
+	failed = startup_run(&graph);
+	printf("\n");
+	startup_report(&graph, stdout);
+	if(failed < 0)
+		return;
+	
+	err = graph.step[failed].err;
+	if(failed == st_wfs_exposure && err == STARTUP_ERR_UNUSABLE_IMAGE)
+	{
+		// close program if no well exposed image is feasible
+		printf("\nSample program will be closed because of unusable image quality.\n");
+		error_exit(s, 0);     // closes the WFS as well, required to release allocated driver data
+	}
+	if(failed == st_wfs_mla && err == STARTUP_ERR_NO_MLA)
+	{
+		printf("\nNo MLA selected.\n");
+		engine_exit(config.headless ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	if(failed == st_wfs_init || failed == st_wfs_mla || failed == st_wfs_camera || failed == st_wfs_exposure)
+		handle_errors(s, err);
+	error_exit(s, err); // DMH errors, and WFS warnings that stopped the graph
+}
+
+
+/*===============================================================================================================================
+  Thorlabs backend of the HAL, the WFS and DMH drivers behind hal_sensor_t / hal_mirror_t
+===============================================================================================================================*/
+
+/*---------------------------------------------------------------------------
+ Pupil, lenslet scale and spot count for the Zernike projection
+---------------------------------------------------------------------------*/
+int wfs_geometry (void *ctx, zfit_geometry_t *geo, float scale_x[], float scale_y[], int *spots_x, int *spots_y)
+{
+	int err;
+	instr_t *wfs = ctx;
+	
+	if(err = WFS_GetPupil (wfs->handle, &geo->center_x_mm, &geo->center_y_mm, &geo->diameter_x_mm, &geo->diameter_y_mm))
+		return err;
+	if(err = WFS_GetXYScale (wfs->handle, scale_x, scale_y))
+		return err;
+	geo->slope_per_px = wfs->cam_pitch_um / wfs->lenslet_f_um;
+	*spots_x = wfs->spots_x;
+	*spots_y = wfs->spots_y;
+	return VI_SUCCESS;
+}
+
+
+int wfs_take_image (void *ctx)
+{
+	return WFS_TakeSpotfieldImage (((instr_t *)ctx)->handle);
+}
+
+
+int wfs_take_image_auto (void *ctx)
+{
+	return WFS_TakeSpotfieldImageAutoExpos (((instr_t *)ctx)->handle, NULL, NULL);
+}
+
+
+int wfs_get_image (void *ctx, unsigned char **image, int *rows, int *cols)
+{
+	return WFS_GetSpotfieldImage (((instr_t *)ctx)->handle, image, rows, cols);
+}
+
+
+int wfs_deviations (void *ctx, int cancel_tilt, float dev_x[], float dev_y[])
+{
+	int err;
+	ViSession handle = ((instr_t *)ctx)->handle;
+	
+	if(err = WFS_CalcSpotsCentrDiaIntens (handle, SAMPLE_OPTION_DYN_NOISE_CUT, SAMPLE_OPTION_CALC_SPOT_DIAS))
+		return err;
+	if(err = WFS_CalcSpotToReferenceDeviations (handle, cancel_tilt))
+		return err;
+	return WFS_GetSpotDeviations (handle, dev_x, dev_y);
+}
+
+
+int wfs_zernikes (void *ctx, int order, float zernike[])
+{
+	ViInt32 zernike_order = order;
+	
+	// calculates also deviation from centroid data for wavefront integration
+	return WFS_ZernikeLsf (((instr_t *)ctx)->handle, &zernike_order, zernike, NULL, NULL);
+}
+
+
+int wfs_get_exposure_range (void *ctx, double *min_ms, double *max_ms, double *incr_ms)
+{
+	return WFS_GetExposureTimeRange (((instr_t *)ctx)->handle, min_ms, max_ms, incr_ms);
+}
+
+
+int wfs_get_exposure (void *ctx, double *ms)
+{
+	return WFS_GetExposureTime (((instr_t *)ctx)->handle, ms);
+}
+
+
+int wfs_set_exposure (void *ctx, double ms, double *actual_ms)
+{
+	return WFS_SetExposureTime (((instr_t *)ctx)->handle, ms, actual_ms);
+}
+
+
+int wfs_get_gain (void *ctx, double *gain)
+{
+	return WFS_GetMasterGain (((instr_t *)ctx)->handle, gain);
+}
+
+
+int wfs_get_gain_range (void *ctx, double *min, double *max)
+{
+	return WFS_GetMasterGainRange (((instr_t *)ctx)->handle, min, max);
+}
+
+
+int wfs_set_gain (void *ctx, double gain, double *actual)
+{
+	return WFS_SetMasterGain (((instr_t *)ctx)->handle, gain, actual);
+}
+
+
+int wfs_get_status (void *ctx, int *status)
+{
+	int err;
+	ViInt32 device_status;
+	
+	if(err = WFS_GetStatus (((instr_t *)ctx)->handle, &device_status))
+		return err;
+	*status = ((device_status & WFS_STATBIT_PTH) ? HAL_STATUS_POWER_HIGH : 0) | ((device_status & WFS_STATBIT_PTL) ? HAL_STATUS_POWER_LOW : 0);
+	return VI_SUCCESS;
+}
+
+
+int wfs_image_min_max (void *ctx, int *min, int *max, double *saturated_pct)
+{
+	return WFS_CalcImageMinMax (((instr_t *)ctx)->handle, min, max, saturated_pct);
+}
+
+
+int wfs_beam_centroid (void *ctx, double *x_mm, double *y_mm)
+{
+	ViReal64 dia_x, dia_y;
+	
+	return WFS_CalcBeamCentroidDia (((instr_t *)ctx)->handle, x_mm, y_mm, &dia_x, &dia_y);
+}
+
+
+/*---------------------------------------------------------------------------
+ Highspeed mode on around the spots of a fresh full-frame image, or off
+---------------------------------------------------------------------------*/
+int wfs_highspeed (void *ctx, int on)
+{
+	int err;
+	instr_t *wfs = ctx;
+	ViSession handle = wfs->handle;
+	
+	if(!on)
+		return WFS_SetHighspeedMode (handle, OPTION_OFF, 0, 0, 0);
+	// centroids of a full-frame image place the windows
+	if(err = WFS_TakeSpotfieldImage (handle))
+		return err;
+	if(err = WFS_CalcSpotsCentrDiaIntens (handle, SAMPLE_OPTION_DYN_NOISE_CUT, SAMPLE_OPTION_CALC_SPOT_DIAS))
+		return err;
+	if(err = WFS_SetHighspeedMode (handle, OPTION_ON, SAMPLE_OPTION_HS_ADAPT_CENTR, SAMPLE_HS_NOISE_LEVEL, SAMPLE_HS_ALLOW_AUTOEXPOS))
+		return err;
+	if(err = WFS_GetHighspeedWindows (handle, &wfs->hs_win_count_x, &wfs->hs_win_count_y, &wfs->hs_win_size_x, &wfs->hs_win_size_y, wfs->hs_win_start_x, wfs->hs_win_start_y))
+	{
+		WFS_SetHighspeedMode (handle, OPTION_OFF, 0, 0, 0);
+		return err;
+	}
+	return VI_SUCCESS;
+}
+
+
+int wfs_highspeed_check (void *ctx)
+{
+	int err = WFS_CheckHighspeedCentroids (((instr_t *)ctx)->handle);
+	
+	return (err == WFS_ERROR_HIGHSPEED_WINDOW_MISMATCH) ? 1 : err;
+}
+
+
+int dmh_set_segments (void *ctx, const double voltage[])
+{
+	return TLDFM_set_segment_voltages (*(ViSession *)ctx, (ViReal64 *)voltage); // the driver does not write the pattern
+}
+
+
+int dmh_set_tilt (void *ctx, const double voltage[])
+{
+	return TLDFM_set_tilt_voltages (*(ViSession *)ctx, (ViReal64 *)voltage);
+}
+
+
+/*---------------------------------------------------------------------------
+ Fill the HAL table for the opened WFS of a loop
+---------------------------------------------------------------------------*/
+void thorlabs_sensor (session_t *s, hal_sensor_t *sensor)
+{
+	memset(sensor, 0, sizeof(*sensor));
+	sensor->name               = s->instr.instrument_name;
+	sensor->ctx                = &s->instr;
+	sensor->geometry           = wfs_geometry;
+	sensor->take_image         = wfs_take_image;
+	sensor->take_image_auto    = wfs_take_image_auto;
+	sensor->get_image          = wfs_get_image;
+	sensor->deviations         = wfs_deviations;
+	sensor->zernikes           = wfs_zernikes;
+	sensor->get_exposure_range = wfs_get_exposure_range;
+	sensor->get_exposure       = wfs_get_exposure;
+	sensor->set_exposure       = wfs_set_exposure;
+	sensor->get_gain           = wfs_get_gain;
+	sensor->get_gain_range     = wfs_get_gain_range;
+	sensor->set_gain           = wfs_set_gain;
+	sensor->get_status         = wfs_get_status;
+	sensor->image_min_max      = wfs_image_min_max;
+	sensor->beam_centroid      = wfs_beam_centroid;
+	sensor->highspeed          = wfs_highspeed;
+	sensor->highspeed_check    = wfs_highspeed_check;
+}
+
+
+/*---------------------------------------------------------------------------
+ Fill the HAL tables of a loop for its opened WFS and DMH
+---------------------------------------------------------------------------*/
+void thorlabs_backend (session_t *s)
+{
+	hal_sensor_t *sensor = &s->wfs_sensor;
+	hal_mirror_t *mirror = &s->dmh_mirror;
+	long int err;
+	ViUInt32 count;
+	
+	thorlabs_sensor(s, sensor);
+	memset(mirror, 0, sizeof(*mirror));
+	mirror->name         = "DMH40";
+	mirror->ctx          = &s->dm;
+	mirror->set_segments = dmh_set_segments;
+	mirror->set_tilt     = dmh_set_tilt;
+	if(err = TLDFM_get_segment_count (s->dm, &count))
+		error_exit(s, err);
+	mirror->n_segments = (int)count;
+	if(err = TLDFM_get_segment_minimum (s->dm, &mirror->seg_min))
+		error_exit(s, err);
+	if(err = TLDFM_get_segment_maximum (s->dm, &mirror->seg_max))
+		error_exit(s, err);
+	if(err = TLDFM_get_tilt_count (s->dm, &count))
+		error_exit(s, err);
+	mirror->n_tilt = (int)count;
+	if(err = TLDFM_get_tilt_minimum (s->dm, &mirror->tilt_min))
+		error_exit(s, err);
+	if(err = TLDFM_get_tilt_maximum (s->dm, &mirror->tilt_max))
+		error_exit(s, err);
+}
+
+
+/*===============================================================================================================================
+  Handle Errors
+  This function retrieves the appropriate text to the given error number of the WFS of loop s (NULL before any
+  WFS is open) and closes the connections of all loops in case of an error
+===============================================================================================================================*/
+void handle_errors (session_t *s, int err)
+{
+	char buf[WFS_ERR_DESCR_BUFFER_SIZE];
+
+	if(!err) return;
+
+	// Get error string
+	WFS_error_message (s ? s->instr.handle : VI_NULL, err, buf);
+
+	if(err < 0) // errors
+	{
+		printf("\n%sWavefront Sensor Error: %s\n", s ? s->label : "", buf);
+
+		// close instruments after an error has occured, required to release allocated driver data
+		printf("\nSample program will be closed because of the occured error.\n");
+		engine_exit(1);
+	}
+}
+
+
+
+/*===============================================================================================================================
+	Select Instrument
+	The instrument list is read once. config.wfs_serial picks the instrument, headless takes the only one there is
+===============================================================================================================================*/
+int select_instrument (session_t *s, int *selection, ViChar resourceName[])
+{
+	int            i,err,pick = -1;
+	long int 	instr_cnt;
+	ViInt32        device_id[SAMPLE_MAX_INSTRUMENTS];
+	long int            in_use;
 	char           instr_name[WFS_BUFFER_SIZE];
-	char           serNr[WFS_BUFFER_SIZE];
+	char           serNr[SAMPLE_MAX_INSTRUMENTS][WFS_BUFFER_SIZE];
+	char           rsrc[SAMPLE_MAX_INSTRUMENTS][WFS_BUFFER_SIZE];
 	char           strg[WFS_BUFFER_SIZE];
 
+	*selection = 0;
+	
 	// Find available instruments
 	if(err = WFS_GetInstrumentListLen (VI_NULL, &instr_cnt))
-		handle_errors(err);
+		handle_errors(s, err);
 		
 	if(instr_cnt == 0)
 	{
 		printf("No Wavefront Sensor instrument found!\n");
 		return 0;
 	}
+	if(instr_cnt > SAMPLE_MAX_INSTRUMENTS)
+		instr_cnt = SAMPLE_MAX_INSTRUMENTS;
 
 	// List available instruments
 	printf("Available Wavefront Sensor instruments:\n\n");
 	
 	for(i=0;i<instr_cnt;i++)
 	{
-		if(err = WFS_GetInstrumentListInfo (VI_NULL, i, &device_id, &in_use, instr_name, serNr, resourceName))
-			handle_errors(err);
+		if(err = WFS_GetInstrumentListInfo (VI_NULL, i, &device_id[i], &in_use, instr_name, serNr[i], rsrc[i]))
+			handle_errors(s, err);
 		
-		printf("%4d   %s    %s    %s\n", device_id, instr_name, serNr, (!in_use) ? "" : "(inUse)");
+		printf("%4d   %s    %s    %s\n", device_id[i], instr_name, serNr[i], (!in_use) ? "" : "(inUse)");
+		if(s->wfs_serial[0] && !strcmp(serNr[i], s->wfs_serial))
+			pick = i;
 	}
 
-	// Select instrument
-	printf("\nSelect a Wavefront Sensor instrument: ");
-	fflush(stdin);
-	
-	fgets (strg, WFS_BUFFER_SIZE, stdin);
-	*selection = atoi(strg);
-
-	// get selected resource name
-	for(i=0;i<instr_cnt;i++)
-	{   
-		if(err = WFS_GetInstrumentListInfo (VI_NULL, i, &device_id, &in_use, instr_name, serNr, resourceName))
-		   handle_errors(err);
+	if(s->wfs_serial[0])
+	{
+		if(pick < 0)
+			printf("\nNo Wavefront Sensor with serial number %s found.\n", s->wfs_serial);
+	}
+	else if(config.headless)
+	{
+		if(instr_cnt == 1)
+			pick = 0;
+		else
+			printf("\nSeveral Wavefront Sensors found, set wfs_serial to select one.\n");
+	}
+	else
+	{
+		// Select instrument
+		printf("\nSelect a Wavefront Sensor instrument%s: ", s->label[0] ? " for this loop" : "");
+		fflush(stdin);
 		
-		if(device_id == *selection)
-			break; // resourceName fits to device_id
+		fgets (strg, WFS_BUFFER_SIZE, stdin);
+		for(i=0;i<instr_cnt;i++)
+			if(device_id[i] == atoi(strg))
+				pick = i;
 	}
-	
+	if(pick < 0)
+		return 0;
+
+	*selection = device_id[pick];
+	strncpy(resourceName, rsrc[pick], WFS_BUFFER_SIZE);
+	strncpy(s->instr.serial_number_wfs, serNr[pick], WFS_BUFFER_SIZE);
 	return *selection;
 }
 
 
 /*===============================================================================================================================
 	Select MLA
+	config.mla_name picks the MLA, headless takes the only one there is, otherwise the operator is asked.
+	selection is -1 if none was selected. Returns the driver error and leaves reporting it to the caller.
 ===============================================================================================================================*/
-int select_mla (int *selection)
+int select_mla (session_t *s, int *selection)
 {
 	int            i,err;
-	long int	mla_cnt;
 
+	*selection = -1;
+	
 	// Read out number of available Microlens Arrays 
-	if(err = WFS_GetMlaCount (instr.handle, &instr.mla_cnt))
-		handle_errors(err);
+	if(err = WFS_GetMlaCount (s->instr.handle, &s->instr.mla_cnt))
+		return err;
 
 	// List available Microlens Arrays
 	printf("\nAvailable Microlens Arrays:\n\n");
-	for(i=0;i<instr.mla_cnt;i++)
+	for(i=0;i<s->instr.mla_cnt;i++)
 	{   
-		if(WFS_GetMlaData (instr.handle, i, instr.mla_name, &instr.cam_pitch_um, &instr.lenslet_pitch_um, &instr.center_spot_offset_x, &instr.center_spot_offset_y, &instr.lenslet_f_um, &instr.grd_corr_0, &instr.grd_corr_45))
-			handle_errors(err);   
+		if(err = WFS_GetMlaData (s->instr.handle, i, s->instr.mla_name, &s->instr.cam_pitch_um, &s->instr.lenslet_pitch_um, &s->instr.center_spot_offset_x, &s->instr.center_spot_offset_y, &s->instr.lenslet_f_um, &s->instr.grd_corr_0, &s->instr.grd_corr_45))
+			return err;
+	
+		printf("%2d  %s   CamPitch=%6.3f LensletPitch=%8.3f\n", i, s->instr.mla_name, s->instr.cam_pitch_um, s->instr.lenslet_pitch_um);
+		if(config.mla_name[0] && !strcmp(s->instr.mla_name, config.mla_name))
+			*selection = i;
+	}
 	
-		printf("%2d  %s   CamPitch=%6.3f LensletPitch=%8.3f\n", i, instr.mla_name, instr.cam_pitch_um, instr.lenslet_pitch_um);
+	if(config.mla_name[0])
+	{
+		if(*selection < 0)
+			printf("\nNo Microlens Array named %s.\n", config.mla_name);
+	}
+	else if(config.headless)
+	{
+		if(s->instr.mla_cnt == 1)
+			*selection = 0;
+		else
+			printf("\nSeveral Microlens Arrays found, set mla to select one.\n");
+	}
+	else
+	{
+		// Select MLA
+		printf("\nSelect a Microlens Array%s: ", s->label[0] ? " for this loop" : "");
+		fflush(stdin);
+		*selection = getchar() - '0';
+		if(*selection < -1 || *selection >= s->instr.mla_cnt)
+			*selection = -1; // nothing selected
 	}
 	
-	// Select MLA
-	printf("\nSelect a Microlens Array: ");
-	fflush(stdin);
-	*selection = getchar() - '0';
-	if(*selection < -1)
-		*selection = -1; // nothing selected
+	// the list left the data of the last MLA in instr, read the selected one
+	if(*selection >= 0)
+		if(err = WFS_GetMlaData (s->instr.handle, *selection, s->instr.mla_name, &s->instr.cam_pitch_um, &s->instr.lenslet_pitch_um, &s->instr.center_spot_offset_x, &s->instr.center_spot_offset_y, &s->instr.lenslet_f_um, &s->instr.grd_corr_0, &s->instr.grd_corr_45))
+		{
+			*selection = -1;
+			return err;
+		}
 
-	return *selection;
+	return VI_SUCCESS;
+}
+
+
+/*---------------------------------------------------------------------------
+  Compile-time settings as the defaults of the configuration
+---------------------------------------------------------------------------*/
+void config_sample_defaults (config_t *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->pupil_centroid_x = SAMPLE_PUPIL_CENTROID_X;
+	cfg->pupil_centroid_y = SAMPLE_PUPIL_CENTROID_Y;
+	cfg->pupil_diameter_x = SAMPLE_PUPIL_DIAMETER_X;
+	cfg->pupil_diameter_y = SAMPLE_PUPIL_DIAMETER_Y;
+	cfg->zernike_order    = SAMPLE_ZERNIKE_ORDERS;
+	cfg->loops            = SAMPLE_LOOPS;
+	cfg->backend          = SAMPLE_BACKEND;
+	cfg->reconstructor    = SAMPLE_LOOP_RECONSTRUCTOR;
+	cfg->loop_rate_hz     = SAMPLE_LOOP_RATE_HZ;
+	cfg->loop_cpu         = SAMPLE_LOOP_CPU;
+	cfg->loop_rt_priority = SAMPLE_LOOP_RT_PRIORITY;
+	cfg->loop_pipelined   = SAMPLE_LOOP_PIPELINED;
+	cfg->zonal_gain       = SAMPLE_ZONAL_GAIN;
+	cfg->zonal_leak       = SAMPLE_ZONAL_LEAK;
+	cfg->projection_iterations = SAMPLE_PROJECTION_ITERATIONS;
+	cfg->dm_relax         = SAMPLE_DM_RELAX;
+	cfg->calib_scheme     = SAMPLE_CALIB_SCHEME;
+	cfg->calib_frames     = SAMPLE_CALIB_FRAMES;
+	cfg->poke_voltage     = SAMPLE_POKE_VOLTAGE;
+	cfg->telemetry        = SAMPLE_TELEMETRY;
+	cfg->capture          = SAMPLE_CAPTURE;
+	cfg->tiptilt          = SAMPLE_TIPTILT;
+	cfg->tiptilt_source   = SAMPLE_TIPTILT_SOURCE;
+	cfg->tiptilt_gain     = SAMPLE_TIPTILT_GAIN;
+	cfg->tiptilt_leak     = SAMPLE_TIPTILT_LEAK;
+	cfg->tiptilt_ho_every = SAMPLE_TIPTILT_HO_EVERY;
+	cfg->log_console_hz   = SAMPLE_LOG_CONSOLE_HZ;
+	strncpy(cfg->log_file, SAMPLE_LOG_FILE_NAME, CONFIG_STRING_LENGTH - 1);
+	strncpy(cfg->multirate, SAMPLE_MULTIRATE, CONFIG_STRING_LENGTH - 1);
+	strncpy(cfg->replay_file, SAMPLE_REPLAY_FILE_NAME, CONFIG_STRING_LENGTH - 1);
+}
+
+
+/*---------------------------------------------------------------------------
+  Index of the configured camera resolution in the pixel tables of the
+  instrument, default_index if none is configured. Exits if the instrument
+  has no such resolution.
+---------------------------------------------------------------------------*/
+int camera_resolution (session_t *s, const int xpixel[], const int ypixel[], int count, int default_index)
+{
+	int i;
+
+	if(config.cam_width <= 0)
+		return default_index;
+	for(i = 0; i < count; i++)
+		if(xpixel[i] == config.cam_width && ypixel[i] == config.cam_height)
+			return i;
+
+	printf("\n%sThe camera has no %d x %d resolution, available are:", s->label, config.cam_width, config.cam_height);
+	for(i = 0; i < count; i++)
+		printf(" %dx%d", xpixel[i], ypixel[i]);
+	printf("\n");
+	engine_exit(EXIT_FAILURE);
 }
 
 
@@ -575,40 +1800,35 @@ int select_mla (int *selection)
 ---------------------------------------------------------------------------*/
 void waitKeypress (void)
 {
+   if(config.headless)
+      return;
    printf("Press <ENTER> to continue\n");
    while(EOF == getchar());
 }
 
 /*---------------------------------------------------------------------------
-  Exit with error message
+  Exit with error message of loop s, NULL for errors outside the loops
 ---------------------------------------------------------------------------*/
-void error_exit (ViSession instrHdl, ViStatus err)
+void error_exit (session_t *s, ViStatus err)
 {
    ViChar buf[TLDFM_ERR_DESCR_BUFER_SIZE];
 
    // Get error description and print out error
-   TLDFMX_error_message(instrHdl, err, buf);
-   fprintf(stderr, "\nERROR: %s\n", buf);
-
-   // close session to instrument if open
-   if(VI_NULL != instrHdl)
-   {
-      TLDFMX_close(instrHdl);
-   }
-   WFS_close(instr.handle);
+   TLDFMX_error_message(s ? s->dm : VI_NULL, err, buf);
+   fprintf(stderr, "\n%sERROR: %s\n", s ? s->label : "", buf);
 
-   // exit program
+   // exit program, the sessions to the instruments of all loops are closed
    printf("\nThe program is shutting down.\n");
-   waitKeypress();
-
-   exit(EXIT_FAILURE);
+   engine_exit(EXIT_FAILURE);
 }
 
 
 /*---------------------------------------------------------------------------
- Read out device ID and print it to screen
+ Read out device ID and print it to screen. s->dm_serial picks the
+ mirror, headless takes the only one there is. *resource stays NULL if
+ none was selected.
 ---------------------------------------------------------------------------*/
-ViStatus select_instrument_DMH (ViChar **resource)
+ViStatus select_instrument_DMH (session_t *s, ViChar **resource, ViChar serial[])
 {
 	ViStatus err;
 	ViUInt32 deviceCount = 0;
@@ -616,10 +1836,11 @@ ViStatus select_instrument_DMH (ViChar **resource)
 	
 	ViChar    manufacturer[TLDFM_BUFFER_SIZE];
 	ViChar    instrumentName[TLDFM_MAX_INSTR_NAME_LENGTH];
-    ViChar    serialNumber[TLDFM_MAX_SN_LENGTH];
+    ViChar    serialNumber[SAMPLE_MAX_INSTRUMENTS][TLDFM_MAX_SN_LENGTH];
     ViBoolean deviceAvailable;
-    ViChar    resourceName[TLDFM_BUFFER_SIZE];
+    ViChar    resourceName[SAMPLE_MAX_INSTRUMENTS][TLDFM_BUFFER_SIZE];
 	
+	*resource = NULL;
 	printf("Scanning for instruments...\n");
 	err = TLDFM_get_device_count(VI_NULL, &deviceCount);
 	if((TL_ERROR_RSRC_NFOUND == err) || (0 == deviceCount))
@@ -627,43 +1848,75 @@ ViStatus select_instrument_DMH (ViChar **resource)
 		printf("No matching instruments found\n\n");
 		return err;
 	}
+	if(SAMPLE_MAX_INSTRUMENTS < deviceCount)
+	{
+		deviceCount = SAMPLE_MAX_INSTRUMENTS;
+	}
 	
 	printf("Found %d matching instrument(s):\n\n", deviceCount);
 	
-	for(ViUInt32 i = 0; i < deviceCount;)
+	for(ViUInt32 i = 0; i < deviceCount; i++)
 	{
 		err = TLDFM_get_device_information(VI_NULL,
 										   i,
 										   manufacturer,
 										   instrumentName,
-										   serialNumber,
+										   serialNumber[i],
 										   &deviceAvailable,
-										   resourceName);
+										   resourceName[i]);
+		if(VI_SUCCESS != err)
+		{
+			return err;
+		}
 		
 		printf("%d:\t%s\t%s\tS/N:%s\t%s\n",
-				++i,
+				i + 1,
 				manufacturer,
 				instrumentName,
-				serialNumber,
+				serialNumber[i],
 				deviceAvailable ? "available" : "locked");
+		if(s->dm_serial[0] && !strcmp(serialNumber[i], s->dm_serial))
+		{
+			choice = i + 1;
+		}
 	}
 	
-	if(2 <= deviceCount)
+	if(s->dm_serial[0])
+	{
+		if(!choice)
+		{
+			printf("\nNo deformable mirror with serial number %s found\n\n", s->dm_serial);
+		}
+	}
+	else if(1 == deviceCount)
+	{
+		choice = 1;
+		if(!config.headless)
+		{
+			printf("\nPress any key to continue");
+			waitKeypress();
+		}
+	}
+	else if(config.headless)
+	{
+		printf("\nSeveral deformable mirrors found, set dm_serial to select one\n\n");
+	}
+	else
 	{
 		ViBoolean deviceSelected = VI_FALSE;
-		printf("\nPlease choose: ");
+		printf("\nPlease choose%s: ", s->label[0] ? " the mirror of this loop" : "");
 		do
 		{
 			do
 			{
 				choice = getchar();
 			}
-			while(EOF == choice);
+			while(EOF == choice || '\n' == choice);
+			choice -= '0';
 		
-			if((0 >= choice) || (deviceCount < choice))
+			if((0 >= choice) || ((int)deviceCount < choice))
 			{
 				printf("Invalid choice\n\n");
-				choice = EOF;
 			}
 			else
 			{
@@ -672,117 +1925,1448 @@ ViStatus select_instrument_DMH (ViChar **resource)
 		}
 		while(!deviceSelected);
 	}
-	else
-	{
-		choice = 1;
-		printf("\nPress any key to continue");
-		waitKeypress();
-	}
 	
-	err = TLDFM_get_device_information(VI_NULL,
-									   (ViUInt32)(choice - 1),
-									   manufacturer,
-									   instrumentName,
-									   serialNumber,
-									   &deviceAvailable,
-									   resourceName);
-	
-	if(VI_SUCCESS == err)
+	if(choice)
 	{
 		*resource = malloc(TLDFM_BUFFER_SIZE);
-		strncpy(*resource, resourceName, TLDFM_BUFFER_SIZE);
+		strncpy(*resource, resourceName[choice - 1], TLDFM_BUFFER_SIZE);
+		strncpy(serial, serialNumber[choice - 1], TLDFM_MAX_SN_LENGTH);
 	}
-	return err;
+	return VI_SUCCESS;
 }
 
 
 /*---------------------------------------------------------------------------
- Generate Zernike Shape
+ Frame callback of calib_run(): measure_calib_frame() with its arguments
 ---------------------------------------------------------------------------*/
-void get_Zernike_list (void) {
-	float	zernike_input[16]={0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-	int	iter = 0;
-	char	holder[10] = {'\0'};
-	char* error_check;
-	fflush(stdin);
-	while (iter < 16){
-		printf("Input the %d-th order Zernike in um (input 'p' to zero following orders; input 'e' to terminate)\n",iter);
-		fgets(holder,10,stdin);
-		if (holder[0] == 'p'){
-			break;
-		}else if (holder[0] == 'e'){
-			WFS_close(instr.handle);
-			TLDFMX_close(instrHdl);
-			exit(EXIT_FAILURE);
+typedef struct
+{
+	session_t         *session;
+	const zonal_t     *zn;
+	const cent_grid_t *grid;
+	zfit_t            *zf;
+} calib_frame_ctx_t;
+
+
+int calib_frame (void *ctx, double meas[])
+{
+	calib_frame_ctx_t *cf = (calib_frame_ctx_t *)ctx;
+	
+	measure_calib_frame(cf->session, cf->zn, cf->grid, cf->zf, meas);
+	return VI_SUCCESS;
+}
+
+
+/*---------------------------------------------------------------------------
+ Measure the Zernike response (and slope response if zn is given) of every
+ segment with push-pull patterns around the bias pattern. The exposure is
+ settled once at the bias and then held, so all frames are comparable.
+ Prints the noise of every mode and of its interaction matrix row. ref gets
+ the mean measurement at the bias, the return value is its length.
+---------------------------------------------------------------------------*/
+int measure_interaction_matrix (session_t *s, recon_t *rc, zonal_t *zn, const cent_grid_t *grid, zfit_t *zf, ViReal64 bias[], double ref[])
+{
+	hal_sensor_t *sensor = s->sensor;
+	hal_mirror_t *mirror = s->mirror;
+	int      err;
+	int      n_slopes = 0;
+	double   response[RECON_MODES];
+	double   t0 = rt_now_ns(), row, noise, slope_noise = 0.0;
+	calib_t  cal;
+	calib_frame_ctx_t cf = { s, zn, grid, zf };
+	static float deviation_x[MAX_SPOTS_Y][MAX_SPOTS_X], deviation_y[MAX_SPOTS_Y][MAX_SPOTS_X];
+	static double meas[RECON_MODES + 2 * MAX_SPOTS_X * MAX_SPOTS_Y];
+	
+	// the reference at the bias sets the exposure and, in the zonal path, the lenslets that form the slope vector
+	if(err = mirror->set_segments (mirror->ctx, bias))
+		error_exit(s, err);
+	if(err = sensor->take_image_auto (sensor->ctx))
+		handle_errors(s, err);
+	if(zn)
+	{
+		measure_deviations(s, grid, *deviation_x, *deviation_y, NULL);
+		n_slopes = zonal_set_mask(zn, *deviation_x, *deviation_y, grid ? grid->n_x : s->instr.spots_x, grid ? grid->n_y : s->instr.spots_y) * 2;
+	}
+	if(calib_init(&cal, MAX_SEGMENTS, RECON_MODES + n_slopes, config.calib_scheme, config.poke_voltage, config.calib_frames))
+		error_exit(s, TL_ERROR_ALLOC);
+	
+	// the noise frames at the bias, every pattern pushed and pulled; the mean at the bias is the reference a cached
+	// calibration is checked against
+	if(err = calib_run(&cal, mirror, sensor, bias, SAMPLE_CALIB_NOISE_FRAMES, SAMPLE_CALIB_SETTLE_FRAMES, calib_frame, &cf, meas, ref))
+	{
+		if(cal.failed == CALIB_FAILED_MIRROR)
+			error_exit(s, err);
+		handle_errors(s, err);
+	}
+	
+	for(int seg = 0; seg < MAX_SEGMENTS; seg++)
+	{
+		const double *r = calib_response(&cal, seg);
+		for(int i = 0; i < RECON_MODES; i++)
+			response[i] = isnan(r[i]) ? 0.0 : r[i];
+		recon_set_response(rc, seg, response);
+		if(zn)
+			zonal_set_column(zn, seg, r + RECON_MODES);
+	}
+	
+	printf("%d %s patterns pushed and pulled by %.1f V, %d frames averaged at each: %d frames in %.1f s.\n", cal.n_patterns,
+	       (cal.scheme == CALIB_SCHEME_HADAMARD) ? "Hadamard" : "single segment", cal.amplitude, cal.n_avg, (int)(cal.frames + cal.settled), (rt_now_ns() - t0) / 1e9);
+	printf("  Mode   noise[nm]   row rms[nm/V]   row noise[nm/V]     SNR\n");
+	for(int i = 0; i < RECON_MODES; i++)
+	{
+		row = 0.0;
+		for(int seg = 0; seg < MAX_SEGMENTS; seg++)
+			row += rc->im[i * MAX_SEGMENTS + seg] * rc->im[i * MAX_SEGMENTS + seg];
+		row = sqrt(row / MAX_SEGMENTS);
+		noise = calib_response_noise(&cal, i);
+		printf("  Z%-4d %10.2f %15.3f %17.4f %8.1f\n", RECON_FIRST_MODE + i, calib_noise(&cal, i) * 1e3, row * 1e3, noise * 1e3, row / noise);
+	}
+	if(zn)
+	{
+		for(int i = RECON_MODES; i < cal.n_meas; i++)
+			slope_noise += isnan(calib_noise(&cal, i)) ? 0.0 : calib_noise(&cal, i);
+		slope_noise = n_slopes ? slope_noise / n_slopes : 0.0;
+		printf("  Slopes: %d, mean noise %.4f px per frame, %.5f px/V in the matrix.\n", n_slopes, slope_noise,
+		       slope_noise / (cal.amplitude * sqrt(2.0 * cal.n_avg * ((cal.scheme == CALIB_SCHEME_HADAMARD) ? cal.n_patterns : 1))));
+	}
+	calib_free(&cal);
+	return RECON_MODES + n_slopes;
+}
+
+
+/*---------------------------------------------------------------------------
+ One calibration frame at the held exposure: Z4 .. Z15, then the x and y
+ slopes of the zonal lenslets if zn is given, NaN where a spot is missing
+---------------------------------------------------------------------------*/
+void measure_calib_frame (session_t *s, const zonal_t *zn, const cent_grid_t *grid, zfit_t *zf, double meas[])
+{
+	hal_sensor_t *sensor = s->sensor;
+	int err;
+	float zernike[MAX_ZERNIKE_MODES+1];
+	static float fit_x[MAX_SPOTS_Y][MAX_SPOTS_X], fit_y[MAX_SPOTS_Y][MAX_SPOTS_X];
+	static float deviation_x[MAX_SPOTS_Y][MAX_SPOTS_X], deviation_y[MAX_SPOTS_Y][MAX_SPOTS_X];
+	
+	if(err = sensor->take_image (sensor->ctx))
+		handle_errors(s, err);
+	if(zn)
+	{
+		measure_deviations(s, grid, *deviation_x, *deviation_y, NULL);
+		for(int i = 0; i < zn->n_sub; i++)
+		{
+			meas[RECON_MODES + i]             = (*deviation_x)[zn->idx[i]];
+			meas[RECON_MODES + zn->n_sub + i] = (*deviation_y)[zn->idx[i]];
+		}
+	}
+	measure_zernikes(s, zf, *fit_x, *fit_y, zernike, NULL);
+	for(int i = 0; i < RECON_MODES; i++)
+		meas[i] = zernike[RECON_FIRST_MODE + i];
+}
+
+
+/*---------------------------------------------------------------------------
+ Quick check of a cached calibration against the live system: Z4..Z15 at
+ the bias must still match the cached reference wavefront, and in the
+ zonal path the spots their reference positions. Then a few
+ Hadamard patterns pushed and pulled must move the Zernikes as the cached
+ interaction matrix predicts. Takes 2 * (SAMPLE_CALIB_SETTLE_FRAMES +
+ config.calib_frames) frames per pattern instead of the full measurement.
+ Returns 0 if the cache holds.
+---------------------------------------------------------------------------*/
+int check_calibration (session_t *s, const recon_t *rc, const zonal_t *zn, const cent_grid_t *grid, zfit_t *zf, ViReal64 bias[], const double ref[], int n_ref)
+{
+	hal_sensor_t *sensor = s->sensor;
+	hal_mirror_t *mirror = s->mirror;
+	int      err, lost = 0, frames = 0, ok = 1, p;
+	double   t0 = rt_now_ns(), drift = 0.0, error, worst = 0.0;
+	double   dv[MAX_SEGMENTS], dz[RECON_MODES], push[RECON_MODES];
+	ViReal64 pattern[MAX_SEGMENTS];
+	calib_t  cal;
+	static double meas[RECON_MODES + 2 * MAX_SPOTS_X * MAX_SPOTS_Y];
+	
+	if(calib_init(&cal, MAX_SEGMENTS, n_ref, CALIB_SCHEME_HADAMARD, config.poke_voltage, config.calib_frames))
+		error_exit(s, TL_ERROR_ALLOC);
+	
+	// the reference at the bias, with the exposure settled as for the full measurement
+	if(err = mirror->set_segments (mirror->ctx, bias))
+		error_exit(s, err);
+	if(err = sensor->take_image_auto (sensor->ctx))
+		handle_errors(s, err);
+	calib_group_begin(&cal);
+	for(int f = 0; f < cal.n_avg; f++, frames++)
+	{
+		measure_calib_frame(s, zn, grid, zf, meas);
+		calib_group_add(&cal, meas);
+	}
+	calib_group_end(&cal, -1, 0);
+	// a beam or pupil that moved changes the wavefront at the bias, even where the responses still agree
+	drift = calcache_drift(ref, cal.mean, RECON_MODES, &lost);
+	printf("Reference wavefront: %.3f um rms drift of Z%d..Z%d.\n", drift, RECON_FIRST_MODE, RECON_FIRST_MODE + RECON_MODES - 1);
+	if(drift > SAMPLE_CALCACHE_DRIFT_UM || lost)
+		ok = 0;
+	if(zn)
+	{
+		drift = calcache_drift(ref + RECON_MODES, cal.mean + RECON_MODES, n_ref - RECON_MODES, &lost);
+		lost /= 2;
+		printf("Reference positions: %.3f px rms drift, %d of %d lenslets lost.\n", drift, lost, zn->n_sub);
+		if(drift > SAMPLE_CALCACHE_DRIFT_PX || lost > SAMPLE_CALCACHE_LOST * zn->n_sub)
+			ok = 0;
+	}
+	
+	// pattern 0 moves all segments the same way, the mixed ones below tell swapped or dead segments apart
+	for(p = 1; ok && p <= SAMPLE_CALCACHE_CHECK_PATTERNS && p < cal.n_patterns; p++)
+	{
+		for(int sign = 1; sign >= -1; sign -= 2)
+		{
+			calib_pattern(&cal, p, sign, bias, pattern);
+			if(err = mirror->set_segments (mirror->ctx, pattern))
+				error_exit(s, err);
+			for(int f = 0; f < SAMPLE_CALIB_SETTLE_FRAMES; f++, frames++)
+			{
+				if(err = sensor->take_image (sensor->ctx))
+					handle_errors(s, err);
+			}
+			calib_group_begin(&cal);
+			for(int f = 0; f < cal.n_avg; f++, frames++)
+			{
+				measure_calib_frame(s, zn, grid, zf, meas);
+				calib_group_add(&cal, meas);
+			}
+			calib_group_end(&cal, -1, 0);
+			if(sign > 0)
+				memcpy(push, cal.mean, sizeof(push));
+		}
+		for(int i = 0; i < RECON_MODES; i++)
+			dz[i] = 0.5 * (push[i] - cal.mean[i]);
+		for(int a = 0; a < MAX_SEGMENTS; a++)
+			dv[a] = cal.amplitude * cal.sign[p * MAX_SEGMENTS + a];
+		error = calcache_response_error(rc, dv, dz);
+		if(isnan(error) || error > worst)
+			worst = error;
+	}
+	if(err = mirror->set_segments (mirror->ctx, bias))
+		error_exit(s, err);
+	if(ok)
+	{
+		printf("Response to %d patterns differs by %.1f %% from the cached matrix.\n", p - 1, worst * 100.0);
+		ok = worst <= SAMPLE_CALCACHE_TOLERANCE;
+	}
+	printf("Calibration checked in %d frames, %.1f s.\n", frames, (rt_now_ns() - t0) / 1e9);
+	calib_free(&cal);
+	return ok ? 0 : -1;
+}
+
+
+/*---------------------------------------------------------------------------
+ Spot deviations of the image just taken, from the centroiding engine if a
+ lenslet grid is given, otherwise from the driver. If tilt is given, it gets
+ the mean deviation of the lit lenslets in px (NaN if none is lit), measured
+ before SAMPLE_OPTION_CANCEL_TILT takes it out.
+---------------------------------------------------------------------------*/
+void measure_deviations (session_t *s, const cent_grid_t *grid, float deviation_x[], float deviation_y[], double tilt[])
+{
+	hal_sensor_t *sensor = s->sensor;
+	int err;
+	unsigned char *image;
+	int rows, columns;
+	int cancel_tilt = tilt ? 0 : SAMPLE_OPTION_CANCEL_TILT;
+	int spots_x = grid ? grid->n_x : s->instr.spots_x, spots_y = grid ? grid->n_y : s->instr.spots_y;
+	int n = 0;
+	
+	if(grid)
+	{
+		// the sensor's image buffer is read in place, no copy
+		if(err = sensor->get_image (sensor->ctx, &image, &rows, &columns))
+			handle_errors(s, err);
+		cent_compute(grid, image, columns, deviation_x, deviation_y, MAX_SPOTS_X);
+		cent_deviations(grid, deviation_x, deviation_y, MAX_SPOTS_X, cancel_tilt);
+	}
+	else if(err = sensor->deviations (sensor->ctx, cancel_tilt, deviation_x, deviation_y))
+		handle_errors(s, err);
+	if(!tilt)
+		return;
+	
+	tilt[0] = tilt[1] = 0.0;
+	for(int j = 0; j < spots_y; j++)
+		for(int i = 0; i < spots_x; i++)
+			if(!isnan(deviation_x[j * MAX_SPOTS_X + i])){
+				tilt[0] += deviation_x[j * MAX_SPOTS_X + i];
+				tilt[1] += deviation_y[j * MAX_SPOTS_X + i];
+				n++;
+			}
+	tilt[0] = n ? tilt[0] / n : NAN;
+	tilt[1] = n ? tilt[1] / n : NAN;
+	if(!SAMPLE_OPTION_CANCEL_TILT || !n)
+		return;
+	for(int j = 0; j < spots_y; j++)
+		for(int i = 0; i < spots_x; i++){
+			deviation_x[j * MAX_SPOTS_X + i] -= (float)tilt[0];   // NaN stays NaN
+			deviation_y[j * MAX_SPOTS_X + i] -= (float)tilt[1];
+		}
+}
+
+
+/*---------------------------------------------------------------------------
+ Bring the Zernike projection up to the pupil and MLA, rebuilt from the
+ deviations of this frame if either changed since it was built. Returns 1
+ if it can be used, 0 if it cannot be built.
+---------------------------------------------------------------------------*/
+int zernike_projection (session_t *s, zfit_t *zf, float deviation_x[], float deviation_y[])
+{
+	hal_sensor_t *sensor = s->sensor;
+	int err;
+	int spots_x, spots_y;
+	zfit_geometry_t geo;
+	float scale_x[MAX_SPOTS_X], scale_y[MAX_SPOTS_Y];
+	
+	if(zf->generation != s->geometry_generation)
+	{
+		if(err = sensor->geometry (sensor->ctx, &geo, scale_x, scale_y, &spots_x, &spots_y))
+			handle_errors(s, err);
+		if(zfit_build(zf, RECON_ZERNIKE_ORDER, &geo, scale_x, scale_y, deviation_x, deviation_y, spots_x, spots_y, s->geometry_generation) > 0)
+			printf("Zernike projection built for %d lenslets, order %d, rank %d.\n", zf->n_sub, zf->order, zf->rank);
+		else
+			printf("Zernike projection could not be built, fitting with the driver.\n");
+	}
+	return zf->generation == s->geometry_generation;
+}
+
+
+/*---------------------------------------------------------------------------
+ Zernikes Z1 .. Z15 of the image just taken. With a projection the fit is one
+ GEMV on the driver's deviations, and the projection is rebuilt from this
+ frame first if the pupil or MLA changed since it was built. Without one, or
+ if it cannot be built, the sensor's own fit (WFS_ZernikeLsf) is used. tilt
+ as for measure_deviations.
+---------------------------------------------------------------------------*/
+void measure_zernikes (session_t *s, zfit_t *zf, float deviation_x[], float deviation_y[], float zernike[], double tilt[])
+{
+	hal_sensor_t *sensor = s->sensor;
+	int err;
+	
+	if(zf)
+	{
+		measure_deviations(s, NULL, deviation_x, deviation_y, tilt);
+		if(zernike_projection(s, zf, deviation_x, deviation_y))
+		{
+			zfit_apply(zf, deviation_x, deviation_y, zernike);
+			return;
+		}
+	}
+	// the driver fits its own deviations, the tilt needs ours
+	if(tilt && !zf)
+		measure_deviations(s, NULL, deviation_x, deviation_y, tilt);
+	if(err = sensor->zernikes (sensor->ctx, RECON_ZERNIKE_ORDER, zernike))
+		handle_errors(s, err);
+}
+
+
+/*---------------------------------------------------------------------------
+ Multi-rate measurement of one high-order frame. The groups averaging the
+ frame add its slopes to their sums, or its Zernikes when the driver fits,
+ and the modes of the groups due are fitted once from their mean slopes.
+ The fit is linear, so this is the mean of a fit on every frame without
+ fitting every frame. The sums start over when the projection is rebuilt
+ or the fit changes hands. Every frame carries the last mean of every group
+ and the frame it is from, fr->zernike holds the means: the pipeline may
+ replace a frame the control thread never read, and the groups due on it
+ then step with the next one. tilt as for measure_deviations.
+---------------------------------------------------------------------------*/
+void measure_groups (loop_state_t *ls, loop_frame_t *fr, double tilt[])
+{
+	int err;
+	session_t *s = ls->args->session;
+	hal_sensor_t *sensor = ls->args->sensor;
+	zfit_t *zf = ls->args->zfit;
+	mrate_t *mr = ls->args->mrate;
+	unsigned int due;
+	int first, last, source;
+	double z[16];
+	
+	if(zf || tilt)
+		measure_deviations(s, NULL, *fr->deviation_x, *fr->deviation_y, tilt);
+	source = (zf && zernike_projection(s, zf, *fr->deviation_x, *fr->deviation_y)) ? zf->generation : -1;
+	if(source != ls->mr_source){
+		mrate_reset(mr);
+		ls->mr_source = source;
+	}
+	if(source >= 0){
+		due = mrate_accumulate(mr, fr->ho_frame, zfit_slopes(zf, *fr->deviation_x, *fr->deviation_y), zf->n_slopes);
+		for(int g = 0; g < mr->n_groups; g++){
+			if(!(due & (1u << g)))
+				continue;
+			mrate_mean(mr, g, ls->mr_mean, zf->n_slopes);
+			mrate_span(mr, 1u << g, &first, &last);
+			zfit_fit_modes(zf, ls->mr_mean, ls->mr_zernike, first + RECON_FIRST_MODE, last + RECON_FIRST_MODE);
+		}
+	}else{
+		if(err = sensor->zernikes (sensor->ctx, RECON_ZERNIKE_ORDER, fr->zernike))
+			handle_errors(s, err);
+		for(int i = 0; i < 16; i++)
+			z[i] = fr->zernike[i];
+		due = mrate_accumulate(mr, fr->ho_frame, z, 16);
+		for(int g = 0; g < mr->n_groups; g++){
+			if(!(due & (1u << g)))
+				continue;
+			mrate_mean(mr, g, z, 16);
+			mrate_span(mr, 1u << g, &first, &last);
+			for(int i = first + RECON_FIRST_MODE; i <= last + RECON_FIRST_MODE; i++)
+				ls->mr_zernike[i] = (float)z[i];
+		}
+	}
+	for(int g = 0; g < mr->n_groups; g++)
+		if(due & (1u << g))
+			ls->mr_frame[g] = fr->ho_frame;
+	memcpy(fr->group_frame, ls->mr_frame, sizeof(fr->group_frame));
+	for(int i = RECON_FIRST_MODE; i < 16; i++)
+		fr->zernike[i] = ls->mr_zernike[i];
+}
+
+
+/*---------------------------------------------------------------------------
+ Tip/tilt signal of the image just taken, TT_SOURCE_* units. Returns 0, or
+ -1 if the frame has no lit lenslet or no beam.
+---------------------------------------------------------------------------*/
+int measure_tilt (session_t *s, const cent_grid_t *grid, int source, double tilt[])
+{
+	hal_sensor_t *sensor = s->sensor;
+	static float deviation_x[MAX_SPOTS_Y][MAX_SPOTS_X], deviation_y[MAX_SPOTS_Y][MAX_SPOTS_X];
+	
+	if(source == TT_SOURCE_BEAM)
+		return sensor->beam_centroid (sensor->ctx, &tilt[0], &tilt[1]) ? -1 : 0;
+	measure_deviations(s, grid, *deviation_x, *deviation_y, tilt);
+	return isnan(tilt[0]) ? -1 : 0;
+}
+
+
+/*---------------------------------------------------------------------------
+ Measure the response of the tip/tilt signal to every tilt arm with
+ push-pull steps around the bias, and hand it to the controller. The
+ setpoint is the signal at the bias for the beam centroid, and zero mean
+ deviation (the reference wavefront) for the spots. Returns 0, or -1 if the
+ arms do not move the signal along both axes. The arms end at the bias.
+---------------------------------------------------------------------------*/
+int measure_tiptilt_response (session_t *s, const cent_grid_t *grid, tt_t *tt)
+{
+	hal_sensor_t *sensor = s->sensor;
+	hal_mirror_t *mirror = s->mirror;
+	int      err;
+	double   im[TT_AXES * HAL_MAX_TILT], sum[TT_AXES], tilt[TT_AXES];
+	ViReal64 pattern[HAL_MAX_TILT];
+	int      n_avg = (config.calib_frames > 0) ? config.calib_frames : 1;
+	
+	if(err = mirror->set_tilt (mirror->ctx, tt->bias))
+		error_exit(s, err);
+	if(err = sensor->take_image_auto (sensor->ctx))
+		handle_errors(s, err);
+	memset(tt->setpoint, 0, sizeof(tt->setpoint));
+	if(tt->source == TT_SOURCE_BEAM){
+		sum[0] = sum[1] = 0.0;
+		for(int f = 0; f < n_avg; f++){
+			if(err = sensor->take_image (sensor->ctx))
+				handle_errors(s, err);
+			if(measure_tilt(s, grid, tt->source, tilt))
+				return -1;
+			sum[0] += tilt[0];
+			sum[1] += tilt[1];
+		}
+		tt->setpoint[0] = sum[0] / n_avg;
+		tt->setpoint[1] = sum[1] / n_avg;
+	}
+	
+	for(int a = 0; a < tt->n_tilt; a++){
+		im[a] = im[tt->n_tilt + a] = 0.0;
+		for(int sign = 1; sign >= -1; sign -= 2){
+			memcpy(pattern, tt->bias, sizeof(double) * tt->n_tilt);
+			pattern[a] += sign * SAMPLE_TIPTILT_POKE_VOLTAGE;
+			if(err = mirror->set_tilt (mirror->ctx, pattern))
+				error_exit(s, err);
+			// frames exposed while the arms move are thrown away
+			for(int f = 0; f < SAMPLE_CALIB_SETTLE_FRAMES; f++){
+				if(err = sensor->take_image (sensor->ctx))
+					handle_errors(s, err);
+			}
+			for(int f = 0; f < n_avg; f++){
+				if(err = sensor->take_image (sensor->ctx))
+					handle_errors(s, err);
+				if(measure_tilt(s, grid, tt->source, tilt))
+					return -1;
+				im[a]              += sign * tilt[0] / (2.0 * SAMPLE_TIPTILT_POKE_VOLTAGE * n_avg);
+				im[tt->n_tilt + a] += sign * tilt[1] / (2.0 * SAMPLE_TIPTILT_POKE_VOLTAGE * n_avg);
+			}
+		}
+	}
+	if(err = mirror->set_tilt (mirror->ctx, tt->bias))
+		error_exit(s, err);
+	for(int a = 0; a < tt->n_tilt; a++)
+		printf("Tilt arm %d: %+.4f, %+.4f %s per V\n", a + 1, im[a], im[tt->n_tilt + a], (tt->source == TT_SOURCE_BEAM) ? "mm" : "px");
+	return tt_set_response(tt, im);
+}
+
+
+/*---------------------------------------------------------------------------
+ Send a command to the loop, never waits
+---------------------------------------------------------------------------*/
+void operator_send (spsc_t *to_loop, loop_cmd_t *cmd)
+{
+	if(spsc_push(to_loop, cmd))
+		printf("Loop command queue full, command not sent.\n");
+}
+
+
+/*---------------------------------------------------------------------------
+ Operator console thread: reads commands from stdin without blocking the
+ loops, sends them over the command channels and prints the loops' events
+ and reports.
+ It owns the operator's copy of every loop's target, every change goes out
+ as a whole vector. With several loops the commands go to the loop picked
+ with 'l n', or to all of them after 'l 0'.
+---------------------------------------------------------------------------*/
+void *operator_thread (void *Args)
+{
+	engine_t * en = (engine_t *)Args;
+	console_t con;
+	console_cmd_t cc;
+	loop_cmd_t cmd[ENGINE_MAX_LOOPS];
+	loop_event_t ev, status[ENGINE_MAX_LOOPS];
+	char line[CONSOLE_LINE_MAX];
+	int r, i, sel = 0, done = 0;
+	
+	console_init(&con);
+	memset(status, 0, sizeof(status));
+	memset(cmd, 0, sizeof(cmd));
+	for(i = 0; i < en->n; i++)
+		memcpy(cmd[i].target, en->session[i].target, sizeof(cmd[i].target));
+	printf("\n%s running.\n", (en->n > 1) ? "Loops" : "Loop");
+	console_help();
+	
+	while(!done){
+		for(i = 0; i < en->n; i++){
+			session_t *s = &en->session[i];
+			
+			while(spsc_pop(&s->from_loop, &ev) == 0){
+				if(ev.type == LOOP_EVENT_STATUS){
+					status[i] = ev;
+				}else if(ev.type == LOOP_EVENT_CONVERGED){
+					printf("%sThe Zernike amplitudes are achieved (residual rms %.4f um). Enter new Zernikes.\n", s->label, ev.residual_rms);
+				}else if(ev.type == LOOP_EVENT_LOCK_LOST){
+					printf("%sSeems the loop fails to lock (residual rms %.4f um); 'q' terminates, otherwise it keeps trying.\n", s->label, ev.residual_rms);
+				}
+			}
+			if(spsc_flag_load(&s->report.posted)){
+				loop_report_print(s, &s->report);
+				spsc_flag_store(&s->report.posted, 0);
+			}
+		}
+		
+		r = console_read_line(&con, (int)SAMPLE_OPERATOR_POLL_MS, line, sizeof(line));
+		if(r < 0){
+			// stdin closed, keep relaying events
+			rt_sleep_ns(SAMPLE_OPERATOR_POLL_MS * 1e6);
+			continue;
+		}
+		if(r == 0)
+			continue;
+		
+		switch(console_parse(line, &cc)){
+			case CONSOLE_CMD_LOOP:
+				if(cc.channel > en->n){
+					printf("There %s %d loop%s.\n", (en->n > 1) ? "are" : "is", en->n, (en->n > 1) ? "s" : "");
+				}else{
+					sel = cc.channel;
+					if(sel)
+						printf("Commands go to loop %d.\n", sel);
+					else
+						printf("Commands go to all loops.\n");
+				}
+				break;
+			case CONSOLE_CMD_HELP:
+				console_help();
+				break;
+			case CONSOLE_CMD_QUIT:
+				// every loop ends, whichever one is picked
+				for(i = 0; i < en->n; i++){
+					cmd[i].type = LOOP_CMD_QUIT;
+					operator_send(&en->session[i].to_loop, &cmd[i]);
+				}
+				done = 1;
+				break;
+			case CONSOLE_CMD_INVALID:
+				printf("Unknown command '%s', 'h' lists the commands.\n", line);
+				break;
+			default:
+				for(i = 0; i < en->n; i++)
+					if(!sel || sel == i + 1)
+						operator_command(&en->session[i], &cc, &cmd[i], &status[i]);
+				break;
+		}
+	}
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------
+ One operator command for loop s, cmd is the operator's copy of its target
+ and status its last status event
+---------------------------------------------------------------------------*/
+void operator_command (session_t *s, const console_cmd_t *cc, loop_cmd_t *cmd, const loop_event_t *status)
+{
+	switch(cc->type){
+		case CONSOLE_CMD_TARGET:
+			memset(cmd->target, 0, sizeof(cmd->target));
+			for (int i = 0; i < cc->n_values; i++)
+				cmd->target[i] = cc->values[i];
+			cmd->type = LOOP_CMD_TARGET;
+			operator_send(&s->to_loop, cmd);
+			break;
+		case CONSOLE_CMD_ZERNIKE:
+			cmd->target[cc->channel] = (float)cc->value;
+			cmd->type = LOOP_CMD_TARGET;
+			operator_send(&s->to_loop, cmd);
+			break;
+		case CONSOLE_CMD_PAUSE:
+			cmd->type = LOOP_CMD_PAUSE;
+			operator_send(&s->to_loop, cmd);
 			break;
+		case CONSOLE_CMD_RESUME:
+			cmd->type = LOOP_CMD_RESUME;
+			operator_send(&s->to_loop, cmd);
+			break;
+		case CONSOLE_CMD_GAIN:
+			cmd->type = LOOP_CMD_GAIN;
+			cmd->channel = cc->channel;
+			cmd->value = cc->value;
+			operator_send(&s->to_loop, cmd);
+			break;
+		case CONSOLE_CMD_STATUS:
+			cmd->type = LOOP_CMD_REPORT;
+			operator_send(&s->to_loop, cmd);
+			printf("%sIteration %ld, residual rms %.4f um, target:", s->label, status->iteration, status->residual_rms);
+			for (int i = 0; i < 16; i++)
+				printf(" %.3f", cmd->target[i]);
+			printf("\n");
+			break;
+		case CONSOLE_CMD_CAPTURE:
+			cmd->type = LOOP_CMD_CAPTURE;
+			cmd->value = cc->value;
+			operator_send(&s->to_loop, cmd);
+			break;
+	}
+}
+
+/*---------------------------------------------------------------------------
+ Convert the Zernike target into slope offsets for the zonal path: the
+ voltages that produce the target (modal control matrix) mapped to slopes
+---------------------------------------------------------------------------*/
+void update_zonal_target (zonal_t *zn, const recon_t *rc, const float target[])
+{
+	double z_target[RECON_MODES];
+	double v_target[MAX_SEGMENTS];
+	
+	for(int i = 0; i < RECON_MODES; i++)
+		z_target[i] = target[RECON_FIRST_MODE + i];
+	recon_apply(rc, z_target, v_target);
+	la_gemv(zn->im, zn->n_slopes, zn->n_act, v_target, zn->target);
+}
+
+/*---------------------------------------------------------------------------
+ Keep highspeed mode healthy between frames: check the centroids against
+ their windows on a schedule, fall back to full-frame mode when spots left
+ them and re-arm highspeed mode around the new spot positions later
+---------------------------------------------------------------------------*/
+void highspeed_service (loop_state_t *ls)
+{
+	int err;
+	hal_sensor_t *sensor = ls->args->sensor;
+	
+	ls->hs_frames++;
+	if(ls->hs_active){
+		if(ls->hs_frames < SAMPLE_HS_CHECK_EVERY)
+			return;
+		ls->hs_frames = 0;
+		err = sensor->highspeed_check (sensor->ctx);
+		if(err == 1){
+			alog_post(&alog, ls->log->acquire, ls->log->hs_fallback, 0);
+			if(err = sensor->highspeed (sensor->ctx, 0))
+				handle_errors(ls->args->session, err);
+			ls->hs_active = 0;
+			ls->hs_fallbacks++;
 		}else{
-			zernike_input[iter] = strtof(holder,&error_check);
-			if (*error_check == '\0'){
-				printf("Not a valid float input\n");
-			}else{
-				iter ++;
+			handle_errors(ls->args->session, err);
+		}
+	}else{
+		if(ls->hs_frames < SAMPLE_HS_RETRY_EVERY)
+			return;
+		ls->hs_frames = 0;
+		highspeed_arm(ls);
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+ Highspeed mode on around the current spots, the windows or the failure go
+ to the log. Runs where the frames are taken; only the Thorlabs backend has
+ highspeed mode, its windows are in the session's instr.
+---------------------------------------------------------------------------*/
+void highspeed_arm (loop_state_t *ls)
+{
+	hal_sensor_t *sensor = ls->args->sensor;
+	const instr_t *wfs = &ls->args->session->instr;
+	
+	ls->hs_active = (sensor->highspeed (sensor->ctx, 1) == 0);
+	if(ls->hs_active)
+		alog_post(&alog, ls->log->acquire, ls->log->hs_on, 4, (double)wfs->hs_win_count_x, (double)wfs->hs_win_count_y, (double)wfs->hs_win_size_x, (double)wfs->hs_win_size_y);
+	else
+		alog_post(&alog, ls->log->acquire, ls->log->hs_failed, 0);
+}
+
+
+/*---------------------------------------------------------------------------
+ Find the exposure of the first well exposed frame: bisection / secant on
+ the image peak over exposure and gain, starting from the exposure stored for
+ this sensor serial (NULL stores nothing). Returns 0 with a well exposed last
+ frame, 1 if the search gave up and the camera's auto exposure took it, or
+ the sensor error.
+---------------------------------------------------------------------------*/
+int find_exposure (hal_sensor_t *sensor, const char *serial)
+{
+	int           err, result, status, img_min, img_max;
+	double        exp_min, exp_max, exp_incr, gain_min, gain_max, exposure, gain, saturated;
+	expo_search_t es;
+	
+	if(err = sensor->get_exposure_range (sensor->ctx, &exp_min, &exp_max, &exp_incr))
+		return err;
+	if(err = sensor->get_exposure (sensor->ctx, &exposure))
+		return err;
+	if(err = sensor->get_gain (sensor->ctx, &gain))
+		return err;
+	gain_min = gain_max = gain;
+	if(sensor->get_gain_range && sensor->set_gain && (err = sensor->get_gain_range (sensor->ctx, &gain_min, &gain_max)))
+		return err;
+	// the loops search at the same time, one file keeps the exposures of all sensors
+	pthread_mutex_lock(&engine.expo_lock);
+	err = serial ? expo_recall(SAMPLE_EXPOS_FILE_NAME, serial, &exposure, &gain) : -1;
+	pthread_mutex_unlock(&engine.expo_lock);
+	if(err == 0)
+		printf("\nExposure search starts at %.3f ms, gain %.2f from the last run.\n", exposure, gain);
+	expo_search_init(&es, exp_min, exp_max, exp_incr, gain_min, gain_max, exposure, gain, SAMPLE_EXPOS_SEARCH_FRAMES);
+	
+	printf("\nImage No.   Exposure[ms]   Gain   Peak\n");
+	do
+	{
+		if(err = sensor->set_exposure (sensor->ctx, es.exposure, &es.exposure))
+			return err;
+		if(sensor->set_gain && (err = sensor->set_gain (sensor->ctx, es.gain, &es.gain)))
+			return err;
+		exposure = es.exposure;
+		gain     = es.gain;
+		if(err = sensor->take_image (sensor->ctx))
+			return err;
+		if(err = sensor->get_status (sensor->ctx, &status))
+			return err;
+		if(err = sensor->image_min_max (sensor->ctx, &img_min, &img_max, &saturated))
+			return err;
+		result = expo_search_update(&es, img_max, saturated, (status & HAL_STATUS_POWER_HIGH) != 0, (status & HAL_STATUS_POWER_LOW) != 0);
+		printf("    %d         %8.3f    %5.2f    %3d\n", es.frames, exposure, gain, img_max);
+	}
+	while(result == EXPO_SEARCH_MORE);
+	
+	if(result == EXPO_SEARCH_FOUND)
+	{
+		pthread_mutex_lock(&engine.expo_lock);
+		err = serial ? expo_remember(SAMPLE_EXPOS_FILE_NAME, serial, exposure, gain) : 0;
+		pthread_mutex_unlock(&engine.expo_lock);
+		if(err)
+			printf("Could not store the exposure in %s.\n", SAMPLE_EXPOS_FILE_NAME);
+		return 0;
+	}
+	printf("Exposure search gave up after %d frames, using the camera's auto exposure.\n", es.frames);
+	if(err = sensor->take_image_auto (sensor->ctx))
+		return err;
+	return 1;
+}
+
+
+/*---------------------------------------------------------------------------
+ Settle the exposure once with the exposure search, then keep it fixed for
+ the loop frames
+---------------------------------------------------------------------------*/
+void exposure_init (loop_state_t *ls)
+{
+	int err;
+	hal_sensor_t *sensor = ls->args->sensor;
+	double exp_min, exp_max, exp_incr;
+	
+	if(err = sensor->get_exposure_range (sensor->ctx, &exp_min, &exp_max, &exp_incr))
+		handle_errors(ls->args->session, err);
+	// recorded frames do not follow the exposure, the replay keeps the recorded one
+	if(config.backend == HAL_BACKEND_REPLAY)
+		err = sensor->take_image_auto (sensor->ctx);
+	else
+		err = find_exposure(sensor, (config.backend == HAL_BACKEND_THORLABS) ? ls->args->session->instr.serial_number_wfs : NULL);
+	if(err < 0)
+		handle_errors(ls->args->session, err);
+	if(err = sensor->get_exposure (sensor->ctx, &ls->exposure))
+		handle_errors(ls->args->session, err);
+	if(err = sensor->get_gain (sensor->ctx, &ls->gain))
+		handle_errors(ls->args->session, err);
+	expo_init(&ls->expo, exp_min, exp_max, exp_incr, SAMPLE_EXPOS_TUNE_EVERY);
+	printf("%sLoop exposure fixed at %.3f ms (range %.3f .. %.3f ms).\n", ls->args->session->label, ls->exposure, exp_min, exp_max);
+}
+
+
+/*---------------------------------------------------------------------------
+ Exposure tuner: look at the frame just taken and change the exposure for the
+ following frames only if the signal left the hysteresis band
+---------------------------------------------------------------------------*/
+void exposure_service (loop_state_t *ls)
+{
+	int err;
+	hal_sensor_t *sensor = ls->args->sensor;
+	int img_min = 0, img_max = 0, status = 0;
+	double saturated = 0.0, exposure;
+	
+	if(err = sensor->get_status (sensor->ctx, &status))
+		handle_errors(ls->args->session, err);
+	// no image is read out in highspeed mode, the power status bits are all there is
+	if(ls->hs_active || sensor->image_min_max (sensor->ctx, &img_min, &img_max, &saturated))
+		img_max = (int)(ls->expo.target * EXPO_FULL_SCALE);
+	exposure = expo_update(&ls->expo, ls->exposure, img_max, saturated, (status & HAL_STATUS_POWER_HIGH) != 0, (status & HAL_STATUS_POWER_LOW) != 0);
+	if(exposure != ls->exposure){
+		if(err = sensor->set_exposure (sensor->ctx, exposure, &ls->exposure))
+			handle_errors(ls->args->session, err);
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+ Loop stage 1: expose and measure one frame
+---------------------------------------------------------------------------*/
+void loop_measure (loop_state_t *ls, loop_frame_t *fr)
+{
+	int err;
+	threadArgs * Argstruct = ls->args;
+	
+	if(Argstruct->highspeed)
+		highspeed_service(ls);
+	rt_stage_begin(&ls->rt);
+	fr->t_ns = rt_now_ns();
+	if(err = Argstruct->sensor->take_image (Argstruct->sensor->ctx))
+		handle_errors(ls->args->session, err);
+	fr->acquire_ns = rt_stage_end(&ls->rt, ls->st_acquire);
+	// the camera settings of this frame travel with it, the tuner below only changes the next one
+	fr->exposure  = ls->exposure;
+	fr->gain      = ls->gain;
+	fr->highspeed = ls->hs_active;
+	if(expo_due(&ls->expo))
+		exposure_service(ls);
+	// the spots give the tilt with the high-order measurement, the beam centroid on its own
+	tt_t *tt = Argstruct->tiptilt;
+	double *tilt = (tt && tt->source == TT_SOURCE_SPOTS) ? fr->tilt : NULL;
+	fr->high_order = !tt || ls->frames % config.tiptilt_ho_every == 0;
+	ls->frames++;
+	// a frame that no mode group averages is a tip/tilt only frame
+	if(fr->high_order && Argstruct->mrate){
+		fr->ho_frame = ls->ho_frames++;
+		fr->high_order = (mrate_measuring(Argstruct->mrate, fr->ho_frame) != 0);
+	}
+	if(!fr->high_order){
+		// tip/tilt only frame: deviations without the Zernike fit, nothing at all for the beam centroid
+		if(tilt)
+			measure_deviations(Argstruct->session, Argstruct->grid, *fr->deviation_x, *fr->deviation_y, tilt);
+	}else if(config.reconstructor == LOOP_RECON_ZONAL){
+		// slope path: centroids and deviations only, the Zernike fit is skipped
+		measure_deviations(Argstruct->session, Argstruct->grid, *fr->deviation_x, *fr->deviation_y, tilt);
+	}else if(Argstruct->mrate){
+		measure_groups(ls, fr, tilt);
+	}else{
+		measure_zernikes(Argstruct->session, Argstruct->zfit, *fr->deviation_x, *fr->deviation_y, fr->zernike, tilt);
+	}
+	if(tt && tt->source == TT_SOURCE_BEAM){
+		// no image is read out in highspeed mode
+		fr->tilt_ok = !fr->highspeed && Argstruct->sensor->beam_centroid (Argstruct->sensor->ctx, &fr->tilt[0], &fr->tilt[1]) == 0;
+	}else{
+		fr->tilt_ok = tt && !isnan(fr->tilt[0]);
+	}
+	fr->measure_ns = rt_stage_end(&ls->rt, ls->st_measure);
+	if(spsc_flag_load(&ls->cap_request) || ls->capturing)
+		loop_capture(ls, fr);
+	loop_report_acquire(ls);
+}
+
+
+/*---------------------------------------------------------------------------
+ Hand the raw frame just taken to the capture writer, a copy into its ring.
+ Runs where the frames are taken, so it is the writer's only producer. The
+ file is created on the first request and stays open until the loop ends.
+---------------------------------------------------------------------------*/
+void loop_capture (loop_state_t *ls, const loop_frame_t *fr)
+{
+	int err;
+	hal_sensor_t *sensor = ls->args->sensor;
+	session_t *s = ls->args->session;
+	unsigned char *image;
+	int rows, columns, status = 0;
+	capture_header_t header;
+	int request = spsc_flag_load(&ls->cap_request);
+	
+	if(request != ls->capturing){
+		ls->capturing = request;
+		if(!ls->capturing){
+			alog_post(&alog, ls->log->acquire, ls->log->capture_off, 2, (double)ls->cap.seq, (double)ls->cap.dropped);
+			return;
+		}
+		if(!ls->cap_open){
+			if(err = sensor->get_image (sensor->ctx, &image, &rows, &columns))
+				handle_errors(ls->args->session, err);
+			ls->cap_open = (capture_header_init(&header, sensor, ls->args->mirror, columns, rows, s->instr.cam_pitch_um, s->instr.lenslet_pitch_um,
+			                                    s->instr.lenslet_f_um, s->instr.center_spot_offset_x, s->instr.center_spot_offset_y) == 0
+			                && capture_open(&ls->cap, s->capture_file, &header, SAMPLE_CAPTURE_DEPTH) == 0);
+			if(!ls->cap_open){
+				alog_post(&alog, ls->log->acquire, ls->log->capture_failed, 0);
+				ls->capturing = 0;
+				spsc_flag_store(&ls->cap_request, 0);
+				return;
 			}
 		}
+		alog_post(&alog, ls->log->acquire, ls->log->capture_on, 0);
 	}
-	for (int i = 0; i < 16; i++){
-		target_zernike[i] = zernike_input[i];
+	// no image is read out in highspeed mode
+	if(fr->highspeed)
+		return;
+	if(err = sensor->get_image (sensor->ctx, &image, &rows, &columns))
+		handle_errors(ls->args->session, err);
+	if(err = sensor->get_status (sensor->ctx, &status))
+		handle_errors(ls->args->session, err);
+	capture_frame(&ls->cap, image, rows, columns, fr->t_ns, fr->exposure, fr->gain, status);
+}
+
+
+/*---------------------------------------------------------------------------
+ Take all pending operator commands, never waits. A new target replaces the
+ whole vector at once, between two frames.
+---------------------------------------------------------------------------*/
+void loop_poll_commands (loop_state_t *ls)
+{
+	loop_cmd_t cmd;
+	
+	while(spsc_pop(ls->args->to_loop, &cmd) == 0){
+		if(cmd.type == LOOP_CMD_TARGET){
+			memcpy(ls->target, cmd.target, sizeof(ls->target));
+			ls->converged = 0;   // report reaching the new target, even if it equals the old one
+		}else if(cmd.type == LOOP_CMD_PAUSE){
+			ls->paused = 1;
+		}else if(cmd.type == LOOP_CMD_RESUME){
+			ls->paused = 0;
+		}else if(cmd.type == LOOP_CMD_GAIN){
+			// Zernike 2 and 3 of the modal path are the tip/tilt axes
+			if(ls->args->tiptilt && config.reconstructor != LOOP_RECON_ZONAL && (cmd.channel == 2 || cmd.channel == 3)){
+				ctrl_param_t param = ls->args->tiptilt->ctrl.param[cmd.channel - 2];
+				param.gain = cmd.value;
+				ctrl_set_channel(&ls->args->tiptilt->ctrl, cmd.channel - 2, param);
+				continue;
+			}
+			// modal channels are Z4 .. Z15, zonal channels are segments 1 .. 40
+			int first = (config.reconstructor == LOOP_RECON_ZONAL) ? 1 : RECON_FIRST_MODE;
+			for(int ch = 0; ch < ls->ctrl.n; ch++){
+				if(cmd.channel < 0 || cmd.channel - first == ch){
+					ctrl_param_t param = ls->ctrl.param[ch];
+					param.gain = cmd.value;
+					ctrl_set_channel(&ls->ctrl, ch, param);
+				}
+			}
+		}else if(cmd.type == LOOP_CMD_QUIT){
+			ls->quit = 1;
+		}else if(cmd.type == LOOP_CMD_REPORT){
+			loop_report(ls);
+		}else if(cmd.type == LOOP_CMD_CAPTURE){
+			spsc_flag_store(&ls->cap_request, cmd.value != 0.0);
+		}
 	}
 }
 
-void* Loop(void *Args){
+
+/*---------------------------------------------------------------------------
+ Report an event to the operator, dropped (and counted by the channel) if the
+ operator is not keeping up
+---------------------------------------------------------------------------*/
+void loop_send_event (loop_state_t *ls, int type, double residual_rms)
+{
+	loop_event_t ev;
+	
+	ev.type = type;
+	ev.iteration = ls->rt.iterations;
+	ev.residual_rms = residual_rms;
+	spsc_push(ls->args->from_loop, &ev);
+}
+
+
+/*---------------------------------------------------------------------------
+ Loop messages and the log thread. The loop threads only post the numbers
+ of a message, the text is made and written by the log thread: on the
+ console at most config.log_console_hz lines per message, in the log file
+ every one of them.
+---------------------------------------------------------------------------*/
+void loop_log_start (void)
+{
+	double hz = config.log_console_hz;
+	loop_log_t shared;
+	char path[2 * CONFIG_STRING_LENGTH];
+	
+	alog_init(&alog);
+	shared.zernike     = alog_format(&alog, "Resulted Zernike starting from Z4: ", ALOG_LIST, hz);
+	shared.first_closed = alog_format(&alog, "Time to first closed loop: %.1f ms after program start.", 0, 0.0);
+	shared.hs_on       = alog_format(&alog, "Highspeed mode on: %.0f x %.0f windows of %.0f x %.0f pixels.", 0, hz);
+	shared.hs_failed   = alog_format(&alog, "Highspeed mode not available, staying in full-frame mode.", 0, hz);
+	shared.hs_fallback = alog_format(&alog, "Spots left their highspeed windows, falling back to full-frame mode.", 0, hz);
+	shared.capture_off = alog_format(&alog, "Capture stopped, %.0f frames offered, %.0f dropped.", 0, 0.0);
+	// every loop posts on its own channels, their label tells the loops apart; only the capture file differs in the text
+	for(int i = 0; i < engine.n; i++){
+		session_t *s = &engine.session[i];
+		
+		s->log = shared;
+		s->log.correct = alog_channel(&alog, SAMPLE_LOG_DEPTH, s->label);
+		s->log.acquire = alog_channel(&alog, SAMPLE_LOG_DEPTH, s->label);
+		// the file name becomes part of a format, a % in it must not read as a conversion
+		alog_escape(path, sizeof(path), s->capture_file);
+		snprintf(s->capture_on_text, sizeof(s->capture_on_text), "Capturing raw frames to %s.", path);
+		snprintf(s->capture_failed_text, sizeof(s->capture_failed_text), "Could not create %s, no frames are recorded.", path);
+		s->log.capture_on     = alog_format(&alog, s->capture_on_text, 0, 0.0);
+		s->log.capture_failed = alog_format(&alog, s->capture_failed_text, 0, 0.0);
+		if(s->log.correct < 0 || s->log.acquire < 0 || s->log.capture_on < 0 || s->log.capture_failed < 0)
+			error_exit(s, TL_ERROR_ALLOC);
+	}
+	if(alog_start(&alog, stdout, config.log_file) == 0)
+		return;
+	printf("Could not create %s, loop messages go to the console only.\n", config.log_file);
+	if(alog_start(&alog, stdout, NULL)){
+		printf("Could not start the log thread.\n");
+		error_exit(NULL, TL_ERROR_SYSTEM_ERROR);
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+ Hand the operator thread a report of the loop, periodically and on operator
+ request. Every thread only copies its own state: the control thread takes
+ its half here, the acquisition side adds its half with the next frame and
+ posts the report, the operator prints it. While the last report is not
+ printed yet no new one is taken.
+---------------------------------------------------------------------------*/
+void loop_report (loop_state_t *ls)
+{
+	loop_report_t *rp = &ls->args->session->report;
+	
+	// want first: the acquisition side sets posted before it clears want
+	if(spsc_flag_load(&rp->want) || spsc_flag_load(&rp->posted))
+		return;
+	loop_report_take_correct(ls, rp);
+	spsc_flag_store(&rp->want, 1);
+}
+
+
+/*---------------------------------------------------------------------------
+ Acquisition side of loop_report, after every frame: adds its half to a
+ report the control thread started and posts it
+---------------------------------------------------------------------------*/
+void loop_report_acquire (loop_state_t *ls)
+{
+	loop_report_t *rp = &ls->args->session->report;
+	
+	if(!spsc_flag_load(&rp->want))
+		return;
+	loop_report_take_acquire(ls, rp);
+	spsc_flag_store(&rp->posted, 1);
+	spsc_flag_store(&rp->want, 0);
+}
+
+
+/*---------------------------------------------------------------------------
+ Copy of the state the thread taking the frames writes: loop rate, acquire
+ and measure latencies, exposure, highspeed state and the mode groups
+---------------------------------------------------------------------------*/
+void loop_report_take_acquire (loop_state_t *ls, loop_report_t *rp)
+{
+	// the scheduler up to its last stage in use, the remaining stages are empty
+	memcpy(&rp->rt, &ls->rt, offsetof(rt_sched_t, stage) + ls->rt.n_stages * sizeof(rt_stage_t));
+	rp->exposure           = ls->exposure;
+	rp->expo_changes       = ls->expo.changes;
+	rp->expo_peak          = ls->expo.last_peak;
+	rp->expo_saturated_pct = ls->expo.last_saturated_pct;
+	rp->hs_active          = ls->hs_active;
+	rp->hs_fallbacks       = ls->hs_fallbacks;
+	if (ls->args->mrate){
+		rp->mrate = *ls->args->mrate;
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+ Copy of the state the control thread writes: reconstruct and actuate
+ latencies when pipelined, the pipeline and the limits reached
+---------------------------------------------------------------------------*/
+void loop_report_take_correct (loop_state_t *ls, loop_report_t *rp)
+{
+	if (config.loop_pipelined){
+		memcpy(&rp->rt_correct, &ls->rt_correct, offsetof(rt_sched_t, stage) + ls->rt_correct.n_stages * sizeof(rt_stage_t));
+		pipeline_stats(&ls->pipe, &rp->pipe);
+	}
+	rp->vbox.n              = ls->vbox.n;
+	rp->vbox.iterations     = ls->vbox.iterations;
+	rp->vbox.weighted       = ls->vbox.weighted;
+	rp->vbox.frames         = ls->vbox.frames;
+	rp->vbox.unfinished     = ls->vbox.unfinished;
+	rp->vbox.iterations_run = ls->vbox.iterations_run;
+	memcpy(rp->vbox.saturated, ls->vbox.saturated, sizeof(rp->vbox.saturated));
+	if (ls->args->tiptilt){
+		tt_t *tt = ls->args->tiptilt;
+		rp->tt_updates   = tt->updates;
+		rp->tt_saturated = tt->ctrl.saturated_frames;
+		memcpy(rp->tt_error, tt->error, sizeof(rp->tt_error));
+		memcpy(rp->tt_voltage, tt->voltage, sizeof(rp->tt_voltage));
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+ Printout of a report of loop s. Runs on the operator thread, and on the main
+ thread for the last report once the loops have ended.
+---------------------------------------------------------------------------*/
+void loop_report_print (const session_t *s, const loop_report_t *rp)
+{
+	if (engine.n > 1)
+		printf("Loop %d:\n", s->index + 1);
+	rt_report(&rp->rt, stdout);
+	printf("Exposure %.3f ms, %ld changes, last peak %.0f, %.2f %% saturated\n", rp->exposure, rp->expo_changes, rp->expo_peak, rp->expo_saturated_pct);
+	if (s->args.highspeed){
+		printf("Highspeed mode %s, %ld fallbacks to full-frame mode\n", rp->hs_active ? "active" : "off", rp->hs_fallbacks);
+	}
+	if (config.loop_pipelined){
+		rt_report(&rp->rt_correct, stdout);
+		pipeline_report_stats(&rp->pipe, stdout);
+	}
+	vbox_report(&rp->vbox, stdout);
+	if (s->args.mrate){
+		mrate_report(&rp->mrate, stdout, RECON_FIRST_MODE);
+	}
+	if (s->args.tiptilt){
+		const tt_t *tt = s->args.tiptilt;
+		printf("Tip/tilt %ld updates, error %+.4f %+.4f %s, arms", rp->tt_updates, rp->tt_error[0], rp->tt_error[1], (tt->source == TT_SOURCE_BEAM) ? "mm" : "px");
+		for (int a = 0; a < tt->n_tilt; a++)
+			printf(" %.1f", rp->tt_voltage[a]);
+		printf(" V, %ld frames at a limit\n", rp->tt_saturated);
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+ Tip/tilt step of every frame: the tilt arms follow the frame's signal
+---------------------------------------------------------------------------*/
+void tiptilt_correct (loop_state_t *ls, const loop_frame_t *fr)
+{
 	int err;
-	int ite = 0;
-	int counter = 0;
-	int recorder = 0;
-	int stable = 0;
-	threadArgs * Argstruct = (threadArgs *)Args;
-	float measuredZernike[16];
+	hal_mirror_t *mirror = ls->args->mirror;
+	tt_t *tt = ls->args->tiptilt;
+	
+	tt_update(tt, fr->tilt);
+	if(err = mirror->set_tilt (mirror->ctx, tt->voltage))
+		error_exit(ls->args->session, err);
+}
+
+
+/*---------------------------------------------------------------------------
+ Fill one telemetry record in place, no system call. residual is Z4 .. Z15,
+ NULL when the segments were not corrected.
+---------------------------------------------------------------------------*/
+void loop_telemetry (loop_state_t *ls, const loop_frame_t *fr, const double residual[], int clamped, int flags)
+{
+	tlm_record_t *r;
+	tt_t *tt = ls->args->tiptilt;
+	int ite;
+	
+	if(!ls->tlm_on)
+		return;
+	r = tlm_begin(&ls->tlm);
+	r->t_ns = fr->t_ns - ls->tlm.header->t0_ns;
+	for (ite = 0; ite < TLM_ZERNIKES; ite ++){
+		r->zernike[ite] = (flags & (TLM_FLAG_ZONAL | TLM_FLAG_TILT_ONLY)) ? 0.0f : fr->zernike[ite];
+		r->target[ite] = ls->target[ite];
+	}
+	for (ite = 0; ite < TLM_RESIDUALS; ite ++)
+		r->residual[ite] = residual ? (float)residual[ite] : 0.0f;
+	for (ite = 0; ite < TLM_SEGMENTS; ite ++)
+		r->voltage[ite] = (float)ls->ctrlVoltage[ite];
+	r->exposure_ms = (float)fr->exposure;
+	r->gain = (float)fr->gain;
+	// stage order as in loop_tlm_stages
+	r->stage_us[0] = (float)(fr->acquire_ns / 1e3);
+	r->stage_us[1] = (float)(fr->measure_ns / 1e3);
+	r->stage_us[2] = residual ? (float)(ls->rt_corr->stage[ls->st_reconstruct].last_ns / 1e3) : 0.0f;
+	r->stage_us[3] = residual ? (float)(ls->rt_corr->stage[ls->st_actuate].last_ns / 1e3) : 0.0f;
+	r->stage_us[4] = (tt && fr->tilt_ok && !(flags & TLM_FLAG_PAUSED)) ? (float)(ls->rt_corr->stage[ls->st_tilt].last_ns / 1e3) : 0.0f;
+	r->flags = flags | (fr->highspeed ? TLM_FLAG_HIGHSPEED : 0);
+	r->clamped = clamped;
+	for (ite = 0; ite < TLM_TILT_ARMS; ite ++)
+		r->tilt_voltage[ite] = (tt && ite < tt->n_tilt) ? (float)tt->voltage[ite] : 0.0f;
+	for (ite = 0; ite < TLM_TILT_AXES; ite ++)
+		r->tilt_error[ite] = (tt && fr->tilt_ok) ? (float)tt->error[ite] : NAN;
+	r->reserved = 0;
+	tlm_commit(&ls->tlm);
+}
+
+
+/*---------------------------------------------------------------------------
+ Loop stage 2: reconstruct, control and drive the mirror from one frame
+---------------------------------------------------------------------------*/
+void loop_correct (loop_state_t *ls, loop_frame_t *fr)
+{
+	int err;
+	int ite;
+	int stable = 1;
+	int clamped = 0;
+	int flags = (config.reconstructor == LOOP_RECON_ZONAL) ? TLM_FLAG_ZONAL : 0;
+	threadArgs * Argstruct = ls->args;
 	float zeroZernike[16];
 	double resultedZernike[12];
-	double ctrlVoltage[60];
-	long int zernike_order = 4;
-	while(1){
-		stable = 1;
-		if(err = WFS_TakeSpotfieldImageAutoExpos (*Argstruct->WFS_handle, NULL, NULL))
-			handle_errors(err);
-		if(err = WFS_ZernikeLsf (*Argstruct->WFS_handle, &zernike_order, measuredZernike, NULL, NULL)) // calculates also deviation from centroid data for wavefront integration
-			handle_errors(err);
+	double residual[RECON_MODES];
+	double deltaVoltage[MAX_SEGMENTS];
+	double rms = 0.0;
+	
+	loop_poll_commands(ls);
+	if(ls->quit)
+		return;
+	if(!fr->high_order)
+		flags |= TLM_FLAG_TILT_ONLY;
+	if(ls->paused){
+		loop_telemetry(ls, fr, NULL, 0, flags | TLM_FLAG_PAUSED);
+		return;   // the mirror holds its last voltages
+	}
+	rt_stage_begin(ls->rt_corr);
+	if(fr->tilt_ok){
+		tiptilt_correct(ls, fr);
+		rt_stage_end(ls->rt_corr, ls->st_tilt);
+	}
+	if(!fr->high_order){
+		loop_telemetry(ls, fr, NULL, 0, flags);
+		return;
+	}
+	if(config.reconstructor == LOOP_RECON_ZONAL){
+		if(memcmp(ls->lastTarget, ls->target, sizeof(ls->lastTarget))){
+			update_zonal_target(Argstruct->zonal, Argstruct->recon, ls->target);
+			memcpy(ls->lastTarget, ls->target, sizeof(ls->lastTarget));
+		}
+		zonal_apply(Argstruct->zonal, *fr->deviation_x, *fr->deviation_y, deltaVoltage);
+		// the Zernike content of the correction stands in for the residual in the lock check below
+		la_gemv(Argstruct->recon->im, RECON_MODES, MAX_SEGMENTS, deltaVoltage, resultedZernike);
+		// zonal error is already a voltage step per segment
+		clamped = ctrl_apply(&ls->ctrl, deltaVoltage, NULL, NULL, Argstruct->voltage, Argstruct->seg_min, Argstruct->seg_max, ls->ctrlVoltage);
+	}else{
 		for (ite = 0; ite < 16; ite ++){
-			zeroZernike[ite] = measuredZernike[ite] - Argstruct->target[ite];
-		}
-		if(err = TLDFMX_get_flat_wavefront (*Argstruct->handle, 0xFFFFFFFF, zeroZernike, resultedZernike, ctrlVoltage))
-			error_exit(*Argstruct->handle, err);
-		if(err = TLDFM_set_segment_voltages (*Argstruct->handle, ctrlVoltage))
-			error_exit(*Argstruct->handle, err);
-		printf("Resulted Zernike starting from Z4: ");
-		for (ite = 0; ite < 12; ite ++){
-			printf("%f,",resultedZernike[ite]);
-			if (resultedZernike[ite] > 0.01 || resultedZernike[ite] < -0.01){
-				stable = 0;
-			}
+			zeroZernike[ite] = fr->zernike[ite] - ls->target[ite];
+		}
+		if(Argstruct->tiptilt){
+			// tip and tilt belong to the tilt arms, the segments keep their stroke
+			zeroZernike[2] = zeroZernike[3] = 0.0f;
 		}
-		printf("\n");
-		if (stable){
-			*Argstruct->thflag = 1;
-			recorder = 1;
+		if(config.reconstructor == LOOP_RECON_TLDFMX){
+			if(err = TLDFMX_get_flat_wavefront (Argstruct->session->dm, 0xFFFFFFFF, zeroZernike, resultedZernike, ls->ctrlVoltage))
+				error_exit(Argstruct->session, err);
+			// the SDK does not keep its pattern inside the segment range
+			clamped = vbox_project(&ls->vbox, ls->ctrlVoltage, Argstruct->seg_min, Argstruct->seg_max, ls->ctrlVoltage);
 		}else{
-			if (recorder){
-				counter = 0;
+			// residuals are Z4..Z15 like the TLDFMX output
+			for (ite = 0; ite < RECON_MODES; ite ++){
+				residual[ite] = zeroZernike[RECON_FIRST_MODE + ite];
+				resultedZernike[ite] = residual[ite];
+			}
+			if(Argstruct->mrate){
+				// the groups due step on their mean residual, the others hold, the mirror is only written when a group is due;
+				// a group is due on every mean it has not stepped on, also one from a frame the pipeline dropped
+				unsigned char active[RECON_MODES];
+				unsigned int due = 0;
+				for (int g = 0; g < Argstruct->mrate->n_groups; g ++){
+					if(fr->group_frame[g] > ls->mr_applied[g]){
+						ls->mr_applied[g] = fr->group_frame[g];
+						due |= 1u << g;
+					}
+				}
+				if(!due){
+					// no group is due: nothing is reconstructed or sent, the stages stay open and only time the frames they ran on
+					loop_telemetry(ls, fr, NULL, 0, flags | TLM_FLAG_HELD);
+					return;
+				}
+				mrate_active(Argstruct->mrate, due, active);
+				for (ite = 0; ite < RECON_MODES; ite ++){
+					if(active[ite])
+						ls->residual[ite] = residual[ite];
+					resultedZernike[ite] = ls->residual[ite];
+				}
+				clamped = ctrl_apply_channels(&ls->ctrl, residual, active, Argstruct->recon->cm, Argstruct->recon->im, Argstruct->voltage, Argstruct->seg_min, Argstruct->seg_max, ls->ctrlVoltage);
 			}else{
-				counter ++;
+				clamped = ctrl_apply(&ls->ctrl, residual, Argstruct->recon->cm, Argstruct->recon->im, Argstruct->voltage, Argstruct->seg_min, Argstruct->seg_max, ls->ctrlVoltage);
 			}
-			recorder = 0;
-		}
-		if (counter > 10){
-			printf("Seems the loop fails to lock; input 'e' to terminate otherwise continue\n");
-			if(getchar() == 'e'){
-				TLDFMX_close(*Argstruct->handle);
-				WFS_close(*Argstruct->WFS_handle);
-				exit(EXIT_FAILURE);
+		}
+	}
+	rt_stage_end(ls->rt_corr, ls->st_reconstruct);
+	if(err = Argstruct->mirror->set_segments (Argstruct->mirror->ctx, ls->ctrlVoltage))
+		error_exit(Argstruct->session, err);
+	rt_stage_end(ls->rt_corr, ls->st_actuate);
+	if(!ls->closed){
+		ls->closed = 1;
+		alog_post(&alog, ls->log->correct, ls->log->first_closed, 1, (rt_now_ns() - t_program_start_ns) * 1e-6);
+	}
+	
+	// a binary record, the log thread formats it
+	alog_post_values(&alog, ls->log->correct, ls->log->zernike, resultedZernike, 12);
+	for (ite = 0; ite < 12; ite ++){
+		rms += resultedZernike[ite] * resultedZernike[ite];
+		if (resultedZernike[ite] > 0.01 || resultedZernike[ite] < -0.01){
+			stable = 0;
+		}
+	}
+	rms = sqrt(rms / 12);
+	loop_telemetry(ls, fr, resultedZernike, clamped, flags | (stable ? TLM_FLAG_CONVERGED : 0));
+	if (stable){
+		if (!ls->converged){
+			loop_send_event(ls, LOOP_EVENT_CONVERGED, rms);
+			ls->converged = 1;
+		}
+		ls->lock_lost = 0;
+		ls->recorder = 1;
+	}else{
+		if (ls->recorder){
+			ls->counter = 0;
+		}else{
+			ls->counter ++;
+		}
+		ls->recorder = 0;
+	}
+	if (++ls->corrections % SAMPLE_LOOP_REPORT_EVERY == 0){
+		loop_send_event(ls, LOOP_EVENT_STATUS, rms);
+		loop_report(ls);
+	}
+	if (ls->counter > 10){
+		if (!ls->lock_lost){
+			loop_send_event(ls, LOOP_EVENT_LOCK_LOST, rms);
+			ls->lock_lost = 1;
+		}
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+ Acquisition thread of the pipelined loop, paced by the loop scheduler
+---------------------------------------------------------------------------*/
+void *loop_acquire_thread (void *Args)
+{
+	loop_state_t *ls = (loop_state_t *)Args;
+	
+	rt_start(&ls->rt);
+	while(!spsc_flag_load(&ls->stop)){
+		session_busy_begin(ls->args->session);
+		loop_measure(ls, (loop_frame_t *)pipeline_write_begin(&ls->pipe));
+		pipeline_write_end(&ls->pipe);
+		session_busy_end(ls->args->session);
+		rt_wait(&ls->rt);
+	}
+	return NULL;
+}
+
+
+void* Loop(void *Args){
+	int ite;
+	threadArgs * Argstruct = (threadArgs *)Args;
+	session_t *s = Argstruct->session;
+	loop_state_t *ls = &s->ls;
+	loop_frame_t *frames = s->frames;
+	ctrl_param_t zonal_param = { config.zonal_gain, config.zonal_leak, 0.0, 0.0 };
+	pthread_t acquire_id;
+	
+	// the drivers are in use from here, except while the loop waits for its next frame
+	session_busy_begin(s);
+	memset(ls, 0, sizeof(*ls));
+	ls->args = Argstruct;
+	ls->log = &s->log;
+	memcpy(ls->target, Argstruct->target, sizeof(ls->target));
+	ls->mr_source = -2;   // the first frame starts the multi-rate sums
+	for(ite = 0; ite < MRATE_MAX_GROUPS; ite++)
+		ls->mr_frame[ite] = ls->mr_applied[ite] = -1;
+	ls->rt_corr = config.loop_pipelined ? &ls->rt_correct : &ls->rt;
+	rt_init(&ls->rt, config.loop_rate_hz);
+	rt_init(&ls->rt_correct, 0.0);
+	ls->st_acquire     = rt_add_stage(&ls->rt,    "acquire",     SAMPLE_BUDGET_ACQUIRE_US);
+	ls->st_measure     = rt_add_stage(&ls->rt,    "measure",     SAMPLE_BUDGET_MEASURE_US);
+	ls->st_tilt        = Argstruct->tiptilt ? rt_add_stage(ls->rt_corr, "tilt", SAMPLE_BUDGET_TILT_US) : -1;
+	ls->st_reconstruct = rt_add_stage(ls->rt_corr, "reconstruct", SAMPLE_BUDGET_RECONSTRUCT_US);
+	ls->st_actuate     = rt_add_stage(ls->rt_corr, "actuate",     SAMPLE_BUDGET_ACTUATE_US);
+	if((config.loop_rt_priority > 0 || s->cpu >= 0) && rt_set_realtime(config.loop_rt_priority, s->cpu))
+		printf("%sCould not set real-time priority / CPU affinity of the loop thread.\n", s->label);
+	memcpy(ls->ctrlVoltage, Argstruct->voltage, sizeof(ViReal64) * MAX_SEGMENTS);
+	if(config.reconstructor == LOOP_RECON_ZONAL){
+		// zonal channels are the segments themselves
+		ctrl_init(&ls->ctrl, MAX_SEGMENTS, MAX_SEGMENTS, zonal_param);
+		update_zonal_target(Argstruct->zonal, Argstruct->recon, ls->target);
+		memcpy(ls->lastTarget, ls->target, sizeof(ls->lastTarget));
+	}else{
+		ctrl_init(&ls->ctrl, RECON_MODES, MAX_SEGMENTS, loop_ctrl_param[0]);
+		for (ite = 0; ite < RECON_MODES; ite ++)
+			ctrl_set_channel(&ls->ctrl, ite, loop_ctrl_param[ite]);
+	}
+	// the TLDFMX path has no interaction matrix of ours, its voltages are clipped and counted
+	vbox_init(&ls->vbox, MAX_SEGMENTS, (config.reconstructor == LOOP_RECON_TLDFMX) ? NULL : Argstruct->recon->im, RECON_MODES, config.projection_iterations);
+	ctrl_set_box(&ls->ctrl, &ls->vbox);
+	
+	if(config.telemetry){
+		ls->tlm_on = (tlm_open(&ls->tlm, s->telemetry_file, SAMPLE_TELEMETRY_RECORDS, 5, loop_tlm_stages) == 0);
+		if(!ls->tlm_on)
+			printf("%sCould not create %s, the loop runs without telemetry.\n", s->label, s->telemetry_file);
+	}
+	exposure_init(ls);
+	spsc_flag_store(&ls->cap_request, config.capture);
+	if(Argstruct->highspeed){
+		highspeed_arm(ls);
+	}
+	
+	if(config.loop_pipelined){
+		// the camera exposes the next frame while this thread corrects the previous one
+		if(pipeline_init(&ls->pipe, &frames[0], &frames[1]) || pthread_create(&acquire_id, NULL, loop_acquire_thread, ls)){
+			printf("%sCould not start the acquisition thread.\n", s->label);
+			error_exit(Argstruct->session, TL_ERROR_SYSTEM_ERROR);
+		}
+		while(!ls->quit){
+			session_busy_end(s);
+			loop_frame_t *fr = (loop_frame_t *)pipeline_read_begin(&ls->pipe);
+			session_busy_begin(s);
+			if(!fr)
 				break;
-			}
+			loop_correct(ls, fr);
+			pipeline_read_end(&ls->pipe);
 		}
+		session_busy_end(s);
+		spsc_flag_store(&ls->stop, 1);
+		pthread_join(acquire_id, NULL);
+		pipeline_stop(&ls->pipe);
+		loop_report_take_acquire(ls, &s->last_report);
+		loop_report_take_correct(ls, &s->last_report);
+		pipeline_destroy(&ls->pipe);
+		tlm_close(&ls->tlm);
+		capture_close(&ls->cap);
+		return NULL;
+	}
+	
+	rt_start(&ls->rt);
+	while(!ls->quit){
+		loop_measure(ls, &frames[0]);
+		loop_correct(ls, &frames[0]);
+		session_busy_end(s);
+		rt_wait(&ls->rt);
+		session_busy_begin(s);
 	}
+	session_busy_end(s);
+	loop_report_take_acquire(ls, &s->last_report);
+	loop_report_take_correct(ls, &s->last_report);
+	tlm_close(&ls->tlm);
+	capture_close(&ls->cap);
+	return NULL;
 }
 
 /*===============================================================================================================================
@@ -0,0 +1,2618 @@
+/*===============================================================================================================================
+  WFS-DMH-bench.c
+
+  Benchmarks for the loop building blocks against the simulated sensor/mirror stand-in (src/sim.c).
+  This program does not link the Thorlabs SDKs and is meant to be built on Linux, e.g. from the repository root:
+
+      gcc -O2 -march=native -o wfs-dmh-bench bench/WFS-DMH-bench.c src/[a-z]*.c -lm -lpthread
+
+  Usage: wfs-dmh-bench <benchmark> [iterations]
+===============================================================================================================================*/
+
+#include "../src/linalg.h"
+#include "../src/recon.h"
+#include "../src/sim.h"
+#include "../src/zonal.h"
+#include "../src/control.h"
+#include "../src/rtloop.h"
+#include "../src/pipeline.h"
+#include "../src/centroid.h"
+#include "../src/zfit.h"
+#include "../src/spsc.h"
+#include "../src/telemetry.h"
+#include "../src/capture.h"
+#include "../src/calib.h"
+#include "../src/calcache.h"
+#include "../src/config.h"
+#include "../src/startup.h"
+#include "../src/exposure.h"
+#include "../src/alog.h"
+#include "../src/histo.h"
+#include "../src/tiptilt.h"
+#include "../src/mrate.h"
+#include "../src/vbox.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  BENCH_SEGMENTS                (40)     // MAX_SEGMENTS of the DMH40
+#define  BENCH_POKE_VOLTAGE            (10.0)
+#define  BENCH_NOISE_UM                (0.002)
+#define  BENCH_DEFAULT_ITERATIONS      (200000)
+#define  BENCH_SPOTS_STRIDE            (80)     // MAX_SPOTS_X, row stride of the driver's spot arrays
+#define  BENCH_FIT_MODES               (15)     // Zernike modes of a 4th order fit, piston excluded
+#define  BENCH_LENSLET_PITCH_UM        (150.0)  // MLA150
+#define  BENCH_SPOT_SIGMA              (2.0)    // spot radius, pixels
+#define  BENCH_SPOT_PEAK               (200.0)  // counts
+#define  BENCH_SPOT_SHIFT              (3.0)    // largest spot deviation, pixels
+#define  BENCH_TLM_FILE_NAME           "wfs-dmh-bench_telemetry.bin"
+#define  BENCH_TLM_RECORDS             (65536)  // ring smaller than the default run, so it wraps
+#define  BENCH_CAPTURE_FILE_NAME       "wfs-dmh-bench_capture.bin"
+#define  BENCH_CAPTURE_DEPTH           (64)
+#define  BENCH_CALCACHE_PREFIX         "wfs-dmh-bench_cal"
+#define  BENCH_CALIB_NOISE_FRAMES      (8)      // SAMPLE_CALIB_NOISE_FRAMES
+#define  BENCH_CALCACHE_PATTERNS       (2)      // SAMPLE_CALCACHE_CHECK_PATTERNS
+#define  BENCH_CALCACHE_DRIFT_UM       (0.05)   // SAMPLE_CALCACHE_DRIFT_UM
+#define  BENCH_EXPO_FRAMES             (8)      // SAMPLE_EXPOS_SEARCH_FRAMES
+#define  BENCH_LOG_FILE_NAME           "wfs-dmh-bench_log.txt"
+#define  BENCH_LOG_DEPTH               (1024)   // SAMPLE_LOG_DEPTH
+#define  BENCH_LOG_PERIOD_US           (20.0)   // a 50 kHz loop posting one Zernike line per iteration
+#define  BENCH_LOG_CAPTURE_NAME        "capture_%d%s_100%.bin"  // a capture file name that reads as conversions
+#define  BENCH_TT_POKE_VOLTAGE         (10.0)   // SAMPLE_TIPTILT_POKE_VOLTAGE
+#define  BENCH_TT_DISTURBANCE_V        (15.0)   // tilt arm disturbance, rotating, V
+#define  BENCH_TT_PERIOD_FRAMES        (40.0)
+#define  BENCH_TT_URAD_PER_V           (20.0)   // DMH40 tilt arm stroke, the simulator default is ten times smaller
+#define  BENCH_TT_SETTLE_FRAMES        (60)     // frames before the residual is counted
+#define  BENCH_MR_DRIFT_UM             (0.004)  // random walk step of Z4 .. Z6 per frame
+#define  BENCH_MR_SETTLE_FRAMES        (200)
+#define  BENCH_MR_GRID                 (36)     // lenslets across the pupil of the fit that is timed
+#define  BENCH_VB_ABERRATION           (3.0)    // aberration of the plant scaled up, so its correction leaves the range
+#define  BENCH_VB_SWING                (1.0)    // ... and swinging by this much of the original
+#define  BENCH_VB_PERIOD_FRAMES        (100.0)
+#define  BENCH_VB_RANGE                (0.5)    // segment range around the bias, fraction of the largest ideal offset
+#define  BENCH_VB_SETTLE_FRAMES        (200)
+#define  BENCH_ENGINE_LOOPS            (3)      // config.loops, WFS-DMH.c runs up to MAX_WFS_DEVICES
+#define  BENCH_ENGINE_FRAMES           (5000)   // frames per loop at most, every one is rendered
+
+typedef struct
+{
+	const char  *name;
+	const char  *help;
+	int         (*run)(long iterations);
+} bench_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+static int bench_recon (long iterations);
+static int bench_zonal (long iterations);
+static int bench_ctrl (long iterations);
+static int bench_rt (long iterations);
+static int bench_pipeline (long iterations);
+static int bench_cent (long iterations);
+static int bench_zfit (long iterations);
+static int bench_spsc (long iterations);
+static int bench_tlm (long iterations);
+static int bench_hal (long iterations);
+static int bench_replay (long iterations);
+static int bench_calib (long iterations);
+static int bench_calcache (long iterations);
+static int bench_startup (long iterations);
+static int bench_expo (long iterations);
+static int bench_log (long iterations);
+static int bench_tiptilt (long iterations);
+static int bench_mrate (long iterations);
+static int bench_vbox (long iterations);
+static int bench_engine (long iterations);
+
+/*===============================================================================================================================
+  Global Variables
+===============================================================================================================================*/
+static const bench_t benches[] =
+{
+	{ "recon", "native GEMV reconstructor vs. per-frame re-solve (stand-in for TLDFMX_get_flat_wavefront)", bench_recon },
+	{ "zonal", "slope-domain reconstructor vs. Zernike fit + modal reconstructor, per lenslet grid", bench_zonal },
+	{ "ctrl",  "settling time, noise and cost of controller settings on the plant with one frame delay", bench_ctrl },
+	{ "rt",    "release jitter and deadline misses of the fixed-rate scheduler at 1 kHz (iterations = loop count)", bench_rt },
+	{ "pipeline", "sequential vs. pipelined acquire/correct on a timed sensor stand-in (iterations = frames)", bench_pipeline },
+	{ "zfit",  "per-frame least-squares Zernike fit vs. cached projection matrix, per order and lenslet grid", bench_zfit },
+	{ "spsc",  "throughput, round trip and tearing check of the operator/loop channel (iterations = messages)", bench_spsc },
+	{ "cent",  "scalar vs. AVX2 centroiding of a MONO8 spotfield at every camera resolution", bench_cent },
+	{ "hal",   "full closed loop (image, centroids, Zernike fit, control, mirror) on the simulated optical bench backend", bench_hal },
+	{ "tlm",   "cost per loop iteration of the mmap'd telemetry ring, then read back and check the file", bench_tlm },
+	{ "calib", "interaction matrix error and frames of single poke, push-pull poke and Hadamard calibration on the simulated bench", bench_calib },
+	{ "calcache", "full calibration vs. loading the calibration cache and checking it, on an intact and a rewired simulated mirror", bench_calcache },
+	{ "startup", "Thorlabs startup sequence with modelled device times, one after the other vs. as a dependency graph", bench_startup },
+	{ "expo", "frames of the exposure search from a cold and from a remembered start, over four decades of light on the simulated bench", bench_expo },
+	{ "log",   "cost to the loop of one Zernike line: printf into a file vs. posting to the asynchronous log (iterations = lines)", bench_log },
+	{ "tiptilt", "beam tilt residual on the simulated bench with a rotating tilt disturbance: open, tilt arms every frame, every 4th frame (iterations = frames)", bench_tiptilt },
+	{ "mrate", "residual and per-frame fit + control cost of one rate for all modes vs. mode groups at their own rates, on the plant (iterations = frames)", bench_mrate },
+	{ "vbox",  "steady residual and controller cost with the correction outside the voltage range: clipping vs. active-set projection per iteration budget (iterations = frames)", bench_vbox },
+	{ "engine", "several closed loops in one process on their own simulated benches: each alone, all at once, all at once pinned to a core each", bench_engine },
+	{ "replay", "record raw frames of the simulated bench, then replay them through centroids and Zernike fit (iterations = frames)", bench_replay },
+};
+
+static volatile double bench_sink; // keeps the optimiser from dropping timed work
+
+/*===============================================================================================================================
+  Code
+===============================================================================================================================*/
+int main (int argc, char *argv[])
+{
+	long iterations = BENCH_DEFAULT_ITERATIONS;
+	int  i;
+
+	if(argc < 2)
+	{
+		printf("Usage: %s <benchmark> [iterations]\n\n", argv[0]);
+		for(i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])); i++)
+			printf("  %-10s %s\n", benches[i].name, benches[i].help);
+		return 1;
+	}
+	if(argc > 2)
+		iterations = atol(argv[2]);
+
+	for(i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])); i++)
+		if(strcmp(argv[1], benches[i].name) == 0)
+			return benches[i].run(iterations);
+
+	printf("Unknown benchmark '%s'\n", argv[1]);
+	return 1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Monotonic time in ns
+---------------------------------------------------------------------------*/
+static double bench_now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*---------------------------------------------------------------------------
+  Measure the plant response by poking every segment, same procedure as measure_interaction_matrix() in WFS-DMH.c
+---------------------------------------------------------------------------*/
+static void bench_calibrate (sim_plant_t *plant, recon_t *rc)
+{
+	double voltage[BENCH_SEGMENTS], z_ref[RECON_MODES], z[RECON_MODES], response[RECON_MODES];
+	int    i, j;
+
+	for(j = 0; j < BENCH_SEGMENTS; j++)
+		voltage[j] = SIM_BIAS_VOLTAGE;
+	sim_plant_measure(plant, voltage, z_ref);
+
+	for(j = 0; j < BENCH_SEGMENTS; j++)
+	{
+		voltage[j] = SIM_BIAS_VOLTAGE + BENCH_POKE_VOLTAGE;
+		sim_plant_measure(plant, voltage, z);
+		voltage[j] = SIM_BIAS_VOLTAGE;
+
+		for(i = 0; i < RECON_MODES; i++)
+			response[i] = (z[i] - z_ref[i]) / BENCH_POKE_VOLTAGE;
+		recon_set_response(rc, j, response);
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+  Per-frame damped least-squares solve from the interaction matrix. This is what an opaque solver has to do when it
+  re-derives the voltages from each residual, and serves as the SDK path stand-in on Linux.
+---------------------------------------------------------------------------*/
+static void bench_resolve (const recon_t *rc, const double residual[], double dv[])
+{
+	double  a[RECON_MODES * RECON_MODES], y[RECON_MODES];
+	int     i, j, k;
+
+	for(i = 0; i < rc->n_modes; i++)
+		for(j = 0; j <= i; j++)
+		{
+			double acc = (i == j) ? 1e-9 : 0.0;
+			for(k = 0; k < rc->n_act; k++)
+				acc += rc->im[i * rc->n_act + k] * rc->im[j * rc->n_act + k];
+			a[i * rc->n_modes + j] = a[j * rc->n_modes + i] = acc;
+		}
+	memcpy(y, residual, sizeof(double) * rc->n_modes);
+	la_cholesky_solve(a, rc->n_modes, y);
+	la_gemv_t(rc->im, rc->n_modes, rc->n_act, y, dv);
+}
+
+
+/*---------------------------------------------------------------------------
+  recon: per-frame cost of the reconstructors and closed-loop residual on the plant
+---------------------------------------------------------------------------*/
+static int bench_recon (long iterations)
+{
+	sim_plant_t  plant;
+	recon_t      rc;
+	double       residual[RECON_MODES], dv[BENCH_SEGMENTS], voltage[BENCH_SEGMENTS], z[RECON_MODES];
+	double       t0, t_resolve, t_gemv, t_calib, rms0 = 0.0, rms = 0.0;
+	long         n;
+	int          i, j;
+
+	if(sim_plant_init(&plant, RECON_MODES, BENCH_SEGMENTS, BENCH_NOISE_UM, 12345) || recon_init(&rc, RECON_MODES, BENCH_SEGMENTS))
+		return 1;
+
+	t0 = bench_now_ns();
+	bench_calibrate(&plant, &rc);
+	if(recon_compute(&rc, RECON_DEFAULT_RCOND) < 0)
+	{
+		printf("Control matrix inversion failed\n");
+		return 1;
+	}
+	t_calib = bench_now_ns() - t0;
+
+	for(i = 0; i < RECON_MODES; i++)
+		residual[i] = plant.aberration[i];
+
+	t0 = bench_now_ns();
+	for(n = 0; n < iterations; n++)
+	{
+		residual[n % RECON_MODES] += 1e-9;
+		bench_resolve(&rc, residual, dv);
+		bench_sink += dv[0];
+	}
+	t_resolve = (bench_now_ns() - t0) / iterations;
+
+	t0 = bench_now_ns();
+	for(n = 0; n < iterations; n++)
+	{
+		residual[n % RECON_MODES] += 1e-9;
+		recon_apply(&rc, residual, dv);
+		bench_sink += dv[0];
+	}
+	t_gemv = (bench_now_ns() - t0) / iterations;
+
+	// close the loop on the plant with unity gain, as Loop() does
+	for(j = 0; j < BENCH_SEGMENTS; j++)
+		voltage[j] = SIM_BIAS_VOLTAGE;
+	for(n = 0; n < 20; n++)
+	{
+		sim_plant_measure(&plant, voltage, z);
+		if(n == 0)
+		{
+			for(i = 0; i < RECON_MODES; i++)
+				rms0 += z[i] * z[i];
+		}
+		recon_apply(&rc, z, dv);
+		for(j = 0; j < BENCH_SEGMENTS; j++)
+			voltage[j] -= dv[j];
+	}
+	sim_plant_measure(&plant, voltage, z);
+	for(i = 0; i < RECON_MODES; i++)
+		rms += z[i] * z[i];
+
+	printf("Modal reconstructor, %d modes x %d segments, rank %d\n", RECON_MODES, BENCH_SEGMENTS, rc.rank);
+	printf("  calibration + SVD        %10.1f us (once)\n", t_calib / 1e3);
+	printf("  per-frame re-solve       %10.1f ns/frame\n", t_resolve);
+	printf("  control matrix GEMV      %10.1f ns/frame  (%.1fx faster)\n", t_gemv, t_resolve / t_gemv);
+	printf("  closed loop residual rms %10.4f um -> %.4f um after 20 frames\n", sqrt(rms0 / RECON_MODES), sqrt(rms / RECON_MODES));
+
+	recon_free(&rc);
+	sim_plant_free(&plant);
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Scatter a packed slope vector into driver-layout deviation arrays, lenslets outside the pupil are NaN
+---------------------------------------------------------------------------*/
+static void bench_scatter (const int mask[], int grid, const double slopes[], int n_sub, float dev_x[], float dev_y[])
+{
+	int x, y, i = 0;
+
+	for(y = 0; y < grid; y++)
+		for(x = 0; x < grid; x++)
+		{
+			int k = y * BENCH_SPOTS_STRIDE + x;
+			if(mask[y * grid + x])
+			{
+				dev_x[k] = (float)slopes[i];
+				dev_y[k] = (float)slopes[n_sub + i];
+				i++;
+			}
+			else
+				dev_x[k] = dev_y[k] = NAN;
+		}
+}
+
+
+/*---------------------------------------------------------------------------
+  Per-frame least-squares Zernike fit of the slopes, the work WFS_ZernikeLsf repeats on every frame
+---------------------------------------------------------------------------*/
+static void bench_zernike_lsf (const double basis[], int n_slopes, const double slopes[], double zernike[])
+{
+	double  a[BENCH_FIT_MODES * BENCH_FIT_MODES];
+	int     i, j, k;
+
+	for(i = 0; i < BENCH_FIT_MODES; i++)
+		for(j = 0; j <= i; j++)
+		{
+			double acc = 0.0;
+			for(k = 0; k < n_slopes; k++)
+				acc += basis[k * BENCH_FIT_MODES + i] * basis[k * BENCH_FIT_MODES + j];
+			a[i * BENCH_FIT_MODES + j] = a[j * BENCH_FIT_MODES + i] = acc;
+		}
+	la_gemv_t(basis, n_slopes, BENCH_FIT_MODES, slopes, zernike);
+	la_cholesky_solve(a, BENCH_FIT_MODES, zernike);
+}
+
+
+/*---------------------------------------------------------------------------
+  zonal: latency per frame of the slope path against the Zernike path for growing lenslet grids
+---------------------------------------------------------------------------*/
+static int bench_zonal (long iterations)
+{
+	static const int grids[] = { 17, 36, 48 }; // ~lenslets across 512, 1080 and 1440 pixel WFS20 images with a 150 um MLA
+	static float     dev_x[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE], dev_y[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE];
+	static float     ref_x[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE], ref_y[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE];
+	int              g;
+
+	iterations /= 20; // frames are far more expensive than in the recon benchmark
+
+	printf("Slope-domain vs. Zernike path, %d segments\n", BENCH_SEGMENTS);
+	printf("  grid  lenslets   Zernike fit+GEMV   slope GEMV    speedup   slope rms after 20 frames\n");
+
+	for(g = 0; g < (int)(sizeof(grids) / sizeof(grids[0])); g++)
+	{
+		int          grid = grids[g], n_sub = 0, i, j, x, y;
+		int          *mask = calloc(grid * grid, sizeof(int));
+		double       r, c = (grid - 1) / 2.0, *slopes, *basis, *meas, t0, t_zern, t_zonal, rms0 = 0.0, rms = 0.0;
+		double       zernike[BENCH_FIT_MODES], modal_cm[BENCH_SEGMENTS * BENCH_FIT_MODES], dv[BENCH_SEGMENTS], voltage[BENCH_SEGMENTS];
+		sim_plant_t  plant;
+		zonal_t      zn;
+		unsigned int rng = 99;
+		long         n;
+
+		for(y = 0; y < grid; y++)
+			for(x = 0; x < grid; x++)
+			{
+				r = sqrt((x - c) * (x - c) + (y - c) * (y - c));
+				if(r <= grid / 2.0)
+				{
+					mask[y * grid + x] = 1;
+					n_sub++;
+				}
+			}
+
+		slopes = malloc(sizeof(double) * 2 * n_sub);
+		meas   = malloc(sizeof(double) * 2 * n_sub);
+		basis  = malloc(sizeof(double) * 2 * n_sub * BENCH_FIT_MODES);
+		for(i = 0; i < 2 * n_sub * BENCH_FIT_MODES; i++)
+			basis[i] = sim_gauss(&rng);
+		for(i = 0; i < BENCH_SEGMENTS * BENCH_FIT_MODES; i++)
+			modal_cm[i] = sim_gauss(&rng);
+
+		if(sim_plant_init(&plant, 2 * n_sub, BENCH_SEGMENTS, BENCH_NOISE_UM, 777) || zonal_init(&zn, BENCH_SEGMENTS, n_sub, BENCH_SPOTS_STRIDE))
+			return 1;
+
+		// calibrate the slope reconstructor by poking every segment of the plant
+		for(j = 0; j < BENCH_SEGMENTS; j++)
+			voltage[j] = SIM_BIAS_VOLTAGE;
+		sim_plant_measure(&plant, voltage, meas);
+		bench_scatter(mask, grid, meas, n_sub, ref_x, ref_y);
+		zonal_set_mask(&zn, ref_x, ref_y, grid, grid);
+		for(j = 0; j < BENCH_SEGMENTS; j++)
+		{
+			voltage[j] += BENCH_POKE_VOLTAGE;
+			sim_plant_measure(&plant, voltage, meas);
+			voltage[j] -= BENCH_POKE_VOLTAGE;
+			bench_scatter(mask, grid, meas, n_sub, dev_x, dev_y);
+			zonal_set_response(&zn, j, dev_x, dev_y, ref_x, ref_y, BENCH_POKE_VOLTAGE);
+		}
+		zonal_compute(&zn, RECON_DEFAULT_RCOND);
+
+		sim_plant_measure(&plant, voltage, meas);
+		bench_scatter(mask, grid, meas, n_sub, dev_x, dev_y);
+
+		t0 = bench_now_ns();
+		for(n = 0; n < iterations; n++)
+		{
+			zonal_gather(&zn, dev_x, dev_y, slopes);
+			bench_zernike_lsf(basis, 2 * n_sub, slopes, zernike);
+			la_gemv(modal_cm, BENCH_SEGMENTS, BENCH_FIT_MODES, zernike, dv);
+			bench_sink += dv[0];
+		}
+		t_zern = (bench_now_ns() - t0) / iterations;
+
+		t0 = bench_now_ns();
+		for(n = 0; n < iterations; n++)
+		{
+			zonal_apply(&zn, dev_x, dev_y, dv);
+			bench_sink += dv[0];
+		}
+		t_zonal = (bench_now_ns() - t0) / iterations;
+
+		// close the loop on the plant through the slope path
+		for(n = 0; n < 20; n++)
+		{
+			sim_plant_measure(&plant, voltage, meas);
+			if(n == 0)
+				for(i = 0; i < 2 * n_sub; i++)
+					rms0 += meas[i] * meas[i];
+			bench_scatter(mask, grid, meas, n_sub, dev_x, dev_y);
+			zonal_apply(&zn, dev_x, dev_y, dv);
+			for(j = 0; j < BENCH_SEGMENTS; j++)
+				voltage[j] -= dv[j];
+		}
+		sim_plant_measure(&plant, voltage, meas);
+		for(i = 0; i < 2 * n_sub; i++)
+			rms += meas[i] * meas[i];
+
+		printf("  %4d  %8d   %13.1f ns   %10.1f ns   %6.1fx   %.4f -> %.4f px\n", grid, n_sub, t_zern, t_zonal, t_zern / t_zonal,
+		       sqrt(rms0 / (2 * n_sub)), sqrt(rms / (2 * n_sub)));
+
+		zonal_free(&zn);
+		sim_plant_free(&plant);
+		free(mask); free(slopes); free(meas); free(basis);
+	}
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  ctrl: step response of the closed loop for several controller settings.
+  The plant sees the voltages one frame late, as the mirror does while the next image is exposed.
+---------------------------------------------------------------------------*/
+static int bench_ctrl (long iterations)
+{
+	static const struct
+	{
+		const char    *name;
+		ctrl_param_t  param;
+	} settings[] =
+	{
+		{ "full step (as before)", { 1.0, 0.0,   0.0,  0.0 } },
+		{ "integrator g=0.5",      { 0.5, 0.0,   0.0,  0.0 } },
+		{ "leaky g=0.3 l=0.01",    { 0.3, 0.01,  0.0,  0.0 } },
+		{ "PID g=0.4 kp=0.1 kd=0.1", { 0.4, 0.0, 0.1,  0.1 } },
+	};
+	const int    frames = 400;
+	sim_plant_t  plant;
+	recon_t      rc;
+	ctrl_t       ct;
+	double       bias[BENCH_SEGMENTS], voltage[BENCH_SEGMENTS], applied[BENCH_SEGMENTS], z[RECON_MODES];
+	double       rms, rms0, tail, t0, t_ctrl;
+	int          s, i, n, settle, clamped;
+
+	if(sim_plant_init(&plant, RECON_MODES, BENCH_SEGMENTS, 0.01, 4242) || recon_init(&rc, RECON_MODES, BENCH_SEGMENTS))
+		return 1;
+	bench_calibrate(&plant, &rc);
+	recon_compute(&rc, RECON_DEFAULT_RCOND);
+	for(i = 0; i < BENCH_SEGMENTS; i++)
+		bias[i] = SIM_BIAS_VOLTAGE;
+
+	printf("Controller step response, %d modes, noise %.3f um, settled = within 10%% of the initial rms for good\n", RECON_MODES, plant.noise_um);
+	printf("  %-26s  settle[frames]  steady rms[um]  saturated\n", "setting");
+
+	for(s = 0; s < (int)(sizeof(settings) / sizeof(settings[0])); s++)
+	{
+		ctrl_init(&ct, RECON_MODES, BENCH_SEGMENTS, settings[s].param);
+		memcpy(voltage, bias, sizeof(bias));
+		memcpy(applied, bias, sizeof(bias));
+		settle = -1;
+		rms0 = tail = 0.0;
+
+		for(n = 0; n < frames; n++)
+		{
+			sim_plant_measure(&plant, applied, z);
+			memcpy(applied, voltage, sizeof(voltage)); // last frame's command reaches the mirror now
+			ctrl_apply(&ct, z, rc.cm, rc.im, bias, 0.0, 100.0, voltage);
+
+			rms = 0.0;
+			for(i = 0; i < RECON_MODES; i++)
+				rms += z[i] * z[i];
+			rms = sqrt(rms / RECON_MODES);
+			if(n == 0)
+				rms0 = rms;
+			if(rms > 0.1 * rms0)
+				settle = -1;
+			else if(settle < 0)
+				settle = n;
+			if(n >= frames - 100)
+				tail += rms / 100.0;
+		}
+		if(settle >= 0)
+			printf("  %-26s  %14d  %14.4f  %9ld\n", settings[s].name, settle, tail, ct.saturated_frames);
+		else
+			printf("  %-26s  %14s  %14.4f  %9ld\n", settings[s].name, "never", tail, ct.saturated_frames);
+	}
+
+	// cost per iteration is fixed, saturated or not
+	ctrl_init(&ct, RECON_MODES, BENCH_SEGMENTS, settings[1].param);
+	for(i = 0; i < RECON_MODES; i++)
+		z[i] = plant.aberration[i];
+	t0 = bench_now_ns();
+	for(n = 0; n < iterations; n++)
+	{
+		z[n % RECON_MODES] += 1e-9;
+		clamped = ctrl_apply(&ct, z, rc.cm, rc.im, bias, 0.0, 100.0, voltage);
+		bench_sink += voltage[0] + clamped;
+	}
+	t_ctrl = (bench_now_ns() - t0) / iterations;
+	printf("  controller update incl. anti-windup: %.1f ns/frame\n", t_ctrl);
+
+	recon_free(&rc);
+	sim_plant_free(&plant);
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  rt: the closed loop on the plant released at 1 kHz by the scheduler, reports release jitter
+---------------------------------------------------------------------------*/
+static int bench_rt (long iterations)
+{
+	sim_plant_t  plant;
+	recon_t      rc;
+	ctrl_t       ct;
+	rt_sched_t   rt;
+	ctrl_param_t param = { 0.5, 0.0, 0.0, 0.0 };
+	double       bias[BENCH_SEGMENTS], voltage[BENCH_SEGMENTS], z[RECON_MODES];
+	double       release, prev = 0.0, dev, jitter_max = 0.0, jitter_sum = 0.0;
+	int          i, st_measure, st_control;
+	long         n;
+
+	if(iterations > 20000)
+		iterations = 5000; // default count is meant for the compute benchmarks, this one runs in real time
+
+	if(sim_plant_init(&plant, RECON_MODES, BENCH_SEGMENTS, BENCH_NOISE_UM, 1) || recon_init(&rc, RECON_MODES, BENCH_SEGMENTS))
+		return 1;
+	bench_calibrate(&plant, &rc);
+	recon_compute(&rc, RECON_DEFAULT_RCOND);
+	ctrl_init(&ct, RECON_MODES, BENCH_SEGMENTS, param);
+	for(i = 0; i < BENCH_SEGMENTS; i++)
+		bias[i] = voltage[i] = SIM_BIAS_VOLTAGE;
+
+	if(rt_set_realtime(10, 1))
+		printf("(running without SCHED_FIFO / pinning, needs CAP_SYS_NICE)\n");
+
+	rt_init(&rt, 1000.0);
+	st_measure = rt_add_stage(&rt, "measure", 50.0);
+	st_control = rt_add_stage(&rt, "control", 50.0);
+	rt_start(&rt);
+	for(n = 0; n < iterations; n++)
+	{
+		release = rt_now_ns();
+		if(n > 0)
+		{
+			dev = fabs(release - prev - rt.period_ns);
+			jitter_sum += dev;
+			if(dev > jitter_max)
+				jitter_max = dev;
+		}
+		prev = release;
+
+		rt_stage_begin(&rt);
+		sim_plant_measure(&plant, voltage, z);
+		rt_stage_end(&rt, st_measure);
+		ctrl_apply(&ct, z, rc.cm, rc.im, bias, 0.0, 100.0, voltage);
+		rt_stage_end(&rt, st_control);
+		rt_wait(&rt);
+	}
+
+	rt_report(&rt, stdout);
+	printf("  release jitter: mean %.1f us, max %.1f us\n", jitter_sum / (iterations - 1) / 1e3, jitter_max / 1e3);
+
+	recon_free(&rc);
+	sim_plant_free(&plant);
+	return 0;
+}
+
+
+/*===============================================================================================================================
+  Pipeline benchmark: a sensor stand-in that takes real time to expose and read out, and a mirror that takes real time to
+  write, like the USB devices. Times are in us.
+===============================================================================================================================*/
+
+#define  BENCH_EXPOSE_US               (3000.0)  // exposure + readout of one spotfield image
+#define  BENCH_MEASURE_US              (800.0)   // centroids and fit on the host
+#define  BENCH_CORRECT_US              (200.0)   // reconstruct + control
+#define  BENCH_ACTUATE_US              (1000.0)  // segment voltage transfer
+
+typedef struct
+{
+	sim_plant_t      plant;
+	recon_t          rc;
+	ctrl_t           ct;
+	double           bias[BENCH_SEGMENTS];
+	double           voltage[BENCH_SEGMENTS];    // currently on the mirror
+	pthread_mutex_t  mirror_lock;
+	pipeline_t       pipe;
+	double           frame[2][RECON_MODES];
+	long             frames;
+	double           rms_tail;
+	volatile int     running;
+} bench_pipe_t;
+
+
+/*---------------------------------------------------------------------------
+  Wait in the OS (device I/O) or spin (host computation)
+---------------------------------------------------------------------------*/
+static void bench_sleep_us (double us)
+{
+	struct timespec ts;
+
+	ts.tv_sec  = (time_t)(us / 1e6);
+	ts.tv_nsec = (long)((us - ts.tv_sec * 1e6) * 1e3);
+	nanosleep(&ts, NULL);
+}
+
+static void bench_spin_us (double us)
+{
+	double end = rt_now_ns() + us * 1e3;
+
+	while(rt_now_ns() < end)
+		;
+}
+
+
+/*---------------------------------------------------------------------------
+  Sensor stand-in: expose the current mirror state, then compute the Zernikes
+---------------------------------------------------------------------------*/
+static void bench_pipe_measure (bench_pipe_t *bp, double z[])
+{
+	double v[BENCH_SEGMENTS];
+
+	pthread_mutex_lock(&bp->mirror_lock);
+	memcpy(v, bp->voltage, sizeof(v));
+	pthread_mutex_unlock(&bp->mirror_lock);
+
+	bench_sleep_us(BENCH_EXPOSE_US);
+	sim_plant_measure(&bp->plant, v, z);
+	bench_spin_us(BENCH_MEASURE_US);
+}
+
+
+/*---------------------------------------------------------------------------
+  Correction: controller, then the mirror write
+---------------------------------------------------------------------------*/
+static void bench_pipe_correct (bench_pipe_t *bp, const double z[], long n)
+{
+	double v[BENCH_SEGMENTS], rms = 0.0;
+	int    i;
+
+	ctrl_apply(&bp->ct, z, bp->rc.cm, bp->rc.im, bp->bias, 0.0, 100.0, v);
+	bench_spin_us(BENCH_CORRECT_US);
+	bench_sleep_us(BENCH_ACTUATE_US);
+
+	pthread_mutex_lock(&bp->mirror_lock);
+	memcpy(bp->voltage, v, sizeof(v));
+	pthread_mutex_unlock(&bp->mirror_lock);
+
+	if(n >= bp->frames - 50)
+	{
+		for(i = 0; i < RECON_MODES; i++)
+			rms += z[i] * z[i];
+		bp->rms_tail += sqrt(rms / RECON_MODES) / 50.0;
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+  Acquisition thread of the pipelined run
+---------------------------------------------------------------------------*/
+static void *bench_pipe_acquire (void *arg)
+{
+	bench_pipe_t *bp = (bench_pipe_t *)arg;
+
+	while(bp->running)
+	{
+		bench_pipe_measure(bp, (double *)pipeline_write_begin(&bp->pipe));
+		pipeline_write_end(&bp->pipe);
+	}
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------
+  pipeline: throughput and latency of both loop structures, and the residual they reach
+---------------------------------------------------------------------------*/
+static int bench_pipeline (long iterations)
+{
+	bench_pipe_t  bp;
+	ctrl_param_t  param = { 0.4, 0.0, 0.0, 0.0 };
+	pthread_t     thread;
+	double        t0, t_seq, t_pipe, lat_seq = 0.0, t_frame, z[RECON_MODES];
+	long          n;
+	int           i, pipelined;
+
+	if(iterations > 20000)
+		iterations = 500; // real-time benchmark, the default count is meant for the compute benchmarks
+
+	memset(&bp, 0, sizeof(bp));
+	if(sim_plant_init(&bp.plant, RECON_MODES, BENCH_SEGMENTS, BENCH_NOISE_UM, 5) || recon_init(&bp.rc, RECON_MODES, BENCH_SEGMENTS))
+		return 1;
+	bench_calibrate(&bp.plant, &bp.rc);
+	recon_compute(&bp.rc, RECON_DEFAULT_RCOND);
+	pthread_mutex_init(&bp.mirror_lock, NULL);
+	bp.frames = iterations;
+
+	printf("Loop structure on a sensor stand-in: expose %.0f us, measure %.0f us, correct %.0f us, actuate %.0f us\n",
+	       BENCH_EXPOSE_US, BENCH_MEASURE_US, BENCH_CORRECT_US, BENCH_ACTUATE_US);
+
+	for(pipelined = 0; pipelined < 2; pipelined++)
+	{
+		ctrl_init(&bp.ct, RECON_MODES, BENCH_SEGMENTS, param);
+		for(i = 0; i < BENCH_SEGMENTS; i++)
+			bp.bias[i] = bp.voltage[i] = SIM_BIAS_VOLTAGE;
+		bp.rms_tail = 0.0;
+
+		t0 = rt_now_ns();
+		if(!pipelined)
+		{
+			for(n = 0; n < iterations; n++)
+			{
+				t_frame = rt_now_ns();
+				bench_pipe_measure(&bp, z);
+				bench_pipe_correct(&bp, z, n);
+				lat_seq += rt_now_ns() - t_frame;
+			}
+			t_seq = rt_now_ns() - t0;
+			printf("  sequential  %7.1f frames/s   end-to-end latency mean %.1f us   residual %.4f um\n",
+			       iterations / t_seq * 1e9, lat_seq / iterations / 1e3, bp.rms_tail);
+		}
+		else
+		{
+			pipeline_init(&bp.pipe, bp.frame[0], bp.frame[1]);
+			bp.running = 1;
+			pthread_create(&thread, NULL, bench_pipe_acquire, &bp);
+			for(n = 0; n < iterations; n++)
+			{
+				const double *fz = (const double *)pipeline_read_begin(&bp.pipe);
+				bench_pipe_correct(&bp, fz, n);
+				pipeline_read_end(&bp.pipe);
+			}
+			t_pipe = rt_now_ns() - t0;
+			bp.running = 0;
+			pipeline_stop(&bp.pipe);
+			pthread_join(thread, NULL);
+			printf("  pipelined   %7.1f frames/s   end-to-end latency mean %.1f us   residual %.4f um\n",
+			       iterations / t_pipe * 1e9, bp.pipe.latency_sum_ns / bp.pipe.consumed / 1e3, bp.rms_tail);
+			printf("  ");
+			pipeline_report(&bp.pipe, stdout);
+			pipeline_destroy(&bp.pipe);
+		}
+	}
+
+	pthread_mutex_destroy(&bp.mirror_lock);
+	recon_free(&bp.rc);
+	sim_plant_free(&bp.plant);
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Camera resolutions, the cam_wfs*_xpixel / ypixel tables of WFS-DMH.c
+---------------------------------------------------------------------------*/
+typedef struct
+{
+	const char  *name;
+	double      pitch_um;   // camera pixel pitch, approximate
+	int         count;
+	int         xpixel[12];
+	int         ypixel[12];
+} bench_cam_t;
+
+static const bench_cam_t bench_cams[] =
+{
+	{ "WFS150/300", 4.65,  5, { 1280, 1024, 768, 512, 320 }, { 1024, 1024, 768, 512, 320 } },
+	{ "WFS10",      9.9,   5, {  640,  480, 360, 260, 180 }, {  480,  480, 360, 260, 180 } },
+	{ "WFS20",      5.0,  10, { 1440, 1080, 768, 512, 360,  720, 540, 384, 256, 180 }, { 1080, 1080, 768, 512, 360,  540, 540, 384, 256, 180 } },
+	{ "WFS30",      5.86, 12, { 1936, 1216, 1024, 768, 512, 360, 968, 608, 512, 384, 256, 180 }, { 1216, 1216, 1024, 768, 512, 360, 608, 608, 512, 384, 256, 180 } },
+	{ "WFS40",      5.5,  12, { 2048, 1536, 1024, 768, 512, 360, 1024, 768, 512, 384, 256, 180 }, { 2048, 1536, 1024, 768, 512, 360, 1024, 768, 512, 384, 256, 180 } },
+};
+
+
+/*---------------------------------------------------------------------------
+  Render a Gaussian spot behind every lenslet of the grid, shifted by a random deviation that is returned as truth
+---------------------------------------------------------------------------*/
+static void bench_render_spots (const cent_grid_t *g, unsigned char img[], float true_x[], float true_y[], unsigned int *rng)
+{
+	int i, j, x, y, r = (int)(3.0 * BENCH_SPOT_SIGMA) + 1;
+
+	for(i = 0; i < g->width * g->height; i++)
+		img[i] = (unsigned char)(4.0 + 2.0 * fabs(sim_gauss(rng)));   // dark level and read noise
+
+	for(j = 0; j < g->n_y; j++)
+		for(i = 0; i < g->n_x; i++)
+		{
+			int    k = j * BENCH_SPOTS_STRIDE + i;
+			double sx = g->ref_x[i] + BENCH_SPOT_SHIFT * (2.0 * ((*rng = *rng * 1103515245u + 12345u) >> 8 & 0xFFFF) / 65535.0 - 1.0);
+			double sy = g->ref_y[j] + BENCH_SPOT_SHIFT * (2.0 * ((*rng = *rng * 1103515245u + 12345u) >> 8 & 0xFFFF) / 65535.0 - 1.0);
+
+			true_x[k] = (float)sx;
+			true_y[k] = (float)sy;
+			for(y = (int)sy - r; y <= (int)sy + r; y++)
+				for(x = (int)sx - r; x <= (int)sx + r; x++)
+				{
+					double v;
+					if(x < 0 || y < 0 || x >= g->width || y >= g->height)
+						continue;
+					v = img[y * g->width + x] + BENCH_SPOT_PEAK * exp(-((x - sx) * (x - sx) + (y - sy) * (y - sy)) / (2.0 * BENCH_SPOT_SIGMA * BENCH_SPOT_SIGMA));
+					img[y * g->width + x] = (unsigned char)(v > 255.0 ? 255.0 : v);
+				}
+		}
+}
+
+
+/*---------------------------------------------------------------------------
+  cent: time per frame of both centroiding kernels at every camera resolution, checks they agree
+---------------------------------------------------------------------------*/
+static int bench_cent (long iterations)
+{
+	static float  cx[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE], cy[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE];
+	static float  vx[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE], vy[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE];
+	static float  true_x[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE], true_y[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE];
+	unsigned int  rng = 4242;
+	int           c, r, avx2 = cent_cpu_has_avx2();
+
+	iterations /= 2000; // frames per resolution and kernel
+	if(iterations < 1)
+		iterations = 1;
+
+	printf("Thresholded centre of gravity on MONO8 images, %.0f um lenslets, AVX2 %s\n", BENCH_LENSLET_PITCH_UM, avx2 ? "available" : "not available");
+	printf("  camera       resolution   lenslets  win   scalar[us]   AVX2[us]  speedup   Mpixel/s   err rms[px]  mismatches\n");
+
+	for(c = 0; c < (int)(sizeof(bench_cams) / sizeof(bench_cams[0])); c++)
+		for(r = 0; r < bench_cams[c].count; r++)
+		{
+			const bench_cam_t *cam = &bench_cams[c];
+			int               w = cam->xpixel[r], h = cam->ypixel[r], i, mismatches = 0, found;
+			unsigned char     *img = malloc((size_t)w * h);
+			double            t0, t_scalar, t_simd = 0.0, err = 0.0;
+			cent_grid_t       g;
+			long              n;
+
+			if(!img || cent_grid_init(&g, w, h, cam->pitch_um, BENCH_LENSLET_PITCH_UM, 0.0, 0.0, CENT_DEFAULT_THRESHOLD) <= 0)
+			{
+				free(img);
+				continue;
+			}
+			bench_render_spots(&g, img, true_x, true_y, &rng);
+
+			cent_set_simd(&g, 0);
+			t0 = bench_now_ns();
+			for(n = 0; n < iterations; n++)
+				found = cent_compute(&g, img, w, cx, cy, BENCH_SPOTS_STRIDE);
+			t_scalar = (bench_now_ns() - t0) / iterations;
+
+			if(cent_set_simd(&g, 1))
+			{
+				t0 = bench_now_ns();
+				for(n = 0; n < iterations; n++)
+					cent_compute(&g, img, w, vx, vy, BENCH_SPOTS_STRIDE);
+				t_simd = (bench_now_ns() - t0) / iterations;
+			}
+
+			for(int y = 0; y < g.n_y; y++)
+				for(int x = 0; x < g.n_x; x++)
+				{
+					i = y * BENCH_SPOTS_STRIDE + x;
+					err += (cx[i] - true_x[i]) * (cx[i] - true_x[i]) + (cy[i] - true_y[i]) * (cy[i] - true_y[i]);
+					if(g.simd && (cx[i] != vx[i] || cy[i] != vy[i]))
+						mismatches++;
+				}
+			bench_sink += found;
+
+			printf("  %-10s  %5d x %-5d  %6d  %4d   %10.1f  %9.1f  %6.1fx  %9.0f   %10.3f  %10d\n", r ? "" : cam->name, w, h, g.n_x * g.n_y, g.win,
+			       t_scalar / 1e3, t_simd / 1e3, t_simd > 0.0 ? t_scalar / t_simd : 0.0, (double)w * h / (g.simd ? t_simd : t_scalar) * 1e3,
+			       sqrt(err / (g.n_x * g.n_y)), mismatches);
+			free(img);
+		}
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Per-frame fit by normal equations of any size, what a fit without a cached projection repeats on every frame
+---------------------------------------------------------------------------*/
+static void bench_normal_fit (const double basis[], int n_slopes, int n_fit, const double slopes[], double a[], double coef[])
+{
+	int i, j, k;
+
+	for(i = 0; i < n_fit; i++)
+		for(j = 0; j <= i; j++)
+		{
+			double acc = 0.0;
+			for(k = 0; k < n_slopes; k++)
+				acc += basis[k * n_fit + i] * basis[k * n_fit + j];
+			a[i * n_fit + j] = a[j * n_fit + i] = acc;
+		}
+	la_gemv_t(basis, n_slopes, n_fit, slopes, coef);
+	la_cholesky_solve(a, n_fit, coef);
+}
+
+
+/*---------------------------------------------------------------------------
+  zfit: cost per frame of the Zernike fit and recovery of known coefficients, for growing grids and orders
+---------------------------------------------------------------------------*/
+static int bench_zfit (long iterations)
+{
+	static const int grids[]  = { 17, 36, 48 };
+	static const int orders[] = { 4, 6, 10 };
+	static float     dev_x[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE], dev_y[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE];
+	float            scale[BENCH_SPOTS_STRIDE], zernike[ZFIT_MAX_MODES + 1];
+	zfit_geometry_t  geo = { 0.0, 0.0, 0.0, 0.0, 5.0 / 5200.0 }; // 5 um pixels behind 5.2 mm lenslets
+	unsigned int     rng = 31;
+	int              g, o;
+
+	iterations /= 1000; // the order 10 normal equations take ~10 ms per frame on the largest grid
+	if(iterations < 1)
+		iterations = 1;
+
+	printf("Zernike fit from spot deviations, 150 um lenslets\n");
+	printf("  grid  order  lenslets   normal eq.[us]   projection[us]   speedup   coef err rms[um]\n");
+
+	for(g = 0; g < (int)(sizeof(grids) / sizeof(grids[0])); g++)
+		for(o = 0; o < (int)(sizeof(orders) / sizeof(orders[0])); o++)
+		{
+			int     grid = grids[g], i, j, n_fit;
+			double  truth[ZFIT_MAX_MODES], t0, t_normal, t_proj, err = 0.0, *a, *coef;
+			zfit_t  zf;
+			long    n;
+
+			for(i = 0; i < grid; i++)
+				scale[i] = (float)((i - (grid - 1) / 2.0) * 0.15);
+			geo.diameter_x_mm = geo.diameter_y_mm = grid * 0.15;
+			for(i = 0; i < BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE; i++)
+				dev_x[i] = dev_y[i] = 0.0f;
+
+			if(zfit_init(&zf, grid * grid, BENCH_SPOTS_STRIDE) || zfit_build(&zf, orders[o], &geo, scale, scale, dev_x, dev_y, grid, grid, 1) <= 0)
+				return 1;
+			n_fit = zf.n_modes - 1;
+
+			// deviations of a known wavefront plus centroid noise
+			for(j = 0; j < n_fit; j++)
+				truth[j] = 0.1 * sim_gauss(&rng);
+			for(i = 0; i < zf.n_sub; i++)
+			{
+				double sx = 0.0, sy = 0.0;
+				for(j = 0; j < n_fit; j++)
+				{
+					sx += zf.basis[(size_t)i * n_fit + j] * truth[j];
+					sy += zf.basis[(size_t)(zf.n_sub + i) * n_fit + j] * truth[j];
+				}
+				dev_x[zf.idx[i]] = (float)(sx + 0.01 * sim_gauss(&rng));
+				dev_y[zf.idx[i]] = (float)(sy + 0.01 * sim_gauss(&rng));
+			}
+
+			a    = malloc(sizeof(double) * n_fit * n_fit);
+			coef = malloc(sizeof(double) * n_fit);
+			t0 = bench_now_ns();
+			for(n = 0; n < iterations; n++)
+			{
+				for(i = 0; i < zf.n_sub; i++)
+				{
+					zf.slopes[i]           = dev_x[zf.idx[i]];
+					zf.slopes[zf.n_sub + i] = dev_y[zf.idx[i]];
+				}
+				bench_normal_fit(zf.basis, zf.n_slopes, n_fit, zf.slopes, a, coef);
+				bench_sink += coef[0];
+			}
+			t_normal = (bench_now_ns() - t0) / iterations;
+
+			t0 = bench_now_ns();
+			for(n = 0; n < iterations; n++)
+			{
+				zfit_apply(&zf, dev_x, dev_y, zernike);
+				bench_sink += zernike[2];
+			}
+			t_proj = (bench_now_ns() - t0) / iterations;
+
+			for(j = 0; j < n_fit; j++)
+				err += (zernike[j + 2] - truth[j]) * (zernike[j + 2] - truth[j]);
+			printf("  %4d  %5d  %8d   %14.1f   %14.1f   %6.1fx   %16.5f\n", grid, orders[o], zf.n_sub, t_normal / 1e3, t_proj / 1e3,
+			       t_normal / t_proj, sqrt(err / n_fit));
+			free(a);
+			free(coef);
+			zfit_free(&zf);
+		}
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  spsc: target-sized messages between two threads, the way operator and loop use the channel
+---------------------------------------------------------------------------*/
+typedef struct
+{
+	int    type;
+	float  target[16];
+} bench_msg_t;
+
+typedef struct
+{
+	spsc_t  to;
+	spsc_t  back;
+	long    count;
+	int     echo;      // 1: send every message straight back (round trip), 0: just check it
+	long    torn;
+	long    out_of_order;
+} bench_spsc_t;
+
+
+/*---------------------------------------------------------------------------
+  Spin a while on an empty/full channel, then sleep so the other side can run even on a single core
+---------------------------------------------------------------------------*/
+static void bench_backoff (int *spins)
+{
+	if(++*spins < 4096)
+		return;
+	*spins = 0;
+	bench_sleep_us(20.0);
+}
+
+
+static void *bench_spsc_consumer (void *arg)
+{
+	bench_spsc_t *bs = (bench_spsc_t *)arg;
+	bench_msg_t  msg;
+	long         n = 0;
+	int          spins = 0;
+
+	while(n < bs->count)
+	{
+		if(spsc_pop(&bs->to, &msg))
+		{
+			bench_backoff(&spins);
+			continue;
+		}
+		for(int i = 1; i < 16; i++)
+			if(msg.target[i] != msg.target[0])
+			{
+				bs->torn++;
+				break;
+			}
+		if(msg.type != (int)(n & 0x7fffffff))
+			bs->out_of_order++;
+		n++;
+		if(bs->echo)
+			while(spsc_push(&bs->back, &msg))
+				bench_backoff(&spins);
+	}
+	return NULL;
+}
+
+
+static int bench_spsc (long iterations)
+{
+	bench_spsc_t bs;
+	bench_msg_t  msg;
+	pthread_t    thread;
+	double       t0, t_stream, t_rtt;
+	long         n;
+	int          spins = 0;
+
+	memset(&bs, 0, sizeof(bs));
+	if(spsc_init(&bs.to, 16, sizeof(bench_msg_t)) || spsc_init(&bs.back, 16, sizeof(bench_msg_t)))
+		return 1;
+	printf("SPSC channel, %d byte messages, 16 deep, %ld CPUs%s\n", (int)sizeof(bench_msg_t), sysconf(_SC_NPROCESSORS_ONLN),
+	       sysconf(_SC_NPROCESSORS_ONLN) < 2 ? " (both threads share one core, timings are scheduler bound)" : "");
+
+	// streaming: the producer only backs off when the ring is full
+	bs.count = iterations;
+	pthread_create(&thread, NULL, bench_spsc_consumer, &bs);
+	t0 = bench_now_ns();
+	for(n = 0; n < bs.count; n++)
+	{
+		msg.type = (int)(n & 0x7fffffff);
+		for(int i = 0; i < 16; i++)
+			msg.target[i] = (float)n;
+		while(spsc_push(&bs.to, &msg))
+			bench_backoff(&spins);
+	}
+	pthread_join(thread, NULL);
+	t_stream = (bench_now_ns() - t0) / bs.count;
+	printf("  streaming   %8.1f ns/message  %6.1f M messages/s  torn %ld  out of order %ld  full ring retries %ld\n",
+	       t_stream, 1e3 / t_stream, bs.torn, bs.out_of_order, bs.to.full);
+
+	// ping-pong: one message in flight, the latency a target change sees
+	spsc_free(&bs.to);
+	spsc_free(&bs.back);
+	spsc_init(&bs.to, 16, sizeof(bench_msg_t));
+	spsc_init(&bs.back, 16, sizeof(bench_msg_t));
+	bs.count = iterations / 10 + 1;
+	bs.echo  = 1;
+	bs.torn  = bs.out_of_order = 0;
+	pthread_create(&thread, NULL, bench_spsc_consumer, &bs);
+	t0 = bench_now_ns();
+	for(n = 0; n < bs.count; n++)
+	{
+		msg.type = (int)(n & 0x7fffffff);
+		for(int i = 0; i < 16; i++)
+			msg.target[i] = (float)n;
+		spsc_push(&bs.to, &msg);
+		while(spsc_pop(&bs.back, &msg))
+			bench_backoff(&spins);
+	}
+	pthread_join(thread, NULL);
+	t_rtt = (bench_now_ns() - t0) / bs.count;
+	printf("  round trip  %8.1f ns  torn %ld  out of order %ld\n", t_rtt, bs.torn, bs.out_of_order);
+
+	spsc_free(&bs.to);
+	spsc_free(&bs.back);
+	return bs.torn || bs.out_of_order;
+}
+
+
+/*---------------------------------------------------------------------------
+  tlm: fill records the way loop_telemetry() in WFS-DMH.c does, then read the file back like an offline analysis
+---------------------------------------------------------------------------*/
+static int bench_tlm (long iterations)
+{
+	static const char *stages[] = { "acquire", "measure", "reconstruct", "actuate" };
+	tlm_t        tl;
+	tlm_header_t h;
+	tlm_record_t *r, rec;
+	FILE         *fp;
+	double       t0, t_open, t_rec, t_close;
+	long         n, first, bad = 0, found = 0;
+
+	t0 = bench_now_ns();
+	if(tlm_open(&tl, BENCH_TLM_FILE_NAME, BENCH_TLM_RECORDS, 4, stages))
+	{
+		printf("Could not create %s\n", BENCH_TLM_FILE_NAME);
+		return 1;
+	}
+	t_open = bench_now_ns() - t0;
+	printf("Telemetry ring, %d byte records, %d records (%.1f MB)\n", (int)sizeof(tlm_record_t), BENCH_TLM_RECORDS, tl.size / 1e6);
+
+	t0 = bench_now_ns();
+	for(n = 0; n < iterations; n++)
+	{
+		r = tlm_begin(&tl);
+		r->t_ns = (double)n;
+		for(int i = 0; i < TLM_ZERNIKES; i++)
+		{
+			r->zernike[i] = (float)(n + i);
+			r->target[i]  = 0.0f;
+		}
+		for(int i = 0; i < TLM_RESIDUALS; i++)
+			r->residual[i] = (float)n;
+		for(int i = 0; i < TLM_SEGMENTS; i++)
+			r->voltage[i] = (float)SIM_BIAS_VOLTAGE;
+		r->exposure_ms = 1.0f;
+		r->gain        = 1.0f;
+		for(int i = 0; i < 4; i++)
+			r->stage_us[i] = (float)i;
+		r->flags   = (n % 2) ? TLM_FLAG_TILT_ONLY : 0;
+		r->clamped = 0;
+		for(int i = 0; i < TLM_TILT_ARMS; i++)
+			r->tilt_voltage[i] = (float)(n + i);
+		for(int i = 0; i < TLM_TILT_AXES; i++)
+			r->tilt_error[i] = 0.0f;
+		r->reserved = 0;
+		tlm_commit(&tl);
+	}
+	t_rec = (bench_now_ns() - t0) / iterations;
+
+	t0 = bench_now_ns();
+	tlm_close(&tl);
+	t_close = bench_now_ns() - t0;
+	printf("  open + prefault %8.1f ms   per record %6.1f ns   close (msync) %8.1f ms\n", t_open / 1e6, t_rec, t_close / 1e6);
+
+	// read back: the newest min(iterations, capacity) records, each at seq % capacity
+	fp = fopen(BENCH_TLM_FILE_NAME, "rb");
+	if(!fp || fread(&h, sizeof(h), 1, fp) != 1)
+		return 1;
+	first = (long)h.written > (long)h.capacity ? (long)h.written - (long)h.capacity : 0;
+	fseek(fp, h.header_size, SEEK_SET);
+	while(fread(&rec, h.record_size, 1, fp) == 1)
+	{
+		if((long)rec.seq < first || (long)rec.seq >= (long)h.written || rec.t_ns != (double)rec.seq || rec.zernike[3] != (float)(rec.seq + 3)
+		   || rec.tilt_voltage[2] != (float)(rec.seq + 2) || rec.flags != ((rec.seq % 2) ? TLM_FLAG_TILT_ONLY : 0))
+			bad++;
+		found++;
+	}
+	fclose(fp);
+	remove(BENCH_TLM_FILE_NAME);
+	printf("  read back %ld records of %llu written, %ld inconsistent\n", found, (unsigned long long)h.written, bad);
+	return bad != 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  hal: the loop of WFS-DMH.c end to end through the hal_sensor_t / hal_mirror_t interface of the simulated bench.
+  Calibrates with the same poke sequence as measure_interaction_matrix(), then closes the loop free running.
+---------------------------------------------------------------------------*/
+static int bench_hal (long iterations)
+{
+	sim_optics_config_t cfg;
+	sim_optics_t        so;
+	hal_sensor_t        *sensor = &so.sensor;
+	hal_mirror_t        *mirror = &so.mirror;
+	recon_t             rc;
+	ctrl_t              ct;
+	rt_sched_t          rt;
+	ctrl_param_t        param = { 0.4, 0.0, 0.0, 0.0 };
+	float               z_ref[ZFIT_MAX_MODES + 1], z[ZFIT_MAX_MODES + 1];
+	double              bias[BENCH_SEGMENTS], pattern[BENCH_SEGMENTS], voltage[BENCH_SEGMENTS], response[RECON_MODES], err[RECON_MODES];
+	double              t0, t_loop, rms = 0.0, rms_open = 0.0, rms_tail = 0.0;
+	int                 st_acquire, st_measure, st_reconstruct, st_actuate, i, seg;
+	long                n, tail = 0;
+
+	if(iterations > 20000)
+		iterations = 20000;   // every frame is rendered, the default count would take half a minute
+	sim_optics_defaults(&cfg);
+	if(sim_optics_init(&so, &cfg) || recon_init(&rc, RECON_MODES, BENCH_SEGMENTS))
+		return 1;
+	printf("%s: %d x %d pixels, %d lit lenslets of %d x %d; %s, %d segments\n", sensor->name, cfg.width, cfg.height, so.n_lit,
+	       so.grid.n_x, so.grid.n_y, mirror->name, mirror->n_segments);
+
+	for(i = 0; i < BENCH_SEGMENTS; i++)
+		bias[i] = SIM_BIAS_VOLTAGE;
+	t0 = bench_now_ns();
+	for(seg = -1; seg < BENCH_SEGMENTS; seg++)
+	{
+		memcpy(pattern, bias, sizeof(pattern));
+		if(seg >= 0)
+			pattern[seg] += BENCH_POKE_VOLTAGE;
+		mirror->set_segments(mirror->ctx, pattern);
+		sensor->take_image_auto(sensor->ctx);
+		if(sensor->zernikes(sensor->ctx, RECON_ZERNIKE_ORDER, (seg < 0) ? z_ref : z))
+			return 1;
+		if(seg < 0)
+			continue;
+		for(i = 0; i < RECON_MODES; i++)
+			response[i] = (z[RECON_FIRST_MODE + i] - z_ref[RECON_FIRST_MODE + i]) / BENCH_POKE_VOLTAGE;
+		recon_set_response(&rc, seg, response);
+	}
+	recon_compute(&rc, RECON_DEFAULT_RCOND);
+	printf("  calibration %.1f ms, control matrix rank %d of %d\n", (bench_now_ns() - t0) / 1e6, rc.rank, RECON_MODES);
+
+	ctrl_init(&ct, RECON_MODES, BENCH_SEGMENTS, param);
+	mirror->set_segments(mirror->ctx, bias);
+	rt_init(&rt, 0.0);
+	st_acquire     = rt_add_stage(&rt, "acquire", 0.0);
+	st_measure     = rt_add_stage(&rt, "measure", 0.0);
+	st_reconstruct = rt_add_stage(&rt, "reconstruct", 0.0);
+	st_actuate     = rt_add_stage(&rt, "actuate", 0.0);
+	rt_start(&rt);
+	t0 = bench_now_ns();
+	for(n = 0; n < iterations; n++)
+	{
+		rt_stage_begin(&rt);
+		sensor->take_image(sensor->ctx);
+		rt_stage_end(&rt, st_acquire);
+		sensor->zernikes(sensor->ctx, RECON_ZERNIKE_ORDER, z);
+		rt_stage_end(&rt, st_measure);
+		rms = 0.0;
+		for(i = 0; i < RECON_MODES; i++)
+		{
+			err[i] = z[RECON_FIRST_MODE + i];   // flat target
+			rms += err[i] * err[i];
+		}
+		rms = sqrt(rms / RECON_MODES);
+		ctrl_apply(&ct, err, rc.cm, rc.im, bias, mirror->seg_min, mirror->seg_max, voltage);
+		rt_stage_end(&rt, st_reconstruct);
+		mirror->set_segments(mirror->ctx, voltage);
+		rt_stage_end(&rt, st_actuate);
+		rt_wait(&rt);
+
+		if(n == 0)
+			rms_open = rms;
+		if(n >= iterations - iterations / 10)
+		{
+			rms_tail += rms;
+			tail++;
+		}
+	}
+	t_loop = bench_now_ns() - t0;
+	printf("  closed loop %.0f frames/s, Z4..Z15 residual rms %.4f um open loop, %.4f um closed (last 10 %%)\n",
+	       iterations / t_loop * 1e9, rms_open, tail ? rms_tail / tail : rms);
+	rt_report(&rt, stdout);
+
+	recon_free(&rc);
+	sim_optics_free(&so);
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  replay: capture frames of the simulated bench under a wandering mirror, then
+  feed the file back through the replay backend as fast as it goes. The
+  Zernikes of the replay must equal the ones measured live on the same frames.
+---------------------------------------------------------------------------*/
+static int bench_replay (long iterations)
+{
+	sim_optics_config_t cfg;
+	sim_optics_t        so;
+	capture_header_t    h;
+	capture_writer_t    cw;
+	replay_t            rp;
+	hal_sensor_t        *sensor = &so.sensor;
+	unsigned char       *image;
+	float               *z_live, z[ZFIT_MAX_MODES + 1];
+	double              voltage[BENCH_SEGMENTS], t_copy = 0.0, t0, t_replay, diff = 0.0;
+	int                 rows, cols, i;
+	long                n, replayed = 0;
+	unsigned int        rng = 7;
+
+	if(iterations > 1000)
+		iterations = 1000;   // a 512 x 512 frame is 256 kB on disk
+	sim_optics_defaults(&cfg);
+	if(sim_optics_init(&so, &cfg))
+		return 1;
+	z_live = calloc((size_t)iterations * (ZFIT_MAX_MODES + 1), sizeof(float));
+	if(!z_live || capture_header_init(&h, sensor, &so.mirror, cfg.width, cfg.height, cfg.cam_pitch_um, cfg.lenslet_pitch_um, cfg.lenslet_f_um, 0.0, 0.0)
+	   || capture_open(&cw, BENCH_CAPTURE_FILE_NAME, &h, BENCH_CAPTURE_DEPTH))
+	{
+		printf("Could not create %s.\n", BENCH_CAPTURE_FILE_NAME);
+		return 1;
+	}
+
+	for(n = 0; n < iterations; n++)
+	{
+		for(i = 0; i < BENCH_SEGMENTS; i++)
+			voltage[i] = SIM_BIAS_VOLTAGE + 5.0 * sim_gauss(&rng);
+		so.mirror.set_segments(so.mirror.ctx, voltage);
+		sensor->take_image(sensor->ctx);
+		sensor->get_image(sensor->ctx, &image, &rows, &cols);
+		t0 = bench_now_ns();
+		capture_frame(&cw, image, rows, cols, t0, so.exposure_ms, so.gain, so.status);
+		t_copy += bench_now_ns() - t0;
+		sensor->zernikes(sensor->ctx, RECON_ZERNIKE_ORDER, z_live + n * (ZFIT_MAX_MODES + 1));
+	}
+	capture_close(&cw);
+	printf("capture: %ld frames of %d x %d, %.1f us per frame on the loop thread, %ld dropped while the disk was behind\n",
+	       iterations, cols, rows, t_copy / iterations / 1e3, cw.dropped);
+
+	if(replay_open(&rp, BENCH_CAPTURE_FILE_NAME, 0))
+	{
+		printf("Could not replay %s.\n", BENCH_CAPTURE_FILE_NAME);
+		return 1;
+	}
+	t0 = bench_now_ns();
+	while(rp.sensor.take_image(rp.sensor.ctx) == 0)
+	{
+		const float *zl = z_live + rp.frame->seq * (ZFIT_MAX_MODES + 1);   // dropped frames leave gaps in seq
+
+		rp.sensor.zernikes(rp.sensor.ctx, RECON_ZERNIKE_ORDER, z);
+		for(i = 1; i <= ZFIT_MAX_MODES; i++)
+			if(fabs(z[i] - zl[i]) > diff)
+				diff = fabs(z[i] - zl[i]);
+		replayed++;
+	}
+	t_replay = bench_now_ns() - t0;
+	printf("replay: %ld frames, %.0f frames/s through centroids and Zernike fit, largest difference to the live fit %.2e um\n",
+	       replayed, replayed / t_replay * 1e9, diff);
+
+	replay_close(&rp);
+	sim_optics_free(&so);
+	free(z_live);
+	remove(BENCH_CAPTURE_FILE_NAME);
+	return replayed + cw.dropped != iterations || diff > 1e-6;
+}
+
+
+/*---------------------------------------------------------------------------
+  Frame callback of calib_run(): Z4..Z15 of one frame of the hal sensor
+---------------------------------------------------------------------------*/
+static int bench_calib_frame (void *ctx, double meas[])
+{
+	hal_sensor_t *sensor = ctx;
+	float        z[ZFIT_MAX_MODES + 1];
+	int          err, i;
+
+	if((err = sensor->take_image(sensor->ctx)) < 0)
+		return err;
+	sensor->zernikes(sensor->ctx, RECON_ZERNIKE_ORDER, z);
+	for(i = 0; i < RECON_MODES; i++)
+		meas[i] = z[RECON_FIRST_MODE + i];
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  One calibration of the Z4..Z15 interaction matrix on the simulated bench.
+  n_avg 0 is the old sequence: one frame per single sided poke with auto
+  exposure each time. Returns the frames taken, the worst mode's predicted
+  matrix noise in noise, the mean at the bias in ref if given (push-pull).
+---------------------------------------------------------------------------*/
+static long bench_calib_run (sim_optics_t *so, int scheme, int n_avg, double amplitude, double im[], double *noise, double ref[])
+{
+	hal_sensor_t *sensor = &so->sensor;
+	hal_mirror_t *mirror = &so->mirror;
+	calib_t      cal;
+	float        z[ZFIT_MAX_MODES + 1], z_ref[ZFIT_MAX_MODES + 1];
+	double       bias[BENCH_SEGMENTS], pattern[BENCH_SEGMENTS], meas[RECON_MODES];
+	long         frames = 0;
+	int          i, a;
+
+	for(a = 0; a < BENCH_SEGMENTS; a++)
+		bias[a] = SIM_BIAS_VOLTAGE;
+	mirror->set_segments(mirror->ctx, bias);
+	sensor->take_image_auto(sensor->ctx);
+	sensor->zernikes(sensor->ctx, RECON_ZERNIKE_ORDER, z_ref);
+	frames++;
+	*noise = NAN;   // no noise estimate from single frames
+	if(n_avg == 0)
+	{
+		for(a = 0; a < BENCH_SEGMENTS; a++, frames++)
+		{
+			memcpy(pattern, bias, sizeof(pattern));
+			pattern[a] += amplitude;
+			mirror->set_segments(mirror->ctx, pattern);
+			sensor->take_image_auto(sensor->ctx);
+			sensor->zernikes(sensor->ctx, RECON_ZERNIKE_ORDER, z);
+			for(i = 0; i < RECON_MODES; i++)
+				im[i * BENCH_SEGMENTS + a] = (z[RECON_FIRST_MODE + i] - z_ref[RECON_FIRST_MODE + i]) / amplitude;
+		}
+		return frames;
+	}
+
+	// the sequence measure_interaction_matrix() in WFS-DMH.c runs, without settle frames as the simulated mirror has no lag
+	if(calib_init(&cal, BENCH_SEGMENTS, RECON_MODES, scheme, amplitude, n_avg))
+		return -1;
+	if(calib_run(&cal, mirror, sensor, bias, BENCH_CALIB_NOISE_FRAMES, 0, bench_calib_frame, sensor, meas, ref))
+	{
+		calib_free(&cal);
+		return -1;
+	}
+	frames += cal.frames + cal.settled;
+	for(a = 0; a < BENCH_SEGMENTS; a++)
+		for(i = 0; i < RECON_MODES; i++)
+			im[i * BENCH_SEGMENTS + a] = calib_response(&cal, a)[i];
+	*noise = 0.0;
+	for(i = 0; i < RECON_MODES; i++)
+		if(calib_response_noise(&cal, i) > *noise)
+			*noise = calib_response_noise(&cal, i);
+	calib_free(&cal);
+	return frames;
+}
+
+
+/*---------------------------------------------------------------------------
+  calib: interaction matrix of the old single sided poke sequence, push-pull
+  pokes and push-pull Hadamard patterns against a noise-free reference, with
+  the frames each needs. The sensor noise is raised so the matrix noise shows.
+---------------------------------------------------------------------------*/
+static int bench_calib (long iterations)
+{
+	static const struct { const char *name; int scheme, n_avg; double amplitude; } runs[] =
+	{
+		{ "poke, single sided, auto exposure", CALIB_SCHEME_POKE,     0, BENCH_POKE_VOLTAGE },
+		{ "poke, push-pull, 1 frame",          CALIB_SCHEME_POKE,     1, BENCH_POKE_VOLTAGE },
+		{ "poke, push-pull, 4 frames",         CALIB_SCHEME_POKE,     4, BENCH_POKE_VOLTAGE },
+		{ "poke, push-pull, 16 frames",        CALIB_SCHEME_POKE,    16, BENCH_POKE_VOLTAGE },
+		{ "Hadamard, push-pull, 1 frame",      CALIB_SCHEME_HADAMARD, 1, BENCH_POKE_VOLTAGE },
+		{ "Hadamard, push-pull, 1 frame, 5 V", CALIB_SCHEME_HADAMARD, 1, BENCH_POKE_VOLTAGE / 2 },
+	};
+	sim_optics_config_t cfg;
+	sim_optics_t        so;
+	recon_t             rc;
+	double              im_true[RECON_MODES * BENCH_SEGMENTS], im[RECON_MODES * BENCH_SEGMENTS], noise, noise_counts, t0, e, n_true = 0.0;
+	long                frames;
+	int                 r, i;
+
+	(void)iterations;
+	sim_optics_defaults(&cfg);
+	noise_counts = 4 * cfg.noise_counts;
+	cfg.noise_counts = 0.0;
+	if(sim_optics_init(&so, &cfg) || recon_init(&rc, RECON_MODES, BENCH_SEGMENTS))
+		return 1;
+	bench_calib_run(&so, CALIB_SCHEME_POKE, 1, BENCH_POKE_VOLTAGE, im_true, &noise, NULL);
+	sim_optics_free(&so);
+	for(i = 0; i < RECON_MODES * BENCH_SEGMENTS; i++)
+		n_true += im_true[i] * im_true[i];
+
+	printf("Z4..Z15 interaction matrix, %d segments, sensor noise %.0f counts; error relative to a noise-free calibration\n", BENCH_SEGMENTS, noise_counts);
+	printf("  %-36s %8s %10s %12s %16s %6s\n", "scheme", "frames", "time[ms]", "rel. error", "pred. noise[nm/V]", "rank");
+	cfg.noise_counts = noise_counts;
+	for(r = 0; r < (int)(sizeof(runs) / sizeof(runs[0])); r++)
+	{
+		if(sim_optics_init(&so, &cfg))
+			return 1;
+		t0 = bench_now_ns();
+		frames = bench_calib_run(&so, runs[r].scheme, runs[r].n_avg, runs[r].amplitude, im, &noise, NULL);
+		t0 = bench_now_ns() - t0;
+		e = 0.0;
+		for(i = 0; i < RECON_MODES * BENCH_SEGMENTS; i++)
+			e += (im[i] - im_true[i]) * (im[i] - im_true[i]);
+		memcpy(rc.im, im, sizeof(im));
+		recon_compute(&rc, RECON_DEFAULT_RCOND);
+		printf("  %-36s %8ld %10.1f %12.4f %16.4f %6d\n", runs[r].name, frames, t0 / 1e6, sqrt(e / n_true), noise * 1e3, rc.rank);
+		sim_optics_free(&so);
+	}
+	recon_free(&rc);
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Mirror whose cable pairs are swapped (segment 0 <-> 1, 2 <-> 3, ...), a
+  setup the cached calibration no longer fits
+---------------------------------------------------------------------------*/
+static int bench_swapped_segments (void *ctx, const double voltage[])
+{
+	hal_mirror_t *inner = ctx;
+	double       v[BENCH_SEGMENTS];
+	int          a;
+
+	for(a = 0; a < BENCH_SEGMENTS; a++)
+		v[a] = voltage[a ^ 1];
+	return inner->set_segments(inner->ctx, v);
+}
+
+
+/*---------------------------------------------------------------------------
+  The quick check of check_calibration() in WFS-DMH.c, Zernikes only:
+  the wavefront at the bias against the cached reference, then push-pull
+  of the first Hadamard patterns against the cached matrix. Returns the
+  worst relative error, the rms drift from ref in drift, frames taken in
+  frames.
+---------------------------------------------------------------------------*/
+static double bench_calcache_check (hal_sensor_t *sensor, hal_mirror_t *mirror, const recon_t *rc, const double ref[], double *drift, long *frames)
+{
+	calib_t  cal;
+	float    z[ZFIT_MAX_MODES + 1];
+	double   bias[BENCH_SEGMENTS], pattern[BENCH_SEGMENTS], meas[RECON_MODES], push[RECON_MODES];
+	double   dv[BENCH_SEGMENTS], dz[RECON_MODES], e, worst = 0.0;
+	int      i, a, p, sign, f, lost;
+
+	for(a = 0; a < BENCH_SEGMENTS; a++)
+		bias[a] = SIM_BIAS_VOLTAGE;
+	if(calib_init(&cal, BENCH_SEGMENTS, RECON_MODES, CALIB_SCHEME_HADAMARD, BENCH_POKE_VOLTAGE, 4))
+		return NAN;
+	mirror->set_segments(mirror->ctx, bias);
+	sensor->take_image_auto(sensor->ctx);
+	(*frames)++;
+	calib_group_begin(&cal);
+	for(f = 0; f < cal.n_avg; f++, (*frames)++)
+	{
+		bench_calib_frame(sensor, meas);
+		calib_group_add(&cal, meas);
+	}
+	calib_group_end(&cal, -1, 0);
+	*drift = calcache_drift(ref, cal.mean, RECON_MODES, &lost);
+	if(lost)
+		*drift = INFINITY;
+	for(p = 1; p <= BENCH_CALCACHE_PATTERNS; p++)
+	{
+		for(sign = 1; sign >= -1; sign -= 2)
+		{
+			calib_pattern(&cal, p, sign, bias, pattern);
+			mirror->set_segments(mirror->ctx, pattern);
+			calib_group_begin(&cal);
+			for(f = 0; f < cal.n_avg; f++, (*frames)++)
+			{
+				sensor->take_image(sensor->ctx);
+				sensor->zernikes(sensor->ctx, RECON_ZERNIKE_ORDER, z);
+				for(i = 0; i < RECON_MODES; i++)
+					meas[i] = z[RECON_FIRST_MODE + i];
+				calib_group_add(&cal, meas);
+			}
+			calib_group_end(&cal, -1, 0);
+			if(sign > 0)
+				memcpy(push, cal.mean, sizeof(push));
+		}
+		for(i = 0; i < RECON_MODES; i++)
+			dz[i] = 0.5 * (push[i] - cal.mean[i]);
+		for(a = 0; a < BENCH_SEGMENTS; a++)
+			dv[a] = cal.amplitude * cal.sign[p * BENCH_SEGMENTS + a];
+		e = calcache_response_error(rc, dv, dz);
+		if(isnan(e) || e > worst)
+			worst = e;
+	}
+	mirror->set_segments(mirror->ctx, bias);
+	calib_free(&cal);
+	return worst;
+}
+
+
+/*---------------------------------------------------------------------------
+  calcache: what a start with the calibration cache costs against the full
+  push-pull calibration, and whether the quick check tells an intact mirror
+  from one with swapped cables, and from a beam that changed since. A key
+  of another MLA must not load.
+---------------------------------------------------------------------------*/
+static int bench_calcache (long iterations)
+{
+	sim_optics_config_t cfg;
+	sim_optics_t        so, moved;
+	hal_mirror_t        swapped;
+	recon_t             rc, cached;
+	calcache_key_t      key, other;
+	char                path[256];
+	double              im[RECON_MODES * BENCH_SEGMENTS], bias[BENCH_SEGMENTS], ref[RECON_MODES], cached_ref[RECON_MODES];
+	double              pupil[4] = { 0.0, 0.0, 2.0, 2.0 }, noise, t0, t_full, t_load, t_check, age, e_ok, e_bad, e_moved;
+	double              d_ok, d_bad, d_moved;
+	long                frames, check_frames = 0, bad_frames = 0, moved_frames = 0;
+	int                 a, n_ref, load, other_load, unusable, fail = 0;
+
+	(void)iterations;
+	sim_optics_defaults(&cfg);
+	if(sim_optics_init(&so, &cfg) || recon_init(&rc, RECON_MODES, BENCH_SEGMENTS) || recon_init(&cached, RECON_MODES, BENCH_SEGMENTS))
+		return 1;
+	for(a = 0; a < BENCH_SEGMENTS; a++)
+		bias[a] = SIM_BIAS_VOLTAGE;
+	calcache_key_init(&key, "SIM", "SIM", 0, so.grid.n_x, so.grid.n_y, BENCH_SEGMENTS, 1, pupil, bias);
+	calcache_path(path, sizeof(path), BENCH_CALCACHE_PREFIX, &key);
+
+	// full calibration with the defaults of WFS-DMH.c: single segment push-pull, 4 frames each
+	t0 = bench_now_ns();
+	frames = bench_calib_run(&so, CALIB_SCHEME_POKE, 4, BENCH_POKE_VOLTAGE, im, &noise, ref);
+	memcpy(rc.im, im, sizeof(im));
+	recon_compute(&rc, RECON_DEFAULT_RCOND);
+	t_full = bench_now_ns() - t0;
+	if(calcache_save(path, &key, &rc, NULL, ref, RECON_MODES))
+		return 1;
+	// cached is still empty, rank 0: it must not replace the file
+	unusable = calcache_save(path, &key, &cached, NULL, ref, RECON_MODES);
+
+	t0 = bench_now_ns();
+	load = calcache_load(path, &key, &cached, NULL, cached_ref, RECON_MODES, &n_ref, &age);
+	t_load = bench_now_ns() - t0;
+	t0 = bench_now_ns();
+	e_ok = bench_calcache_check(&so.sensor, &so.mirror, &cached, cached_ref, &d_ok, &check_frames);
+	t_check = bench_now_ns() - t0;
+
+	swapped = so.mirror;
+	swapped.ctx = &so.mirror;
+	swapped.set_segments = bench_swapped_segments;
+	e_bad = bench_calcache_check(&so.sensor, &swapped, &cached, cached_ref, &d_bad, &bad_frames);
+
+	// same mirror, another static aberration: the beam changed, the responses did not
+	cfg.seed++;
+	if(sim_optics_init(&moved, &cfg))
+		return 1;
+	e_moved = bench_calcache_check(&moved.sensor, &moved.mirror, &cached, cached_ref, &d_moved, &moved_frames);
+	sim_optics_free(&moved);
+
+	other = key;
+	other.mla = 1;
+	other_load = calcache_load(path, &other, &cached, NULL, cached_ref, RECON_MODES, &n_ref, &age);
+
+	printf("Calibration cache, %d segments, Z4..Z15, simulated bench\n", BENCH_SEGMENTS);
+	printf("  %-40s %8s %10s\n", "", "frames", "time[ms]");
+	printf("  %-40s %8ld %10.1f\n", "full push-pull calibration", frames, t_full / 1e6);
+	printf("  %-40s %8d %10.3f\n", "load cache", 0, t_load / 1e6);
+	printf("  %-40s %8ld %10.1f\n", "quick check", check_frames, t_check / 1e6);
+	printf("Check error: intact mirror %.1f %%, swapped cables %.1f %%, changed beam %.1f %% (tolerance 30 %%)\n", e_ok * 100.0, e_bad * 100.0, e_moved * 100.0);
+	printf("Reference drift: intact mirror %.4f um, swapped cables %.4f um, changed beam %.4f um (tolerance %.2f um)\n", d_ok, d_bad, d_moved, BENCH_CALCACHE_DRIFT_UM);
+	printf("Load: own key %s, key of another MLA %s\n", load == CALCACHE_OK ? "ok" : "failed", other_load == CALCACHE_MISMATCH ? "rejected" : "NOT rejected");
+	printf("Save of a rank 0 calibration %s\n", unusable == CALCACHE_UNUSABLE ? "refused" : "NOT refused");
+
+	fail = load != CALCACHE_OK || other_load != CALCACHE_MISMATCH || unusable != CALCACHE_UNUSABLE || !(e_ok <= 0.3) || !(e_bad > 0.3)
+	    || !(d_ok <= BENCH_CALCACHE_DRIFT_UM) || !(d_moved > BENCH_CALCACHE_DRIFT_UM);
+	remove(path);
+	recon_free(&rc);
+	recon_free(&cached);
+	sim_optics_free(&so);
+	return fail;
+}
+
+
+/*---------------------------------------------------------------------------
+  Startup steps of WFS-DMH.c, each an I/O wait of its typical duration
+  (scaled down by 10) or a failure
+---------------------------------------------------------------------------*/
+typedef struct
+{
+	const char  *name;
+	double      ms;
+	int         chain;    // 0 WFS, 1 DMH, 2 needs both
+} bench_startup_step_t;
+
+static const bench_startup_step_t bench_startup_steps[] =
+{
+	{ "wfs_init",      90.0, 0 },
+	{ "dm_init",       70.0, 1 },
+	{ "wfs_mla",        2.0, 0 },
+	{ "dm_hysteresis",  3.0, 1 },
+	{ "wfs_camera",    25.0, 0 },
+	{ "dm_relax",     150.0, 1 },
+	{ "wfs_exposure",  18.0, 0 },  // three auto exposure trials
+	{ "tldfmx_system", 40.0, 2 },
+};
+
+static int bench_startup_failing; // index of the step that fails, -1 for none
+
+static int bench_startup_wait (void *ctx)
+{
+	const bench_startup_step_t *st = (const bench_startup_step_t *)ctx;
+
+	bench_sleep_us(st->ms * 1e3);
+	return (st - bench_startup_steps == bench_startup_failing) ? -1 : 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Graph of the steps above, serial chains every step to the one before
+---------------------------------------------------------------------------*/
+static int bench_startup_graph (startup_t *su, int serial)
+{
+	int          n = (int)(sizeof(bench_startup_steps) / sizeof(bench_startup_steps[0]));
+	int          i, last[2] = { -1, -1 };
+	unsigned int after;
+
+	startup_init(su);
+	for(i = 0; i < n; i++)
+	{
+		const bench_startup_step_t *st = &bench_startup_steps[i];
+
+		if(serial)
+			after = i ? STARTUP_AFTER(i - 1) : 0;
+		else if(st->chain == 2)
+			after = STARTUP_AFTER(last[0]) | STARTUP_AFTER(last[1]);
+		else
+			after = (last[st->chain] >= 0) ? STARTUP_AFTER(last[st->chain]) : 0;
+		if(st->chain < 2)
+			last[st->chain] = i;
+		startup_add(su, st->name, bench_startup_wait, (void *)st, after);
+	}
+	return startup_run(su);
+}
+
+
+static int bench_startup (long iterations)
+{
+	static startup_t serial, graph, broken;
+	int              failed_serial, failed_graph, failed_broken, fail;
+
+	(void)iterations;
+	bench_startup_failing = -1;
+	failed_serial = bench_startup_graph(&serial, 1);
+	failed_graph  = bench_startup_graph(&graph, 0);
+	bench_startup_failing = 1; // dm_init
+	failed_broken = bench_startup_graph(&broken, 0);
+
+	printf("Startup of the Thorlabs backend, device times / 10\n\nOne after the other:\n");
+	startup_report(&serial, stdout);
+	printf("\nDependency graph:\n");
+	startup_report(&graph, stdout);
+	printf("\nDependency graph, dm_init fails:\n");
+	startup_report(&broken, stdout);
+	printf("\nSpeed-up %.2fx\n", serial.total_ns / graph.total_ns);
+
+	// a failed DMH stops its chain and the step that needs both, the WFS chain still runs
+	fail = failed_serial != -1 || failed_graph != -1 || failed_broken != 1 || broken.step[3].state != STARTUP_SKIPPED
+	    || broken.step[7].state != STARTUP_SKIPPED || broken.step[6].state != STARTUP_DONE || !(graph.total_ns < serial.total_ns);
+	return fail;
+}
+
+
+/*---------------------------------------------------------------------------
+  Exposure search of WFS-DMH.c (find_exposure) on the simulated bench from
+  exposure / gain. Returns the frames taken, negative if it failed; the
+  exposure and gain found are returned in place.
+---------------------------------------------------------------------------*/
+static int bench_expo_run (sim_optics_t *so, double *exposure, double *gain, int *peak)
+{
+	hal_sensor_t  *s = &so->sensor;
+	expo_search_t es;
+	double        exp_min, exp_max, exp_incr, gain_min, gain_max, saturated;
+	int           status, img_min, img_max, result;
+
+	s->get_exposure_range(s->ctx, &exp_min, &exp_max, &exp_incr);
+	s->get_gain_range(s->ctx, &gain_min, &gain_max);
+	expo_search_init(&es, exp_min, exp_max, exp_incr, gain_min, gain_max, *exposure, *gain, BENCH_EXPO_FRAMES);
+	do
+	{
+		s->set_exposure(s->ctx, es.exposure, &es.exposure);
+		s->set_gain(s->ctx, es.gain, &es.gain);
+		*exposure = es.exposure;
+		*gain     = es.gain;
+		s->take_image(s->ctx);
+		s->get_status(s->ctx, &status);
+		s->image_min_max(s->ctx, &img_min, &img_max, &saturated);
+		*peak  = img_max;
+		result = expo_search_update(&es, img_max, saturated, (status & HAL_STATUS_POWER_HIGH) != 0, (status & HAL_STATUS_POWER_LOW) != 0);
+	}
+	while(result == EXPO_SEARCH_MORE);
+	return (result == EXPO_SEARCH_FOUND) ? es.frames : -es.frames;
+}
+
+
+static int bench_expo (long iterations)
+{
+	static const double light[] = { 2.0, 20.0, 250.0, 2500.0, 10000.0 }; // spot peak counts per ms at gain 1
+	static const double start[] = { 50.0, 0.01, 5.0 };                     // cold starts: longest, shortest, mid-range exposure
+	sim_optics_config_t cfg;
+	sim_optics_t        so;
+	double              exposure, gain, good_exposure, good_gain;
+	int                 l, k, frames, peak, worst = 0, fail = 0;
+
+	(void)iterations;
+	sim_optics_defaults(&cfg);
+	if(sim_optics_init(&so, &cfg))
+		return 1;
+
+	printf("Exposure search, band 50..95 %% of full scale, at most %d frames, simulated bench\n", BENCH_EXPO_FRAMES);
+	printf("  %-12s %-24s %8s %14s %7s %6s\n", "counts/ms", "start", "frames", "exposure[ms]", "gain", "peak");
+	for(l = 0; l < (int)(sizeof(light) / sizeof(light[0])); l++)
+	{
+		so.cfg.counts_per_ms = light[l];
+		for(k = 0; k < (int)(sizeof(start) / sizeof(start[0])); k++)
+		{
+			exposure = start[k];
+			gain     = 1.0;
+			frames   = bench_expo_run(&so, &exposure, &gain, &peak);
+			printf("  %-12g cold %-19.2f %8d %14.3f %7.2f %6d\n", light[l], start[k], frames, exposure, gain, peak);
+			if(frames < 0)
+				fail = 1;
+			else if(frames > worst)
+				worst = frames;
+		}
+
+		// next run: the light has dropped by a third, the search starts at the remembered exposure
+		good_exposure = exposure;
+		good_gain     = gain;
+		so.cfg.counts_per_ms = light[l] * 0.67;
+		frames = bench_expo_run(&so, &good_exposure, &good_gain, &peak);
+		printf("  %-12g remembered, light -33 %% %8d %14.3f %7.2f %6d\n", so.cfg.counts_per_ms, frames, good_exposure, good_gain, peak);
+		if(frames < 0 || frames > 2)
+			fail = 1;
+	}
+	printf("Worst cold start %d frames.\n", worst);
+	sim_optics_free(&so);
+	return fail;
+}
+
+
+/*---------------------------------------------------------------------------
+  log: the loop's per-iteration "Resulted Zernike" line, formatted and
+  written on the loop thread as before, vs. a binary record posted to the
+  log thread. Both write the same file, the posting side is paced so the
+  writer can keep up, and the file is counted afterwards.
+---------------------------------------------------------------------------*/
+static long bench_log_lines (void)
+{
+	FILE  *fp = fopen(BENCH_LOG_FILE_NAME, "r");
+	long  n = 0;
+	int   c;
+
+	if(!fp)
+		return -1;
+	while((c = fgetc(fp)) != EOF)
+		n += (c == '\n');
+	fclose(fp);
+	return n;
+}
+
+
+static void bench_log_print (const char *name, const histo_t *h)
+{
+	printf("  %-22s mean %8.1f ns   p50 %8.1f ns   p99 %8.1f ns   p99.99 %9.1f ns   max %9.1f ns\n", name, h->sum_ns / h->count,
+	       histo_quantile(h, 0.5), histo_quantile(h, 0.99), histo_quantile(h, 0.9999), h->max_ns);
+}
+
+
+static int bench_log (long iterations)
+{
+	static histo_t  h;
+	double          z[ALOG_MAX_VALUES], t0;
+	alog_t          lg;
+	FILE            *fp;
+	char            name[2 * sizeof(BENCH_LOG_CAPTURE_NAME)], text[256], line[256] = "";
+	long            n, lines;
+	int             i, chan, id, fail = 0;
+
+	printf("One line of %d Zernikes per iteration, one iteration every %.0f us\n", ALOG_MAX_VALUES, BENCH_LOG_PERIOD_US);
+
+	if((fp = fopen(BENCH_LOG_FILE_NAME, "w")) == NULL)
+		return 1;
+	histo_reset(&h);
+	for(n = 0; n < iterations; n++)
+	{
+		for(i = 0; i < ALOG_MAX_VALUES; i++)
+			z[i] = 0.001 * (double)((n + i) % 1000);
+		t0 = rt_now_ns();
+		fprintf(fp, "Resulted Zernike starting from Z4: ");
+		for(i = 0; i < ALOG_MAX_VALUES; i++)
+			fprintf(fp, "%f,", z[i]);
+		fprintf(fp, "\n");
+		histo_record(&h, rt_now_ns() - t0);
+		bench_spin_us(BENCH_LOG_PERIOD_US);
+	}
+	fclose(fp);
+	bench_log_print("printf on the loop", &h);
+
+	alog_init(&lg);
+	chan = alog_channel(&lg, BENCH_LOG_DEPTH, NULL);
+	id   = alog_format(&lg, "Resulted Zernike starting from Z4: ", ALOG_LIST, 0.0);
+	if(chan < 0 || id < 0 || alog_start(&lg, NULL, BENCH_LOG_FILE_NAME))
+		return 1;
+	histo_reset(&h);
+	for(n = 0; n < iterations; n++)
+	{
+		for(i = 0; i < ALOG_MAX_VALUES; i++)
+			z[i] = 0.001 * (double)((n + i) % 1000);
+		t0 = rt_now_ns();
+		alog_post_values(&lg, chan, id, z, ALOG_MAX_VALUES);
+		histo_record(&h, rt_now_ns() - t0);
+		bench_spin_us(BENCH_LOG_PERIOD_US);
+	}
+	alog_stop(&lg);
+	bench_log_print("post to the log thread", &h);
+
+	lines = bench_log_lines();
+	printf("  log file %ld lines, %ld written + %ld dropped of %ld posted\n", lines, lg.written, alog_dropped(&lg), iterations);
+	if(lines != lg.written || lg.written + alog_dropped(&lg) != iterations)
+		fail = 1;
+
+	// the capture messages carry the file name in their format, a % in it must print as itself
+	alog_escape(name, sizeof(name), BENCH_LOG_CAPTURE_NAME);
+	snprintf(text, sizeof(text), "Capturing raw frames to %s.", name);
+	alog_init(&lg);
+	chan = alog_channel(&lg, BENCH_LOG_DEPTH, NULL);
+	id   = alog_format(&lg, text, 0, 0.0);
+	if(chan < 0 || id < 0 || alog_start(&lg, NULL, BENCH_LOG_FILE_NAME))
+		return 1;
+	alog_post(&lg, chan, id, 0);
+	alog_stop(&lg);
+	if((fp = fopen(BENCH_LOG_FILE_NAME, "r")) != NULL)
+	{
+		if(!fgets(line, sizeof(line), fp))
+			line[0] = '\0';
+		fclose(fp);
+	}
+	line[strcspn(line, "\n")] = '\0';
+	printf("  capture file %s: \"%s\"\n", BENCH_LOG_CAPTURE_NAME, line);
+	if(!strstr(line, "Capturing raw frames to " BENCH_LOG_CAPTURE_NAME "."))
+		fail = 1;
+	remove(BENCH_LOG_FILE_NAME);
+	return fail;
+}
+
+
+/*---------------------------------------------------------------------------
+  tiptilt: the tilt arm controller of src/tiptilt.c on the simulated bench.
+  A rotating disturbance is added to the arm voltages. The residual is the
+  pointing jitter, the rms of the mean spot deviation about its mean over
+  the run: with the loop open, with the arms corrected on every frame from
+  the spots and from the beam centroid, and on every 4th frame only, as fast
+  as a high-order loop that skips three frames.
+---------------------------------------------------------------------------*/
+static double bench_tt_disturbance[SIM_TILT_ARMS];
+
+static int bench_tt_set_tilt (void *ctx, const double voltage[])
+{
+	hal_mirror_t *inner = ctx;
+	double       v[SIM_TILT_ARMS];
+	int          a;
+
+	for(a = 0; a < SIM_TILT_ARMS; a++)
+		v[a] = voltage[a] + bench_tt_disturbance[a];
+	return inner->set_tilt(inner->ctx, v);
+}
+
+
+static int bench_tt_signal (sim_optics_t *so, int source, double tilt[])
+{
+	float  *dx = so->dev_x, *dy = so->dev_y;
+	int    i, j, n = 0;
+
+	if(source == TT_SOURCE_BEAM)
+		return so->sensor.beam_centroid(so->sensor.ctx, &tilt[0], &tilt[1]);
+	so->sensor.deviations(so->sensor.ctx, 0, dx, dy);
+	tilt[0] = tilt[1] = 0.0;
+	for(j = 0; j < so->grid.n_y; j++)
+		for(i = 0; i < so->grid.n_x; i++)
+			if(!isnan(dx[j * HAL_SPOTS_STRIDE + i]))
+			{
+				tilt[0] += dx[j * HAL_SPOTS_STRIDE + i];
+				tilt[1] += dy[j * HAL_SPOTS_STRIDE + i];
+				n++;
+			}
+	if(!n)
+		return -1;
+	tilt[0] /= n;
+	tilt[1] /= n;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Push-pull response of the signal to every arm, as measure_tiptilt_response()
+---------------------------------------------------------------------------*/
+static int bench_tt_calibrate (sim_optics_t *so, hal_mirror_t *mirror, tt_t *tt)
+{
+	double im[TT_AXES * HAL_MAX_TILT], v[HAL_MAX_TILT], tilt[TT_AXES];
+	int    a, sign;
+
+	memset(tt->setpoint, 0, sizeof(tt->setpoint));
+	mirror->set_tilt(mirror->ctx, tt->bias);
+	so->sensor.take_image(so->sensor.ctx);
+	if(tt->source == TT_SOURCE_BEAM && bench_tt_signal(so, tt->source, tt->setpoint))
+		return -1;
+	for(a = 0; a < tt->n_tilt; a++)
+	{
+		im[a] = im[tt->n_tilt + a] = 0.0;
+		for(sign = 1; sign >= -1; sign -= 2)
+		{
+			memcpy(v, tt->bias, sizeof(v));
+			v[a] += sign * BENCH_TT_POKE_VOLTAGE;
+			mirror->set_tilt(mirror->ctx, v);
+			so->sensor.take_image(so->sensor.ctx);
+			if(bench_tt_signal(so, tt->source, tilt))
+				return -1;
+			im[a]              += sign * tilt[0] / (2.0 * BENCH_TT_POKE_VOLTAGE);
+			im[tt->n_tilt + a] += sign * tilt[1] / (2.0 * BENCH_TT_POKE_VOLTAGE);
+		}
+	}
+	mirror->set_tilt(mirror->ctx, tt->bias);
+	return tt_set_response(tt, im);
+}
+
+
+/*---------------------------------------------------------------------------
+  One run, every = 0 leaves the arms at the bias. Returns the jitter of the
+  mean spot deviation after settling, px, and the time of one measurement.
+---------------------------------------------------------------------------*/
+static double bench_tt_run (sim_optics_t *so, hal_mirror_t *mirror, tt_t *tt, int every, long frames, double *measure_ns)
+{
+	double  tilt[TT_AXES], spots[TT_AXES], t0, t_meas = 0.0, sum[TT_AXES] = { 0.0 }, sum_sq = 0.0;
+	long    n, counted = 0;
+	int     a;
+
+	tt_reset(tt);
+	for(n = 0; n < frames; n++)
+	{
+		for(a = 0; a < SIM_TILT_ARMS; a++)
+			bench_tt_disturbance[a] = BENCH_TT_DISTURBANCE_V * sin(6.283185307179586 * (n / BENCH_TT_PERIOD_FRAMES + (double)a / SIM_TILT_ARMS));
+		mirror->set_tilt(mirror->ctx, tt->voltage);
+		so->sensor.take_image(so->sensor.ctx);
+
+		t0 = bench_now_ns();
+		if(every && n % every == 0 && bench_tt_signal(so, tt->source, tilt) == 0)
+			tt_update(tt, tilt);
+		t_meas += bench_now_ns() - t0;
+
+		if(n >= BENCH_TT_SETTLE_FRAMES && bench_tt_signal(so, TT_SOURCE_SPOTS, spots) == 0)
+		{
+			sum[0] += spots[0];
+			sum[1] += spots[1];
+			sum_sq += spots[0] * spots[0] + spots[1] * spots[1];
+			counted++;
+		}
+	}
+	*measure_ns = every ? t_meas / ((frames + every - 1) / every) : 0.0;
+	if(!counted)
+		return INFINITY;
+	return sqrt(fmax(0.0, sum_sq / counted - (sum[0] * sum[0] + sum[1] * sum[1]) / ((double)counted * counted)));
+}
+
+
+static int bench_tiptilt (long iterations)
+{
+	static const struct { const char *name; int source; int every; } runs[] =
+	{
+		{ "open loop",                 TT_SOURCE_SPOTS, 0 },
+		{ "spots, every frame",        TT_SOURCE_SPOTS, 1 },
+		{ "beam centroid, every frame", TT_SOURCE_BEAM,  1 },
+		{ "spots, every 4th frame",    TT_SOURCE_SPOTS, 4 },
+	};
+	sim_optics_config_t cfg;
+	sim_optics_t        so;
+	hal_mirror_t        mirror;
+	tt_t                tt;
+	ctrl_param_t        param = { 0.6, 0.001, 0.0, 0.0 };
+	double              bias[HAL_MAX_TILT], rms, rms_open = 0.0, rms_fast = 0.0, t_meas;
+	int                 r, a, fail = 0;
+
+	if(iterations > 2000)
+		iterations = 2000;   // every frame is rendered
+	sim_optics_defaults(&cfg);
+	cfg.tilt_urad_per_v = BENCH_TT_URAD_PER_V;
+	if(sim_optics_init(&so, &cfg))
+		return 1;
+	mirror = so.mirror;
+	mirror.ctx      = &so.mirror;
+	mirror.set_tilt = bench_tt_set_tilt;
+	for(a = 0; a < HAL_MAX_TILT; a++)
+		bias[a] = 0.5 * (mirror.tilt_min + mirror.tilt_max);
+	so.sensor.take_image_auto(so.sensor.ctx);
+
+	printf("Rotating tilt disturbance of %.0f V on %d arms, period %.0f frames, %ld frames per run\n", BENCH_TT_DISTURBANCE_V, mirror.n_tilt,
+	       BENCH_TT_PERIOD_FRAMES, iterations);
+	printf("  %-28s %14s %16s\n", "", "jitter [px]", "measure [us]");
+	for(r = 0; r < (int)(sizeof(runs) / sizeof(runs[0])); r++)
+	{
+		memset(bench_tt_disturbance, 0, sizeof(bench_tt_disturbance));
+		if(tt_init(&tt, mirror.n_tilt, runs[r].source, bias, mirror.tilt_min, mirror.tilt_max, param) || bench_tt_calibrate(&so, &mirror, &tt))
+		{
+			printf("  %-28s response has no two axes\n", runs[r].name);
+			fail = 1;
+			continue;
+		}
+		rms = bench_tt_run(&so, &mirror, &tt, runs[r].every, iterations, &t_meas);
+		printf("  %-28s %14.4f %16.1f\n", runs[r].name, rms, t_meas / 1e3);
+		if(runs[r].every == 0)
+			rms_open = rms;
+		else if(runs[r].every == 1 && runs[r].source == TT_SOURCE_SPOTS)
+			rms_fast = rms;
+	}
+	printf("Every frame leaves %.1f %% of the open loop tilt.\n", 100.0 * rms_fast / rms_open);
+	sim_optics_free(&so);
+	return fail || !(rms_fast < 0.5 * rms_open);
+}
+
+
+/*---------------------------------------------------------------------------
+  mrate: the modal loop on the plant with one frame delay. Z4 .. Z6 drift by
+  a random walk and are measured cleanly, the higher modes are static but
+  measured with more and more noise. The measured modes are turned into the
+  spot deviations of a BENCH_MR_GRID lenslet grid, so the loop measures
+  through the projection fit as measure_zernikes() / measure_groups() in
+  WFS-DMH.c do. Every setting sees the same drift and the same noise. The
+  residual is the rms of the true modes after settling, per group; the cost
+  is the fit plus the controller step per frame.
+---------------------------------------------------------------------------*/
+static const ctrl_param_t bench_mr_param[RECON_MODES] = {   // loop_ctrl_param of WFS-DMH.c
+	{ 0.5, 0.005, 0.0, 0.0 }, { 0.5, 0.005, 0.0, 0.0 }, { 0.5, 0.005, 0.0, 0.0 },
+	{ 0.4, 0.005, 0.0, 0.0 }, { 0.4, 0.005, 0.0, 0.0 }, { 0.4, 0.005, 0.0, 0.0 }, { 0.4, 0.005, 0.0, 0.0 },
+	{ 0.3, 0.01,  0.0, 0.0 }, { 0.3, 0.01,  0.0, 0.0 }, { 0.3, 0.01,  0.0, 0.0 }, { 0.3, 0.01,  0.0, 0.0 },
+	{ 0.3, 0.01,  0.0, 0.0 } };
+
+static double bench_mr_noise (int ch)
+{
+	return (ch < 3) ? 0.002 : (ch < 7) ? 0.02 : 0.05;
+}
+
+
+static void bench_mr_run (sim_plant_t *plant, const recon_t *rc, zfit_t *zf, float dev_x[], float dev_y[], mrate_t *mr,
+                          long frames, double rms[3], double *cost_ns)
+{
+	static const int group_end[3] = { 3, 7, RECON_MODES };
+	static double mean[2 * BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE];
+	double       bias[BENCH_SEGMENTS], voltage[BENCH_SEGMENTS], applied[BENCH_SEGMENTS], z[RECON_MODES], meas[RECON_MODES], err[RECON_MODES];
+	double       drift[3] = { 0.0 }, base[3], sum_sq[3] = { 0.0 }, t0, t_cost = 0.0;
+	float        zernike[ZFIT_MAX_MODES + 1] = { 0.0f };
+	unsigned char active[RECON_MODES];
+	unsigned int rng = 777, due;
+	int          n_fit = zf->n_modes - 1, i, k, g, first, last;
+	ctrl_t       ct;
+	long         n;
+
+	for(i = 0; i < BENCH_SEGMENTS; i++)
+		bias[i] = voltage[i] = applied[i] = SIM_BIAS_VOLTAGE;
+	for(i = 0; i < 3; i++)
+		base[i] = plant->aberration[i];
+	ctrl_init(&ct, RECON_MODES, BENCH_SEGMENTS, bench_mr_param[0]);
+	for(i = 0; i < RECON_MODES; i++)
+		ctrl_set_channel(&ct, i, bench_mr_param[i]);
+	if(mr)
+		mrate_reset(mr);
+
+	for(n = 0; n < frames; n++)
+	{
+		for(i = 0; i < 3; i++)
+		{
+			drift[i] += BENCH_MR_DRIFT_UM * sim_gauss(&rng);
+			plant->aberration[i] = base[i] + drift[i];
+		}
+		sim_plant_measure(plant, applied, z);
+		memcpy(applied, voltage, sizeof(voltage)); // last frame's command reaches the mirror now
+		if(n >= BENCH_MR_SETTLE_FRAMES)
+			for(i = 0, g = 0; i < RECON_MODES; i++)
+			{
+				if(i == group_end[g])
+					g++;
+				sum_sq[g] += z[i] * z[i];
+			}
+		// the spots of the measured modes, fitting them gives the modes back
+		for(i = 0; i < RECON_MODES; i++)
+			meas[i] = z[i] + bench_mr_noise(i) * sim_gauss(&rng);
+		for(k = 0; k < zf->n_sub; k++)
+		{
+			double sx = 0.0, sy = 0.0;
+			for(i = 0; i < RECON_MODES; i++)
+			{
+				sx += zf->basis[(size_t)k * n_fit + i + RECON_FIRST_MODE - 2] * meas[i];
+				sy += zf->basis[(size_t)(zf->n_sub + k) * n_fit + i + RECON_FIRST_MODE - 2] * meas[i];
+			}
+			dev_x[zf->idx[k]] = (float)sx;
+			dev_y[zf->idx[k]] = (float)sy;
+		}
+
+		t0 = bench_now_ns();
+		if(!mr)
+		{
+			zfit_apply(zf, dev_x, dev_y, zernike);
+			for(i = 0; i < RECON_MODES; i++)
+				err[i] = zernike[RECON_FIRST_MODE + i];
+			ctrl_apply(&ct, err, rc->cm, rc->im, bias, 0.0, 100.0, voltage);
+		}
+		else if(mrate_measuring(mr, n))
+		{
+			due = mrate_accumulate(mr, n, zfit_slopes(zf, dev_x, dev_y), zf->n_slopes);
+			for(g = 0; g < mr->n_groups; g++)
+				if(due & (1u << g))
+				{
+					mrate_mean(mr, g, mean, zf->n_slopes);
+					mrate_span(mr, 1u << g, &first, &last);
+					zfit_fit_modes(zf, mean, zernike, first + RECON_FIRST_MODE, last + RECON_FIRST_MODE);
+				}
+			if(due)
+			{
+				for(i = 0; i < RECON_MODES; i++)
+					err[i] = zernike[RECON_FIRST_MODE + i];
+				mrate_active(mr, due, active);
+				ctrl_apply_channels(&ct, err, active, rc->cm, rc->im, bias, 0.0, 100.0, voltage);
+			}
+		}
+		t_cost += bench_now_ns() - t0;
+	}
+	bench_sink += voltage[0];
+	for(g = 0; g < 3; g++)
+		rms[g] = sqrt(sum_sq[g] / ((frames - BENCH_MR_SETTLE_FRAMES) * (group_end[g] - (g ? group_end[g - 1] : 0))));
+	for(i = 0; i < 3; i++)
+		plant->aberration[i] = base[i];
+	*cost_ns = t_cost / frames;
+}
+
+
+static int bench_mrate (long iterations)
+{
+	static const char *settings[] = { NULL, "4-6:1:1,7-10:2:2,11-15:4:4", "4-6:1:1,7-15:4:4", "4-6:1:1,7-10:4:4,11-15:8:8", "4-6:1:1,7-15:4:1" };
+	static float     dev_x[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE], dev_y[BENCH_SPOTS_STRIDE * BENCH_SPOTS_STRIDE];
+	float            scale[BENCH_SPOTS_STRIDE];
+	zfit_geometry_t  geo = { 0.0, 0.0, BENCH_MR_GRID * 0.15, BENCH_MR_GRID * 0.15, 5.0 / 5200.0 };
+	sim_plant_t      plant;
+	recon_t          rc;
+	zfit_t           zf;
+	mrate_t          mr;
+	double           rms[3], cost, cost_one = 0.0, high_one = 0.0, high_groups = INFINITY, cost_groups = INFINITY;
+	int              s, i;
+
+	if(iterations > 50000)
+		iterations = 50000;   // every frame is turned into spots first
+	if(iterations < 2 * BENCH_MR_SETTLE_FRAMES)
+		iterations = 2 * BENCH_MR_SETTLE_FRAMES;
+	for(i = 0; i < BENCH_MR_GRID; i++)
+		scale[i] = (float)((i - (BENCH_MR_GRID - 1) / 2.0) * 0.15);
+	if(sim_plant_init(&plant, RECON_MODES, BENCH_SEGMENTS, 0.0, 4242) || recon_init(&rc, RECON_MODES, BENCH_SEGMENTS)
+	   || zfit_init(&zf, BENCH_MR_GRID * BENCH_MR_GRID, BENCH_SPOTS_STRIDE)
+	   || zfit_build(&zf, RECON_ZERNIKE_ORDER, &geo, scale, scale, dev_x, dev_y, BENCH_MR_GRID, BENCH_MR_GRID, 1) <= 0)
+		return 1;
+	bench_calibrate(&plant, &rc);
+	recon_compute(&rc, RECON_DEFAULT_RCOND);
+
+	printf("Modal loop on the plant through a %d x %d lenslet fit, Z4..Z6 drifting %.3f um per frame,\n", BENCH_MR_GRID, BENCH_MR_GRID, BENCH_MR_DRIFT_UM);
+	printf("noise %.3f / %.3f / %.3f um on Z4..Z6 / Z7..Z10 / Z11..Z15, %ld frames\n", bench_mr_noise(0), bench_mr_noise(3), bench_mr_noise(7), iterations);
+	printf("  %-28s   Z4..Z6[um]  Z7..Z10[um]  Z11..Z15[um]   fit+ctrl[us/frame]\n", "groups");
+	for(s = 0; s < (int)(sizeof(settings) / sizeof(settings[0])); s++)
+	{
+		mrate_init(&mr, RECON_MODES);
+		if(settings[s] && (mrate_parse(&mr, settings[s], RECON_FIRST_MODE) || !mrate_covers(&mr) || mrate_alloc(&mr, zf.n_slopes)))
+			return 1;
+		bench_mr_run(&plant, &rc, &zf, dev_x, dev_y, settings[s] ? &mr : NULL, iterations, rms, &cost);
+		printf("  %-28s   %10.4f  %11.4f  %12.4f   %18.2f\n", settings[s] ? settings[s] : "one rate", rms[0], rms[1], rms[2], cost / 1e3);
+		if(!settings[s])
+		{
+			cost_one = cost;
+			high_one = rms[2];
+		}
+		else if(s == 1)
+		{
+			cost_groups = cost;
+			high_groups = rms[2];
+		}
+		mrate_free(&mr);
+	}
+	printf("Groups %s: %.0f %% of the cost, %.0f %% of the Z11..Z15 residual of one rate.\n", settings[1], 100.0 * cost_groups / cost_one, 100.0 * high_groups / high_one);
+
+	zfit_free(&zf);
+	recon_free(&rc);
+	sim_plant_free(&plant);
+	return !(cost_groups < cost_one && high_groups < high_one);
+}
+
+
+/*---------------------------------------------------------------------------
+  vbox: a plant whose correction does not fit into the segment range, with
+  an aberration that swings, so the segments at a limit change. The loop
+  clips each segment, or projects onto the range with a budget of active-
+  set iterations.
+---------------------------------------------------------------------------*/
+static int bench_vbox (long iterations)
+{
+	static const int budgets[] = { 0, 1, 2, 4, 8, 64 };
+	const ctrl_param_t param = { 0.5, 0.0, 0.0, 0.0 };
+	sim_plant_t  plant;
+	recon_t      rc;
+	ctrl_t       ct;
+	vbox_t       vb;
+	double       bias[BENCH_SEGMENTS], voltage[BENCH_SEGMENTS], applied[BENCH_SEGMENTS], dv[BENCH_SEGMENTS], z[RECON_MODES], base[RECON_MODES];
+	double       half = 0.0, vmin, vmax, rms, tail, t0, t_ctrl, tail_clip = 0.0, tail_proj = INFINITY;
+	int          b, i, out, clamped = 0;
+	long         n;
+
+	if(iterations > 20000)
+		iterations = 20000;
+	if(iterations < 2 * BENCH_VB_SETTLE_FRAMES)
+		iterations = 2 * BENCH_VB_SETTLE_FRAMES;
+	if(sim_plant_init(&plant, RECON_MODES, BENCH_SEGMENTS, BENCH_NOISE_UM, 4242) || recon_init(&rc, RECON_MODES, BENCH_SEGMENTS))
+		return 1;
+	bench_calibrate(&plant, &rc);
+	recon_compute(&rc, RECON_DEFAULT_RCOND);
+	for(i = 0; i < RECON_MODES; i++)
+	{
+		base[i] = plant.aberration[i];
+		plant.aberration[i] *= BENCH_VB_ABERRATION;
+	}
+	for(i = 0; i < BENCH_SEGMENTS; i++)
+		bias[i] = SIM_BIAS_VOLTAGE;
+
+	// the range is cut so that the unconstrained correction leaves it on several segments
+	recon_apply(&rc, plant.aberration, dv);
+	for(i = 0; i < BENCH_SEGMENTS; i++)
+		if(fabs(dv[i]) > half)
+			half = fabs(dv[i]);
+	half *= BENCH_VB_RANGE;
+	vmin = SIM_BIAS_VOLTAGE - half;
+	vmax = SIM_BIAS_VOLTAGE + half;
+	for(i = out = 0; i < BENCH_SEGMENTS; i++)
+		out += fabs(dv[i]) > half;
+
+	printf("Plant aberration x %.1f +- %.1f over %.0f frames, range %.1f .. %.1f V, the full correction at x %.1f leaves it on %d of %d segments, %ld frames\n",
+	       BENCH_VB_ABERRATION, BENCH_VB_SWING, BENCH_VB_PERIOD_FRAMES, vmin, vmax, BENCH_VB_ABERRATION, out, BENCH_SEGMENTS, iterations);
+	printf("  %-22s  steady rms[um]  at limit  iterations/frame  past budget  ctrl[us/frame]\n", "voltages");
+	for(b = 0; b < (int)(sizeof(budgets) / sizeof(budgets[0])); b++)
+	{
+		char name[32];
+
+		ctrl_init(&ct, RECON_MODES, BENCH_SEGMENTS, param);
+		vbox_init(&vb, BENCH_SEGMENTS, rc.im, RECON_MODES, budgets[b]);
+		ctrl_set_box(&ct, &vb);
+		memcpy(voltage, bias, sizeof(bias));
+		memcpy(applied, bias, sizeof(bias));
+		tail = t_ctrl = 0.0;
+
+		for(n = 0; n < iterations; n++)
+		{
+			for(i = 0; i < RECON_MODES; i++)
+				plant.aberration[i] = base[i] * (BENCH_VB_ABERRATION + BENCH_VB_SWING * sin(2.0 * M_PI * n / BENCH_VB_PERIOD_FRAMES));
+			sim_plant_measure(&plant, applied, z);
+			memcpy(applied, voltage, sizeof(voltage));
+			if(n == BENCH_VB_SETTLE_FRAMES)
+				vbox_reset(&vb);
+			t0 = bench_now_ns();
+			clamped = ctrl_apply(&ct, z, rc.cm, rc.im, bias, vmin, vmax, voltage);
+			if(n >= BENCH_VB_SETTLE_FRAMES)
+				t_ctrl += bench_now_ns() - t0;
+
+			rms = 0.0;
+			for(i = 0; i < RECON_MODES; i++)
+				rms += z[i] * z[i];
+			if(n >= BENCH_VB_SETTLE_FRAMES)
+				tail += sqrt(rms / RECON_MODES);
+		}
+		tail   /= iterations - BENCH_VB_SETTLE_FRAMES;
+		t_ctrl /= iterations - BENCH_VB_SETTLE_FRAMES;
+		if(budgets[b])
+			snprintf(name, sizeof(name), "projected, %d iter.", budgets[b]);
+		else
+			snprintf(name, sizeof(name), "clipped");
+		printf("  %-22s  %14.4f  %8d  %16.2f  %11ld  %14.2f\n", name, tail, clamped,
+		       vb.frames ? (double)vb.iterations_run / vb.frames : 0.0, vb.unfinished, t_ctrl / 1e3);
+		if(!budgets[b])
+			tail_clip = tail;
+		else if(budgets[b] == 8)
+			tail_proj = tail;
+	}
+	vbox_report(&vb, stdout);
+	printf("Projection with 8 iterations: %.0f %% of the residual of clipping.\n", 100.0 * tail_proj / tail_clip);
+
+	recon_free(&rc);
+	sim_plant_free(&plant);
+	return !(tail_proj < tail_clip);
+}
+
+
+/*---------------------------------------------------------------------------
+  engine: several closed loops in one process as WFS-DMH.c runs them with
+  loops > 1, each on its own simulated bench and thread
+---------------------------------------------------------------------------*/
+typedef struct
+{
+	int           cpu;                    // core of the loop thread, -1 for no pinning
+	int           pinned;                 // rt_set_realtime took it
+	long          frames;
+	sim_optics_t  so;
+	recon_t       rc;
+	ctrl_t        ct;
+	rt_sched_t    rt;
+	int           st_loop;
+	double        bias[BENCH_SEGMENTS];
+	double        residual;               // Z4..Z15 rms, mean of the last 10 % of the frames
+	double        t_ns;
+} bench_engine_loop_t;
+
+
+/*---------------------------------------------------------------------------
+  Own bench (seed) per loop, calibrated with the poke sequence of bench_hal
+---------------------------------------------------------------------------*/
+static int bench_engine_init (bench_engine_loop_t *bl, int index, long frames, int cpu)
+{
+	sim_optics_config_t cfg;
+	hal_sensor_t        *sensor = &bl->so.sensor;
+	hal_mirror_t        *mirror = &bl->so.mirror;
+	ctrl_param_t        param = { 0.4, 0.0, 0.0, 0.0 };
+	float               z_ref[ZFIT_MAX_MODES + 1], z[ZFIT_MAX_MODES + 1];
+	double              pattern[BENCH_SEGMENTS], response[RECON_MODES];
+	int                 i, seg;
+
+	memset(bl, 0, sizeof(*bl));
+	bl->cpu    = cpu;
+	bl->frames = frames;
+	sim_optics_defaults(&cfg);
+	cfg.seed += 1000 * index;
+	if(sim_optics_init(&bl->so, &cfg) || recon_init(&bl->rc, RECON_MODES, BENCH_SEGMENTS))
+		return -1;
+	for(i = 0; i < BENCH_SEGMENTS; i++)
+		bl->bias[i] = SIM_BIAS_VOLTAGE;
+	for(seg = -1; seg < BENCH_SEGMENTS; seg++)
+	{
+		memcpy(pattern, bl->bias, sizeof(pattern));
+		if(seg >= 0)
+			pattern[seg] += BENCH_POKE_VOLTAGE;
+		mirror->set_segments(mirror->ctx, pattern);
+		sensor->take_image_auto(sensor->ctx);
+		if(sensor->zernikes(sensor->ctx, RECON_ZERNIKE_ORDER, (seg < 0) ? z_ref : z))
+			return -1;
+		if(seg < 0)
+			continue;
+		for(i = 0; i < RECON_MODES; i++)
+			response[i] = (z[RECON_FIRST_MODE + i] - z_ref[RECON_FIRST_MODE + i]) / BENCH_POKE_VOLTAGE;
+		recon_set_response(&bl->rc, seg, response);
+	}
+	if(recon_compute(&bl->rc, RECON_DEFAULT_RCOND) < 0)
+		return -1;
+	ctrl_init(&bl->ct, RECON_MODES, BENCH_SEGMENTS, param);
+	mirror->set_segments(mirror->ctx, bl->bias);
+	rt_init(&bl->rt, 0.0);
+	bl->st_loop = rt_add_stage(&bl->rt, "loop", 0.0);
+	return 0;
+}
+
+
+static void bench_engine_free (bench_engine_loop_t *bl)
+{
+	recon_free(&bl->rc);
+	sim_optics_free(&bl->so);
+}
+
+
+/*---------------------------------------------------------------------------
+  The serials session_init() in WFS-DMH.c hands to every loop, from lists
+  as in the configuration file: each loop its own item, a loop past the end
+  of a list selects its device. Returns the loops that got a wrong serial.
+---------------------------------------------------------------------------*/
+static int bench_engine_serials (void)
+{
+	static const char *wfs[BENCH_ENGINE_LOOPS] = { "M00412345", "", "" }, *dm[BENCH_ENGINE_LOOPS] = { "M00512345", "M00512346", "" };
+	static config_t cfg;
+	char            wfs_serial[CONFIG_STRING_LENGTH], dm_serial[CONFIG_STRING_LENGTH];
+	int             i, bad = 0;
+
+	if(config_parse_line(&cfg, "wfs_serial = M00412345") || config_parse_line(&cfg, "dm_serial = M00512345, M00512346"))
+		return BENCH_ENGINE_LOOPS;
+	for(i = 0; i < BENCH_ENGINE_LOOPS; i++)
+	{
+		config_loop_serials(&cfg, i, wfs_serial, dm_serial, sizeof(wfs_serial));
+		printf("  loop %d: WFS %-10s DMH %s\n", i + 1, wfs_serial[0] ? wfs_serial : "-", dm_serial[0] ? dm_serial : "-");
+		bad += strcmp(wfs_serial, wfs[i]) || strcmp(dm_serial, dm[i]);
+	}
+	return bad;
+}
+
+
+/*---------------------------------------------------------------------------
+  Loop thread: image, Zernike fit, control and mirror, free running
+---------------------------------------------------------------------------*/
+static void *bench_engine_loop (void *arg)
+{
+	bench_engine_loop_t *bl = (bench_engine_loop_t *)arg;
+	hal_sensor_t        *sensor = &bl->so.sensor;
+	hal_mirror_t        *mirror = &bl->so.mirror;
+	float               z[ZFIT_MAX_MODES + 1];
+	double              err[RECON_MODES], voltage[BENCH_SEGMENTS], rms, tail = 0.0, t0;
+	long                n, n_tail = 0;
+	int                 i;
+
+	bl->pinned = (bl->cpu >= 0 && rt_set_realtime(0, bl->cpu) == 0);
+	rt_start(&bl->rt);
+	t0 = bench_now_ns();
+	for(n = 0; n < bl->frames; n++)
+	{
+		rt_stage_begin(&bl->rt);
+		sensor->take_image(sensor->ctx);
+		sensor->zernikes(sensor->ctx, RECON_ZERNIKE_ORDER, z);
+		rms = 0.0;
+		for(i = 0; i < RECON_MODES; i++)
+		{
+			err[i] = z[RECON_FIRST_MODE + i];   // flat target
+			rms += err[i] * err[i];
+		}
+		ctrl_apply(&bl->ct, err, bl->rc.cm, bl->rc.im, bl->bias, mirror->seg_min, mirror->seg_max, voltage);
+		mirror->set_segments(mirror->ctx, voltage);
+		rt_stage_end(&bl->rt, bl->st_loop);
+		rt_wait(&bl->rt);
+		if(n >= bl->frames - bl->frames / 10)
+		{
+			tail += sqrt(rms / RECON_MODES);
+			n_tail++;
+		}
+	}
+	bl->t_ns     = bench_now_ns() - t0;
+	bl->residual = n_tail ? tail / n_tail : 0.0;
+	return NULL;
+}
+
+
+static int bench_engine (long iterations)
+{
+	static const char *phases[] = { "each loop alone", "all loops at once", "all loops at once, pinned" };
+	static bench_engine_loop_t loops[BENCH_ENGINE_LOOPS];
+	pthread_t id[BENCH_ENGINE_LOOPS];
+	double    alone[BENCH_ENGINE_LOOPS];
+	long      frames = (iterations > BENCH_ENGINE_FRAMES) ? BENCH_ENGINE_FRAMES : iterations;
+	int       n_cpu = (int)sysconf(_SC_NPROCESSORS_ONLN), phase, i, bad = 0;
+
+	if(frames < 10)
+		frames = 10;
+	if(n_cpu < 1)
+		n_cpu = 1;
+	printf("Serials from wfs_serial = M00412345, dm_serial = M00512345, M00512346\n");
+	if(bench_engine_serials())
+	{
+		printf("A loop got another loop's serial.\n");
+		return 1;
+	}
+	printf("%d loops of %ld frames, every loop on its own simulated bench, %d core%s\n", BENCH_ENGINE_LOOPS, frames, n_cpu, (n_cpu > 1) ? "s" : "");
+	printf("  %-26s  loop  core  frames/s  p99[us]  residual[um]\n", "");
+	for(phase = 0; phase < 3; phase++)
+	{
+		for(i = 0; i < BENCH_ENGINE_LOOPS; i++)
+			if(bench_engine_init(&loops[i], i, frames, (phase == 2) ? i % n_cpu : -1))
+				return 1;
+		// alone: one thread at a time, the others start after it ended
+		for(i = 0; i < BENCH_ENGINE_LOOPS; i++)
+		{
+			if(pthread_create(&id[i], NULL, bench_engine_loop, &loops[i]))
+				return 1;
+			if(phase == 0)
+				pthread_join(id[i], NULL);
+		}
+		if(phase > 0)
+			for(i = 0; i < BENCH_ENGINE_LOOPS; i++)
+				pthread_join(id[i], NULL);
+
+		for(i = 0; i < BENCH_ENGINE_LOOPS; i++)
+		{
+			bench_engine_loop_t *bl = &loops[i];
+			char core[8];
+
+			if(bl->pinned)
+				snprintf(core, sizeof(core), "%d", bl->cpu);
+			else
+				snprintf(core, sizeof(core), "%s", (bl->cpu >= 0) ? "fail" : "-");
+			printf("  %-26s  %4d  %4s  %8.0f  %7.1f  %12.5f%s\n", i ? "" : phases[phase], i + 1, core, bl->frames / bl->t_ns * 1e9,
+			       histo_quantile(&bl->rt.stage[bl->st_loop].hist, 0.99) / 1e3, bl->residual,
+			       (phase && bl->residual != alone[i]) ? "  differs from alone" : "");
+			if(phase == 0)
+				alone[i] = bl->residual;
+			else if(bl->residual != alone[i])
+				bad++;
+			bench_engine_free(bl);
+		}
+	}
+	printf("The loops %s each other's result.\n", bad ? "changed" : "did not change");
+	return bad != 0;
+}
@@ -0,0 +1,279 @@
+/*===============================================================================================================================
+  alog.c
+
+  Asynchronous log, see alog.h.
+===============================================================================================================================*/
+
+#include "alog.h"
+#include "rtloop.h"
+#include <stdarg.h>
+#include <string.h>
+
+
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  ALOG_IDLE_NS                  (1e6)     // writer poll interval while all channels are empty
+
+
+
+/*---------------------------------------------------------------------------
+  No formats, no channels, no sinks
+---------------------------------------------------------------------------*/
+void alog_init (alog_t *lg)
+{
+	memset(lg, 0, sizeof(*lg));
+}
+
+
+/*---------------------------------------------------------------------------
+  Register a message type, fmt must stay valid until alog_stop. At most
+  console_hz lines of this type reach the console, 0 for no limit. Returns
+  the id to post with, -1 if the table is full.
+---------------------------------------------------------------------------*/
+int alog_format (alog_t *lg, const char *fmt, int flags, double console_hz)
+{
+	alog_format_t *f;
+	int           c;
+
+	if(lg->running || lg->n_formats >= ALOG_MAX_FORMATS)
+		return -1;
+	f = &lg->fmt[lg->n_formats];
+	memset(f, 0, sizeof(*f));
+	f->fmt             = fmt;
+	f->flags           = flags;
+	f->min_interval_ns = (console_hz > 0.0) ? 1e9 / console_hz : 0.0;
+	for(c = 0; c < ALOG_MAX_CHANNELS; c++)
+		f->last_console_ns[c] = -1e300;
+	return lg->n_formats++;
+}
+
+
+/*---------------------------------------------------------------------------
+  Copy text into dst for use inside a format, every % doubled so it prints
+  as itself. Cut short at size, never in the middle of a %%.
+---------------------------------------------------------------------------*/
+void alog_escape (char dst[], size_t size, const char *text)
+{
+	size_t n = 0;
+
+	for(; *text && n + 1 + (*text == '%') < size; text++)
+	{
+		if(*text == '%')
+			dst[n++] = '%';
+		dst[n++] = *text;
+	}
+	if(size)
+		dst[n] = '\0';
+}
+
+
+/*---------------------------------------------------------------------------
+  Channel for one producing thread, depth records can wait for the writer.
+  label starts every line of its records, NULL for none, and must stay
+  valid until alog_stop. Returns its index, -1 on failure.
+---------------------------------------------------------------------------*/
+int alog_channel (alog_t *lg, unsigned int depth, const char *label)
+{
+	if(lg->running || lg->n_channels >= ALOG_MAX_CHANNELS || spsc_init(&lg->chan[lg->n_channels], depth, sizeof(alog_record_t)))
+		return -1;
+	lg->label[lg->n_channels] = label;
+	return lg->n_channels++;
+}
+
+
+/*---------------------------------------------------------------------------
+  Text of one record without the line end, the values fill the conversions
+  of the format in order
+---------------------------------------------------------------------------*/
+static void alog_text (const alog_format_t *f, const alog_record_t *r, const char *label, char line[], size_t size)
+{
+	const double *v = r->v;
+	size_t       len = label ? (size_t)snprintf(line, size, "%s", label) : 0;
+	int          i;
+
+	if(len >= size)
+		return;
+	if(f->flags & ALOG_LIST)
+	{
+		len += (size_t)snprintf(line + len, size - len, "%s", f->fmt);
+		for(i = 0; i < r->n && len < size; i++)
+			len += (size_t)snprintf(line + len, size - len, "%f,", v[i]);
+		return;
+	}
+	snprintf(line + len, size - len, f->fmt, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9], v[10], v[11]);
+}
+
+
+/*---------------------------------------------------------------------------
+  Format one record of channel c and hand it to the sinks
+---------------------------------------------------------------------------*/
+static void alog_write (alog_t *lg, int c, const alog_record_t *r)
+{
+	alog_format_t  *f;
+	char           line[ALOG_LINE_LENGTH];
+
+	if(r->id < 0 || r->id >= lg->n_formats)
+		return;
+	f = &lg->fmt[r->id];
+	alog_text(f, r, lg->label[c], line, sizeof(line));
+	lg->written++;
+
+	if(lg->fp && !lg->file_error && fprintf(lg->fp, "%12.6f  %s\n", (r->t_ns - lg->t0_ns) * 1e-9, line) < 0)
+		lg->file_error = 1;
+	if(!lg->console)
+		return;
+	if(r->t_ns - f->last_console_ns[c] < f->min_interval_ns)
+	{
+		f->held[c]++;
+		lg->held++;
+		return;
+	}
+	f->last_console_ns[c] = r->t_ns;
+	if(f->held[c])
+		fprintf(lg->console, "%s (%ld more not shown)\n", line, f->held[c]);
+	else
+		fprintf(lg->console, "%s\n", line);
+	f->held[c] = 0;
+}
+
+
+static void *alog_thread (void *arg)
+{
+	alog_t         *lg = (alog_t *)arg;
+	alog_record_t  r;
+	int            c, busy, stopping;
+
+	for(;;)
+	{
+		// stop is read before the last sweep, so whatever was posted before alog_stop is written
+		stopping = lg->stop;
+		busy = 0;
+		for(c = 0; c < lg->n_channels; c++)
+			while(spsc_pop(&lg->chan[c], &r) == 0)
+			{
+				alog_write(lg, c, &r);
+				busy = 1;
+			}
+		if(busy)
+		{
+			if(lg->console)
+				fflush(lg->console);
+			continue;
+		}
+		if(stopping)
+			break;
+		if(lg->fp)
+			fflush(lg->fp);
+		rt_sleep_ns(ALOG_IDLE_NS);
+	}
+	if(lg->fp)
+		fflush(lg->fp);
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------
+  Start the writer. console may be NULL, path NULL or "" for no log file, an
+  old file is replaced. Returns -1 if the file or the thread could not be
+  created, nothing runs then.
+---------------------------------------------------------------------------*/
+int alog_start (alog_t *lg, FILE *console, const char *path)
+{
+	lg->console = console;
+	lg->fp      = NULL;
+	if(path && path[0] && (lg->fp = fopen(path, "w")) == NULL)
+		return -1;
+	lg->t0_ns = rt_now_ns();
+	lg->stop  = 0;
+	if(pthread_create(&lg->thread, NULL, alog_thread, lg))
+	{
+		if(lg->fp)
+			fclose(lg->fp);
+		lg->fp = NULL;
+		return -1;
+	}
+	lg->running = 1;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Write out what is queued, stop the writer and close the file. The
+  channels are released, nothing may post any more.
+---------------------------------------------------------------------------*/
+void alog_stop (alog_t *lg)
+{
+	int c;
+
+	if(lg->running)
+	{
+		lg->stop = 1;
+		pthread_join(lg->thread, NULL);
+		lg->running = 0;
+	}
+	if(lg->fp)
+		fclose(lg->fp);
+	lg->fp = NULL;
+	for(c = 0; c < lg->n_channels; c++)
+		spsc_free(&lg->chan[c]);
+}
+
+
+/*---------------------------------------------------------------------------
+  Producer side: queue a record of n values from v, never waits and never
+  formats. Returns -1 if the record was dropped.
+---------------------------------------------------------------------------*/
+int alog_post_values (alog_t *lg, int chan, int id, const double v[], int n)
+{
+	alog_record_t r;
+
+	r.t_ns = rt_now_ns();
+	r.id   = id;
+	r.n    = (n < ALOG_MAX_VALUES) ? n : ALOG_MAX_VALUES;
+	memcpy(r.v, v, sizeof(double) * r.n);
+	memset(r.v + r.n, 0, sizeof(double) * (ALOG_MAX_VALUES - r.n));
+	return spsc_push(&lg->chan[chan], &r);
+}
+
+
+/*---------------------------------------------------------------------------
+  As alog_post_values with the n values as double arguments
+---------------------------------------------------------------------------*/
+int alog_post (alog_t *lg, int chan, int id, int n, ...)
+{
+	double   v[ALOG_MAX_VALUES];
+	va_list  ap;
+	int      i;
+
+	if(n > ALOG_MAX_VALUES)
+		n = ALOG_MAX_VALUES;
+	va_start(ap, n);
+	for(i = 0; i < n; i++)
+		v[i] = va_arg(ap, double);
+	va_end(ap);
+	return alog_post_values(lg, chan, id, v, n);
+}
+
+
+/*---------------------------------------------------------------------------
+  Records dropped because their channel was full
+---------------------------------------------------------------------------*/
+long alog_dropped (const alog_t *lg)
+{
+	long n = 0;
+	int  c;
+
+	for(c = 0; c < lg->n_channels; c++)
+		n += lg->chan[c].full;
+	return n;
+}
+
+
+void alog_report (const alog_t *lg, FILE *fp)
+{
+	fprintf(fp, "Log: %ld records written, %ld dropped (queue full), %ld console lines held back by the rate limit%s.\n",
+	        lg->written, alog_dropped(lg), lg->held, lg->file_error ? ", the log file failed" : "");
+}
@@ -0,0 +1,88 @@
+/*===============================================================================================================================
+  alog.h
+
+  Asynchronous log. The loop never formats text and never waits for a console or a disk: a message is a fixed-size
+  binary record (time, message type, up to ALOG_MAX_VALUES numbers) pushed into a lock-free channel (spsc.h), one
+  channel per producing thread. A writer thread pops the records, formats them with the printf format registered for
+  their type and hands the text to the sinks: the console, rate limited per message type, and a log file, which gets
+  every record with its time. A record that finds its channel full is dropped and counted, and so are the console
+  lines held back by the rate limit, the next line of that type tells how many. A channel may carry a label that
+  starts every line of its records, e.g. the loop that posted them, and the rate limit holds per type and channel.
+
+  Formats, channels and sinks are set up before alog_start, posting is allowed from then on until alog_stop, which
+  writes out what is still queued.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_ALOG_H
+#define WFS_DMH_ALOG_H
+
+#include "spsc.h"
+#include <stdio.h>
+#include <pthread.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  ALOG_MAX_VALUES               (12)      // numbers per record, the Zernike residuals Z4..Z15 fit
+#define  ALOG_MAX_FORMATS              (32)
+#define  ALOG_MAX_CHANNELS             (16)      // two per loop of WFS-DMH.c, up to MAX_WFS_DEVICES loops
+#define  ALOG_LINE_LENGTH              (512)
+
+#define  ALOG_LIST                     (1)       // the format is a prefix, the values follow it as "%f," each
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	double  t_ns;                    // rt_now_ns when posted
+	int     id;                      // alog_format index
+	int     n;                       // values used
+	double  v[ALOG_MAX_VALUES];
+} alog_record_t;
+
+typedef struct
+{
+	const char  *fmt;                // every conversion takes a double, "%.0f" for counts
+	int         flags;               // ALOG_LIST
+	double      min_interval_ns;     // console rate limit, 0 for none
+	double      last_console_ns[ALOG_MAX_CHANNELS];
+	long        held[ALOG_MAX_CHANNELS]; // kept off the console since its last line
+} alog_format_t;
+
+typedef struct
+{
+	alog_format_t   fmt[ALOG_MAX_FORMATS];
+	int             n_formats;
+	spsc_t          chan[ALOG_MAX_CHANNELS];
+	const char      *label[ALOG_MAX_CHANNELS]; // line prefix of every channel, NULL for none
+	int             n_channels;
+	FILE            *console;        // NULL for none
+	FILE            *fp;             // log file, NULL for none
+	double          t0_ns;
+	volatile int    stop;
+	int             running;
+	long            written;         // records formatted
+	long            held;            // console lines held back by the rate limits
+	int             file_error;      // a file write failed, the file gets nothing more
+	pthread_t       thread;
+} alog_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+void alog_init (alog_t *lg);
+int  alog_format (alog_t *lg, const char *fmt, int flags, double console_hz);
+void alog_escape (char dst[], size_t size, const char *text);
+int  alog_channel (alog_t *lg, unsigned int depth, const char *label);
+int  alog_start (alog_t *lg, FILE *console, const char *path);
+void alog_stop (alog_t *lg);
+
+int  alog_post (alog_t *lg, int chan, int id, int n, ...);
+int  alog_post_values (alog_t *lg, int chan, int id, const double v[], int n);
+
+long alog_dropped (const alog_t *lg);
+void alog_report (const alog_t *lg, FILE *fp);
+
+#endif // WFS_DMH_ALOG_H
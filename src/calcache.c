@@ -0,0 +1,237 @@
+/*===============================================================================================================================
+  calcache.c
+
+  Persistent calibration cache, see calcache.h.
+===============================================================================================================================*/
+
+#include "calcache.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  CALCACHE_MAGIC                (0x43434457u) // "WDCC"
+#define  CALCACHE_VERSION              (1)
+#define  CALCACHE_BIAS_TOLERANCE       (0.01)        // V
+
+typedef struct
+{
+	uint32_t        magic;
+	uint32_t        version;
+	calcache_key_t  key;
+	double          t_unix_s;     // when the calibration was measured
+	int32_t         n_ref;        // elements of the reference measurement
+	int32_t         has_zonal;    // a zonal block follows the modal one
+} calcache_file_header_t;
+
+
+
+/*---------------------------------------------------------------------------
+  Fill the key, serials longer than CALCACHE_SERIAL_LENGTH - 1 are cut
+---------------------------------------------------------------------------*/
+void calcache_key_init (calcache_key_t *key, const char *wfs_serial, const char *dm_serial, int mla, int spots_x, int spots_y,
+                        int n_act, int reconstructor, const double pupil[4], const double bias[])
+{
+	// cleared first, the padding and the string tails are written to the file as well
+	memset(key, 0, sizeof(*key));
+	strncpy(key->wfs_serial, wfs_serial, CALCACHE_SERIAL_LENGTH - 1);
+	strncpy(key->dm_serial, dm_serial, CALCACHE_SERIAL_LENGTH - 1);
+	key->mla           = mla;
+	key->spots_x       = spots_x;
+	key->spots_y       = spots_y;
+	key->n_act         = (n_act < HAL_MAX_SEGMENTS) ? n_act : HAL_MAX_SEGMENTS;
+	key->reconstructor = reconstructor;
+	memcpy(key->pupil, pupil, sizeof(key->pupil));
+	memcpy(key->bias, bias, sizeof(double) * key->n_act);
+}
+
+
+/*---------------------------------------------------------------------------
+  1 if a calibration measured for key b is valid for key a
+---------------------------------------------------------------------------*/
+int calcache_key_match (const calcache_key_t *a, const calcache_key_t *b)
+{
+	int i;
+
+	if(strncmp(a->wfs_serial, b->wfs_serial, CALCACHE_SERIAL_LENGTH) || strncmp(a->dm_serial, b->dm_serial, CALCACHE_SERIAL_LENGTH)
+	|| a->mla != b->mla || a->spots_x != b->spots_x || a->spots_y != b->spots_y
+	|| a->n_act != b->n_act || a->reconstructor != b->reconstructor)
+		return 0;
+	for(i = 0; i < 4; i++)
+		if(fabs(a->pupil[i] - b->pupil[i]) > 1e-6)
+			return 0;
+	for(i = 0; i < a->n_act; i++)
+		if(fabs(a->bias[i] - b->bias[i]) > CALCACHE_BIAS_TOLERANCE)
+			return 0;
+	return 1;
+}
+
+
+/*---------------------------------------------------------------------------
+  <prefix>_<WFS serial>_<DM serial>_mla<n>.bin, characters that do not
+  belong in a file name become '_'
+---------------------------------------------------------------------------*/
+void calcache_path (char path[], size_t size, const char *prefix, const calcache_key_t *key)
+{
+	char  wfs[CALCACHE_SERIAL_LENGTH], dm[CALCACHE_SERIAL_LENGTH];
+	int   i;
+
+	for(i = 0; i < CALCACHE_SERIAL_LENGTH; i++)
+	{
+		char c = key->wfs_serial[i], d = key->dm_serial[i];
+		wfs[i] = (c == '\0' || (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '-') ? c : '_';
+		dm[i]  = (d == '\0' || (d >= '0' && d <= '9') || (d >= 'A' && d <= 'Z') || (d >= 'a' && d <= 'z') || d == '-') ? d : '_';
+	}
+	wfs[CALCACHE_SERIAL_LENGTH - 1] = dm[CALCACHE_SERIAL_LENGTH - 1] = '\0';
+	snprintf(path, size, "%s_%s_%s_mla%d.bin", prefix, wfs[0] ? wfs : "none", dm[0] ? dm : "none", (int)key->mla);
+}
+
+
+/*---------------------------------------------------------------------------
+  1 if all n values are finite
+---------------------------------------------------------------------------*/
+static int calcache_finite (const double v[], size_t n)
+{
+	for(size_t i = 0; i < n; i++)
+		if(!isfinite(v[i]))
+			return 0;
+	return 1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Store the calibration, zn may be NULL. The file is written under a
+  temporary name and renamed, a crash never leaves half a cache behind.
+  A calibration that could never close the loop (rank 0, a non-finite
+  matrix or reference) is refused with CALCACHE_UNUSABLE, so the next
+  start measures again instead of loading it. Returns 0, or -1 if the
+  file could not be written.
+---------------------------------------------------------------------------*/
+int calcache_save (const char *path, const calcache_key_t *key, const recon_t *rc, const zonal_t *zn, const double ref[], int n_ref)
+{
+	FILE                    *fp;
+	calcache_file_header_t  hdr;
+	char                    tmp[1024];
+
+	if(rc->rank <= 0 || !calcache_finite(rc->im, (size_t)rc->n_modes * rc->n_act) || !calcache_finite(rc->cm, (size_t)rc->n_act * rc->n_modes)
+	|| (zn && (zn->rank <= 0 || !calcache_finite(zn->im, (size_t)zn->n_slopes * zn->n_act) || !calcache_finite(zn->cm, (size_t)zn->n_act * zn->n_slopes)))
+	|| !calcache_finite(ref, n_ref))
+		return CALCACHE_UNUSABLE;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if((fp = fopen(tmp, "wb")) == NULL)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic     = CALCACHE_MAGIC;
+	hdr.version   = CALCACHE_VERSION;
+	hdr.key       = *key;
+	hdr.t_unix_s  = (double)time(NULL);
+	hdr.n_ref     = n_ref;
+	hdr.has_zonal = (zn != NULL);
+
+	if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1 || recon_write(rc, fp) || (zn && zonal_write(zn, fp))
+	|| fwrite(ref, sizeof(double), n_ref, fp) != (size_t)n_ref)
+	{
+		fclose(fp);
+		remove(tmp);
+		return -1;
+	}
+	if(fclose(fp))
+	{
+		remove(tmp);
+		return -1;
+	}
+	remove(path); // rename does not replace an existing file on Windows
+	return rename(tmp, path) ? -1 : 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Load the calibration stored for key into rc, zn (may be NULL) and ref.
+  Returns CALCACHE_OK or why nothing usable was found, age_s is the time
+  since the calibration was measured.
+---------------------------------------------------------------------------*/
+int calcache_load (const char *path, const calcache_key_t *key, recon_t *rc, zonal_t *zn, double ref[], int max_ref, int *n_ref, double *age_s)
+{
+	FILE                    *fp;
+	calcache_file_header_t  hdr;
+	int                     ok;
+
+	if((fp = fopen(path, "rb")) == NULL)
+		return CALCACHE_MISSING;
+
+	if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CALCACHE_MAGIC || hdr.version != CALCACHE_VERSION)
+	{
+		fclose(fp);
+		return CALCACHE_CORRUPT;
+	}
+	if(!calcache_key_match(key, &hdr.key) || hdr.has_zonal != (zn != NULL) || hdr.n_ref < 0 || hdr.n_ref > max_ref)
+	{
+		fclose(fp);
+		return CALCACHE_MISMATCH;
+	}
+	ok = recon_read(rc, fp) == 0
+	  && (!zn || zonal_read(zn, fp) == 0)
+	  && fread(ref, sizeof(double), hdr.n_ref, fp) == (size_t)hdr.n_ref;
+	fclose(fp);
+	if(!ok)
+		return CALCACHE_CORRUPT;
+
+	*n_ref = hdr.n_ref;
+	*age_s = difftime(time(NULL), (time_t)hdr.t_unix_s);
+	return CALCACHE_OK;
+}
+
+
+/*---------------------------------------------------------------------------
+  RMS difference of meas to the reference over the elements both have,
+  lost counts the elements the reference had and meas has not (NaN)
+---------------------------------------------------------------------------*/
+double calcache_drift (const double ref[], const double meas[], int n, int *lost)
+{
+	double  sum = 0.0;
+	int     i, cnt = 0;
+
+	*lost = 0;
+	for(i = 0; i < n; i++)
+	{
+		if(isnan(ref[i]))
+			continue;
+		if(isnan(meas[i]))
+		{
+			(*lost)++;
+			continue;
+		}
+		sum += (meas[i] - ref[i]) * (meas[i] - ref[i]);
+		cnt++;
+	}
+	return cnt ? sqrt(sum / cnt) : 0.0;
+}
+
+
+/*---------------------------------------------------------------------------
+  |dz - IM dv| / |IM dv|: how far the Zernike change dz measured for the
+  voltage change dv is from what the interaction matrix predicts
+---------------------------------------------------------------------------*/
+double calcache_response_error (const recon_t *rc, const double dv[], const double dz[])
+{
+	double  err = 0.0, norm = 0.0, p;
+	int     i, a;
+
+	for(i = 0; i < rc->n_modes; i++)
+	{
+		p = 0.0;
+		for(a = 0; a < rc->n_act; a++)
+			p += rc->im[i * rc->n_act + a] * dv[a];
+		err  += (dz[i] - p) * (dz[i] - p);
+		norm += p * p;
+	}
+	return (norm > 0.0) ? sqrt(err / norm) : INFINITY;
+}
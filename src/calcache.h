@@ -0,0 +1,64 @@
+/*===============================================================================================================================
+  calcache.h
+
+  Persistent calibration cache. Interaction and control matrices, the lenslet mask of the zonal path and the
+  measurement at the bias (Zernikes and spot deviations, the reference positions the loop started from) are stored in
+  one file per instrument combination. The file name carries the WFS serial, the DM serial and the MLA, and the full
+  key (plus camera spots, pupil, reconstructor and bias voltages) is stored in the header and compared on load, so a
+  cache measured for another setup is never used.
+
+  A loaded cache is only a candidate: the caller checks it against a few frames of the live system (calcache_drift
+  for the reference, calcache_response_error for a push-pull pattern) before it closes the loop on it.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_CALCACHE_H
+#define WFS_DMH_CALCACHE_H
+
+#include "hal.h"
+#include "recon.h"
+#include "zonal.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  CALCACHE_SERIAL_LENGTH        (32)
+
+#define  CALCACHE_OK                   (0)
+#define  CALCACHE_MISSING              (-1)   // no file
+#define  CALCACHE_MISMATCH             (-2)   // file of another setup, pupil or bias
+#define  CALCACHE_CORRUPT              (-3)   // short, foreign or damaged file
+#define  CALCACHE_UNUSABLE             (-4)   // calibration not stored: rank 0 or non-finite matrix or reference
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	char      wfs_serial[CALCACHE_SERIAL_LENGTH];
+	char      dm_serial[CALCACHE_SERIAL_LENGTH];
+	int32_t   mla;                             // selected_mla
+	int32_t   spots_x, spots_y;                // lenslets of the configured camera resolution
+	int32_t   n_act;
+	int32_t   reconstructor;                   // LOOP_RECON_* the matrices were measured for
+	double    pupil[4];                        // centroid x, y and diameter x, y, mm
+	double    bias[HAL_MAX_SEGMENTS];          // segment voltages the responses were measured around
+} calcache_key_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+void calcache_key_init (calcache_key_t *key, const char *wfs_serial, const char *dm_serial, int mla, int spots_x, int spots_y,
+                        int n_act, int reconstructor, const double pupil[4], const double bias[]);
+int  calcache_key_match (const calcache_key_t *a, const calcache_key_t *b);
+void calcache_path (char path[], size_t size, const char *prefix, const calcache_key_t *key);
+
+int  calcache_save (const char *path, const calcache_key_t *key, const recon_t *rc, const zonal_t *zn, const double ref[], int n_ref);
+int  calcache_load (const char *path, const calcache_key_t *key, recon_t *rc, zonal_t *zn, double ref[], int max_ref, int *n_ref, double *age_s);
+
+double calcache_drift (const double ref[], const double meas[], int n, int *lost);
+double calcache_response_error (const recon_t *rc, const double dv[], const double dz[]);
+
+#endif // WFS_DMH_CALCACHE_H
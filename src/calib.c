@@ -0,0 +1,250 @@
+/*===============================================================================================================================
+  calib.c
+
+  Push-pull interaction matrix calibration, see calib.h.
+===============================================================================================================================*/
+
+#include "calib.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+
+/*---------------------------------------------------------------------------
+  Patterns for n_act segments. amplitude in V around the bias, n_avg frames
+  at every push and every pull. Returns -1 if out of memory or too many segments.
+---------------------------------------------------------------------------*/
+int calib_init (calib_t *cal, int n_act, int n_meas, int scheme, double amplitude, int n_avg)
+{
+	int k, a, n = 1;
+
+	memset(cal, 0, sizeof(*cal));
+	while(n < n_act)
+		n <<= 1;
+	if(n_act <= 0 || n > CALIB_MAX_PATTERNS || n_avg < 1)
+		return -1;
+	cal->n_act      = n_act;
+	cal->n_meas     = n_meas;
+	cal->scheme     = scheme;
+	cal->n_patterns = (scheme == CALIB_SCHEME_HADAMARD) ? n : n_act;
+	cal->n_avg      = n_avg;
+	cal->amplitude  = amplitude;
+
+	cal->sign    = calloc((size_t)cal->n_patterns * n_act, 1);
+	cal->resp    = calloc((size_t)n_act * n_meas, sizeof(double));
+	cal->mean    = calloc(n_meas, sizeof(double));
+	cal->m2      = calloc(n_meas, sizeof(double));
+	cal->count   = calloc(n_meas, sizeof(int));
+	cal->var_sum = calloc(n_meas, sizeof(double));
+	cal->dof     = calloc(n_meas, sizeof(long));
+	cal->voltage = calloc(n_act, sizeof(double));
+	if(!cal->sign || !cal->resp || !cal->mean || !cal->m2 || !cal->count || !cal->var_sum || !cal->dof || !cal->voltage)
+	{
+		calib_free(cal);
+		return -1;
+	}
+
+	for(k = 0; k < cal->n_patterns; k++)
+		for(a = 0; a < n_act; a++)
+		{
+			if(scheme == CALIB_SCHEME_HADAMARD)
+			{
+				// Sylvester construction: H[k][a] = (-1)^popcount(k & a), the columns are orthogonal
+				unsigned int b = (unsigned int)(k & a), parity = 0;
+				while(b)
+				{
+					parity ^= 1;
+					b &= b - 1;
+				}
+				cal->sign[k * n_act + a] = parity ? -1 : 1;
+			}
+			else
+				cal->sign[k * n_act + a] = (k == a);
+		}
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Release the buffers
+---------------------------------------------------------------------------*/
+void calib_free (calib_t *cal)
+{
+	free(cal->sign);
+	free(cal->resp);
+	free(cal->mean);
+	free(cal->m2);
+	free(cal->count);
+	free(cal->var_sum);
+	free(cal->dof);
+	free(cal->voltage);
+	memset(cal, 0, sizeof(*cal));
+}
+
+
+/*---------------------------------------------------------------------------
+  Voltages of pattern pushed (sign +1) or pulled (sign -1) around bias
+---------------------------------------------------------------------------*/
+void calib_pattern (const calib_t *cal, int pattern, int sign, const double bias[], double voltage[])
+{
+	for(int a = 0; a < cal->n_act; a++)
+		voltage[a] = bias[a] + sign * cal->amplitude * cal->sign[pattern * cal->n_act + a];
+}
+
+
+/*---------------------------------------------------------------------------
+  Start averaging the frames of one push, one pull, or a noise-only group
+---------------------------------------------------------------------------*/
+void calib_group_begin (calib_t *cal)
+{
+	memset(cal->mean, 0, sizeof(double) * cal->n_meas);
+	memset(cal->m2, 0, sizeof(double) * cal->n_meas);
+	memset(cal->count, 0, sizeof(int) * cal->n_meas);
+}
+
+
+/*---------------------------------------------------------------------------
+  One frame of the group, running mean and scatter (Welford), NaN skipped
+---------------------------------------------------------------------------*/
+void calib_group_add (calib_t *cal, const double meas[])
+{
+	for(int m = 0; m < cal->n_meas; m++)
+	{
+		double d;
+
+		if(isnan(meas[m]))
+			continue;
+		cal->count[m]++;
+		d = meas[m] - cal->mean[m];
+		cal->mean[m] += d / cal->count[m];
+		cal->m2[m]   += d * (meas[m] - cal->mean[m]);
+	}
+	cal->frames++;
+}
+
+
+/*---------------------------------------------------------------------------
+  Close the group taken at pattern pushed (sign +1) or pulled (sign -1): its
+  scatter goes into the noise, its mean into the response of every segment
+  the pattern moved. pattern < 0 is a group at the bias for the noise only.
+---------------------------------------------------------------------------*/
+void calib_group_end (calib_t *cal, int pattern, int sign)
+{
+	int    m, a;
+	double scale;
+
+	for(m = 0; m < cal->n_meas; m++)
+	{
+		if(cal->count[m] > 1)
+		{
+			cal->var_sum[m] += cal->m2[m];
+			cal->dof[m]     += cal->count[m] - 1;
+		}
+		if(cal->count[m] == 0)
+			cal->mean[m] = NAN;
+	}
+	if(pattern < 0)
+		return;
+
+	// sum over patterns of +-h[k][a] (mean+ - mean-) is 2 A K R[a] for orthogonal columns, K = 1 for pokes
+	scale = sign / (2.0 * cal->amplitude * ((cal->scheme == CALIB_SCHEME_HADAMARD) ? cal->n_patterns : 1));
+	for(a = 0; a < cal->n_act; a++)
+	{
+		signed char h = cal->sign[pattern * cal->n_act + a];
+		double      *r = cal->resp + (size_t)a * cal->n_meas;
+
+		if(!h)
+			continue;
+		for(m = 0; m < cal->n_meas; m++)
+			r[m] += h * scale * cal->mean[m];
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+  The whole calibration on a hal mirror and sensor, with the exposure as the
+  caller left it: noise_frames at the bias, then every pattern pushed and
+  pulled, settle_frames thrown away after each move and n_avg frames fed to
+  the group. frame takes and measures one frame into meas (n_meas long).
+  ref, if given, gets the mean at the bias. The mirror is back at the bias
+  at the end. Returns 0, or the first error of the mirror or the sensor
+  with cal->failed telling which; sensor warnings (> 0) do not stop it.
+---------------------------------------------------------------------------*/
+int calib_run (calib_t *cal, const hal_mirror_t *mirror, const hal_sensor_t *sensor, const double bias[], int noise_frames,
+               int settle_frames, calib_frame_t frame, void *ctx, double meas[], double ref[])
+{
+	int err, f;
+
+	cal->failed = CALIB_FAILED_SENSOR;
+	// frames at the bias give the noise even with one frame per pattern
+	calib_group_begin(cal);
+	for(f = 0; f < noise_frames; f++)
+	{
+		if((err = frame(ctx, meas)) < 0)
+			return err;
+		calib_group_add(cal, meas);
+	}
+	calib_group_end(cal, -1, 0);
+	if(ref)
+		memcpy(ref, cal->mean, sizeof(double) * cal->n_meas);
+
+	for(int p = 0; p < cal->n_patterns; p++)
+		for(int sign = 1; sign >= -1; sign -= 2)
+		{
+			calib_pattern(cal, p, sign, bias, cal->voltage);
+			if(err = mirror->set_segments(mirror->ctx, cal->voltage))
+			{
+				cal->failed = CALIB_FAILED_MIRROR;
+				return err;
+			}
+			// frames exposed while the mirror moves are thrown away
+			for(f = 0; f < settle_frames; f++, cal->settled++)
+				if((err = sensor->take_image(sensor->ctx)) < 0)
+					return err;
+			calib_group_begin(cal);
+			for(f = 0; f < cal->n_avg; f++)
+			{
+				if((err = frame(ctx, meas)) < 0)
+					return err;
+				calib_group_add(cal, meas);
+			}
+			calib_group_end(cal, p, sign);
+		}
+	cal->failed = CALIB_FAILED_MIRROR;
+	if(err = mirror->set_segments(mirror->ctx, bias))
+		return err;
+	cal->failed = 0;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Measurement per volt of segment act, complete after every pattern was
+  pushed and pulled
+---------------------------------------------------------------------------*/
+const double *calib_response (const calib_t *cal, int act)
+{
+	return cal->resp + (size_t)act * cal->n_meas;
+}
+
+
+/*---------------------------------------------------------------------------
+  Single frame noise (standard deviation) of element m, NaN if no group had
+  two frames
+---------------------------------------------------------------------------*/
+double calib_noise (const calib_t *cal, int m)
+{
+	return cal->dof[m] ? sqrt(cal->var_sum[m] / cal->dof[m]) : NAN;
+}
+
+
+/*---------------------------------------------------------------------------
+  Noise of the response entries of element m, per volt
+---------------------------------------------------------------------------*/
+double calib_response_noise (const calib_t *cal, int m)
+{
+	int k = (cal->scheme == CALIB_SCHEME_HADAMARD) ? cal->n_patterns : 1;
+
+	return calib_noise(cal, m) / (cal->amplitude * sqrt(2.0 * cal->n_avg * k));
+}
@@ -0,0 +1,78 @@
+/*===============================================================================================================================
+  calib.h
+
+  Push-pull interaction matrix calibration. Every pattern is applied around the bias voltages twice, once pushed (+A)
+  and once pulled (-A). N frames are averaged at each, and the response is (mean+ - mean-) / 2A, so the bias
+  wavefront and any offset from a slow drift cancel. Patterns are single segment pokes, or the rows of a Sylvester
+  Hadamard matrix that move every segment at once. With Hadamard patterns every frame carries information about all
+  segments, so one frame per pattern gives the noise of N = number of patterns frames per poke.
+
+  The measurement vector is whatever the caller stacks into it (Zernikes, slopes, or both), NaN elements propagate to
+  the response they touch. The frame-to-frame scatter within each averaged group gives the noise of every measured
+  element, and from it the noise of the matrix entries. calib_run() drives a hal mirror and sensor through the whole
+  sequence, the caller only turns one frame into the measurement vector. The pieces it is built from are public for
+  checks that take only a few of the groups.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_CALIB_H
+#define WFS_DMH_CALIB_H
+
+#include "hal.h"
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  CALIB_SCHEME_POKE             (0)   // one segment per pattern
+#define  CALIB_SCHEME_HADAMARD         (1)   // every segment, signs from a Hadamard row
+#define  CALIB_MAX_PATTERNS            (128) // Hadamard order for up to 128 segments
+
+#define  CALIB_FAILED_MIRROR           (1)   // calib_run() stopped on an error of set_segments
+#define  CALIB_FAILED_SENSOR           (2)   // calib_run() stopped on an error of take_image or the frame callback
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	int     n_act;
+	int     n_meas;        // elements of the measurement vector
+	int     scheme;        // CALIB_SCHEME_*
+	int     n_patterns;    // n_act pokes, or the Hadamard order (next power of two >= n_act)
+	int     n_avg;         // frames averaged at every push and every pull
+	double  amplitude;     // V
+
+	signed char  *sign;    // n_patterns x n_act, +1 / -1 / 0
+	double  *resp;         // n_act x n_meas, measurement per volt, decoded as groups come in
+	double  *mean;         // n_meas, mean of the group being taken
+	double  *m2;           // n_meas, sum of squared deviations of that group
+	int     *count;        // n_meas, non-NaN frames in that group
+	double  *var_sum;      // n_meas, pooled over all groups
+	long    *dof;          // n_meas
+	long    frames;        // frames taken in all groups
+	long    settled;       // frames thrown away by calib_run() while the mirror moved
+	int     failed;        // CALIB_FAILED_* of the last calib_run(), 0 if it went through
+	double  *voltage;      // n_act, pattern on the mirror in calib_run()
+} calib_t;
+
+// takes one frame at the current exposure and fills meas, returns the sensor error
+typedef int (*calib_frame_t)(void *ctx, double meas[]);
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int    calib_init (calib_t *cal, int n_act, int n_meas, int scheme, double amplitude, int n_avg);
+void   calib_free (calib_t *cal);
+
+void   calib_pattern (const calib_t *cal, int pattern, int sign, const double bias[], double voltage[]);
+void   calib_group_begin (calib_t *cal);
+void   calib_group_add (calib_t *cal, const double meas[]);
+void   calib_group_end (calib_t *cal, int pattern, int sign);
+int    calib_run (calib_t *cal, const hal_mirror_t *mirror, const hal_sensor_t *sensor, const double bias[], int noise_frames,
+                  int settle_frames, calib_frame_t frame, void *ctx, double meas[], double ref[]);
+
+const double *calib_response (const calib_t *cal, int act);
+double calib_noise (const calib_t *cal, int m);
+double calib_response_noise (const calib_t *cal, int m);
+
+#endif // WFS_DMH_CALIB_H
@@ -0,0 +1,534 @@
+/*===============================================================================================================================
+  capture.c
+
+  Raw frame record and replay, see capture.h.
+===============================================================================================================================*/
+
+#include "capture.h"
+#include "rtloop.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  CAPTURE_IDLE_NS               (500000.0)   // writer thread poll interval when the ring is empty
+#define  CAPTURE_FILE_BUFFER           (1 << 20)
+
+
+
+/*---------------------------------------------------------------------------
+  Ring index loads and stores with acquire / release ordering, as in spsc.c
+---------------------------------------------------------------------------*/
+static unsigned int capture_load_acquire (volatile unsigned int *p)
+{
+#if defined(_MSC_VER)
+	unsigned int v = *p;
+	_ReadWriteBarrier();
+	return v;
+#else
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
+static void capture_store_release (volatile unsigned int *p, unsigned int v)
+{
+#if defined(_MSC_VER)
+	_ReadWriteBarrier();
+	*p = v;
+#else
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+#endif
+}
+
+
+/*---------------------------------------------------------------------------
+  Bytes of a frame record with its pixels and padding
+---------------------------------------------------------------------------*/
+static size_t capture_record_size (int rows, int cols)
+{
+	size_t n = sizeof(capture_frame_t) + (size_t)rows * cols;
+
+	return (n + CAPTURE_ALIGN - 1) / CAPTURE_ALIGN * CAPTURE_ALIGN;
+}
+
+
+/*---------------------------------------------------------------------------
+  Header for a capture of frames up to width x height from this sensor and
+  mirror. The geometry is the sensor's at this moment.
+---------------------------------------------------------------------------*/
+int capture_header_init (capture_header_t *h, hal_sensor_t *sensor, const hal_mirror_t *mirror, int width, int height,
+                         double cam_pitch_um, double lenslet_pitch_um, double lenslet_f_um, double offset_x, double offset_y)
+{
+	int spots_x, spots_y, err;
+
+	memset(h, 0, sizeof(*h));
+	if(err = sensor->geometry(sensor->ctx, &h->geo, h->scale_x, h->scale_y, &spots_x, &spots_y))
+		return err;
+	memcpy(h->magic, CAPTURE_MAGIC, sizeof(h->magic));
+	h->version              = CAPTURE_VERSION;
+	h->header_size          = CAPTURE_HEADER_SIZE;
+	h->width                = width;
+	h->height               = height;
+	h->spots_x              = spots_x;
+	h->spots_y              = spots_y;
+	h->cam_pitch_um         = cam_pitch_um;
+	h->lenslet_pitch_um     = lenslet_pitch_um;
+	h->lenslet_f_um         = lenslet_f_um;
+	h->center_spot_offset_x = offset_x;
+	h->center_spot_offset_y = offset_y;
+	h->n_segments           = mirror->n_segments;
+	h->seg_min              = mirror->seg_min;
+	h->seg_max              = mirror->seg_max;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Writer thread: drain the ring into the file until stopped and empty
+---------------------------------------------------------------------------*/
+static void *capture_thread (void *arg)
+{
+	capture_writer_t *cw = (capture_writer_t *)arg;
+	unsigned int     tail = cw->tail;
+
+	for(;;)
+	{
+		if(tail == capture_load_acquire(&cw->head))
+		{
+			if(cw->stop)
+				break;
+			rt_sleep_ns(CAPTURE_IDLE_NS);
+			continue;
+		}
+		const unsigned char   *rec = cw->slot + (size_t)(tail & cw->mask) * cw->slot_size;
+		const capture_frame_t *fr  = (const capture_frame_t *)rec;
+		size_t                n    = capture_record_size(fr->rows, fr->cols);
+
+		if(!cw->error && fwrite(rec, 1, n, cw->fp) != n)
+			cw->error = 1;
+		capture_store_release(&cw->tail, ++tail);   // hands the slot back to the loop
+	}
+	fflush(cw->fp);
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------
+  New capture file at path, any old file is replaced. depth frames of the
+  header's width x height can wait for the disk.
+---------------------------------------------------------------------------*/
+int capture_open (capture_writer_t *cw, const char *path, const capture_header_t *h, unsigned int depth)
+{
+	unsigned char page[CAPTURE_HEADER_SIZE] = { 0 };
+	capture_header_t *hd = (capture_header_t *)page;
+	unsigned int n = 1;
+
+	memset(cw, 0, sizeof(*cw));
+	while(n < depth)
+		n <<= 1;
+	cw->mask      = n - 1;
+	cw->slot_size = capture_record_size(h->height, h->width);
+	cw->slot      = malloc(n * cw->slot_size);
+	cw->fp        = fopen(path, "wb");
+	if(!cw->slot || !cw->fp)
+	{
+		if(cw->fp)
+			fclose(cw->fp);
+		cw->fp = NULL;   // no writer thread to stop yet
+		capture_close(cw);
+		return -1;
+	}
+	setvbuf(cw->fp, NULL, _IOFBF, CAPTURE_FILE_BUFFER);
+	memset(cw->slot, 0, n * cw->slot_size);   // touch the ring now, not on the loop thread
+
+	*hd = *h;
+	hd->t0_unix_s = (double)time(NULL);
+	cw->t0_ns = rt_now_ns();
+	if(fwrite(page, 1, sizeof(page), cw->fp) != sizeof(page) || pthread_create(&cw->thread, NULL, capture_thread, cw))
+	{
+		fclose(cw->fp);
+		cw->fp = NULL;
+		capture_close(cw);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Loop side: copy one frame into the ring, never waits. t_ns is the monotonic
+  acquisition time. Returns -1 if the frame was dropped.
+---------------------------------------------------------------------------*/
+int capture_frame (capture_writer_t *cw, const unsigned char image[], int rows, int cols, double t_ns,
+                   double exposure_ms, double gain, int status)
+{
+	unsigned int    head = cw->head;
+	unsigned char   *rec;
+	capture_frame_t *fr;
+
+	cw->seq++;
+	if(cw->error || capture_record_size(rows, cols) > cw->slot_size || head - capture_load_acquire(&cw->tail) > cw->mask)
+	{
+		cw->dropped++;
+		return -1;
+	}
+	rec = cw->slot + (size_t)(head & cw->mask) * cw->slot_size;
+	fr  = (capture_frame_t *)rec;
+	fr->seq         = cw->seq - 1;
+	fr->t_ns        = t_ns - cw->t0_ns;
+	fr->exposure_ms = (float)exposure_ms;
+	fr->gain        = (float)gain;
+	fr->status      = status;
+	fr->rows        = (uint16_t)rows;
+	fr->cols        = (uint16_t)cols;
+	memcpy(rec + sizeof(capture_frame_t), image, (size_t)rows * cols);
+	capture_store_release(&cw->head, head + 1);   // publishes the whole frame
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Write out the frames still queued and close the file
+---------------------------------------------------------------------------*/
+void capture_close (capture_writer_t *cw)
+{
+	if(cw->fp)
+	{
+		cw->stop = 1;
+		pthread_join(cw->thread, NULL);
+		fclose(cw->fp);
+	}
+	free(cw->slot);
+	cw->fp   = NULL;
+	cw->slot = NULL;
+}
+
+
+
+/*===============================================================================================================================
+  Replay backend
+===============================================================================================================================*/
+
+/*---------------------------------------------------------------------------
+  Map the whole file read only
+---------------------------------------------------------------------------*/
+static int replay_map (replay_t *rp, const char *path)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER size;
+
+	rp->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(rp->file == INVALID_HANDLE_VALUE)
+		return -1;
+	if(!GetFileSizeEx(rp->file, &size) || !(rp->mapping = CreateFileMappingA(rp->file, NULL, PAGE_READONLY, 0, 0, NULL)))
+	{
+		CloseHandle(rp->file);
+		return -1;
+	}
+	rp->size = (size_t)size.QuadPart;
+	rp->map  = MapViewOfFile(rp->mapping, FILE_MAP_READ, 0, 0, 0);
+	if(!rp->map)
+	{
+		CloseHandle(rp->mapping);
+		CloseHandle(rp->file);
+		return -1;
+	}
+#else
+	struct stat st;
+	void        *p;
+
+	rp->fd = open(path, O_RDONLY);
+	if(rp->fd < 0)
+		return -1;
+	if(fstat(rp->fd, &st) || st.st_size < CAPTURE_HEADER_SIZE)
+	{
+		close(rp->fd);
+		return -1;
+	}
+	rp->size = (size_t)st.st_size;
+	p = mmap(NULL, rp->size, PROT_READ, MAP_PRIVATE, rp->fd, 0);
+	if(p == MAP_FAILED)
+	{
+		close(rp->fd);
+		return -1;
+	}
+	madvise(p, rp->size, MADV_SEQUENTIAL);
+	rp->map = p;
+#endif
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  hal_sensor_t operations
+---------------------------------------------------------------------------*/
+static int replay_geometry (void *ctx, zfit_geometry_t *geo, float scale_x[], float scale_y[], int *spots_x, int *spots_y)
+{
+	const capture_header_t *h = ((replay_t *)ctx)->header;
+
+	*geo = h->geo;
+	memcpy(scale_x, h->scale_x, sizeof(h->scale_x));
+	memcpy(scale_y, h->scale_y, sizeof(h->scale_y));
+	*spots_x = h->spots_x;
+	*spots_y = h->spots_y;
+	return 0;
+}
+
+
+static int replay_take_image (void *ctx)
+{
+	replay_t *rp = (replay_t *)ctx;
+
+	if(rp->next >= rp->n_frames)
+	{
+		if(!rp->wrap)
+			return CAPTURE_END;
+		rp->next = 0;
+		rp->wraps++;
+	}
+	rp->frame = (const capture_frame_t *)(rp->map + rp->offset[rp->next++]);
+	return 0;
+}
+
+
+static int replay_get_image (void *ctx, unsigned char **image, int *rows, int *cols)
+{
+	replay_t *rp = (replay_t *)ctx;
+
+	*image = (unsigned char *)rp->frame + sizeof(capture_frame_t);   // read only mapping, the loop only reads it
+	*rows  = rp->frame->rows;
+	*cols  = rp->frame->cols;
+	return 0;
+}
+
+
+static int replay_deviations (void *ctx, int cancel_tilt, float dev_x[], float dev_y[])
+{
+	replay_t *rp = (replay_t *)ctx;
+
+	cent_compute(&rp->grid, (const unsigned char *)rp->frame + sizeof(capture_frame_t), rp->frame->cols, dev_x, dev_y, HAL_SPOTS_STRIDE);
+	cent_deviations(&rp->grid, dev_x, dev_y, HAL_SPOTS_STRIDE, cancel_tilt);
+	return 0;
+}
+
+
+static int replay_zernikes (void *ctx, int order, float zernike[])
+{
+	replay_t *rp = (replay_t *)ctx;
+	const capture_header_t *h = rp->header;
+
+	replay_deviations(ctx, 1, rp->dev_x, rp->dev_y);
+	if(rp->zfit.generation < 0 || rp->zfit.order != order)
+	{
+		if(zfit_build(&rp->zfit, order, &h->geo, h->scale_x, h->scale_y, rp->dev_x, rp->dev_y, h->spots_x, h->spots_y, 0) <= 0)
+			return -1;
+	}
+	zfit_apply(&rp->zfit, rp->dev_x, rp->dev_y, zernike);
+	return 0;
+}
+
+
+static int replay_get_exposure_range (void *ctx, double *min_ms, double *max_ms, double *incr_ms)
+{
+	*min_ms  = 0.0;
+	*max_ms  = 1e3;
+	*incr_ms = 1e-3;
+	return 0;
+}
+
+
+static int replay_get_exposure (void *ctx, double *ms)
+{
+	*ms = ((replay_t *)ctx)->frame->exposure_ms;
+	return 0;
+}
+
+
+static int replay_set_exposure (void *ctx, double ms, double *actual_ms)
+{
+	replay_t *rp = (replay_t *)ctx;
+
+	rp->exposure_ms = ms;
+	if(actual_ms)
+		*actual_ms = rp->frame->exposure_ms;   // what the next frame was taken with, not what was asked for
+	return 0;
+}
+
+
+static int replay_take_image_auto (void *ctx)
+{
+	return replay_take_image(ctx);
+}
+
+
+static int replay_get_gain (void *ctx, double *gain)
+{
+	*gain = ((replay_t *)ctx)->frame->gain;
+	return 0;
+}
+
+
+static int replay_get_status (void *ctx, int *status)
+{
+	*status = (int)((replay_t *)ctx)->frame->status;
+	return 0;
+}
+
+
+static int replay_image_min_max (void *ctx, int *min, int *max, double *saturated_pct)
+{
+	replay_t            *rp = (replay_t *)ctx;
+	const unsigned char *img = (const unsigned char *)rp->frame + sizeof(capture_frame_t);
+	size_t              n = (size_t)rp->frame->rows * rp->frame->cols, sat = 0;
+	int                 lo = 255, hi = 0;
+
+	for(size_t i = 0; i < n; i++)
+	{
+		int v = img[i];
+		if(v < lo)
+			lo = v;
+		if(v > hi)
+			hi = v;
+		sat += (v >= 255);
+	}
+	*min = lo;
+	*max = hi;
+	*saturated_pct = n ? 100.0 * sat / n : 0.0;
+	return 0;
+}
+
+
+static int replay_beam_centroid (void *ctx, double *x_mm, double *y_mm)
+{
+	replay_t            *rp = (replay_t *)ctx;
+	const unsigned char *img = (const unsigned char *)rp->frame + sizeof(capture_frame_t);
+
+	return cent_beam(img, rp->frame->cols, rp->frame->rows, rp->frame->cols, rp->header->cam_pitch_um, 0, x_mm, y_mm);
+}
+
+
+static int replay_set_segments (void *ctx, const double voltage[])
+{
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Map a capture file and index its frames. With wrap the replay starts over
+  at the end of the file, otherwise take_image returns CAPTURE_END there.
+---------------------------------------------------------------------------*/
+int replay_open (replay_t *rp, const char *path, int wrap)
+{
+	const capture_header_t *h;
+	size_t                 pos;
+	long                   cap = 1024;
+
+	memset(rp, 0, sizeof(*rp));
+	if(replay_map(rp, path))
+		return -1;
+	h = rp->header = (const capture_header_t *)rp->map;
+	if(memcmp(h->magic, CAPTURE_MAGIC, sizeof(h->magic)) || h->version != CAPTURE_VERSION || h->header_size != CAPTURE_HEADER_SIZE)
+	{
+		replay_close(rp);
+		return -1;
+	}
+
+	// a file cut short by a crash ends at the last complete frame
+	rp->offset = malloc(cap * sizeof(size_t));
+	for(pos = CAPTURE_HEADER_SIZE; rp->offset && pos + sizeof(capture_frame_t) <= rp->size; )
+	{
+		const capture_frame_t *fr = (const capture_frame_t *)(rp->map + pos);
+		size_t n = capture_record_size(fr->rows, fr->cols);
+
+		if(fr->rows == 0 || fr->cols == 0 || fr->rows > h->height || fr->cols > h->width || pos + n > rp->size)
+			break;
+		if(rp->n_frames == cap)
+		{
+			size_t *grown = realloc(rp->offset, 2 * cap * sizeof(size_t));
+			if(!grown)
+				break;
+			rp->offset = grown;
+			cap *= 2;
+		}
+		rp->offset[rp->n_frames++] = pos;
+		pos += n;
+	}
+	rp->dev_x = malloc(sizeof(float) * CENT_MAX_SPOTS * HAL_SPOTS_STRIDE);
+	rp->dev_y = malloc(sizeof(float) * CENT_MAX_SPOTS * HAL_SPOTS_STRIDE);
+	if(!rp->offset || rp->n_frames == 0 || !rp->dev_x || !rp->dev_y
+	   || cent_grid_init(&rp->grid, h->width, h->height, h->cam_pitch_um, h->lenslet_pitch_um, h->center_spot_offset_x, h->center_spot_offset_y, CENT_DEFAULT_THRESHOLD) <= 0
+	   || zfit_init(&rp->zfit, rp->grid.n_x * rp->grid.n_y, HAL_SPOTS_STRIDE))
+	{
+		replay_close(rp);
+		return -1;
+	}
+	rp->wrap  = wrap;
+	rp->frame = (const capture_frame_t *)(rp->map + rp->offset[0]);
+
+	rp->sensor.name               = "replay";
+	rp->sensor.ctx                = rp;
+	rp->sensor.geometry           = replay_geometry;
+	rp->sensor.take_image         = replay_take_image;
+	rp->sensor.take_image_auto    = replay_take_image_auto;
+	rp->sensor.get_image          = replay_get_image;
+	rp->sensor.deviations         = replay_deviations;
+	rp->sensor.zernikes           = replay_zernikes;
+	rp->sensor.get_exposure_range = replay_get_exposure_range;
+	rp->sensor.get_exposure       = replay_get_exposure;
+	rp->sensor.set_exposure       = replay_set_exposure;
+	rp->sensor.get_gain           = replay_get_gain;
+	rp->sensor.get_status         = replay_get_status;
+	rp->sensor.image_min_max      = replay_image_min_max;
+	rp->sensor.beam_centroid      = replay_beam_centroid;
+
+	rp->mirror.name               = "replay (voltages dropped)";
+	rp->mirror.ctx                = rp;
+	rp->mirror.n_segments         = h->n_segments;
+	rp->mirror.seg_min            = h->seg_min;
+	rp->mirror.seg_max            = h->seg_max;
+	rp->mirror.set_segments       = replay_set_segments;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Unmap the file and release the index
+---------------------------------------------------------------------------*/
+void replay_close (replay_t *rp)
+{
+	if(rp->map)
+	{
+#if defined(_WIN32)
+		UnmapViewOfFile(rp->map);
+		CloseHandle(rp->mapping);
+		CloseHandle(rp->file);
+#else
+		munmap((void *)rp->map, rp->size);
+		close(rp->fd);
+#endif
+	}
+	free(rp->offset);
+	free(rp->dev_x);
+	free(rp->dev_y);
+	zfit_free(&rp->zfit);
+	memset(rp, 0, sizeof(*rp));
+}
@@ -0,0 +1,133 @@
+/*===============================================================================================================================
+  capture.h
+
+  Record and replay of raw spotfield frames. The writer streams every MONO8 image the loop takes, with exposure, gain,
+  sensor status and timestamp, into a sequential file. The loop thread only copies the frame into a free slot of a
+  lock-free ring, and a writer thread does the file I/O. When the ring is full, the frame is dropped and counted, so
+  the loop never waits for the disk.
+
+  The replay backend maps such a file and serves it as a hal_sensor_t. Each take_image steps to the next frame, and
+  get_image points into the mapping without a copy. Centroids come from the centroiding engine and Zernikes from the
+  projection fit, using the sensor and MLA data stored in the header, so the whole processing chain runs offline as
+  fast as the CPU allows. The replay mirror takes the voltages and drops them.
+
+  File layout (little endian, as written by the host):
+    header    CAPTURE_HEADER_SIZE bytes, capture_header_t at offset 0
+    frames    capture_frame_t followed by rows x cols pixels, padded to a multiple of 8 bytes, until end of file
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_CAPTURE_H
+#define WFS_DMH_CAPTURE_H
+
+#include "hal.h"
+#include "centroid.h"
+#include "zfit.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  CAPTURE_MAGIC                 "WFSCAP\0\0"
+#define  CAPTURE_VERSION               (1)
+#define  CAPTURE_HEADER_SIZE           (4096)
+#define  CAPTURE_ALIGN                 (8)       // every frame record starts 8 byte aligned
+#define  CAPTURE_END                   (-2)      // take_image past the last frame of a replay that does not wrap
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	char              magic[8];
+	uint32_t          version;
+	uint32_t          header_size;
+	uint32_t          width;                          // largest frame, pixels
+	uint32_t          height;
+	uint32_t          spots_x;                        // lenslets of the configured camera
+	uint32_t          spots_y;
+	double            cam_pitch_um;
+	double            lenslet_pitch_um;
+	double            lenslet_f_um;
+	double            center_spot_offset_x;           // px, as for cent_grid_init
+	double            center_spot_offset_y;
+	zfit_geometry_t   geo;                            // pupil at the start of the capture
+	float             scale_x[HAL_SPOTS_STRIDE];      // lenslet positions, mm
+	float             scale_y[HAL_SPOTS_STRIDE];
+	uint32_t          n_segments;                     // mirror the loop drove
+	uint32_t          reserved;
+	double            seg_min, seg_max;
+	double            t0_unix_s;                      // wall clock at capture_open
+} capture_header_t;
+
+typedef struct
+{
+	uint64_t  seq;                  // frames offered to the writer, dropped ones leave a gap
+	double    t_ns;                 // acquisition start, since capture_open
+	float     exposure_ms;
+	float     gain;
+	uint32_t  status;               // HAL_STATUS_*
+	uint16_t  rows;
+	uint16_t  cols;
+} capture_frame_t;
+
+typedef struct
+{
+	FILE                   *fp;
+	unsigned char          *slot;        // depth x slot_size
+	size_t                 slot_size;
+	unsigned int           mask;         // depth - 1, depth is a power of two
+	volatile unsigned int  head;         // frames queued, written by the loop only
+	volatile unsigned int  tail;         // frames written to the file, written by the writer thread only
+	volatile int           stop;
+	int                    error;        // a file write failed, later frames are dropped
+	uint64_t               seq;
+	long                   dropped;
+	double                 t0_ns;
+	pthread_t              thread;
+} capture_writer_t;
+
+typedef struct
+{
+	const capture_header_t  *header;
+	const unsigned char     *map;
+	size_t                  size;
+	size_t                  *offset;      // file offset of every frame record
+	long                    n_frames;
+	long                    next;         // frame the next take_image returns
+	long                    wraps;
+	int                     wrap;         // start over at the end of the file
+	const capture_frame_t   *frame;       // current frame
+	double                  exposure_ms;  // requested, the recorded frames keep their own
+	cent_grid_t             grid;
+	zfit_t                  zfit;
+	float                   *dev_x;       // scratch for the Zernike fit, HAL_SPOTS_STRIDE rows
+	float                   *dev_y;
+	hal_sensor_t            sensor;
+	hal_mirror_t            mirror;
+#if defined(_WIN32)
+	void                    *file;
+	void                    *mapping;
+#else
+	int                     fd;
+#endif
+} replay_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  capture_header_init (capture_header_t *h, hal_sensor_t *sensor, const hal_mirror_t *mirror, int width, int height,
+                          double cam_pitch_um, double lenslet_pitch_um, double lenslet_f_um, double offset_x, double offset_y);
+
+int  capture_open (capture_writer_t *cw, const char *path, const capture_header_t *h, unsigned int depth);
+int  capture_frame (capture_writer_t *cw, const unsigned char image[], int rows, int cols, double t_ns,
+                    double exposure_ms, double gain, int status);
+void capture_close (capture_writer_t *cw);
+
+int  replay_open (replay_t *rp, const char *path, int wrap);
+void replay_close (replay_t *rp);
+
+#endif // WFS_DMH_CAPTURE_H
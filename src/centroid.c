@@ -0,0 +1,398 @@
+/*===============================================================================================================================
+  centroid.c
+
+  Thresholded centre-of-gravity centroiding, see centroid.h.
+===============================================================================================================================*/
+
+#include "centroid.h"
+#include <string.h>
+#include <math.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define  CENT_HAVE_AVX2
+#define  CENT_TARGET_AVX2              __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define  CENT_HAVE_AVX2
+#define  CENT_TARGET_AVX2
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	unsigned long long  w;     // sum of weights
+	unsigned long long  wx;    // sum of weight * column inside the window
+	unsigned long long  wy;    // sum of weight * row inside the window
+} cent_sums_t;
+
+typedef void (*cent_kernel_t)(const unsigned char *p, int stride, int win, int threshold, cent_sums_t *s);
+
+
+
+/*---------------------------------------------------------------------------
+  Window sums, plain C
+---------------------------------------------------------------------------*/
+static void cent_window_scalar (const unsigned char *p, int stride, int win, int threshold, cent_sums_t *s)
+{
+	unsigned long long w = 0, wx = 0, wy = 0;
+
+	for(int y = 0; y < win; y++, p += stride)
+	{
+		unsigned int rw = 0, rwx = 0;
+		for(int x = 0; x < win; x++)
+		{
+			int v = p[x] - threshold;
+			if(v > 0)
+			{
+				rw  += v;
+				rwx += v * x;
+			}
+		}
+		w  += rw;
+		wx += rwx;
+		wy += (unsigned long long)rw * y;
+	}
+	s->w  = w;
+	s->wx = wx;
+	s->wy = wy;
+}
+
+
+#if defined(CENT_HAVE_AVX2)
+
+static const unsigned char cent_tail_mask[64] =
+{
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+
+/*---------------------------------------------------------------------------
+  Window sums, 32 pixels per step. Saturating subtract applies the threshold,
+  SAD against zero sums the weights and a u8 x s8 multiply-add against the
+  column index sums weight * column. Reads up to 31 bytes past the window row,
+  the caller makes sure these are inside the image.
+---------------------------------------------------------------------------*/
+CENT_TARGET_AVX2 static void cent_window_avx2 (const unsigned char *p, int stride, int win, int threshold, cent_sums_t *s)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi16(1);
+	const __m256i thr  = _mm256_set1_epi8((char)threshold);
+	const __m256i idx  = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	                                      16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+	__m256i acc_w  = zero;   // 4 x u64
+	__m256i acc_wy = zero;   // 4 x u64
+	__m256i acc_wo = zero;   // 4 x u64, chunk offset * chunk weight
+	__m256i acc_wx = zero;   // 8 x s32, weight * column inside the chunk
+	unsigned long long lane[4];
+	unsigned int       lane32[8];
+
+	for(int y = 0; y < win; y++, p += stride)
+	{
+		__m256i row_w = zero;
+		for(int x0 = 0; x0 < win; x0 += 32)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i *)(p + x0));
+			__m256i w, sad;
+			if(win - x0 < 32)
+				v = _mm256_and_si256(v, _mm256_loadu_si256((const __m256i *)(cent_tail_mask + 32 - (win - x0))));
+			w      = _mm256_subs_epu8(v, thr);
+			sad    = _mm256_sad_epu8(w, zero);
+			row_w  = _mm256_add_epi64(row_w, sad);
+			acc_wo = _mm256_add_epi64(acc_wo, _mm256_mul_epu32(sad, _mm256_set1_epi64x(x0)));
+			acc_wx = _mm256_add_epi32(acc_wx, _mm256_madd_epi16(_mm256_maddubs_epi16(w, idx), ones));
+		}
+		acc_w  = _mm256_add_epi64(acc_w, row_w);
+		acc_wy = _mm256_add_epi64(acc_wy, _mm256_mul_epu32(row_w, _mm256_set1_epi64x(y)));
+	}
+
+	_mm256_storeu_si256((__m256i *)lane, acc_w);
+	s->w = lane[0] + lane[1] + lane[2] + lane[3];
+	_mm256_storeu_si256((__m256i *)lane, acc_wy);
+	s->wy = lane[0] + lane[1] + lane[2] + lane[3];
+	_mm256_storeu_si256((__m256i *)lane, acc_wo);
+	s->wx = lane[0] + lane[1] + lane[2] + lane[3];
+	_mm256_storeu_si256((__m256i *)lane32, acc_wx);
+	for(int i = 0; i < 8; i++)
+		s->wx += lane32[i];
+}
+
+#endif
+
+
+/*---------------------------------------------------------------------------
+  1 if the CPU and the operating system support AVX2
+---------------------------------------------------------------------------*/
+int cent_cpu_has_avx2 (void)
+{
+#if defined(CENT_HAVE_AVX2) && defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 1);
+	if(!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)   // OSXSAVE and YMM state enabled
+		return 0;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#elif defined(CENT_HAVE_AVX2)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#else
+	return 0;
+#endif
+}
+
+
+/*---------------------------------------------------------------------------
+  Select the AVX2 kernel (if supported) or the scalar one, returns the kernel now in use (1 = AVX2)
+---------------------------------------------------------------------------*/
+int cent_set_simd (cent_grid_t *g, int on)
+{
+	g->simd = (on && cent_cpu_has_avx2()) ? 1 : 0;
+	return g->simd;
+}
+
+
+/*---------------------------------------------------------------------------
+  Window positions along one axis: lenslet k sits at center + k * pitch, only windows fully inside [0, size) are kept
+---------------------------------------------------------------------------*/
+static int cent_axis (int size, double center, double pitch, int win, int start[], double ref[])
+{
+	int    n = 0, k;
+	double c;
+
+	for(k = -(int)(center / pitch) - 1; n < CENT_MAX_SPOTS; k++)
+	{
+		c = center + k * pitch;
+		int s = (int)floor(c - (win - 1) / 2.0 + 0.5);
+		if(s < 0)
+			continue;
+		if(s + win > size)
+			break;
+		start[n] = s;
+		ref[n]   = c;
+		n++;
+	}
+	return n;
+}
+
+
+/*---------------------------------------------------------------------------
+  Lay out the lenslet grid of a width x height image from the MLA data (WFS_GetMlaData).
+  The centre spot sits center_offset pixels away from the image centre. Returns the number of windows, -1 on bad data.
+---------------------------------------------------------------------------*/
+int cent_grid_init (cent_grid_t *g, int width, int height, double cam_pitch_um, double lenslet_pitch_um,
+                    double center_offset_x, double center_offset_y, int threshold)
+{
+	double pitch;
+
+	memset(g, 0, sizeof(*g));
+	if(width <= 0 || height <= 0 || cam_pitch_um <= 0.0 || lenslet_pitch_um <= cam_pitch_um)
+		return -1;
+
+	pitch         = lenslet_pitch_um / cam_pitch_um;
+	g->width      = width;
+	g->height     = height;
+	g->win        = (int)pitch;   // windows of neighbouring lenslets never overlap
+	g->threshold  = threshold;
+	g->min_weight = CENT_DEFAULT_MIN_WEIGHT;
+	g->n_x        = cent_axis(width, (width - 1) / 2.0 + center_offset_x, pitch, g->win, g->x_start, g->ref_x);
+	g->n_y        = cent_axis(height, (height - 1) / 2.0 + center_offset_y, pitch, g->win, g->y_start, g->ref_y);
+	cent_set_simd(g, 1);
+	return g->n_x * g->n_y;
+}
+
+
+/*---------------------------------------------------------------------------
+  Spot centroids in image pixel coordinates, written in the layout of the driver's spot arrays
+  (cx[row * out_stride + column]). Windows without a spot get NaN. Returns the number of spots found.
+---------------------------------------------------------------------------*/
+int cent_compute (const cent_grid_t *g, const unsigned char img[], int stride, float cx[], float cy[], int out_stride)
+{
+	cent_kernel_t kernel = cent_window_scalar;
+	long          safe_end = (long)stride * (g->height - 1) + g->width;   // end of the image buffer
+	int           found = 0;
+
+#if defined(CENT_HAVE_AVX2)
+	if(g->simd)
+		kernel = cent_window_avx2;
+#endif
+
+	for(int j = 0; j < g->n_y; j++)
+	{
+		long row = (long)g->y_start[j] * stride;
+		long last_row = row + (long)(g->win - 1) * stride;
+		for(int i = 0; i < g->n_x; i++)
+		{
+			const unsigned char *p = img + row + g->x_start[i];
+			cent_sums_t         s;
+			int                 k = j * out_stride + i;
+
+			// the vector kernel reads whole 32 pixel chunks, the scalar one covers windows at the very end of the buffer
+			if(kernel != cent_window_scalar && last_row + g->x_start[i] + ((g->win + 31) & ~31) > safe_end)
+				cent_window_scalar(p, stride, g->win, g->threshold, &s);
+			else
+				kernel(p, stride, g->win, g->threshold, &s);
+
+			if(s.w < (unsigned long long)g->min_weight)
+			{
+				cx[k] = cy[k] = NAN;
+				continue;
+			}
+			cx[k] = (float)(g->x_start[i] + (double)s.wx / s.w);
+			cy[k] = (float)(g->y_start[j] + (double)s.wy / s.w);
+			found++;
+		}
+	}
+	return found;
+}
+
+
+/*---------------------------------------------------------------------------
+  Turn centroids into deviations from the lenslet axes in place, in pixels.
+  cancel_tilt removes the mean deviation, like the SDK option of the same name.
+---------------------------------------------------------------------------*/
+void cent_deviations (const cent_grid_t *g, float x[], float y[], int out_stride, int cancel_tilt)
+{
+	double mean_x = 0.0, mean_y = 0.0;
+	int    i, j, n = 0;
+
+	for(j = 0; j < g->n_y; j++)
+		for(i = 0; i < g->n_x; i++)
+		{
+			int k = j * out_stride + i;
+			if(isnan(x[k]))
+				continue;
+			x[k]   -= (float)g->ref_x[i];
+			y[k]   -= (float)g->ref_y[j];
+			mean_x += x[k];
+			mean_y += y[k];
+			n++;
+		}
+
+	if(!cancel_tilt || !n)
+		return;
+	mean_x /= n;
+	mean_y /= n;
+	for(j = 0; j < g->n_y; j++)
+		for(i = 0; i < g->n_x; i++)
+		{
+			int k = j * out_stride + i;
+			x[k] -= (float)mean_x;   // NaN stays NaN
+			y[k] -= (float)mean_y;
+		}
+}
+
+
+/*---------------------------------------------------------------------------
+  Sums of the whole image over threshold, plain C
+---------------------------------------------------------------------------*/
+static void cent_beam_scalar (const unsigned char img[], int width, int height, int stride, int threshold, cent_sums_t *s)
+{
+	s->w = s->wx = s->wy = 0;
+	for(int y = 0; y < height; y++)
+	{
+		const unsigned char *p = img + (size_t)y * stride;
+		unsigned long long  rw = 0, rwx = 0;
+
+		for(int x = 0; x < width; x++)
+		{
+			int v = p[x] - threshold;
+			if(v > 0)
+			{
+				rw  += v;
+				rwx += (unsigned long long)v * x;
+			}
+		}
+		s->w  += rw;
+		s->wx += rwx;
+		s->wy += rw * y;
+	}
+}
+
+
+#if defined(CENT_HAVE_AVX2)
+
+/*---------------------------------------------------------------------------
+  Same sums, 32 pixels per step as cent_window_avx2. The lanes are folded at
+  the end of every row, so no 32 bit sum can overflow on a bright frame, and
+  the pixels after the last full step are summed in plain C, nothing is read
+  past a row.
+---------------------------------------------------------------------------*/
+CENT_TARGET_AVX2 static void cent_beam_avx2 (const unsigned char img[], int width, int height, int stride, int threshold, cent_sums_t *s)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi16(1);
+	const __m256i thr  = _mm256_set1_epi8((char)threshold);
+	const __m256i idx  = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	                                      16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+	int                full = width & ~31;
+	unsigned long long lane[4];
+	unsigned int       lane32[8];
+
+	s->w = s->wx = s->wy = 0;
+	for(int y = 0; y < height; y++)
+	{
+		const unsigned char *p = img + (size_t)y * stride;
+		__m256i             row_w = zero, row_wo = zero, row_wx = zero;
+		unsigned long long  rw, rwx;
+
+		for(int x0 = 0; x0 < full; x0 += 32)
+		{
+			__m256i w   = _mm256_subs_epu8(_mm256_loadu_si256((const __m256i *)(p + x0)), thr);
+			__m256i sad = _mm256_sad_epu8(w, zero);
+			row_w  = _mm256_add_epi64(row_w, sad);
+			row_wo = _mm256_add_epi64(row_wo, _mm256_mul_epu32(sad, _mm256_set1_epi64x(x0)));
+			row_wx = _mm256_add_epi32(row_wx, _mm256_madd_epi16(_mm256_maddubs_epi16(w, idx), ones));
+		}
+		_mm256_storeu_si256((__m256i *)lane, row_w);
+		rw = lane[0] + lane[1] + lane[2] + lane[3];
+		_mm256_storeu_si256((__m256i *)lane, row_wo);
+		rwx = lane[0] + lane[1] + lane[2] + lane[3];
+		_mm256_storeu_si256((__m256i *)lane32, row_wx);
+		for(int i = 0; i < 8; i++)
+			rwx += lane32[i];
+		for(int x = full; x < width; x++)
+		{
+			int v = p[x] - threshold;
+			if(v > 0)
+			{
+				rw  += v;
+				rwx += (unsigned long long)v * x;
+			}
+		}
+		s->w  += rw;
+		s->wx += rwx;
+		s->wy += rw * y;
+	}
+}
+
+#endif
+
+
+/*---------------------------------------------------------------------------
+  Intensity centroid of the whole image over threshold, mm from the image
+  centre, as WFS_CalcBeamCentroidDia. One pass over the pixels, no lenslet
+  windows. Returns -1 if no pixel is over the threshold.
+---------------------------------------------------------------------------*/
+int cent_beam (const unsigned char img[], int width, int height, int stride, double pitch_um, int threshold, double *x_mm, double *y_mm)
+{
+	cent_sums_t s;
+
+#if defined(CENT_HAVE_AVX2)
+	if(cent_cpu_has_avx2())
+		cent_beam_avx2(img, width, height, stride, threshold, &s);
+	else
+#endif
+		cent_beam_scalar(img, width, height, stride, threshold, &s);
+	if(!s.w)
+		return -1;
+	*x_mm = ((double)s.wx / s.w - 0.5 * (width - 1)) * pitch_um * 1e-3;
+	*y_mm = ((double)s.wy / s.w - 0.5 * (height - 1)) * pitch_um * 1e-3;
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*===============================================================================================================================
+  centroid.h
+
+  Centroiding engine for the raw MONO8 spotfield image. The lenslet grid is laid out from the MLA data of the sensor.
+  Every lenslet has a square window, and the spot position is the thresholded centre of gravity of the pixels in that
+  window. Pixels are weighted by their value minus the threshold, and pixels below the threshold do not count. The
+  window sums use AVX2 integer arithmetic when the CPU supports it, picked at runtime, with a scalar fallback that
+  gives identical results.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_CENTROID_H
+#define WFS_DMH_CENTROID_H
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  CENT_MAX_SPOTS                (80)      // MAX_SPOTS_X / MAX_SPOTS_Y of the driver
+#define  CENT_DEFAULT_THRESHOLD        (20)      // counts subtracted from every pixel
+#define  CENT_DEFAULT_MIN_WEIGHT       (255)     // a window with less total weight has no spot
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	int     width;                       // image size, pixels
+	int     height;
+	int     n_x;                         // lenslet windows that lie fully inside the image
+	int     n_y;
+	int     win;                         // window edge, pixels
+	int     x_start[CENT_MAX_SPOTS];     // first pixel column / row of each window
+	int     y_start[CENT_MAX_SPOTS];
+	double  ref_x[CENT_MAX_SPOTS];       // lenslet axis, the reference for deviations, pixels
+	double  ref_y[CENT_MAX_SPOTS];
+	int     threshold;
+	long    min_weight;
+	int     simd;                        // 1 while the AVX2 kernel is in use
+} cent_grid_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  cent_grid_init (cent_grid_t *g, int width, int height, double cam_pitch_um, double lenslet_pitch_um,
+                     double center_offset_x, double center_offset_y, int threshold);
+int  cent_cpu_has_avx2 (void);
+int  cent_set_simd (cent_grid_t *g, int on);
+
+int  cent_compute (const cent_grid_t *g, const unsigned char img[], int stride, float cx[], float cy[], int out_stride);
+void cent_deviations (const cent_grid_t *g, float x[], float y[], int out_stride, int cancel_tilt);
+int  cent_beam (const unsigned char img[], int width, int height, int stride, double pitch_um, int threshold, double *x_mm, double *y_mm);
+
+#endif // WFS_DMH_CENTROID_H
@@ -0,0 +1,395 @@
+/*===============================================================================================================================
+  config.c
+
+  Startup configuration, see config.h.
+===============================================================================================================================*/
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+
+
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  CONFIG_INT                    (0)
+#define  CONFIG_DOUBLE                 (1)
+#define  CONFIG_STRING                 (2)
+#define  CONFIG_BOOL                   (3)
+#define  CONFIG_CHOICE                 (4)   // one of the '|' separated names, stored as its index
+#define  CONFIG_SIZE                   (5)   // "W x H" or "N" for N x N, two ints
+#define  CONFIG_FLOATS                 (6)   // up to CONFIG_TARGET_TERMS numbers, the rest set to 0
+
+typedef struct
+{
+	const char  *key;
+	int         type;
+	size_t      offset;
+	const char  *choices;   // CONFIG_CHOICE
+	const char  *help;
+} config_item_t;
+
+/*===============================================================================================================================
+  Global Variables
+===============================================================================================================================*/
+static const config_item_t config_items[] =
+{
+	{ "wfs_serial",       CONFIG_STRING, offsetof(config_t, wfs_serial),       NULL, "serial number of the wavefront sensor, comma separated with several loops" },
+	{ "dm_serial",        CONFIG_STRING, offsetof(config_t, dm_serial),        NULL, "serial number of the deformable mirror, comma separated with several loops" },
+	{ "mla",              CONFIG_STRING, offsetof(config_t, mla_name),         NULL, "microlens array by name, e.g. MLA150-7AR" },
+	{ "resolution",       CONFIG_SIZE,   offsetof(config_t, cam_width),        NULL, "camera resolution in pixels, e.g. 512 or 1440x1080" },
+	{ "pupil_centroid_x", CONFIG_DOUBLE, offsetof(config_t, pupil_centroid_x), NULL, "mm" },
+	{ "pupil_centroid_y", CONFIG_DOUBLE, offsetof(config_t, pupil_centroid_y), NULL, "mm" },
+	{ "pupil_diameter_x", CONFIG_DOUBLE, offsetof(config_t, pupil_diameter_x), NULL, "mm" },
+	{ "pupil_diameter_y", CONFIG_DOUBLE, offsetof(config_t, pupil_diameter_y), NULL, "mm" },
+	{ "zernike_order",    CONFIG_INT,    offsetof(config_t, zernike_order),    NULL, "order of the startup fit and of the TLDFMX path" },
+	{ "loops",            CONFIG_INT,    offsetof(config_t, loops),            NULL, "closed loops in this process, one WFS/DM pair and one core each" },
+	{ "backend",          CONFIG_CHOICE, offsetof(config_t, backend),          "thorlabs|sim|replay", NULL },
+	{ "reconstructor",    CONFIG_CHOICE, offsetof(config_t, reconstructor),    "tldfmx|native|zonal", NULL },
+	{ "loop_rate_hz",     CONFIG_DOUBLE, offsetof(config_t, loop_rate_hz),     NULL, "0 runs as fast as possible" },
+	{ "loop_cpu",         CONFIG_INT,    offsetof(config_t, loop_cpu),         NULL, "core of the first loop thread, the next loops take the following cores, -1 for none" },
+	{ "loop_rt_priority", CONFIG_INT,    offsetof(config_t, loop_rt_priority), NULL, "SCHED_FIFO priority, 0 for normal scheduling" },
+	{ "loop_pipelined",   CONFIG_BOOL,   offsetof(config_t, loop_pipelined),   NULL, "expose the next frame while correcting" },
+	{ "zonal_gain",       CONFIG_DOUBLE, offsetof(config_t, zonal_gain),       NULL, "integral gain of the zonal path" },
+	{ "zonal_leak",       CONFIG_DOUBLE, offsetof(config_t, zonal_leak),       NULL, NULL },
+	{ "projection_iterations", CONFIG_INT, offsetof(config_t, projection_iterations), NULL, "active-set iterations onto the voltage range per frame, 0 clips" },
+	{ "tiptilt",          CONFIG_BOOL,   offsetof(config_t, tiptilt),          NULL, "drive the tilt arms from the beam tilt on every frame" },
+	{ "tiptilt_source",   CONFIG_CHOICE, offsetof(config_t, tiptilt_source),   "spots|beam", NULL },
+	{ "tiptilt_gain",     CONFIG_DOUBLE, offsetof(config_t, tiptilt_gain),     NULL, "integral gain of the tilt arms" },
+	{ "tiptilt_leak",     CONFIG_DOUBLE, offsetof(config_t, tiptilt_leak),     NULL, NULL },
+	{ "tiptilt_ho_every", CONFIG_INT,    offsetof(config_t, tiptilt_ho_every), NULL, "high-order correction on every n-th frame" },
+	{ "multirate",        CONFIG_STRING, offsetof(config_t, multirate),        NULL, "native path mode groups first-last:divisor:depth, e.g. 4-6:1:1,7-10:2:2,11-15:4:4" },
+	{ "target",           CONFIG_FLOATS, offsetof(config_t, target),           NULL, "Zernike target in um, as the console 't' command" },
+	{ "dm_relax",         CONFIG_BOOL,   offsetof(config_t, dm_relax),         NULL, "relax the mirror at startup, next to the WFS setup" },
+	{ "calib_scheme",     CONFIG_CHOICE, offsetof(config_t, calib_scheme),     "poke|hadamard", NULL },
+	{ "calib_frames",     CONFIG_INT,    offsetof(config_t, calib_frames),     NULL, "frames averaged at every push and pull" },
+	{ "poke_voltage",     CONFIG_DOUBLE, offsetof(config_t, poke_voltage),     NULL, "push-pull amplitude, V" },
+	{ "replay_file",      CONFIG_STRING, offsetof(config_t, replay_file),      NULL, "frames for the replay backend" },
+	{ "telemetry",        CONFIG_BOOL,   offsetof(config_t, telemetry),        NULL, NULL },
+	{ "capture",          CONFIG_BOOL,   offsetof(config_t, capture),          NULL, "record raw frames from the start" },
+	{ "log_file",         CONFIG_STRING, offsetof(config_t, log_file),         NULL, "loop messages with their time, empty for none" },
+	{ "log_console_hz",   CONFIG_DOUBLE, offsetof(config_t, log_console_hz),   NULL, "console lines per second of each loop message, 0 for all" },
+	{ "headless",         CONFIG_BOOL,   offsetof(config_t, headless),         NULL, "never wait for a key, fail instead" },
+};
+
+#define  CONFIG_ITEMS                  ((int)(sizeof(config_items) / sizeof(config_items[0])))
+
+
+
+/*---------------------------------------------------------------------------
+  Index of name in the '|' separated list, or -1
+---------------------------------------------------------------------------*/
+static int config_choice (const char *choices, const char *name)
+{
+	size_t  len = strlen(name);
+	int     i = 0;
+
+	while(*choices)
+	{
+		const char *end = strchr(choices, '|');
+		size_t     n = end ? (size_t)(end - choices) : strlen(choices);
+
+		if(n == len && strncmp(choices, name, n) == 0)
+			return i;
+		if(!end)
+			break;
+		choices = end + 1;
+		i++;
+	}
+	return -1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Set one key from its text value
+---------------------------------------------------------------------------*/
+int config_set (config_t *cfg, const char *key, const char *value)
+{
+	const config_item_t  *it = NULL;
+	char                 *field, *end;
+	int                  i;
+
+	for(i = 0; i < CONFIG_ITEMS; i++)
+		if(strcmp(config_items[i].key, key) == 0)
+			it = &config_items[i];
+	if(!it)
+		return CONFIG_UNKNOWN_KEY;
+	field = (char *)cfg + it->offset;
+
+	switch(it->type)
+	{
+		case CONFIG_INT:
+		{
+			long v = strtol(value, &end, 10);
+			if(end == value || *end)
+				return CONFIG_BAD_VALUE;
+			*(int *)field = (int)v;
+			break;
+		}
+		case CONFIG_DOUBLE:
+		{
+			double v = strtod(value, &end);
+			if(end == value || *end)
+				return CONFIG_BAD_VALUE;
+			*(double *)field = v;
+			break;
+		}
+		case CONFIG_STRING:
+			if(strlen(value) >= CONFIG_STRING_LENGTH)
+				return CONFIG_BAD_VALUE;
+			strcpy(field, value);
+			break;
+		case CONFIG_BOOL:
+			if(!strcmp(value, "1") || !strcmp(value, "on") || !strcmp(value, "yes") || !strcmp(value, "true"))
+				*(int *)field = 1;
+			else if(!strcmp(value, "0") || !strcmp(value, "off") || !strcmp(value, "no") || !strcmp(value, "false"))
+				*(int *)field = 0;
+			else
+				return CONFIG_BAD_VALUE;
+			break;
+		case CONFIG_CHOICE:
+			if((i = config_choice(it->choices, value)) < 0)
+				return CONFIG_BAD_VALUE;
+			*(int *)field = i;
+			break;
+		case CONFIG_SIZE:
+		{
+			int *size = (int *)field;
+			long w = strtol(value, &end, 10), h = w;
+			if(end == value)
+				return CONFIG_BAD_VALUE;
+			if(*end == 'x' || *end == 'X')
+			{
+				const char *p = end + 1;
+				h = strtol(p, &end, 10);
+				if(end == p)
+					return CONFIG_BAD_VALUE;
+			}
+			if(*end || w < 0 || h < 0)
+				return CONFIG_BAD_VALUE;
+			size[0] = (int)w;
+			size[1] = (int)h;
+			break;
+		}
+		case CONFIG_FLOATS:
+		{
+			float       v[CONFIG_TARGET_TERMS] = { 0 };
+			const char  *p = value;
+			for(i = 0; i < CONFIG_TARGET_TERMS; i++)
+			{
+				while(*p == ' ' || *p == '\t' || *p == ',')
+					p++;
+				if(!*p)
+					break;
+				v[i] = strtof(p, &end);
+				if(end == p)
+					return CONFIG_BAD_VALUE;
+				p = end;
+			}
+			while(*p == ' ' || *p == '\t' || *p == ',')
+				p++;
+			if(*p)
+				return CONFIG_BAD_VALUE;
+			memcpy(field, v, sizeof(v));
+			break;
+		}
+	}
+	return CONFIG_OK;
+}
+
+
+/*---------------------------------------------------------------------------
+  "key = value", blanks around both and a '#' comment are ignored. An empty
+  line is CONFIG_OK.
+---------------------------------------------------------------------------*/
+int config_parse_line (config_t *cfg, const char *line)
+{
+	char  buf[2 * CONFIG_STRING_LENGTH], *key, *value, *p;
+
+	if(strlen(line) >= sizeof(buf))
+		return CONFIG_BAD_VALUE;
+	strcpy(buf, line);
+	if((p = strchr(buf, '#')) != NULL)
+		*p = '\0';
+
+	key = buf;
+	while(isspace((unsigned char)*key))
+		key++;
+	if(!*key)
+		return CONFIG_OK;
+	if((value = strchr(key, '=')) == NULL)
+		return CONFIG_SYNTAX;
+	*value++ = '\0';
+
+	for(p = value + strlen(value); p > key && isspace((unsigned char)p[-1]); )
+		*--p = '\0';
+	while(isspace((unsigned char)*value))
+		value++;
+	for(p = key + strlen(key); p > key && isspace((unsigned char)p[-1]); )
+		*--p = '\0';
+	return config_set(cfg, key, value);
+}
+
+
+/*---------------------------------------------------------------------------
+  Apply a configuration file. Returns CONFIG_MISSING if it does not open,
+  otherwise the number of lines that were not understood (each is reported).
+---------------------------------------------------------------------------*/
+int config_load (config_t *cfg, const char *path)
+{
+	FILE  *fp;
+	char  line[2 * CONFIG_STRING_LENGTH];
+	int   n = 0, bad = 0, err;
+
+	if((fp = fopen(path, "r")) == NULL)
+		return CONFIG_MISSING;
+	while(fgets(line, sizeof(line), fp))
+	{
+		n++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if(err = config_parse_line(cfg, line))
+		{
+			printf("%s:%d: %s '%s'\n", path, n, (err == CONFIG_UNKNOWN_KEY) ? "unknown key in" : (err == CONFIG_SYNTAX) ? "no '=' in" : "bad value in", line);
+			bad++;
+		}
+	}
+	fclose(fp);
+	return bad;
+}
+
+
+/*---------------------------------------------------------------------------
+  Apply the command line: files and key=value overrides, left to right. If
+  no file is named, default_path is read when it exists. Returns 0, the
+  number of errors, CONFIG_MISSING or CONFIG_HELP.
+---------------------------------------------------------------------------*/
+int config_args (config_t *cfg, int argc, char *argv[], const char *default_path)
+{
+	int  i, bad = 0, err, named = 0;
+
+	for(i = 1; i < argc; i++)
+		if(!strchr(argv[i], '='))
+			named = 1;
+	if(!named && default_path && (err = config_load(cfg, default_path)) > 0)
+		bad += err;
+
+	for(i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+			return CONFIG_HELP;
+		if(!strchr(argv[i], '='))
+		{
+			if((err = config_load(cfg, argv[i])) == CONFIG_MISSING)
+			{
+				printf("Could not open configuration file %s.\n", argv[i]);
+				return CONFIG_MISSING;
+			}
+			bad += err;
+		}
+		else if(err = config_parse_line(cfg, argv[i]))
+		{
+			printf("%s '%s' on the command line.\n", (err == CONFIG_UNKNOWN_KEY) ? "Unknown key in" : "Bad value in", argv[i]);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+
+/*---------------------------------------------------------------------------
+  Write the configuration in file format, a log of what a start ran with
+---------------------------------------------------------------------------*/
+void config_print (const config_t *cfg, FILE *fp)
+{
+	const char  *field;
+	int         i, k;
+
+	for(i = 0; i < CONFIG_ITEMS; i++)
+	{
+		const config_item_t *it = &config_items[i];
+
+		field = (const char *)cfg + it->offset;
+		fprintf(fp, "%-18s = ", it->key);
+		switch(it->type)
+		{
+			case CONFIG_INT:    fprintf(fp, "%d", *(const int *)field); break;
+			case CONFIG_DOUBLE: fprintf(fp, "%g", *(const double *)field); break;
+			case CONFIG_STRING: fprintf(fp, "%s", field); break;
+			case CONFIG_BOOL:   fprintf(fp, "%s", *(const int *)field ? "on" : "off"); break;
+			case CONFIG_SIZE:   fprintf(fp, "%dx%d", ((const int *)field)[0], ((const int *)field)[1]); break;
+			case CONFIG_CHOICE:
+			{
+				const char *c = it->choices;
+				for(k = *(const int *)field; k > 0 && c; k--)
+					if((c = strchr(c, '|')) != NULL)
+						c++;
+				if(c)
+					fprintf(fp, "%.*s", (int)(strchr(c, '|') ? (size_t)(strchr(c, '|') - c) : strlen(c)), c);
+				break;
+			}
+			case CONFIG_FLOATS:
+				for(k = 0; k < CONFIG_TARGET_TERMS; k++)
+					fprintf(fp, k ? " %g" : "%g", ((const float *)field)[k]);
+				break;
+		}
+		fprintf(fp, "\n");
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+  Usage and the list of keys
+---------------------------------------------------------------------------*/
+void config_help (void)
+{
+	int i;
+
+	printf("Usage: WFS-DMH [config file] [key=value ...]\n\n");
+	for(i = 0; i < CONFIG_ITEMS; i++)
+		printf("  %-18s %s\n", config_items[i].key, config_items[i].choices ? config_items[i].choices : config_items[i].help ? config_items[i].help : "");
+}
+
+
+/*---------------------------------------------------------------------------
+  Item i of a comma separated list, without the blanks around it. Returns
+  0, or -1 with an empty item if the list is shorter.
+---------------------------------------------------------------------------*/
+int config_list_item (const char *list, int i, char item[], int size)
+{
+	const char  *p = list, *end;
+	int         n;
+
+	item[0] = '\0';
+	for(; i > 0; i--)
+	{
+		if((p = strchr(p, ',')) == NULL)
+			return -1;
+		p++;
+	}
+	while(isspace((unsigned char)*p))
+		p++;
+	end = p + strcspn(p, ",");
+	while(end > p && isspace((unsigned char)end[-1]))
+		end--;
+	n = (int)(end - p);
+	if(n >= size)
+		n = size - 1;
+	memcpy(item, p, n);
+	item[n] = '\0';
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Serial numbers of loop i: item i of wfs_serial and of dm_serial, empty
+  where a list is shorter and the device is to be selected
+---------------------------------------------------------------------------*/
+void config_loop_serials (const config_t *cfg, int i, char wfs_serial[], char dm_serial[], int size)
+{
+	config_list_item(cfg->wfs_serial, i, wfs_serial, size);
+	config_list_item(cfg->dm_serial, i, dm_serial, size);
+}
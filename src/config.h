@@ -0,0 +1,95 @@
+/*===============================================================================================================================
+  config.h
+
+  Startup configuration from a file and the command line, so the program can start without anyone at the keyboard.
+  Both use the same "key = value" lines: the file one per line with '#' comments, the command line one per argument
+  without spaces ("pupil_diameter_x=2.5"). An argument without '=' names a configuration file, and the arguments are
+  applied left to right, so later ones override earlier ones.
+
+  Devices are picked by serial number and the MLA by name. With headless set, the program never waits for a key:
+  a missing or ambiguous device ends it with an error, so a supervisor can restart it. With several loops the
+  serial numbers are lists, "wfs_serial = 13245, 13246", one item per loop in loop order.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_CONFIG_H
+#define WFS_DMH_CONFIG_H
+
+#include <stdio.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  CONFIG_STRING_LENGTH          (256)
+#define  CONFIG_TARGET_TERMS           (16)      // Zernike targets, as the console 't' command
+
+#define  CONFIG_OK                     (0)
+#define  CONFIG_UNKNOWN_KEY            (-1)
+#define  CONFIG_BAD_VALUE              (-2)
+#define  CONFIG_SYNTAX                 (-3)      // no '=' in the line
+#define  CONFIG_MISSING                (-4)      // file does not open
+#define  CONFIG_HELP                   (-5)      // -h / --help on the command line
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	// devices, an empty serial or name takes the only one there is, or asks
+	char    wfs_serial[CONFIG_STRING_LENGTH]; // comma separated, one per loop
+	char    dm_serial[CONFIG_STRING_LENGTH];
+	char    mla_name[CONFIG_STRING_LENGTH];
+	int     cam_width, cam_height;         // pixels, 0 for the default resolution of the instrument
+	double  pupil_centroid_x;              // mm
+	double  pupil_centroid_y;
+	double  pupil_diameter_x;
+	double  pupil_diameter_y;
+	int     zernike_order;                 // order of the startup fit and of the TLDFMX path
+
+	// loop
+	int     loops;                         // closed loops in this process, one WFS/DM pair each
+	int     backend;                       // HAL_BACKEND_*
+	int     reconstructor;                 // LOOP_RECON_* of WFS-DMH.c
+	double  loop_rate_hz;                  // 0 runs as fast as possible
+	int     loop_cpu;                      // core of the first loop, the next loops take the following cores, -1 for no pinning
+	int     loop_rt_priority;              // 0 keeps normal scheduling
+	int     loop_pipelined;
+	double  zonal_gain;
+	double  zonal_leak;
+	int     projection_iterations;         // per frame onto the segment voltage range (vbox.h), 0 clips
+	int     tiptilt;                       // offload tip/tilt to the tilt arms
+	int     tiptilt_source;                // TT_SOURCE_* of tiptilt.h
+	double  tiptilt_gain;
+	double  tiptilt_leak;
+	int     tiptilt_ho_every;              // high-order correction on every n-th frame while tip/tilt runs on all
+	char    multirate[CONFIG_STRING_LENGTH]; // mode groups at their own rates (mrate.h), empty for one rate
+	float   target[CONFIG_TARGET_TERMS];   // Zernike target the loop starts on, um
+
+	// calibration
+	int     dm_relax;                      // TLDFMX_relax at startup
+	int     calib_scheme;                  // CALIB_SCHEME_*
+	int     calib_frames;
+	double  poke_voltage;
+
+	// files and operation
+	char    replay_file[CONFIG_STRING_LENGTH];
+	int     telemetry;
+	int     capture;
+	char    log_file[CONFIG_STRING_LENGTH]; // loop messages, empty for none
+	double  log_console_hz;                // console lines per second of each loop message, 0 for all
+	int     headless;
+} config_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  config_set (config_t *cfg, const char *key, const char *value);
+int  config_parse_line (config_t *cfg, const char *line);
+int  config_load (config_t *cfg, const char *path);
+int  config_args (config_t *cfg, int argc, char *argv[], const char *default_path);
+void config_print (const config_t *cfg, FILE *fp);
+void config_help (void);
+int  config_list_item (const char *list, int i, char item[], int size);
+void config_loop_serials (const config_t *cfg, int i, char wfs_serial[], char dm_serial[], int size);
+
+#endif // WFS_DMH_CONFIG_H
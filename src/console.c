@@ -0,0 +1,223 @@
+/*===============================================================================================================================
+  console.c
+
+  Non-blocking operator console, see console.h.
+===============================================================================================================================*/
+
+#include "console.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <conio.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+
+
+/*---------------------------------------------------------------------------
+  Empty console
+---------------------------------------------------------------------------*/
+void console_init (console_t *con)
+{
+	memset(con, 0, sizeof(*con));
+}
+
+
+/*---------------------------------------------------------------------------
+  Move the first line out of the buffer, returns 1 if there was a complete one
+---------------------------------------------------------------------------*/
+static int console_take_line (console_t *con, char line[], int size)
+{
+	char *nl = memchr(con->buf, '\n', con->len);
+	int  n;
+
+	if(!nl)
+	{
+		if(con->len < CONSOLE_LINE_MAX - 1 && !(con->eof && con->len > 0))
+			return 0;
+		nl = con->buf + con->len;   // overlong line or last line without newline
+	}
+	n = (int)(nl - con->buf);
+	if(n > 0 && con->buf[n - 1] == '\r')
+		n--;
+	if(n > size - 1)
+		n = size - 1;
+	memcpy(line, con->buf, n);
+	line[n] = '\0';
+
+	n = (int)(nl - con->buf) + (nl < con->buf + con->len ? 1 : 0);
+	con->len -= n;
+	memmove(con->buf, con->buf + n, con->len);
+	return 1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Wait at most timeout_ms for a complete line on stdin.
+  Returns 1 with the line (without newline) in line[], 0 on timeout, -1 once stdin is closed.
+---------------------------------------------------------------------------*/
+int console_read_line (console_t *con, int timeout_ms, char line[], int size)
+{
+	if(console_take_line(con, line, size))
+		return 1;
+	if(con->eof)
+		return -1;
+
+#if defined(_WIN32)
+	{
+		DWORD end = GetTickCount() + timeout_ms;
+
+		do
+		{
+			while(_kbhit() && con->len < CONSOLE_LINE_MAX - 1)
+			{
+				int c = _getche();
+				if(c == '\r')
+				{
+					c = '\n';
+					_putch('\n');
+				}
+				con->buf[con->len++] = (char)c;
+				if(c == '\n')
+					return console_take_line(con, line, size);
+			}
+			Sleep(10);
+		}
+		while((long)(end - GetTickCount()) > 0);
+	}
+#else
+	{
+		struct pollfd pfd;
+		ssize_t       n;
+
+		pfd.fd     = STDIN_FILENO;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, timeout_ms) <= 0)
+			return 0;
+		n = read(STDIN_FILENO, con->buf + con->len, CONSOLE_LINE_MAX - 1 - con->len);
+		if(n <= 0)
+			con->eof = 1;
+		else
+			con->len += (int)n;
+	}
+#endif
+
+	if(console_take_line(con, line, size))
+		return 1;
+	return con->eof ? -1 : 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Parse one line, returns the command type (CONSOLE_CMD_INVALID for anything not understood)
+---------------------------------------------------------------------------*/
+int console_parse (const char line[], console_cmd_t *cmd)
+{
+	const char *p = line;
+	char       *end;
+	char       word;
+	double     v[CONSOLE_MAX_VALUES + 1];
+	int        n = 0;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->channel = -1;
+
+	while(isspace((unsigned char)*p))
+		p++;
+	if(!*p)
+		return cmd->type = CONSOLE_CMD_NONE;
+	word = (char)tolower((unsigned char)*p);
+	while(*p && !isspace((unsigned char)*p))
+		p++;
+
+	// numeric arguments
+	while(n <= CONSOLE_MAX_VALUES)
+	{
+		while(isspace((unsigned char)*p) || *p == ',')
+			p++;
+		if(!*p)
+			break;
+		v[n] = strtod(p, &end);
+		if(end == p)
+			return cmd->type = CONSOLE_CMD_INVALID;
+		p = end;
+		n++;
+	}
+	if(*p)
+		return cmd->type = CONSOLE_CMD_INVALID;   // more values than a target vector has
+
+	switch(word)
+	{
+		case 't':
+			if(n < 1 || n > CONSOLE_MAX_VALUES)
+				return cmd->type = CONSOLE_CMD_INVALID;
+			cmd->n_values = n;
+			for(int i = 0; i < n; i++)
+				cmd->values[i] = (float)v[i];
+			return cmd->type = CONSOLE_CMD_TARGET;
+		case 'z':
+			if(n != 2 || v[0] < 0 || v[0] >= CONSOLE_MAX_VALUES)
+				return cmd->type = CONSOLE_CMD_INVALID;
+			cmd->channel = (int)v[0];
+			cmd->value   = v[1];
+			return cmd->type = CONSOLE_CMD_ZERNIKE;
+		case 'g':
+			if(n == 1)
+				cmd->value = v[0];
+			else if(n == 2)
+			{
+				cmd->channel = (int)v[0];
+				cmd->value   = v[1];
+			}
+			else
+				return cmd->type = CONSOLE_CMD_INVALID;
+			return cmd->type = (cmd->value >= 0.0) ? CONSOLE_CMD_GAIN : CONSOLE_CMD_INVALID;
+		case 'p':
+			return cmd->type = n ? CONSOLE_CMD_INVALID : CONSOLE_CMD_PAUSE;
+		case 'r':
+			return cmd->type = n ? CONSOLE_CMD_INVALID : CONSOLE_CMD_RESUME;
+		case 's':
+			return cmd->type = n ? CONSOLE_CMD_INVALID : CONSOLE_CMD_STATUS;
+		case 'c':
+			if(n != 1)
+				return cmd->type = CONSOLE_CMD_INVALID;
+			cmd->value = (v[0] != 0.0);
+			return cmd->type = CONSOLE_CMD_CAPTURE;
+		case 'l':
+			if(n != 1 || v[0] < 0)
+				return cmd->type = CONSOLE_CMD_INVALID;
+			cmd->channel = (int)v[0];
+			return cmd->type = CONSOLE_CMD_LOOP;
+		case 'h':
+		case '?':
+			return cmd->type = CONSOLE_CMD_HELP;
+		case 'q':
+		case 'e':   // 'e' terminated the old prompt
+			return cmd->type = n ? CONSOLE_CMD_INVALID : CONSOLE_CMD_QUIT;
+	}
+	return cmd->type = CONSOLE_CMD_INVALID;
+}
+
+
+/*---------------------------------------------------------------------------
+  Command list
+---------------------------------------------------------------------------*/
+void console_help (void)
+{
+	printf("Commands:\n");
+	printf("  t z0 z1 ... z15   new Zernike target in um (missing values are 0)\n");
+	printf("  z n value         change Zernike n of the current target\n");
+	printf("  g gain            integral gain of all channels\n");
+	printf("  g n gain          integral gain of one channel (Zernike n, or segment n in the zonal path)\n");
+	printf("  p / r             pause (hold the mirror) / resume\n");
+	printf("  s                 loop status and stage latency report\n");
+	printf("  c 1 / c 0         start / stop recording raw frames\n");
+	printf("  l n / l 0         following commands to loop n / to all loops (several loops)\n");
+	printf("  q                 quit\n");
+}
@@ -0,0 +1,71 @@
+/*===============================================================================================================================
+  console.h
+
+  Non-blocking operator console. Lines are read from stdin without ever blocking longer than the given timeout
+  (poll on POSIX, the console keyboard buffer on Windows), and every complete line is parsed into one command.
+  Parsing is independent of the loop: the caller decides what a command does.
+
+  Commands (first letter is enough):
+    target z0 z1 ...   whole Zernike target vector in um, index as in the driver's arrays, missing values are 0
+    zernike n value    change one Zernike of the current target
+    pause / resume     hold the mirror / continue correcting
+    gain g             integral gain of every channel
+    gain n g           integral gain of one channel
+    status             print the last loop status and the loop's stage latency report
+    capture 1 / 0      start / stop recording raw frames
+    loop n             send the following commands to loop n only, loop 0 to all loops (with several loops)
+    help               list the commands
+    quit               stop the loop and close the instruments
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_CONSOLE_H
+#define WFS_DMH_CONSOLE_H
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  CONSOLE_LINE_MAX              (512)
+#define  CONSOLE_MAX_VALUES            (16)
+
+#define  CONSOLE_CMD_NONE              (0)   // empty line
+#define  CONSOLE_CMD_INVALID           (1)
+#define  CONSOLE_CMD_TARGET            (2)
+#define  CONSOLE_CMD_ZERNIKE           (3)
+#define  CONSOLE_CMD_PAUSE             (4)
+#define  CONSOLE_CMD_RESUME            (5)
+#define  CONSOLE_CMD_GAIN              (6)
+#define  CONSOLE_CMD_STATUS            (7)
+#define  CONSOLE_CMD_HELP              (8)
+#define  CONSOLE_CMD_QUIT              (9)
+#define  CONSOLE_CMD_CAPTURE           (10)
+#define  CONSOLE_CMD_LOOP              (11)
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	char  buf[CONSOLE_LINE_MAX];   // bytes read but not yet returned as a line
+	int   len;
+	int   eof;
+} console_t;
+
+typedef struct
+{
+	int     type;                          // CONSOLE_CMD_*
+	int     channel;                       // ZERNIKE and GAIN, -1 for all channels; LOOP, 0 for all loops
+	double  value;                         // GAIN, ZERNIKE, CAPTURE
+	int     n_values;                      // TARGET
+	float   values[CONSOLE_MAX_VALUES];
+} console_cmd_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+void console_init (console_t *con);
+int  console_read_line (console_t *con, int timeout_ms, char line[], int size);
+int  console_parse (const char line[], console_cmd_t *cmd);
+void console_help (void);
+
+#endif // WFS_DMH_CONSOLE_H
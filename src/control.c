@@ -0,0 +1,235 @@
+/*===============================================================================================================================
+  control.c
+
+  Per-channel loop controller, see control.h.
+===============================================================================================================================*/
+
+#include "control.h"
+#include "linalg.h"
+#include <string.h>
+
+
+
+/*---------------------------------------------------------------------------
+  Set up n channels driving n_act segments, all channels start with the same parameters
+---------------------------------------------------------------------------*/
+int ctrl_init (ctrl_t *ct, int n, int n_act, ctrl_param_t param)
+{
+	if(n > CTRL_MAX_CHANNELS || n_act > CTRL_MAX_CHANNELS)
+		return -1;
+
+	memset(ct, 0, sizeof(*ct));
+	ct->n     = n;
+	ct->n_act = n_act;
+	for(int i = 0; i < n; i++)
+		ct->param[i] = param;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Gains of a single channel
+---------------------------------------------------------------------------*/
+void ctrl_set_channel (ctrl_t *ct, int ch, ctrl_param_t param)
+{
+	if(ch >= 0 && ch < ct->n)
+		ct->param[ch] = param;
+}
+
+
+/*---------------------------------------------------------------------------
+  Project offsets outside the voltage range with box, NULL clips them.
+  Returns -1 if the box is for another number of segments.
+---------------------------------------------------------------------------*/
+int ctrl_set_box (ctrl_t *ct, vbox_t *box)
+{
+	if(box && box->n != ct->n_act)
+		return -1;
+	ct->box = box;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Forget the integrator and derivative history, the mirror returns to the bias pattern on the next update
+---------------------------------------------------------------------------*/
+void ctrl_reset (ctrl_t *ct)
+{
+	memset(ct->integ, 0, sizeof(ct->integ));
+	memset(ct->prev_err, 0, sizeof(ct->prev_err));
+	memset(ct->u, 0, sizeof(ct->u));
+	memset(ct->u_ach, 0, sizeof(ct->u_ach));
+	memset(ct->dv, 0, sizeof(ct->dv));
+	memset(ct->dv_cmd, 0, sizeof(ct->dv_cmd));
+	ct->saturated_frames = 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Clamp bias - dv to [vmin, vmax] into voltage, or project it with the box,
+  dv becomes the offset that was reached. Returns the number of segments
+  at a limit.
+---------------------------------------------------------------------------*/
+static int ctrl_clamp (ctrl_t *ct, const double bias[], double vmin, double vmax, double voltage[])
+{
+	int     i, clamped = 0;
+	double  v;
+
+	if(ct->box)
+	{
+		for(i = 0; i < ct->n_act; i++)
+			voltage[i] = bias[i] - ct->dv[i];
+		clamped = vbox_project(ct->box, voltage, vmin, vmax, voltage);
+		for(i = 0; i < ct->n_act; i++)
+			ct->dv[i] = bias[i] - voltage[i];
+		return clamped;
+	}
+	for(i = 0; i < ct->n_act; i++)
+	{
+		v = bias[i] - ct->dv[i];
+		if(v < vmin)
+		{
+			v = vmin;
+			clamped++;
+		}
+		else if(v > vmax)
+		{
+			v = vmax;
+			clamped++;
+		}
+		voltage[i] = v;
+		ct->dv[i]  = bias[i] - v;
+	}
+	return clamped;
+}
+
+
+/*---------------------------------------------------------------------------
+  Full map of the corrections u to voltages, clamp and back-calculation
+---------------------------------------------------------------------------*/
+static int ctrl_output (ctrl_t *ct, const double to_volt[], const double from_volt[],
+                        const double bias[], double vmin, double vmax, double voltage[])
+{
+	int     i, clamped;
+
+	if(to_volt)
+		la_gemv(to_volt, ct->n_act, ct->n, ct->u, ct->dv);
+	else
+		memcpy(ct->dv, ct->u, sizeof(double) * ct->n_act);
+	memcpy(ct->dv_cmd, ct->dv, sizeof(double) * ct->n_act);
+
+	clamped = ctrl_clamp(ct, bias, vmin, vmax, voltage);
+
+	// back-calculation: the integrators follow what the clamped voltages actually deliver instead of winding up
+	if(from_volt)
+		la_gemv(from_volt, ct->n, ct->n_act, ct->dv, ct->u_ach);
+	else
+		memcpy(ct->u_ach, ct->dv, sizeof(double) * ct->n);
+
+	if(clamped)
+	{
+		ct->saturated_frames++;
+		for(i = 0; i < ct->n; i++)
+			ct->integ[i] += ct->u_ach[i] - ct->u[i];
+	}
+	return clamped;
+}
+
+
+/*---------------------------------------------------------------------------
+  One controller step.
+  err        residual per channel (measured - target)
+  to_volt    n_act x n matrix from channel correction to voltage offset (control matrix), NULL if channels are segments
+  from_volt  n x n_act matrix from voltage offset back to channels (interaction matrix), NULL if channels are segments
+  voltage    receives bias - to_volt * u clamped to [vmin, vmax]
+  Returns the number of segments that were clamped.
+---------------------------------------------------------------------------*/
+int ctrl_apply (ctrl_t *ct, const double err[], const double to_volt[], const double from_volt[],
+                const double bias[], double vmin, double vmax, double voltage[])
+{
+	int     i;
+
+	for(i = 0; i < ct->n; i++)
+	{
+		const ctrl_param_t *p = &ct->param[i];
+		ct->integ[i]    = (1.0 - p->leak) * ct->integ[i] + p->gain * err[i];
+		ct->u[i]        = ct->integ[i] + p->kp * err[i] + p->kd * (err[i] - ct->prev_err[i]);
+		ct->prev_err[i] = err[i];
+	}
+	return ctrl_output(ct, to_volt, from_volt, bias, vmin, vmax, voltage);
+}
+
+
+/*---------------------------------------------------------------------------
+  Controller step of the channels with active set, the others keep their
+  integrator and their correction. The commanded offset is updated with the
+  columns of to_volt of the active channels only, the full map runs when
+  all of them are active and corrects the rounding that adds up. Back-
+  calculation is limited to the active channels. Other arguments as for
+  ctrl_apply.
+---------------------------------------------------------------------------*/
+int ctrl_apply_channels (ctrl_t *ct, const double err[], const unsigned char active[], const double to_volt[],
+                         const double from_volt[], const double bias[], double vmin, double vmax, double voltage[])
+{
+	double  du[CTRL_MAX_CHANNELS];
+	int     idx[CTRL_MAX_CHANNELS];
+	int     i, k, a, n_active = 0, clamped;
+
+	for(i = 0; i < ct->n; i++)
+	{
+		const ctrl_param_t *p = &ct->param[i];
+		double u;
+
+		if(!active[i])
+			continue;
+		ct->integ[i]    = (1.0 - p->leak) * ct->integ[i] + p->gain * err[i];
+		u               = ct->integ[i] + p->kp * err[i] + p->kd * (err[i] - ct->prev_err[i]);
+		ct->prev_err[i] = err[i];
+		du[n_active]    = u - ct->u[i];
+		idx[n_active++] = i;
+		ct->u[i]        = u;
+	}
+	if(n_active == ct->n)
+		return ctrl_output(ct, to_volt, from_volt, bias, vmin, vmax, voltage);
+
+	if(to_volt)
+		for(a = 0; a < ct->n_act; a++)
+		{
+			const double *row = to_volt + (size_t)a * ct->n;
+			double acc = 0.0;
+
+			for(k = 0; k < n_active; k++)
+				acc += row[idx[k]] * du[k];
+			ct->dv_cmd[a] += acc;
+		}
+	else
+		for(k = 0; k < n_active; k++)
+			ct->dv_cmd[idx[k]] = ct->u[idx[k]];
+	memcpy(ct->dv, ct->dv_cmd, sizeof(double) * ct->n_act);
+
+	clamped = ctrl_clamp(ct, bias, vmin, vmax, voltage);
+
+	for(k = 0; k < n_active; k++)
+	{
+		i = idx[k];
+		if(from_volt)
+		{
+			const double *row = from_volt + (size_t)i * ct->n_act;
+			double acc = 0.0;
+
+			for(a = 0; a < ct->n_act; a++)
+				acc += row[a] * ct->dv[a];
+			ct->u_ach[i] = acc;
+		}
+		else
+			ct->u_ach[i] = ct->dv[i];
+	}
+
+	if(clamped)
+	{
+		ct->saturated_frames++;
+		for(k = 0; k < n_active; k++)
+			ct->integ[idx[k]] += ct->u_ach[idx[k]] - ct->u[idx[k]];
+	}
+	return clamped;
+}
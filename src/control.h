@@ -0,0 +1,70 @@
+/*===============================================================================================================================
+  control.h
+
+  Per-channel loop controller: leaky integrator with optional proportional and derivative terms for every mode, and
+  back-calculation anti-windup against the segment voltage limits. A channel is a Zernike mode for the modal path or a
+  segment for the zonal path. Every update costs the same: one update pass, one map to voltages, one clamp and one map
+  back, whether or not a segment saturates.
+
+  ctrl_apply_channels steps a subset of the channels and holds the others, for the multi-rate loop (mrate.h). It keeps
+  the voltage offset commanded before clamping and adds only the columns of the stepped channels to it, so its cost
+  grows with the channels stepped, again whether or not a segment saturates.
+
+  With a voltage box set (ctrl_set_box), an offset that leaves the segment range is projected onto it (vbox.h)
+  instead of clipped per segment, and the back-calculation follows the projected voltages. Such frames cost up to the
+  box's iteration budget more.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_CONTROL_H
+#define WFS_DMH_CONTROL_H
+
+#include "vbox.h"
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  CTRL_MAX_CHANNELS             (64)
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	double  gain;   // integral gain per frame, 1.0 applies the full correction in one step
+	double  leak;   // fraction of the integrator forgotten per frame, 0 for a pure integrator
+	double  kp;     // proportional gain
+	double  kd;     // derivative gain on the error difference
+} ctrl_param_t;
+
+typedef struct
+{
+	int           n;       // channels
+	int           n_act;   // segments
+	ctrl_param_t  param[CTRL_MAX_CHANNELS];
+
+	double        integ[CTRL_MAX_CHANNELS];     // integrator state
+	double        prev_err[CTRL_MAX_CHANNELS];
+	double        u[CTRL_MAX_CHANNELS];         // commanded correction
+	double        u_ach[CTRL_MAX_CHANNELS];     // correction actually reached after clamping
+	double        dv[CTRL_MAX_CHANNELS];        // voltage offset from the bias pattern
+	double        dv_cmd[CTRL_MAX_CHANNELS];    // to_volt * u, the offset before clamping
+
+	vbox_t        *box;                         // projection onto the voltage range, NULL clips each segment
+	long          saturated_frames;             // frames in which at least one segment hit a limit
+} ctrl_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  ctrl_init (ctrl_t *ct, int n, int n_act, ctrl_param_t param);
+void ctrl_set_channel (ctrl_t *ct, int ch, ctrl_param_t param);
+int  ctrl_set_box (ctrl_t *ct, vbox_t *box);
+void ctrl_reset (ctrl_t *ct);
+
+int  ctrl_apply (ctrl_t *ct, const double err[], const double to_volt[], const double from_volt[],
+                 const double bias[], double vmin, double vmax, double voltage[]);
+int  ctrl_apply_channels (ctrl_t *ct, const double err[], const unsigned char active[], const double to_volt[],
+                          const double from_volt[], const double bias[], double vmin, double vmax, double voltage[]);
+
+#endif // WFS_DMH_CONTROL_H
@@ -0,0 +1,229 @@
+/*===============================================================================================================================
+  exposure.c
+
+  Low-rate exposure tuner, see exposure.h.
+===============================================================================================================================*/
+
+#include "exposure.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+
+
+/*---------------------------------------------------------------------------
+  Tuner for the exposure range of the camera, looking at every n-th frame
+---------------------------------------------------------------------------*/
+void expo_init (expo_tuner_t *et, double exp_min, double exp_max, double exp_incr, int every)
+{
+	memset(et, 0, sizeof(*et));
+	et->exp_min       = exp_min;
+	et->exp_max       = exp_max;
+	et->exp_incr      = exp_incr;
+	et->low           = EXPO_DEFAULT_LOW;
+	et->high          = EXPO_DEFAULT_HIGH;
+	et->target        = EXPO_DEFAULT_TARGET;
+	et->saturated_pct = EXPO_DEFAULT_SATURATED_PCT;
+	et->every         = every > 0 ? every : 1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Count a frame, returns 1 if the tuner wants to look at this one
+---------------------------------------------------------------------------*/
+int expo_due (expo_tuner_t *et)
+{
+	if(++et->frames < et->every)
+		return 0;
+	et->frames = 0;
+	return 1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Exposure time for the next frames. Returns the current exposure unchanged while the peak stays inside the band.
+  peak           brightest pixel of the last image, 0..EXPO_FULL_SCALE
+  saturated_pct  percentage of saturated pixels
+  power_high/low power status bits of the camera
+---------------------------------------------------------------------------*/
+double expo_update (expo_tuner_t *et, double exposure, double peak, double saturated_pct, int power_high, int power_low)
+{
+	double level = peak / EXPO_FULL_SCALE;
+	double factor;
+
+	et->checks++;
+	et->last_peak          = peak;
+	et->last_saturated_pct = saturated_pct;
+
+	if(power_high || saturated_pct > et->saturated_pct || level > et->high)
+		factor = (level > 0.0 && level < 1.0) ? et->target / level : 1.0 / EXPO_MAX_STEP; // a clipped peak says nothing about the true level
+	else if(power_low || level < et->low)
+		factor = (level > 0.0) ? et->target / level : EXPO_MAX_STEP;
+	else
+		return exposure;
+
+	if(factor > EXPO_MAX_STEP)
+		factor = EXPO_MAX_STEP;
+	if(factor < 1.0 / EXPO_MAX_STEP)
+		factor = 1.0 / EXPO_MAX_STEP;
+
+	factor *= exposure;
+	if(et->exp_incr > 0.0)
+		factor = et->exp_min + floor((factor - et->exp_min) / et->exp_incr + 0.5) * et->exp_incr;
+	if(factor < et->exp_min)
+		factor = et->exp_min;
+	if(factor > et->exp_max)
+		factor = et->exp_max;
+
+	if(factor != exposure)
+		et->changes++;
+	return factor;
+}
+
+
+/*---------------------------------------------------------------------------
+  Search from exposure / gain, at most max_frames frames. gain_min ==
+  gain_max keeps the gain.
+---------------------------------------------------------------------------*/
+void expo_search_init (expo_search_t *es, double exp_min, double exp_max, double exp_incr, double gain_min, double gain_max,
+                       double exposure, double gain, int max_frames)
+{
+	memset(es, 0, sizeof(*es));
+	es->exp_min       = exp_min;
+	es->exp_max       = exp_max;
+	es->exp_incr      = exp_incr;
+	es->gain_min      = gain_min;
+	es->gain_max      = gain_max;
+	es->low           = EXPO_DEFAULT_LOW;
+	es->high          = EXPO_DEFAULT_HIGH;
+	es->target        = EXPO_DEFAULT_TARGET;
+	es->saturated_pct = EXPO_DEFAULT_SATURATED_PCT;
+	es->max_frames    = max_frames > 0 ? max_frames : 1;
+	es->bright_level  = -1.0;
+	es->exposure      = (exposure < exp_min) ? exp_min : (exposure > exp_max) ? exp_max : exposure;
+	es->gain          = (gain < gain_min) ? gain_min : (gain > gain_max) ? gain_max : gain;
+}
+
+
+/*---------------------------------------------------------------------------
+  Exposure and gain for the product e: the lowest gain that reaches it,
+  the exposure on the increment grid of the camera
+---------------------------------------------------------------------------*/
+static void expo_search_set (expo_search_t *es, double e)
+{
+	double exposure = e / es->gain_min, gain = es->gain_min;
+
+	if(exposure > es->exp_max)
+	{
+		exposure = es->exp_max;
+		gain     = e / es->exp_max;
+		if(gain > es->gain_max)
+			gain = es->gain_max;
+	}
+	if(es->exp_incr > 0.0)
+		exposure = es->exp_min + floor((exposure - es->exp_min) / es->exp_incr + 0.5) * es->exp_incr;
+	if(exposure < es->exp_min)
+		exposure = es->exp_min;
+	if(exposure > es->exp_max)
+		exposure = es->exp_max;
+	es->exposure = exposure;
+	es->gain     = gain;
+}
+
+
+/*---------------------------------------------------------------------------
+  Look at the frame taken with es->exposure / es->gain. Returns
+  EXPO_SEARCH_MORE with the settings of the next frame in es,
+  EXPO_SEARCH_FOUND or EXPO_SEARCH_FAILED.
+  peak           brightest pixel of the frame, 0..EXPO_FULL_SCALE
+  saturated_pct  percentage of saturated pixels
+  power_high/low power status bits of the camera
+---------------------------------------------------------------------------*/
+int expo_search_update (expo_search_t *es, double peak, double saturated_pct, int power_high, int power_low)
+{
+	double level = peak / EXPO_FULL_SCALE;
+	double e = es->exposure * es->gain, next, e_min, e_max;
+	int    clipped = power_high || saturated_pct > es->saturated_pct;
+
+	es->frames++;
+	es->last_peak = peak;
+	if(!clipped && !power_low && level >= es->low && level <= es->high)
+		return EXPO_SEARCH_FOUND;
+
+	if(clipped || level > es->high)
+	{
+		es->bright       = e;
+		es->bright_level = (clipped || level >= 1.0) ? -1.0 : level; // a clipped peak is only a bound
+	}
+	else
+	{
+		es->dark       = e;
+		es->dark_level = level;
+	}
+	if(es->frames >= es->max_frames)
+		return EXPO_SEARCH_FAILED;
+
+	// secant through the bracket, or through the origin from the side that has a level
+	if(es->dark > 0.0 && es->bright_level > es->dark_level)
+		next = es->dark + (es->target - es->dark_level) * (es->bright - es->dark) / (es->bright_level - es->dark_level);
+	else if(es->dark > 0.0 && es->dark_level >= EXPO_SEARCH_MIN_LEVEL)
+		next = es->dark * es->target / es->dark_level;
+	else if(es->bright > 0.0 && es->bright_level > 0.0)
+		next = es->bright * es->target / es->bright_level;
+	else
+		next = (es->dark == e) ? e * EXPO_SEARCH_STEP : e / EXPO_SEARCH_STEP;
+
+	// bisection on the log scale when the secant leaves the bracket
+	if(es->dark > 0.0 && es->bright > 0.0 && (next <= es->dark || next >= es->bright))
+		next = sqrt(es->dark * es->bright);
+
+	e_min = es->exp_min * es->gain_min;
+	e_max = es->exp_max * es->gain_max;
+	if(next < e_min)
+		next = e_min;
+	if(next > e_max)
+		next = e_max;
+	expo_search_set(es, next);
+
+	// nothing left to try: at the end of the range, or the bracket is closed on the exposure grid
+	if(fabs(es->exposure * es->gain - e) <= 1e-9 * e)
+		return EXPO_SEARCH_FAILED;
+	return EXPO_SEARCH_MORE;
+}
+
+
+/*---------------------------------------------------------------------------
+  Exposure and gain stored for the sensor with this serial, -1 if there
+  is no file or it belongs to another sensor
+---------------------------------------------------------------------------*/
+int expo_recall (const char *path, const char *serial, double *exposure, double *gain)
+{
+	FILE   *fp;
+	char   stored[256];
+	double e, g;
+	int    n;
+
+	if((fp = fopen(path, "r")) == NULL)
+		return -1;
+	n = fscanf(fp, "%255s %lf %lf", stored, &e, &g);
+	fclose(fp);
+	if(n != 3 || strcmp(stored, serial) || !(e > 0.0) || !(g > 0.0))
+		return -1;
+	*exposure = e;
+	*gain     = g;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Store the last good exposure and gain of the sensor with this serial
+---------------------------------------------------------------------------*/
+int expo_remember (const char *path, const char *serial, double exposure, double gain)
+{
+	FILE *fp;
+
+	if((fp = fopen(path, "w")) == NULL)
+		return -1;
+	fprintf(fp, "%s %.6f %.6f\n", serial, exposure, gain);
+	return fclose(fp) ? -1 : 0;
+}
@@ -0,0 +1,93 @@
+/*===============================================================================================================================
+  exposure.h
+
+  Low-rate exposure tuner for the fixed-exposure loop. The loop takes every frame at a fixed exposure time. Every few
+  frames the tuner looks at the image peak, the share of saturated pixels and the power status bits of the camera. It
+  only proposes a new exposure time once the signal leaves a hysteresis band, so a spot field near a threshold does not
+  make the exposure flip from frame to frame. The caller applies the change between two frames.
+
+  Exposure search for the first well exposed frame. It brackets the exposure x gain product between a too dark and a
+  too bright frame, and takes the secant through the bracket (or through the origin, the peak grows in proportion)
+  for the next frame, falling back to a bisection on the log scale when the secant leaves the bracket. A clipped
+  frame gives no level, only a bound. The search ends in the band or after a fixed number of frames; the last good
+  exposure is stored per sensor serial, so the next run usually starts inside the band.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_EXPOSURE_H
+#define WFS_DMH_EXPOSURE_H
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  EXPO_FULL_SCALE               (255.0)   // MONO8 image
+#define  EXPO_DEFAULT_LOW              (0.50)    // raise the exposure when the peak falls below this fraction of full scale
+#define  EXPO_DEFAULT_HIGH             (0.95)    // lower it when the peak rises above this fraction
+#define  EXPO_DEFAULT_TARGET           (0.75)    // peak aimed at after a change
+#define  EXPO_DEFAULT_SATURATED_PCT    (0.05)    // lower it when more than this percentage of pixels is saturated
+#define  EXPO_MAX_STEP                 (2.0)     // largest factor applied in one change
+#define  EXPO_SEARCH_STEP              (8.0)     // factor of a search step without a usable level
+#define  EXPO_SEARCH_MIN_LEVEL         (0.02)    // a darker peak is taken as no level at all
+
+#define  EXPO_SEARCH_MORE              (0)       // take the next frame at exposure / gain of the search
+#define  EXPO_SEARCH_FOUND             (1)       // the last frame is inside the band
+#define  EXPO_SEARCH_FAILED            (-1)      // out of frames, or the band is out of reach of exposure and gain
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	double  exp_min;         // exposure range of the camera, ms
+	double  exp_max;
+	double  exp_incr;
+	double  low;             // hysteresis band and target as fractions of full scale
+	double  high;
+	double  target;
+	double  saturated_pct;
+	int     every;           // frames between two looks at the image
+
+	long    frames;
+	long    checks;
+	long    changes;
+	double  last_peak;
+	double  last_saturated_pct;
+} expo_tuner_t;
+
+typedef struct
+{
+	double  exp_min;         // exposure range of the camera, ms
+	double  exp_max;
+	double  exp_incr;
+	double  gain_min;        // master gain range, equal if the gain is not set
+	double  gain_max;
+	double  low;             // band and target as fractions of full scale
+	double  high;
+	double  target;
+	double  saturated_pct;
+	int     max_frames;
+
+	double  exposure;        // settings of the next frame
+	double  gain;
+	int     frames;
+	double  dark;            // exposure x gain bracket, 0 while no frame was too dark
+	double  dark_level;
+	double  bright;          // 0 while no frame was too bright
+	double  bright_level;    // -1 if that frame was clipped
+	double  last_peak;
+} expo_search_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+void   expo_init (expo_tuner_t *et, double exp_min, double exp_max, double exp_incr, int every);
+int    expo_due (expo_tuner_t *et);
+double expo_update (expo_tuner_t *et, double exposure, double peak, double saturated_pct, int power_high, int power_low);
+
+void   expo_search_init (expo_search_t *es, double exp_min, double exp_max, double exp_incr, double gain_min, double gain_max,
+                         double exposure, double gain, int max_frames);
+int    expo_search_update (expo_search_t *es, double peak, double saturated_pct, int power_high, int power_low);
+int    expo_recall (const char *path, const char *serial, double *exposure, double *gain);
+int    expo_remember (const char *path, const char *serial, double exposure, double gain);
+
+#endif // WFS_DMH_EXPOSURE_H
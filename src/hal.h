@@ -0,0 +1,78 @@
+/*===============================================================================================================================
+  hal.h
+
+  Hardware abstraction of the sensor and the mirror. The loop only talks to a hal_sensor_t and a hal_mirror_t, so the
+  same loop runs on the Thorlabs WFS / DMH devices (backend in WFS-DMH.c), on the simulated optical bench (sim.c) or
+  on recorded frames (capture.c).
+  Every operation returns 0 on success and a negative, backend specific error code otherwise. Optional operations
+  are NULL when a backend does not support them.
+
+  Deviation and Zernike arrays follow the driver: spot arrays have a row stride of HAL_SPOTS_STRIDE with NaN where a
+  lenslet has no spot, Zernike arrays are indexed from 1 (1 piston, 2 tip, 3 tilt, ...).
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_HAL_H
+#define WFS_DMH_HAL_H
+
+#include "zfit.h"
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  HAL_SPOTS_STRIDE              (80)      // MAX_SPOTS_X of the driver
+#define  HAL_MAX_SEGMENTS              (40)      // MAX_SEGMENTS of the DMH40
+#define  HAL_MAX_TILT                  (3)       // tilt arms of the DMH40
+
+#define  HAL_STATUS_POWER_HIGH         (0x01)    // saturated spots, WFS_STATBIT_PTH
+#define  HAL_STATUS_POWER_LOW          (0x02)    // too little light, WFS_STATBIT_PTL
+
+#define  HAL_BACKEND_THORLABS          (0)
+#define  HAL_BACKEND_SIM               (1)
+#define  HAL_BACKEND_REPLAY            (2)       // frames recorded with the capture writer, see capture.h
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	const char  *name;
+	void        *ctx;          // backend state, passed to every operation
+
+	// spots_x / spots_y of the configured camera, and the geometry the Zernike projection needs
+	int   (*geometry)(void *ctx, zfit_geometry_t *geo, float scale_x[], float scale_y[], int *spots_x, int *spots_y);
+
+	int   (*take_image)(void *ctx);                                            // expose and read out at the current exposure
+	int   (*take_image_auto)(void *ctx);                                       // same, the camera adjusts exposure first
+	int   (*get_image)(void *ctx, unsigned char **image, int *rows, int *cols); // MONO8 of the last frame, read in place
+	int   (*deviations)(void *ctx, int cancel_tilt, float dev_x[], float dev_y[]); // centroids of the last frame to the reference, px
+	int   (*zernikes)(void *ctx, int order, float zernike[]);                 // fit of the last frame, um
+
+	int   (*get_exposure_range)(void *ctx, double *min_ms, double *max_ms, double *incr_ms);
+	int   (*get_exposure)(void *ctx, double *ms);
+	int   (*set_exposure)(void *ctx, double ms, double *actual_ms);
+	int   (*get_gain)(void *ctx, double *gain);
+	int   (*get_gain_range)(void *ctx, double *min, double *max); // optional, with set_gain
+	int   (*set_gain)(void *ctx, double gain, double *actual);     // optional
+	int   (*get_status)(void *ctx, int *status);                              // HAL_STATUS_* of the last frame
+	int   (*image_min_max)(void *ctx, int *min, int *max, double *saturated_pct);
+	int   (*beam_centroid)(void *ctx, double *x_mm, double *y_mm);  // optional: intensity centroid of the last frame
+
+	int   (*highspeed)(void *ctx, int on);      // optional: windowed readout around the current spots
+	int   (*highspeed_check)(void *ctx);        // optional: 1 if spots left their windows, 0 if not
+} hal_sensor_t;
+
+typedef struct
+{
+	const char  *name;
+	void        *ctx;
+	int         n_segments;
+	int         n_tilt;
+	double      seg_min, seg_max;      // V
+	double      tilt_min, tilt_max;
+
+	int   (*set_segments)(void *ctx, const double voltage[]);
+	int   (*set_tilt)(void *ctx, const double voltage[]);   // optional
+} hal_mirror_t;
+
+#endif // WFS_DMH_HAL_H
@@ -0,0 +1,117 @@
+/*===============================================================================================================================
+  histo.c
+
+  Log-linear latency histogram, see histo.h.
+===============================================================================================================================*/
+
+#include "histo.h"
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+
+
+/*---------------------------------------------------------------------------
+  Index of the highest set bit, v > 0
+---------------------------------------------------------------------------*/
+static int histo_msb (uint64_t v)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+
+	_BitScanReverse64(&i, v);
+	return (int)i;
+#else
+	return 63 - __builtin_clzll(v);
+#endif
+}
+
+
+/*---------------------------------------------------------------------------
+  Bucket of a value in ns
+---------------------------------------------------------------------------*/
+static int histo_index (uint64_t v)
+{
+	int e;
+
+	if(v < HISTO_SUB_COUNT)
+		return (int)v;
+	e = histo_msb(v);
+	if(e > HISTO_MAX_EXP)
+		return HISTO_BUCKETS - 1;
+	// group e - HISTO_SUB_BITS + 1, position given by the HISTO_SUB_BITS bits below the top one
+	return (e - HISTO_SUB_BITS + 1) * HISTO_SUB_COUNT + (int)((v >> (e - HISTO_SUB_BITS)) - HISTO_SUB_COUNT);
+}
+
+
+/*---------------------------------------------------------------------------
+  Largest value in ns that falls into bucket i
+---------------------------------------------------------------------------*/
+static double histo_upper (int i)
+{
+	int g = i / HISTO_SUB_COUNT, sub = i % HISTO_SUB_COUNT;
+
+	if(g == 0)
+		return (double)i;
+	return (double)((((uint64_t)(HISTO_SUB_COUNT + sub + 1)) << (g - 1)) - 1);
+}
+
+
+/*---------------------------------------------------------------------------
+  Empty histogram
+---------------------------------------------------------------------------*/
+void histo_reset (histo_t *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+
+/*---------------------------------------------------------------------------
+  Count one value in ns
+---------------------------------------------------------------------------*/
+void histo_record (histo_t *h, double ns)
+{
+	uint64_t v = (ns > 0.0) ? (uint64_t)ns : 0;
+
+	if(ns >= HISTO_MAX_NS)
+		v = (uint64_t)HISTO_MAX_NS;
+	h->bucket[histo_index(v)]++;
+	h->count++;
+	h->sum_ns += ns;
+	if(ns > h->max_ns)
+		h->max_ns = ns;
+}
+
+
+/*---------------------------------------------------------------------------
+  Value in ns below which a fraction q of the counts lie (0 <= q <= 1), as the
+  upper end of its bucket but never above the recorded maximum
+---------------------------------------------------------------------------*/
+double histo_quantile (const histo_t *h, double q)
+{
+	uint64_t rank, seen = 0;
+	double   v;
+
+	if(h->count == 0)
+		return 0.0;
+	rank = (uint64_t)(q * (double)h->count + 0.5);
+	if(rank < 1)
+		rank = 1;
+	if(rank > h->count)
+		rank = h->count;
+	for(int i = 0; i < HISTO_BUCKETS; i++)
+	{
+		seen += h->bucket[i];
+		if(seen >= rank)
+		{
+			if(i == HISTO_BUCKETS - 1)
+				return h->max_ns;   // overflow bucket has no upper end
+			v = histo_upper(i);
+			return (v < h->max_ns) ? v : h->max_ns;
+		}
+	}
+	return h->max_ns;
+}
+
@@ -0,0 +1,43 @@
+/*===============================================================================================================================
+  histo.h
+
+  Fixed-memory latency histogram with HDR-style log-linear buckets. Values below 2^HISTO_SUB_BITS ns are counted
+  exactly. Above that, every power of two is split into 2^HISTO_SUB_BITS equal buckets, so a quantile is within 1/32
+  (about 3 %) of the true value from 1 ns up to HISTO_MAX_NS. Recording is a bit scan and one increment, without
+  allocation, locks or floating point division, so it can stay on in every loop iteration.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_HISTO_H
+#define WFS_DMH_HISTO_H
+
+#include <stdint.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  HISTO_SUB_BITS                (5)
+#define  HISTO_SUB_COUNT               (1 << HISTO_SUB_BITS)
+#define  HISTO_MAX_EXP                 (36)      // largest power of two resolved, 2^36 ns ~ 69 s
+#define  HISTO_BUCKETS                 ((HISTO_MAX_EXP - HISTO_SUB_BITS + 2) * HISTO_SUB_COUNT)
+#define  HISTO_MAX_NS                  ((double)((uint64_t)1 << (HISTO_MAX_EXP + 1)))
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	uint64_t  count;
+	double    sum_ns;
+	double    max_ns;
+	uint64_t  bucket[HISTO_BUCKETS];   // longer values are counted in the last bucket
+} histo_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+void   histo_reset (histo_t *h);
+void   histo_record (histo_t *h, double ns);
+double histo_quantile (const histo_t *h, double q);
+
+#endif // WFS_DMH_HISTO_H
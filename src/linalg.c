@@ -0,0 +1,252 @@
+/*===============================================================================================================================
+  linalg.c
+
+  Dense linear algebra helpers: one-sided Jacobi SVD, truncated pseudo-inverse, Cholesky solve and matrix-vector products.
+  These are only used off the hot path (calibration) except for la_gemv, which is the per-frame reconstructor product.
+===============================================================================================================================*/
+
+#include "linalg.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  LA_SVD_MAX_SWEEPS             (60)     // Jacobi sweeps before giving up, converges in ~10 for our sizes
+#define  LA_SVD_EPS                    (1e-15)
+
+
+
+/*---------------------------------------------------------------------------
+  Singular value decomposition A = U S V^T for m >= n (one-sided Jacobi).
+  a (m x n) is overwritten by U, s receives n singular values, v the n x n V.
+  Returns 0 on success, -1 if m < n or the sweeps did not converge.
+---------------------------------------------------------------------------*/
+int la_svd (double a[], int m, int n, double s[], double v[])
+{
+	int     i, j, k, sweep, rotated;
+	double  alpha, beta, gamma, zeta, t, c, sn, ap, aq;
+
+	if(m < n)
+		return -1;
+
+	for(i = 0; i < n; i++)
+		for(j = 0; j < n; j++)
+			v[i * n + j] = (i == j) ? 1.0 : 0.0;
+
+	for(sweep = 0; sweep < LA_SVD_MAX_SWEEPS; sweep++)
+	{
+		rotated = 0;
+		for(j = 0; j < n - 1; j++)
+		{
+			for(k = j + 1; k < n; k++)
+			{
+				alpha = beta = gamma = 0.0;
+				for(i = 0; i < m; i++)
+				{
+					ap = a[i * n + j];
+					aq = a[i * n + k];
+					alpha += ap * ap;
+					beta  += aq * aq;
+					gamma += ap * aq;
+				}
+				if(fabs(gamma) <= LA_SVD_EPS * sqrt(alpha * beta) || gamma == 0.0)
+					continue;
+
+				rotated = 1;
+				zeta = (beta - alpha) / (2.0 * gamma);
+				t    = ((zeta >= 0.0) ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+				c    = 1.0 / sqrt(1.0 + t * t);
+				sn   = c * t;
+
+				for(i = 0; i < m; i++)
+				{
+					ap = a[i * n + j];
+					aq = a[i * n + k];
+					a[i * n + j] = c * ap - sn * aq;
+					a[i * n + k] = sn * ap + c * aq;
+				}
+				for(i = 0; i < n; i++)
+				{
+					ap = v[i * n + j];
+					aq = v[i * n + k];
+					v[i * n + j] = c * ap - sn * aq;
+					v[i * n + k] = sn * ap + c * aq;
+				}
+			}
+		}
+		if(!rotated)
+			break;
+	}
+
+	// column norms are the singular values, normalised columns are U
+	for(j = 0; j < n; j++)
+	{
+		alpha = 0.0;
+		for(i = 0; i < m; i++)
+			alpha += a[i * n + j] * a[i * n + j];
+		s[j] = sqrt(alpha);
+		if(s[j] > 0.0)
+			for(i = 0; i < m; i++)
+				a[i * n + j] /= s[j];
+	}
+
+	return (sweep < LA_SVD_MAX_SWEEPS) ? 0 : -1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Truncated pseudo-inverse of a (m x n) into ainv (n x m).
+  Singular values below rcond * s_max are discarded. Returns the rank kept, or -1 on failure.
+---------------------------------------------------------------------------*/
+int la_pinv (const double a[], int m, int n, double rcond, double ainv[])
+{
+	int     i, j, k, rows, cols, rank = 0, transposed = (m < n);
+	double  *u, *v, *s, smax = 0.0, acc;
+
+	// the SVD wants a tall matrix, so factor A^T when A is wide and transpose the result back
+	rows = transposed ? n : m;
+	cols = transposed ? m : n;
+
+	u = malloc(sizeof(double) * rows * cols);
+	v = malloc(sizeof(double) * cols * cols);
+	s = malloc(sizeof(double) * cols);
+	if(!u || !v || !s)
+	{
+		free(u); free(v); free(s);
+		return -1;
+	}
+
+	for(i = 0; i < m; i++)
+		for(j = 0; j < n; j++)
+		{
+			if(transposed)
+				u[j * cols + i] = a[i * n + j];
+			else
+				u[i * cols + j] = a[i * n + j];
+		}
+
+	if(la_svd(u, rows, cols, s, v))
+	{
+		free(u); free(v); free(s);
+		return -1;
+	}
+
+	for(k = 0; k < cols; k++)
+		if(s[k] > smax)
+			smax = s[k];
+
+	for(k = 0; k < cols; k++)
+	{
+		if(s[k] > rcond * smax && s[k] > 0.0)
+		{
+			s[k] = 1.0 / s[k];
+			rank++;
+		}
+		else
+			s[k] = 0.0;
+	}
+
+	// pinv(B) = V S^-1 U^T is cols x rows; for the transposed case pinv(A) = pinv(A^T)^T
+	for(i = 0; i < cols; i++)
+		for(j = 0; j < rows; j++)
+		{
+			acc = 0.0;
+			for(k = 0; k < cols; k++)
+				acc += v[i * cols + k] * s[k] * u[j * cols + k];
+			if(transposed)
+				ainv[j * m + i] = acc;
+			else
+				ainv[i * m + j] = acc;
+		}
+
+	free(u); free(v); free(s);
+	return rank;
+}
+
+
+/*---------------------------------------------------------------------------
+  Solve A x = b in place for symmetric positive definite A (n x n).
+  a is overwritten by its Cholesky factor, b by the solution. Returns -1 if A is not SPD.
+---------------------------------------------------------------------------*/
+int la_cholesky_solve (double a[], int n, double b[])
+{
+	int     i, j, k;
+	double  acc;
+
+	for(j = 0; j < n; j++)
+	{
+		acc = a[j * n + j];
+		for(k = 0; k < j; k++)
+			acc -= a[j * n + k] * a[j * n + k];
+		if(acc <= 0.0)
+			return -1;
+		a[j * n + j] = sqrt(acc);
+
+		for(i = j + 1; i < n; i++)
+		{
+			acc = a[i * n + j];
+			for(k = 0; k < j; k++)
+				acc -= a[i * n + k] * a[j * n + k];
+			a[i * n + j] = acc / a[j * n + j];
+		}
+	}
+
+	// forward then backward substitution with L and L^T
+	for(i = 0; i < n; i++)
+	{
+		acc = b[i];
+		for(k = 0; k < i; k++)
+			acc -= a[i * n + k] * b[k];
+		b[i] = acc / a[i * n + i];
+	}
+	for(i = n - 1; i >= 0; i--)
+	{
+		acc = b[i];
+		for(k = i + 1; k < n; k++)
+			acc -= a[k * n + i] * b[k];
+		b[i] = acc / a[i * n + i];
+	}
+
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  y = A x for A (m x n)
+---------------------------------------------------------------------------*/
+void la_gemv (const double a[], int m, int n, const double x[], double y[])
+{
+	int     i, j;
+	double  acc;
+
+	for(i = 0; i < m; i++)
+	{
+		const double *row = a + (size_t)i * n;
+		acc = 0.0;
+		for(j = 0; j < n; j++)
+			acc += row[j] * x[j];
+		y[i] = acc;
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+  y = A^T x for A (m x n), y has n entries
+---------------------------------------------------------------------------*/
+void la_gemv_t (const double a[], int m, int n, const double x[], double y[])
+{
+	int     i, j;
+
+	memset(y, 0, sizeof(double) * n);
+	for(i = 0; i < m; i++)
+	{
+		const double *row = a + (size_t)i * n;
+		for(j = 0; j < n; j++)
+			y[j] += row[j] * x[i];
+	}
+}
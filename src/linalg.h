@@ -0,0 +1,21 @@
+/*===============================================================================================================================
+  linalg.h
+
+  Small dense linear algebra helpers used by the reconstructors. All matrices are row-major double arrays.
+  Nothing in here touches the Thorlabs SDKs, so these routines also build on Linux for the benchmarks.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_LINALG_H
+#define WFS_DMH_LINALG_H
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  la_svd (double a[], int m, int n, double s[], double v[]);
+int  la_pinv (const double a[], int m, int n, double rcond, double ainv[]);
+int  la_cholesky_solve (double a[], int n, double b[]);
+
+void la_gemv (const double a[], int m, int n, const double x[], double y[]);
+void la_gemv_t (const double a[], int m, int n, const double x[], double y[]);
+
+#endif // WFS_DMH_LINALG_H
@@ -0,0 +1,298 @@
+/*===============================================================================================================================
+  mrate.c
+
+  Multi-rate schedule of the modal loop, see mrate.h.
+===============================================================================================================================*/
+
+#include "mrate.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+
+
+/*---------------------------------------------------------------------------
+  n channels and no groups yet
+---------------------------------------------------------------------------*/
+void mrate_init (mrate_t *mr, int n)
+{
+	memset(mr, 0, sizeof(*mr));
+	mr->n = n;
+}
+
+
+/*---------------------------------------------------------------------------
+  Group of count channels from first, corrected on every divisor-th frame
+  from the mean of the last depth frames. Returns its index, -1 if it does
+  not fit the channels, overlaps a group or the table is full.
+---------------------------------------------------------------------------*/
+int mrate_add_group (mrate_t *mr, int first, int count, int divisor, int depth)
+{
+	mrate_group_t *g;
+	int i;
+
+	if(mr->n_groups >= MRATE_MAX_GROUPS || first < 0 || count < 1 || first + count > mr->n || divisor < 1 || depth < 1 || depth > divisor)
+		return -1;
+	for(i = 0; i < mr->n_groups; i++)
+		if(first < mr->group[i].first + mr->group[i].count && mr->group[i].first < first + count)
+			return -1;
+	g = &mr->group[mr->n_groups];
+	memset(g, 0, sizeof(*g));
+	g->first   = first;
+	g->count   = count;
+	g->divisor = divisor;
+	g->depth   = depth;
+	return mr->n_groups++;
+}
+
+
+/*---------------------------------------------------------------------------
+  Groups from text, "first-last:divisor:depth" per group in Zernike
+  numbers, comma separated. A single mode needs no "-last", without
+  ":depth" all frames since the last correction are averaged. Channel 0 is
+  Zernike first_mode. Returns 0, or -1 with no groups set.
+---------------------------------------------------------------------------*/
+int mrate_parse (mrate_t *mr, const char *text, int first_mode)
+{
+	const char *p = text;
+	char *end;
+	long a, b, d, k;
+
+	mr->n_groups = 0;
+	for(;;)
+	{
+		while(isspace((unsigned char)*p))
+			p++;
+		a = strtol(p, &end, 10);
+		if(end == p)
+			break;
+		b = a;
+		p = end;
+		if(*p == '-')
+		{
+			b = strtol(p + 1, &end, 10);
+			if(end == p + 1)
+				break;
+			p = end;
+		}
+		if(*p != ':')
+			break;
+		d = strtol(p + 1, &end, 10);
+		if(end == p + 1)
+			break;
+		p = end;
+		k = d;
+		if(*p == ':')
+		{
+			k = strtol(p + 1, &end, 10);
+			if(end == p + 1)
+				break;
+			p = end;
+		}
+		if(mrate_add_group(mr, (int)(a - first_mode), (int)(b - a + 1), (int)d, (int)k) < 0)
+			break;
+		while(isspace((unsigned char)*p))
+			p++;
+		if(*p == '\0')
+			return 0;
+		if(*p++ != ',')
+			break;
+	}
+	mr->n_groups = 0;
+	return -1;
+}
+
+
+/*---------------------------------------------------------------------------
+  1 if every channel is in a group, channels outside would never be corrected
+---------------------------------------------------------------------------*/
+int mrate_covers (const mrate_t *mr)
+{
+	int i, n = 0;
+
+	for(i = 0; i < mr->n_groups; i++)
+		n += mr->group[i].count;
+	return mr->n_groups > 0 && n == mr->n;
+}
+
+
+/*---------------------------------------------------------------------------
+  Sums of up to len samples per frame for every group, after the groups are
+  set. Returns -1 if out of memory.
+---------------------------------------------------------------------------*/
+int mrate_alloc (mrate_t *mr, int len)
+{
+	int i;
+
+	for(i = 0; i < mr->n_groups; i++)
+		if((mr->group[i].sum = calloc(len, sizeof(double))) == NULL)
+		{
+			mrate_free(mr);
+			return -1;
+		}
+	mr->len = len;
+	return 0;
+}
+
+
+void mrate_free (mrate_t *mr)
+{
+	int i;
+
+	for(i = 0; i < mr->n_groups; i++)
+	{
+		free(mr->group[i].sum);
+		mr->group[i].sum = NULL;
+	}
+	mr->len = 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Drop the partial sums and the counters, the groups stay. Needed whenever
+  the samples change their meaning, e.g. with the lenslets fitted.
+---------------------------------------------------------------------------*/
+void mrate_reset (mrate_t *mr)
+{
+	int i;
+
+	for(i = 0; i < mr->n_groups; i++)
+	{
+		if(mr->group[i].sum)
+			memset(mr->group[i].sum, 0, sizeof(double) * mr->len);
+		mr->group[i].n_sum   = 0;
+		mr->group[i].updates = 0;
+	}
+	mr->frames = 0;
+	mr->full   = 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Groups (bit i for group i) whose next correction averages this frame
+---------------------------------------------------------------------------*/
+unsigned int mrate_measuring (const mrate_t *mr, long frame)
+{
+	unsigned int mask = 0;
+	int i;
+
+	for(i = 0; i < mr->n_groups; i++)
+		if(frame % mr->group[i].divisor >= mr->group[i].divisor - mr->group[i].depth)
+			mask |= 1u << i;
+	return mask;
+}
+
+
+/*---------------------------------------------------------------------------
+  Groups corrected on this frame, always a subset of mrate_measuring
+---------------------------------------------------------------------------*/
+unsigned int mrate_due (const mrate_t *mr, long frame)
+{
+	unsigned int mask = 0;
+	int i;
+
+	for(i = 0; i < mr->n_groups; i++)
+		if(frame % mr->group[i].divisor == mr->group[i].divisor - 1)
+			mask |= 1u << i;
+	return mask;
+}
+
+
+/*---------------------------------------------------------------------------
+  Lowest and highest channel of the groups in the mask. Returns the number
+  of channels in between, 0 for an empty mask.
+---------------------------------------------------------------------------*/
+int mrate_span (const mrate_t *mr, unsigned int groups, int *first, int *last)
+{
+	int i;
+
+	*first = mr->n;
+	*last  = -1;
+	for(i = 0; i < mr->n_groups; i++)
+		if(groups & (1u << i))
+		{
+			if(mr->group[i].first < *first)
+				*first = mr->group[i].first;
+			if(mr->group[i].first + mr->group[i].count - 1 > *last)
+				*last = mr->group[i].first + mr->group[i].count - 1;
+		}
+	return (*last >= *first) ? *last - *first + 1 : 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  active[ch] 1 for the channels of the groups in the mask, 0 for the others
+---------------------------------------------------------------------------*/
+void mrate_active (const mrate_t *mr, unsigned int groups, unsigned char active[])
+{
+	int i, ch;
+
+	memset(active, 0, mr->n);
+	for(i = 0; i < mr->n_groups; i++)
+		if(groups & (1u << i))
+			for(ch = mr->group[i].first; ch < mr->group[i].first + mr->group[i].count; ch++)
+				active[ch] = 1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Add the n samples x of this frame to the sums of the groups that average
+  it. Returns the groups due, mrate_mean takes their means.
+---------------------------------------------------------------------------*/
+unsigned int mrate_accumulate (mrate_t *mr, long frame, const double x[], int n)
+{
+	unsigned int measuring = mrate_measuring(mr, frame), due = mrate_due(mr, frame);
+	int i, k;
+
+	if(n > mr->len)
+		n = mr->len;
+	for(i = 0; i < mr->n_groups; i++)
+	{
+		mrate_group_t *g = &mr->group[i];
+
+		if(!(measuring & (1u << i)))
+			continue;
+		for(k = 0; k < n; k++)
+			g->sum[k] += x[k];
+		g->n_sum++;
+	}
+	mr->frames++;
+	if(mr->n_groups && due == (1u << mr->n_groups) - 1)
+		mr->full++;
+	return due;
+}
+
+
+/*---------------------------------------------------------------------------
+  Mean of the first n samples of group g since its last correction, the sum
+  starts over. Frames pass the same n until mrate_reset, so only these are
+  cleared.
+---------------------------------------------------------------------------*/
+void mrate_mean (mrate_t *mr, int g, double mean[], int n)
+{
+	mrate_group_t *gr = &mr->group[g];
+	int k;
+
+	if(n > mr->len)
+		n = mr->len;
+	for(k = 0; k < n; k++)
+		mean[k] = gr->n_sum ? gr->sum[k] / gr->n_sum : 0.0;
+	memset(gr->sum, 0, sizeof(double) * n);
+	gr->n_sum = 0;
+	gr->updates++;
+}
+
+
+void mrate_report (const mrate_t *mr, FILE *fp, int first_mode)
+{
+	int i;
+
+	fprintf(fp, "Multi-rate groups:");
+	for(i = 0; i < mr->n_groups; i++)
+	{
+		const mrate_group_t *g = &mr->group[i];
+
+		fprintf(fp, " Z%d-%d every %d (mean of %d) %ld,", g->first + first_mode, g->first + g->count - 1 + first_mode, g->divisor, g->depth, g->updates);
+	}
+	fprintf(fp, " all groups on %ld of %ld frames\n", mr->full, mr->frames);
+}
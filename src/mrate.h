@@ -0,0 +1,75 @@
+/*===============================================================================================================================
+  mrate.h
+
+  Multi-rate schedule of the modal loop. The controller channels (Z4 .. Z15) are split into groups, and every group
+  has its own update divisor and averaging depth: a group with divisor d is corrected on every d-th frame, from the
+  mean of the last depth frames before that. Low orders that drift quickly are corrected on every frame, noisy high
+  orders less often and from an average.
+
+  The schedule only depends on the frame number, so the thread that measures a frame and the thread that corrects it
+  agree on it without talking: mrate_measuring tells which groups average the frame, mrate_due which ones are
+  corrected from it. Every group keeps the sum of the samples of its frames, the spot slopes or the Zernikes, and
+  mrate_mean hands it their mean when it is due. The Zernike fit is linear, so a group's modes are fitted once from
+  its mean slopes, which equals the mean of a fit on every frame, and a frame that no group is due on needs no fit.
+
+  Groups are written as "first-last:divisor:depth" per group, separated by commas, in Zernike numbers, e.g.
+  "4-6:1:1,7-10:2:2,11-15:4:4".
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_MRATE_H
+#define WFS_DMH_MRATE_H
+
+#include <stdio.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  MRATE_MAX_GROUPS              (8)
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	int     first;                   // channels first .. first + count - 1
+	int     count;
+	int     divisor;                 // corrected on every divisor-th frame
+	int     depth;                   // frames averaged into a correction, 1 .. divisor
+	int     n_sum;                   // frames in sum since the last correction
+	double  *sum;                    // samples summed over these frames
+	long    updates;
+} mrate_group_t;
+
+typedef struct
+{
+	int            n;                               // channels
+	int            n_groups;
+	mrate_group_t  group[MRATE_MAX_GROUPS];
+	int            len;                             // samples per frame the sums hold at most
+	long           frames;                          // frames passed to mrate_accumulate
+	long           full;                            // of these, frames on which every group was due
+} mrate_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+void mrate_init (mrate_t *mr, int n);
+int  mrate_add_group (mrate_t *mr, int first, int count, int divisor, int depth);
+int  mrate_parse (mrate_t *mr, const char *text, int first_mode);
+int  mrate_covers (const mrate_t *mr);
+int  mrate_alloc (mrate_t *mr, int len);
+void mrate_free (mrate_t *mr);
+void mrate_reset (mrate_t *mr);
+
+unsigned int mrate_measuring (const mrate_t *mr, long frame);
+unsigned int mrate_due (const mrate_t *mr, long frame);
+int  mrate_span (const mrate_t *mr, unsigned int groups, int *first, int *last);
+void mrate_active (const mrate_t *mr, unsigned int groups, unsigned char active[]);
+
+unsigned int mrate_accumulate (mrate_t *mr, long frame, const double x[], int n);
+void mrate_mean (mrate_t *mr, int g, double mean[], int n);
+
+void mrate_report (const mrate_t *mr, FILE *fp, int first_mode);
+
+#endif // WFS_DMH_MRATE_H
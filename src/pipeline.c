@@ -0,0 +1,190 @@
+/*===============================================================================================================================
+  pipeline.c
+
+  Two-stage frame pipeline, see pipeline.h.
+===============================================================================================================================*/
+
+#include "pipeline.h"
+#include "rtloop.h"
+#include <string.h>
+
+
+
+/*---------------------------------------------------------------------------
+  Use the two caller-allocated buffers as slots
+---------------------------------------------------------------------------*/
+int pipeline_init (pipeline_t *pl, void *buf0, void *buf1)
+{
+	memset(pl, 0, sizeof(*pl));
+	pl->slot[0]      = buf0;
+	pl->slot[1]      = buf1;
+	pl->ready        = -1;
+	pl->reading      = -1;
+	pl->writing      = -1;
+	pl->last_written = 1;
+
+	if(pthread_mutex_init(&pl->lock, NULL))
+		return -1;
+	if(pthread_cond_init(&pl->cond, NULL))
+	{
+		pthread_mutex_destroy(&pl->lock);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Release the synchronisation objects, the buffers stay with the caller
+---------------------------------------------------------------------------*/
+void pipeline_destroy (pipeline_t *pl)
+{
+	pthread_cond_destroy(&pl->cond);
+	pthread_mutex_destroy(&pl->lock);
+}
+
+
+/*---------------------------------------------------------------------------
+  Writer: get the slot the reader is not using. Never blocks.
+---------------------------------------------------------------------------*/
+void *pipeline_write_begin (pipeline_t *pl)
+{
+	int w;
+
+	pthread_mutex_lock(&pl->lock);
+	if(pl->reading >= 0)
+		w = 1 - pl->reading;
+	else if(pl->ready >= 0)
+		w = 1 - pl->ready;
+	else
+		w = 1 - pl->last_written;
+
+	if(pl->ready == w)
+	{
+		// reader fell behind, the newer frame replaces the unread one
+		pl->ready = -1;
+		pl->dropped++;
+	}
+	pl->writing    = w;
+	pl->t_start[w] = rt_now_ns();
+	pthread_mutex_unlock(&pl->lock);
+
+	return pl->slot[w];
+}
+
+
+/*---------------------------------------------------------------------------
+  Writer: publish the slot filled since pipeline_write_begin
+---------------------------------------------------------------------------*/
+void pipeline_write_end (pipeline_t *pl)
+{
+	pthread_mutex_lock(&pl->lock);
+	pl->ready        = pl->writing;
+	pl->last_written = pl->writing;
+	pl->t_published[pl->writing] = rt_now_ns();
+	pl->writing      = -1;
+	pl->produced++;
+	pthread_cond_signal(&pl->cond);
+	pthread_mutex_unlock(&pl->lock);
+}
+
+
+/*---------------------------------------------------------------------------
+  Reader: wait for the newest frame, returns NULL once the pipeline is stopped
+---------------------------------------------------------------------------*/
+void *pipeline_read_begin (pipeline_t *pl)
+{
+	double wait;
+	int    r;
+
+	pthread_mutex_lock(&pl->lock);
+	while(pl->ready < 0 && !pl->stop)
+		pthread_cond_wait(&pl->cond, &pl->lock);
+	if(pl->stop)
+	{
+		pthread_mutex_unlock(&pl->lock);
+		return NULL;
+	}
+
+	r = pl->reading = pl->ready;
+	pl->ready = -1;
+	wait = rt_now_ns() - pl->t_published[r];
+	pl->wait_sum_ns += wait;
+	if(wait > pl->wait_max_ns)
+		pl->wait_max_ns = wait;
+	pthread_mutex_unlock(&pl->lock);
+
+	return pl->slot[r];
+}
+
+
+/*---------------------------------------------------------------------------
+  Reader: done with the frame, account its end-to-end latency
+---------------------------------------------------------------------------*/
+void pipeline_read_end (pipeline_t *pl)
+{
+	double latency;
+
+	pthread_mutex_lock(&pl->lock);
+	latency = rt_now_ns() - pl->t_start[pl->reading];
+	pl->latency_sum_ns += latency;
+	if(latency > pl->latency_max_ns)
+		pl->latency_max_ns = latency;
+	pl->reading = -1;
+	pl->consumed++;
+	pthread_mutex_unlock(&pl->lock);
+}
+
+
+/*---------------------------------------------------------------------------
+  Wake a waiting reader and make it return NULL
+---------------------------------------------------------------------------*/
+void pipeline_stop (pipeline_t *pl)
+{
+	pthread_mutex_lock(&pl->lock);
+	pl->stop = 1;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->lock);
+}
+
+
+/*---------------------------------------------------------------------------
+  Copy of the counters, the lock is only held for the copy
+---------------------------------------------------------------------------*/
+void pipeline_stats (pipeline_t *pl, pipeline_stats_t *st)
+{
+	pthread_mutex_lock(&pl->lock);
+	st->produced       = pl->produced;
+	st->consumed       = pl->consumed;
+	st->dropped        = pl->dropped;
+	st->wait_sum_ns    = pl->wait_sum_ns;
+	st->wait_max_ns    = pl->wait_max_ns;
+	st->latency_sum_ns = pl->latency_sum_ns;
+	st->latency_max_ns = pl->latency_max_ns;
+	pthread_mutex_unlock(&pl->lock);
+}
+
+
+/*---------------------------------------------------------------------------
+  Printout of frame counts and latencies
+---------------------------------------------------------------------------*/
+void pipeline_report (pipeline_t *pl, FILE *fp)
+{
+	pipeline_stats_t st;
+
+	pipeline_stats(pl, &st);
+	pipeline_report_stats(&st, fp);
+}
+
+
+/*---------------------------------------------------------------------------
+  Printout of counters taken with pipeline_stats, on any thread
+---------------------------------------------------------------------------*/
+void pipeline_report_stats (const pipeline_stats_t *st, FILE *fp)
+{
+	long n = st->consumed ? st->consumed : 1;
+
+	fprintf(fp, "Pipeline: %ld frames acquired, %ld corrected, %ld dropped\n", st->produced, st->consumed, st->dropped);
+	fprintf(fp, "  added latency (queue wait) mean %.1f us, max %.1f us; end-to-end mean %.1f us, max %.1f us\n",
+	        st->wait_sum_ns / n / 1e3, st->wait_max_ns / 1e3, st->latency_sum_ns / n / 1e3, st->latency_max_ns / 1e3);
+}
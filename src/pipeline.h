@@ -0,0 +1,68 @@
+/*===============================================================================================================================
+  pipeline.h
+
+  Two-stage frame pipeline with preallocated double buffers. The acquisition stage fills one slot while the correction
+  stage works on the other, so the camera exposes frame N+1 while frame N is reconstructed and sent to the mirror.
+  The writer never blocks: if the reader is still busy, an unread frame is replaced by the newer one and counted as
+  dropped. Queue wait (the latency added by pipelining) and end-to-end latency are tracked per frame.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_PIPELINE_H
+#define WFS_DMH_PIPELINE_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	void             *slot[2];
+	double           t_start[2];       // acquisition start of the frame in each slot, ns
+	double           t_published[2];
+	int              ready;            // slot with the newest unread frame, -1 if none
+	int              reading;          // slot held by the reader, -1 if none
+	int              writing;          // slot held by the writer, -1 if none
+	int              last_written;
+	int              stop;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+
+	long             produced;
+	long             consumed;
+	long             dropped;
+	double           wait_sum_ns;      // published -> picked up, what pipelining adds to the loop delay
+	double           wait_max_ns;
+	double           latency_sum_ns;   // acquisition start -> correction done
+	double           latency_max_ns;
+} pipeline_t;
+
+typedef struct
+{
+	long             produced;
+	long             consumed;
+	long             dropped;
+	double           wait_sum_ns;
+	double           wait_max_ns;
+	double           latency_sum_ns;
+	double           latency_max_ns;
+} pipeline_stats_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int   pipeline_init (pipeline_t *pl, void *buf0, void *buf1);
+void  pipeline_destroy (pipeline_t *pl);
+
+void *pipeline_write_begin (pipeline_t *pl);
+void  pipeline_write_end (pipeline_t *pl);
+void *pipeline_read_begin (pipeline_t *pl);
+void  pipeline_read_end (pipeline_t *pl);
+void  pipeline_stop (pipeline_t *pl);
+
+void  pipeline_stats (pipeline_t *pl, pipeline_stats_t *st);
+void  pipeline_report (pipeline_t *pl, FILE *fp);
+void  pipeline_report_stats (const pipeline_stats_t *st, FILE *fp);
+
+#endif // WFS_DMH_PIPELINE_H
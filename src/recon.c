@@ -0,0 +1,171 @@
+/*===============================================================================================================================
+  recon.c
+
+  Native modal reconstructor, see recon.h.
+===============================================================================================================================*/
+
+#include "recon.h"
+#include "linalg.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  RECON_FILE_MAGIC              (0x43524457u) // "WDRC"
+#define  RECON_FILE_VERSION            (1)
+
+typedef struct
+{
+	unsigned int  magic;
+	int           version;
+	int           n_modes;
+	int           n_act;
+	int           rank;
+	double        rcond;
+} recon_file_header_t;
+
+
+
+/*---------------------------------------------------------------------------
+  Allocate an empty reconstructor for n_modes measured terms and n_act segments
+---------------------------------------------------------------------------*/
+int recon_init (recon_t *rc, int n_modes, int n_act)
+{
+	memset(rc, 0, sizeof(*rc));
+	rc->n_modes = n_modes;
+	rc->n_act   = n_act;
+	rc->rcond   = RECON_DEFAULT_RCOND;
+	rc->im      = calloc((size_t)n_modes * n_act, sizeof(double));
+	rc->cm      = calloc((size_t)n_modes * n_act, sizeof(double));
+
+	if(!rc->im || !rc->cm)
+	{
+		recon_free(rc);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Release the matrices
+---------------------------------------------------------------------------*/
+void recon_free (recon_t *rc)
+{
+	free(rc->im);
+	free(rc->cm);
+	rc->im = rc->cm = NULL;
+}
+
+
+/*---------------------------------------------------------------------------
+  Store the measured response (um per volt) of segment act as one IM column
+---------------------------------------------------------------------------*/
+void recon_set_response (recon_t *rc, int act, const double response[])
+{
+	for(int i = 0; i < rc->n_modes; i++)
+		rc->im[i * rc->n_act + act] = response[i];
+}
+
+
+/*---------------------------------------------------------------------------
+  Invert the interaction matrix into the control matrix, returns the rank kept or -1
+---------------------------------------------------------------------------*/
+int recon_compute (recon_t *rc, double rcond)
+{
+	rc->rcond = rcond;
+	rc->rank  = la_pinv(rc->im, rc->n_modes, rc->n_act, rcond, rc->cm);
+	return rc->rank;
+}
+
+
+/*---------------------------------------------------------------------------
+  Voltage step dv that cancels the Zernike residual (measured - target), per iteration cost is one GEMV
+---------------------------------------------------------------------------*/
+void recon_apply (const recon_t *rc, const double residual[], double dv[])
+{
+	la_gemv(rc->cm, rc->n_act, rc->n_modes, residual, dv);
+}
+
+
+/*---------------------------------------------------------------------------
+  Write interaction and control matrix at the current position of fp, so
+  they can be part of a larger file
+---------------------------------------------------------------------------*/
+int recon_write (const recon_t *rc, FILE *fp)
+{
+	recon_file_header_t  hdr;
+	size_t               cnt = (size_t)rc->n_modes * rc->n_act;
+
+	hdr.magic   = RECON_FILE_MAGIC;
+	hdr.version = RECON_FILE_VERSION;
+	hdr.n_modes = rc->n_modes;
+	hdr.n_act   = rc->n_act;
+	hdr.rank    = rc->rank;
+	hdr.rcond   = rc->rcond;
+
+	if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1 || fwrite(rc->im, sizeof(double), cnt, fp) != cnt || fwrite(rc->cm, sizeof(double), cnt, fp) != cnt)
+		return -1;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Read matrices written by recon_write, rc must be initialised with matching
+  dimensions
+---------------------------------------------------------------------------*/
+int recon_read (recon_t *rc, FILE *fp)
+{
+	recon_file_header_t  hdr;
+	size_t               cnt = (size_t)rc->n_modes * rc->n_act;
+
+	if(fread(&hdr, sizeof(hdr), 1, fp) != 1
+	|| hdr.magic != RECON_FILE_MAGIC || hdr.version != RECON_FILE_VERSION
+	|| hdr.n_modes != rc->n_modes || hdr.n_act != rc->n_act
+	|| fread(rc->im, sizeof(double), cnt, fp) != cnt
+	|| fread(rc->cm, sizeof(double), cnt, fp) != cnt)
+		return -1;
+
+	rc->rank  = hdr.rank;
+	rc->rcond = hdr.rcond;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Store interaction and control matrix in a binary file
+---------------------------------------------------------------------------*/
+int recon_save (const recon_t *rc, const char *path)
+{
+	FILE  *fp;
+
+	if((fp = fopen(path, "wb")) == NULL)
+		return -1;
+	if(recon_write(rc, fp))
+	{
+		fclose(fp);
+		return -1;
+	}
+	return fclose(fp) ? -1 : 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Load matrices saved by recon_save, rc must be initialised with matching dimensions
+---------------------------------------------------------------------------*/
+int recon_load (recon_t *rc, const char *path)
+{
+	FILE  *fp;
+	int   err;
+
+	if((fp = fopen(path, "rb")) == NULL)
+		return -1;
+	err = recon_read(rc, fp);
+	fclose(fp);
+	return err;
+}
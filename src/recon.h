@@ -0,0 +1,53 @@
+/*===============================================================================================================================
+  recon.h
+
+  Native modal reconstructor. The Zernike response of every mirror segment is measured once (interaction matrix),
+  inverted with a truncated SVD into a control matrix and stored, so each loop iteration is one matrix-vector product
+  instead of a call to TLDFMX_get_flat_wavefront.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_RECON_H
+#define WFS_DMH_RECON_H
+
+#include <stdio.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  RECON_FIRST_MODE              (4)   // Z4 (astigmatism 45) is the first term the mirror segments correct, as in TLDFMX
+#define  RECON_MODES                   (12)  // Z4 .. Z15, same terms as TLDFMX_MAX_ZERNIKE_TERMS
+#define  RECON_ZERNIKE_ORDER           (4)   // Zernike order that contains Z15
+#define  RECON_DEFAULT_RCOND           (0.02) // drop singular values below 2% of the largest
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	int     n_modes;   // rows of the interaction matrix
+	int     n_act;     // columns of the interaction matrix (mirror segments)
+	int     rank;      // singular values kept in the control matrix
+	double  rcond;
+
+	double  *im;       // interaction matrix, n_modes x n_act, um per volt
+	double  *cm;       // control matrix, n_act x n_modes, volt per um
+} recon_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  recon_init (recon_t *rc, int n_modes, int n_act);
+void recon_free (recon_t *rc);
+
+void recon_set_response (recon_t *rc, int act, const double response[]);
+int  recon_compute (recon_t *rc, double rcond);
+void recon_apply (const recon_t *rc, const double residual[], double dv[]);
+
+int  recon_write (const recon_t *rc, FILE *fp);
+int  recon_read (recon_t *rc, FILE *fp);
+
+int  recon_save (const recon_t *rc, const char *path);
+int  recon_load (recon_t *rc, const char *path);
+
+#endif // WFS_DMH_RECON_H
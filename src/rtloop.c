@@ -0,0 +1,253 @@
+/*===============================================================================================================================
+  rtloop.c
+
+  Fixed-rate loop scheduler, see rtloop.h.
+===============================================================================================================================*/
+
+#if !defined(_WIN32)
+#define _GNU_SOURCE   // pthread_setaffinity_np
+#endif
+
+#include "rtloop.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  RT_NS_PER_S                   (1000000000L)
+
+
+
+/*---------------------------------------------------------------------------
+  Add ns to a timespec
+---------------------------------------------------------------------------*/
+static void rt_ts_add (struct timespec *ts, double ns)
+{
+	long long total = (long long)ts->tv_nsec + (long long)ns;
+
+	ts->tv_sec  += (time_t)(total / RT_NS_PER_S);
+	ts->tv_nsec  = (long)(total % RT_NS_PER_S);
+	if(ts->tv_nsec < 0)
+	{
+		ts->tv_nsec += RT_NS_PER_S;
+		ts->tv_sec--;
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+  a - b in ns
+---------------------------------------------------------------------------*/
+static double rt_ts_diff (const struct timespec *a, const struct timespec *b)
+{
+	return (double)(a->tv_sec - b->tv_sec) * 1e9 + (double)(a->tv_nsec - b->tv_nsec);
+}
+
+
+/*---------------------------------------------------------------------------
+  Monotonic clock in ns
+---------------------------------------------------------------------------*/
+double rt_now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*---------------------------------------------------------------------------
+  Sleep for ns, for threads outside the loop that poll at a low rate
+---------------------------------------------------------------------------*/
+void rt_sleep_ns (double ns)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rt_ts_add(&ts, ns);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+}
+
+
+/*---------------------------------------------------------------------------
+  Scheduler for rate_hz iterations per second, 0 runs free without sleeping
+---------------------------------------------------------------------------*/
+void rt_init (rt_sched_t *rt, double rate_hz)
+{
+	memset(rt, 0, sizeof(*rt));
+	rt->period_ns = (rate_hz > 0.0) ? 1e9 / rate_hz : 0.0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Register a stage with a time budget in us (0 for none), returns the stage id or -1
+---------------------------------------------------------------------------*/
+int rt_add_stage (rt_sched_t *rt, const char *name, double budget_us)
+{
+	rt_stage_t *st;
+
+	if(rt->n_stages >= RT_MAX_STAGES)
+		return -1;
+
+	st = &rt->stage[rt->n_stages];
+	memset(st, 0, sizeof(*st));
+	st->name      = name;
+	st->budget_ns = budget_us * 1e3;
+	return rt->n_stages++;
+}
+
+
+/*---------------------------------------------------------------------------
+  Run the calling thread with real-time priority and/or pinned to one core.
+  priority 0 keeps the normal scheduler, cpu < 0 keeps the affinity. Returns -1 if a request was refused.
+---------------------------------------------------------------------------*/
+int rt_set_realtime (int priority, int cpu)
+{
+	int ret = 0;
+
+#if defined(_WIN32)
+	if(priority > 0 && !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+		ret = -1;
+	if(cpu >= 0 && !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu))
+		ret = -1;
+#else
+	if(priority > 0)
+	{
+		struct sched_param sp;
+
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = priority;
+		if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
+			ret = -1;
+		mlockall(MCL_CURRENT | MCL_FUTURE); // page faults would cost more than the whole loop iteration
+	}
+	if(cpu >= 0)
+	{
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			ret = -1;
+	}
+#endif
+	return ret;
+}
+
+
+/*---------------------------------------------------------------------------
+  Release the first iteration now
+---------------------------------------------------------------------------*/
+void rt_start (rt_sched_t *rt)
+{
+	clock_gettime(CLOCK_MONOTONIC, &rt->next);
+	rt->stage_start = rt->next;
+	rt_ts_add(&rt->next, rt->period_ns);
+}
+
+
+/*---------------------------------------------------------------------------
+  Mark the start of the first stage of an iteration, later stages start where the previous one ended
+---------------------------------------------------------------------------*/
+void rt_stage_begin (rt_sched_t *rt)
+{
+	clock_gettime(CLOCK_MONOTONIC, &rt->stage_start);
+}
+
+
+/*---------------------------------------------------------------------------
+  Close a stage, returns its duration in ns
+---------------------------------------------------------------------------*/
+double rt_stage_end (rt_sched_t *rt, int stage)
+{
+	struct timespec now;
+	rt_stage_t      *st = &rt->stage[stage];
+	double          ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = rt_ts_diff(&now, &rt->stage_start);
+	rt->stage_start = now;
+
+	st->count++;
+	st->total_ns += ns;
+	st->last_ns   = ns;
+	if(ns > st->max_ns)
+		st->max_ns = ns;
+	histo_record(&st->hist, ns);
+	if(st->budget_ns > 0.0 && ns > st->budget_ns)
+		st->overruns++;
+	return ns;
+}
+
+
+/*---------------------------------------------------------------------------
+  End of an iteration: account a deadline miss and sleep until the next release on the absolute grid.
+  A late iteration releases the next one on the first grid point still ahead, so the phase is kept.
+  Returns 1 if this iteration missed its deadline.
+---------------------------------------------------------------------------*/
+int rt_wait (rt_sched_t *rt)
+{
+	struct timespec now;
+	double          late;
+	int             missed = 0;
+
+	rt->iterations++;
+	if(rt->period_ns <= 0.0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late = rt_ts_diff(&now, &rt->next);
+	if(late > 0.0)
+	{
+		missed = 1;
+		rt->deadline_misses++;
+		if(late > rt->max_late_ns)
+			rt->max_late_ns = late;
+		while(rt_ts_diff(&now, &rt->next) >= 0.0)
+		{
+			rt_ts_add(&rt->next, rt->period_ns);
+			rt->skipped_periods++;
+		}
+	}
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &rt->next, NULL))
+		; // interrupted by a signal, the absolute deadline makes retrying safe
+
+	rt->stage_start = rt->next;
+	rt_ts_add(&rt->next, rt->period_ns);
+	return missed;
+}
+
+
+/*---------------------------------------------------------------------------
+  Printout of rate, deadline misses and per stage timing
+---------------------------------------------------------------------------*/
+void rt_report (const rt_sched_t *rt, FILE *fp)
+{
+	if(rt->period_ns > 0.0)
+		fprintf(fp, "Loop %.1f Hz: %ld iterations, %ld deadline misses (max %.1f us late), %ld periods skipped\n",
+		        1e9 / rt->period_ns, rt->iterations, rt->deadline_misses, rt->max_late_ns / 1e3, rt->skipped_periods);
+	else
+		fprintf(fp, "Loop free running: %ld iterations\n", rt->iterations);
+
+	fprintf(fp, "  Stage          mean[us]    p50[us]    p99[us]  p99.9[us]     max[us]   budget[us]   overruns\n");
+	for(int i = 0; i < rt->n_stages; i++)
+	{
+		const rt_stage_t *st = &rt->stage[i];
+		fprintf(fp, "  %-12s %10.1f %10.1f %10.1f %10.1f  %10.1f   %10.1f   %8ld\n", st->name, st->count ? st->total_ns / st->count / 1e3 : 0.0,
+		        histo_quantile(&st->hist, 0.5) / 1e3, histo_quantile(&st->hist, 0.99) / 1e3, histo_quantile(&st->hist, 0.999) / 1e3,
+		        st->max_ns / 1e3, st->budget_ns / 1e3, st->overruns);
+	}
+}
@@ -0,0 +1,69 @@
+/*===============================================================================================================================
+  rtloop.h
+
+  Fixed-rate loop scheduler. Iterations are released on an absolute CLOCK_MONOTONIC grid with clock_nanosleep, so the
+  rate does not drift with the work done per iteration. Every iteration that ends after its deadline is counted as a
+  deadline miss, and every stage that runs longer than its budget is counted as an overrun of that stage. Every stage
+  time also goes into a per-stage latency histogram, so the report gives p50/p99/p99.9 next to mean and max.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_RTLOOP_H
+#define WFS_DMH_RTLOOP_H
+
+#include "histo.h"
+#include <stdio.h>
+#include <time.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  RT_MAX_STAGES                 (8)
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	const char  *name;
+	double      budget_ns;   // 0 = no budget, never counts an overrun
+	long        count;
+	long        overruns;
+	double      total_ns;
+	double      max_ns;
+	double      last_ns;
+	histo_t     hist;
+} rt_stage_t;
+
+typedef struct
+{
+	double           period_ns;          // 0 = free running, no sleep
+	struct timespec  next;               // absolute release time of the next iteration
+	struct timespec  stage_start;
+
+	long             iterations;
+	long             deadline_misses;    // iterations that finished after their deadline
+	long             skipped_periods;    // whole periods dropped to resynchronise after a late iteration
+	double           max_late_ns;
+
+	int              n_stages;
+	rt_stage_t       stage[RT_MAX_STAGES];
+} rt_sched_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+void   rt_init (rt_sched_t *rt, double rate_hz);
+int    rt_add_stage (rt_sched_t *rt, const char *name, double budget_us);
+int    rt_set_realtime (int priority, int cpu);
+
+void   rt_start (rt_sched_t *rt);
+void   rt_stage_begin (rt_sched_t *rt);
+double rt_stage_end (rt_sched_t *rt, int stage);
+int    rt_wait (rt_sched_t *rt);
+
+void   rt_report (const rt_sched_t *rt, FILE *fp);
+double rt_now_ns (void);
+void   rt_sleep_ns (double ns);
+
+#endif // WFS_DMH_RTLOOP_H
@@ -0,0 +1,565 @@
+/*===============================================================================================================================
+  sim.c
+
+  Simulated sensor/mirror stand-in, see sim.h.
+===============================================================================================================================*/
+
+#include "sim.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+
+/*---------------------------------------------------------------------------
+  xorshift32 uniform in (0,1]
+---------------------------------------------------------------------------*/
+static double sim_uniform (unsigned int *state)
+{
+	unsigned int x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x ? x : 0x9e3779b9u;
+	return ((double)(*state >> 8) + 1.0) / 16777216.0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Standard normal deviate (Box-Muller)
+---------------------------------------------------------------------------*/
+double sim_gauss (unsigned int *state)
+{
+	double u1 = sim_uniform(state);
+	double u2 = sim_uniform(state);
+
+	return sqrt(-2.0 * log(u1)) * cos(6.283185307179586 * u2);
+}
+
+
+/*---------------------------------------------------------------------------
+  Build a random but well conditioned plant. Response falls off with mode number like a real segmented mirror,
+  which reaches the low orders easily and the high orders only weakly.
+---------------------------------------------------------------------------*/
+int sim_plant_init (sim_plant_t *p, int n_modes, int n_act, double noise_um, unsigned int seed)
+{
+	int i, j;
+
+	memset(p, 0, sizeof(*p));
+	p->n_modes    = n_modes;
+	p->n_act      = n_act;
+	p->noise_um   = noise_um;
+	p->rng        = seed ? seed : 1;
+	p->im         = malloc(sizeof(double) * n_modes * n_act);
+	p->aberration = malloc(sizeof(double) * n_modes);
+	if(!p->im || !p->aberration)
+	{
+		sim_plant_free(p);
+		return -1;
+	}
+
+	for(i = 0; i < n_modes; i++)
+	{
+		double scale = 0.02 / (1.0 + 0.25 * i); // um per volt
+		for(j = 0; j < n_act; j++)
+			p->im[i * n_act + j] = scale * sim_gauss(&p->rng);
+		p->aberration[i] = 0.5 * sim_gauss(&p->rng) / (1.0 + 0.25 * i);
+	}
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Release the plant
+---------------------------------------------------------------------------*/
+void sim_plant_free (sim_plant_t *p)
+{
+	free(p->im);
+	free(p->aberration);
+	p->im = p->aberration = NULL;
+}
+
+
+/*---------------------------------------------------------------------------
+  Zernike amplitudes (um) produced by the given segment voltages
+---------------------------------------------------------------------------*/
+void sim_plant_measure (sim_plant_t *p, const double voltage[], double zernike[])
+{
+	int i, j;
+
+	for(i = 0; i < p->n_modes; i++)
+	{
+		const double *row = p->im + i * p->n_act;
+		double acc = p->aberration[i];
+		for(j = 0; j < p->n_act; j++)
+			acc += row[j] * (voltage[j] - SIM_BIAS_VOLTAGE);
+		zernike[i] = acc + p->noise_um * sim_gauss(&p->rng);
+	}
+}
+
+
+
+/*===============================================================================================================================
+  Optical bench: Shack-Hartmann sensor and segmented mirror
+===============================================================================================================================*/
+
+/*---------------------------------------------------------------------------
+  A WFS20-like sensor at 512 x 512 pixels with an MLA150 and the 2 mm pupil of
+  WFS-DMH.c, behind a DMH40-like mirror biased at SIM_BIAS_VOLTAGE
+---------------------------------------------------------------------------*/
+void sim_optics_defaults (sim_optics_config_t *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->width             = 512;
+	cfg->height            = 512;
+	cfg->cam_pitch_um      = 5.0;
+	cfg->lenslet_pitch_um  = 150.0;
+	cfg->lenslet_f_um      = 5200.0;
+	cfg->pupil_diameter_mm = 2.0;
+	cfg->beam_diameter_mm  = 2.4;
+	cfg->spot_sigma_px     = 1.5;
+	cfg->counts_per_ms     = 250.0;
+	cfg->dark_counts       = 4.0;
+	cfg->noise_counts      = 3.0;
+	cfg->aberration_um     = 0.1;
+	cfg->seg_um_per_v      = 0.01;
+	cfg->seg_width         = 0.25;
+	cfg->tilt_urad_per_v   = 2.0;
+	cfg->seg_min           = 0.0;
+	cfg->seg_max           = 200.0;
+	cfg->tilt_min          = 0.0;
+	cfg->tilt_max          = 200.0;
+	cfg->seed              = 1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Segment centres in pupil radii: 4, 12 and 24 segments on three rings
+---------------------------------------------------------------------------*/
+static void sim_segment_layout (double x[], double y[])
+{
+	static const int    count[3]  = { 4, 12, 24 };
+	static const double radius[3] = { 0.2, 0.5, 0.85 };
+	int                 k = 0;
+
+	for(int r = 0; r < 3; r++)
+		for(int i = 0; i < count[r]; i++, k++)
+		{
+			double a = 6.283185307179586 * (i + 0.5) / count[r];
+			x[k] = radius[r] * cos(a);
+			y[k] = radius[r] * sin(a);
+		}
+}
+
+
+/*---------------------------------------------------------------------------
+  Render one frame from the current mirror state at the current exposure
+---------------------------------------------------------------------------*/
+static void sim_render (sim_optics_t *so)
+{
+	const sim_optics_config_t *c = &so->cfg;
+	double dv[SIM_SEGMENTS], dt[SIM_TILT_ARMS], gx[64], gy[64];
+	double amp = c->counts_per_ms * so->exposure_ms * so->gain;
+	double two_s2 = 2.0 * c->spot_sigma_px * c->spot_sigma_px;
+	int    r = (int)ceil(3.0 * c->spot_sigma_px), n = 2 * r + 1;
+
+	pthread_mutex_lock(&so->lock);
+	for(int k = 0; k < SIM_SEGMENTS; k++)
+		dv[k] = so->voltage[k] - SIM_BIAS_VOLTAGE;
+	for(int a = 0; a < SIM_TILT_ARMS; a++)
+		dt[a] = so->tilt[a] - SIM_BIAS_VOLTAGE;
+	pthread_mutex_unlock(&so->lock);
+
+	memset(so->image, (int)c->dark_counts, (size_t)c->width * c->height);
+	so->status = (amp >= SIM_FULL_SCALE) ? HAL_STATUS_POWER_HIGH : (amp < 0.1 * SIM_FULL_SCALE) ? HAL_STATUS_POWER_LOW : 0;
+	if(n > 64)
+	{
+		r = 31;   // gx / gy hold 64 taps, wider spots are cut off
+		n = 2 * r + 1;
+	}
+
+	for(int l = 0; l < so->n_lit; l++)
+	{
+		const double *ix = so->infl + (size_t)l * SIM_SEGMENTS;
+		const double *iy = so->infl + (size_t)(so->n_lit + l) * SIM_SEGMENTS;
+		int    i = so->lit[l] % HAL_SPOTS_STRIDE, j = so->lit[l] / HAL_SPOTS_STRIDE;
+		double sx = so->slope0[l], sy = so->slope0[so->n_lit + l], px, py;
+		int    x0, y0;
+
+		for(int k = 0; k < SIM_SEGMENTS; k++)
+		{
+			sx += ix[k] * dv[k];
+			sy += iy[k] * dv[k];
+		}
+		for(int a = 0; a < SIM_TILT_ARMS; a++)
+		{
+			sx += so->tilt_px_per_v[0][a] * dt[a];
+			sy += so->tilt_px_per_v[1][a] * dt[a];
+		}
+		px = so->grid.ref_x[i] + sx;
+		py = so->grid.ref_y[j] + sy;
+		x0 = (int)floor(px) - r + 1;
+		y0 = (int)floor(py) - r + 1;
+
+		// the spot is separable, n + n exponentials instead of n * n
+		for(int d = 0; d < n; d++)
+		{
+			gx[d] = amp * exp(-(x0 + d - px) * (x0 + d - px) / two_s2);
+			gy[d] = exp(-(y0 + d - py) * (y0 + d - py) / two_s2);
+		}
+		for(int dy = 0; dy < n; dy++)
+		{
+			int y = y0 + dy;
+			unsigned char *row;
+			if(y < 0 || y >= c->height)
+				continue;
+			row = so->image + (size_t)y * c->width;
+			for(int dx = 0; dx < n; dx++)
+			{
+				int    x = x0 + dx;
+				double v;
+				if(x < 0 || x >= c->width)
+					continue;
+				v = c->dark_counts + gx[dx] * gy[dy] + c->noise_counts * (2.0 * sim_uniform(&so->rng) - 1.0);
+				row[x] = (unsigned char)(v < 0.0 ? 0.0 : v > SIM_FULL_SCALE ? SIM_FULL_SCALE : v);
+			}
+		}
+	}
+	so->frames++;
+}
+
+
+/*---------------------------------------------------------------------------
+  hal_sensor_t operations
+---------------------------------------------------------------------------*/
+static int sim_geometry (void *ctx, zfit_geometry_t *geo, float scale_x[], float scale_y[], int *spots_x, int *spots_y)
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	*geo = so->geo;
+	memcpy(scale_x, so->scale_x, sizeof(so->scale_x));
+	memcpy(scale_y, so->scale_y, sizeof(so->scale_y));
+	*spots_x = so->grid.n_x;
+	*spots_y = so->grid.n_y;
+	return 0;
+}
+
+
+static int sim_take_image (void *ctx)
+{
+	sim_render((sim_optics_t *)ctx);
+	return 0;
+}
+
+
+static int sim_set_exposure (void *ctx, double ms, double *actual_ms)
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	if(ms < so->exp_min)
+		ms = so->exp_min;
+	if(ms > so->exp_max)
+		ms = so->exp_max;
+	so->exposure_ms = so->exp_min + floor((ms - so->exp_min) / so->exp_incr + 0.5) * so->exp_incr;
+	if(actual_ms)
+		*actual_ms = so->exposure_ms;
+	return 0;
+}
+
+
+static int sim_take_image_auto (void *ctx)
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	// the camera's auto exposure aims at three quarters of full scale
+	sim_set_exposure(ctx, 0.75 * SIM_FULL_SCALE / (so->cfg.counts_per_ms * so->gain), NULL);
+	sim_render(so);
+	return 0;
+}
+
+
+static int sim_get_image (void *ctx, unsigned char **image, int *rows, int *cols)
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	*image = so->image;
+	*rows  = so->cfg.height;
+	*cols  = so->cfg.width;
+	return 0;
+}
+
+
+static int sim_deviations (void *ctx, int cancel_tilt, float dev_x[], float dev_y[])
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	cent_compute(&so->grid, so->image, so->cfg.width, dev_x, dev_y, HAL_SPOTS_STRIDE);
+	cent_deviations(&so->grid, dev_x, dev_y, HAL_SPOTS_STRIDE, cancel_tilt);
+	return 0;
+}
+
+
+static int sim_zernikes (void *ctx, int order, float zernike[])
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	sim_deviations(ctx, 1, so->dev_x, so->dev_y);
+	if(so->zfit.generation < 0 || so->zfit.order != order)
+	{
+		if(zfit_build(&so->zfit, order, &so->geo, so->scale_x, so->scale_y, so->dev_x, so->dev_y, so->grid.n_x, so->grid.n_y, 0) <= 0)
+			return -1;
+	}
+	zfit_apply(&so->zfit, so->dev_x, so->dev_y, zernike);
+	return 0;
+}
+
+
+static int sim_get_exposure_range (void *ctx, double *min_ms, double *max_ms, double *incr_ms)
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	*min_ms  = so->exp_min;
+	*max_ms  = so->exp_max;
+	*incr_ms = so->exp_incr;
+	return 0;
+}
+
+
+static int sim_get_exposure (void *ctx, double *ms)
+{
+	*ms = ((sim_optics_t *)ctx)->exposure_ms;
+	return 0;
+}
+
+
+static int sim_get_gain (void *ctx, double *gain)
+{
+	*gain = ((sim_optics_t *)ctx)->gain;
+	return 0;
+}
+
+
+static int sim_get_gain_range (void *ctx, double *min, double *max)
+{
+	*min = 1.0;
+	*max = SIM_GAIN_MAX;
+	return 0;
+}
+
+
+static int sim_set_gain (void *ctx, double gain, double *actual)
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	so->gain = (gain < 1.0) ? 1.0 : (gain > SIM_GAIN_MAX) ? SIM_GAIN_MAX : gain;
+	if(actual)
+		*actual = so->gain;
+	return 0;
+}
+
+
+static int sim_get_status (void *ctx, int *status)
+{
+	*status = ((sim_optics_t *)ctx)->status;
+	return 0;
+}
+
+
+static int sim_image_min_max (void *ctx, int *min, int *max, double *saturated_pct)
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+	size_t       n = (size_t)so->cfg.width * so->cfg.height, sat = 0;
+	int          lo = SIM_FULL_SCALE, hi = 0;
+
+	for(size_t i = 0; i < n; i++)
+	{
+		int v = so->image[i];
+		if(v < lo)
+			lo = v;
+		if(v > hi)
+			hi = v;
+		sat += (v >= SIM_FULL_SCALE);
+	}
+	*min = lo;
+	*max = hi;
+	*saturated_pct = 100.0 * sat / n;
+	return 0;
+}
+
+
+static int sim_beam_centroid (void *ctx, double *x_mm, double *y_mm)
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	return cent_beam(so->image, so->cfg.width, so->cfg.height, so->cfg.width, so->cfg.cam_pitch_um, (int)(so->cfg.dark_counts + so->cfg.noise_counts), x_mm, y_mm);
+}
+
+
+/*---------------------------------------------------------------------------
+  hal_mirror_t operations, voltages outside the range are clamped like the driver does
+---------------------------------------------------------------------------*/
+static int sim_set_segments (void *ctx, const double voltage[])
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	pthread_mutex_lock(&so->lock);
+	for(int k = 0; k < SIM_SEGMENTS; k++)
+		so->voltage[k] = (voltage[k] < so->cfg.seg_min) ? so->cfg.seg_min : (voltage[k] > so->cfg.seg_max) ? so->cfg.seg_max : voltage[k];
+	pthread_mutex_unlock(&so->lock);
+	return 0;
+}
+
+
+static int sim_set_tilt (void *ctx, const double voltage[])
+{
+	sim_optics_t *so = (sim_optics_t *)ctx;
+
+	pthread_mutex_lock(&so->lock);
+	for(int a = 0; a < SIM_TILT_ARMS; a++)
+		so->tilt[a] = (voltage[a] < so->cfg.tilt_min) ? so->cfg.tilt_min : (voltage[a] > so->cfg.tilt_max) ? so->cfg.tilt_max : voltage[a];
+	pthread_mutex_unlock(&so->lock);
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Lay out the lenslets, draw a random static aberration and tabulate the
+  slope of the aberration and of every influence function at each lit lenslet
+---------------------------------------------------------------------------*/
+int sim_optics_init (sim_optics_t *so, const sim_optics_config_t *cfg)
+{
+	double seg_x[SIM_SEGMENTS], seg_y[SIM_SEGMENTS], r_mm, to_px, s2;
+	int    i, j, k, l;
+
+	memset(so, 0, sizeof(*so));
+	so->cfg = *cfg;
+	so->rng = cfg->seed ? cfg->seed : 1;
+	pthread_mutex_init(&so->lock, NULL);
+	if(cent_grid_init(&so->grid, cfg->width, cfg->height, cfg->cam_pitch_um, cfg->lenslet_pitch_um, 0.0, 0.0, CENT_DEFAULT_THRESHOLD) <= 0)
+	{
+		sim_optics_free(so);
+		return -1;
+	}
+
+	so->image = malloc((size_t)cfg->width * cfg->height);
+	so->dev_x = malloc(sizeof(float) * CENT_MAX_SPOTS * HAL_SPOTS_STRIDE);
+	so->dev_y = malloc(sizeof(float) * CENT_MAX_SPOTS * HAL_SPOTS_STRIDE);
+	so->lit   = malloc(sizeof(int) * so->grid.n_x * so->grid.n_y);
+	so->slope0 = malloc(sizeof(double) * 2 * so->grid.n_x * so->grid.n_y);
+	so->infl  = malloc(sizeof(double) * 2 * so->grid.n_x * so->grid.n_y * SIM_SEGMENTS);
+	if(!so->image || !so->dev_x || !so->dev_y || !so->lit || !so->slope0 || !so->infl || zfit_init(&so->zfit, so->grid.n_x * so->grid.n_y, HAL_SPOTS_STRIDE))
+	{
+		sim_optics_free(so);
+		return -1;
+	}
+
+	for(i = 0; i < so->grid.n_x; i++)
+		so->scale_x[i] = (float)((so->grid.ref_x[i] - (cfg->width - 1) / 2.0) * cfg->cam_pitch_um / 1000.0);
+	for(j = 0; j < so->grid.n_y; j++)
+		so->scale_y[j] = (float)((so->grid.ref_y[j] - (cfg->height - 1) / 2.0) * cfg->cam_pitch_um / 1000.0);
+	so->geo.diameter_x_mm = so->geo.diameter_y_mm = cfg->pupil_diameter_mm;
+	so->geo.slope_per_px  = cfg->cam_pitch_um / cfg->lenslet_f_um;
+
+	for(k = 2; k <= SIM_ABERRATION_MODES; k++)
+		so->aberration[k] = cfg->aberration_um * sim_gauss(&so->rng);
+
+	// wavefront slope in um / um to spot shift in pixels
+	r_mm  = cfg->pupil_diameter_mm / 2.0;
+	to_px = cfg->lenslet_f_um / cfg->cam_pitch_um;
+	s2    = cfg->seg_width * cfg->seg_width;
+	sim_segment_layout(seg_x, seg_y);
+	for(j = 0; j < so->grid.n_y; j++)
+		for(i = 0; i < so->grid.n_x; i++)
+		{
+			if(so->scale_x[i] * so->scale_x[i] + so->scale_y[j] * so->scale_y[j] <= cfg->beam_diameter_mm * cfg->beam_diameter_mm / 4.0)
+				so->lit[so->n_lit++] = j * HAL_SPOTS_STRIDE + i;
+		}
+	for(l = 0; l < so->n_lit; l++)
+	{
+		double u = so->scale_x[so->lit[l] % HAL_SPOTS_STRIDE] / r_mm, v = so->scale_y[so->lit[l] / HAL_SPOTS_STRIDE] / r_mm;
+		double sx = 0.0, sy = 0.0, gx, gy;
+
+		for(k = 2; k <= SIM_ABERRATION_MODES; k++)
+		{
+			zfit_mode_gradient(k, u, v, &gx, &gy);
+			sx += so->aberration[k] * gx;
+			sy += so->aberration[k] * gy;
+		}
+		so->slope0[l]             = sx / (r_mm * 1000.0) * to_px;
+		so->slope0[so->n_lit + l] = sy / (r_mm * 1000.0) * to_px;
+
+		for(k = 0; k < SIM_SEGMENTS; k++)
+		{
+			double du = u - seg_x[k], dv = v - seg_y[k];
+			double w  = cfg->seg_um_per_v * exp(-(du * du + dv * dv) / (2.0 * s2));
+			so->infl[(size_t)l * SIM_SEGMENTS + k]              = -w * du / s2 / (r_mm * 1000.0) * to_px;
+			so->infl[(size_t)(so->n_lit + l) * SIM_SEGMENTS + k] = -w * dv / s2 / (r_mm * 1000.0) * to_px;
+		}
+	}
+	for(k = 0; k < SIM_TILT_ARMS; k++)
+	{
+		double a = 6.283185307179586 * k / SIM_TILT_ARMS;
+		so->tilt_px_per_v[0][k] = cfg->tilt_urad_per_v * 1e-6 * cos(a) * to_px;
+		so->tilt_px_per_v[1][k] = cfg->tilt_urad_per_v * 1e-6 * sin(a) * to_px;
+	}
+
+	for(k = 0; k < SIM_SEGMENTS; k++)
+		so->voltage[k] = SIM_BIAS_VOLTAGE;
+	for(k = 0; k < SIM_TILT_ARMS; k++)
+		so->tilt[k] = SIM_BIAS_VOLTAGE;
+	so->exp_min  = 0.01;
+	so->exp_max  = 50.0;
+	so->exp_incr = 0.01;
+	so->gain     = 1.0;
+	sim_set_exposure(so, 0.75 * SIM_FULL_SCALE / cfg->counts_per_ms, NULL);
+
+	so->sensor.name               = "simulated Shack-Hartmann sensor";
+	so->sensor.ctx                = so;
+	so->sensor.geometry           = sim_geometry;
+	so->sensor.take_image         = sim_take_image;
+	so->sensor.take_image_auto    = sim_take_image_auto;
+	so->sensor.get_image          = sim_get_image;
+	so->sensor.deviations         = sim_deviations;
+	so->sensor.zernikes           = sim_zernikes;
+	so->sensor.get_exposure_range = sim_get_exposure_range;
+	so->sensor.get_exposure       = sim_get_exposure;
+	so->sensor.set_exposure       = sim_set_exposure;
+	so->sensor.get_gain           = sim_get_gain;
+	so->sensor.get_gain_range     = sim_get_gain_range;
+	so->sensor.set_gain           = sim_set_gain;
+	so->sensor.get_status         = sim_get_status;
+	so->sensor.image_min_max      = sim_image_min_max;
+	so->sensor.beam_centroid      = sim_beam_centroid;
+
+	so->mirror.name               = "simulated segmented mirror";
+	so->mirror.ctx                = so;
+	so->mirror.n_segments         = SIM_SEGMENTS;
+	so->mirror.n_tilt             = SIM_TILT_ARMS;
+	so->mirror.seg_min            = cfg->seg_min;
+	so->mirror.seg_max            = cfg->seg_max;
+	so->mirror.tilt_min           = cfg->tilt_min;
+	so->mirror.tilt_max           = cfg->tilt_max;
+	so->mirror.set_segments       = sim_set_segments;
+	so->mirror.set_tilt           = sim_set_tilt;
+
+	sim_render(so);
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Release the bench
+---------------------------------------------------------------------------*/
+void sim_optics_free (sim_optics_t *so)
+{
+	pthread_mutex_destroy(&so->lock);
+	free(so->image);
+	free(so->dev_x);
+	free(so->dev_y);
+	free(so->lit);
+	free(so->slope0);
+	free(so->infl);
+	zfit_free(&so->zfit);
+	memset(so, 0, sizeof(*so));
+}
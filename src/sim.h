@@ -0,0 +1,116 @@
+/*===============================================================================================================================
+  sim.h
+
+  Simulated stand-in for the sensor/mirror pair, so reconstructors and controllers can be exercised and benchmarked
+  without the Thorlabs hardware.
+
+  sim_plant_t is the modal shortcut: linear in the segment voltages, z = IM (v - v_bias) + z_aberration + noise.
+
+  sim_optics_t is the optical bench behind the hal_sensor_t / hal_mirror_t backends. The wavefront is a static
+  Zernike aberration plus the mirror: 40 segments with Gaussian influence functions on three rings over the pupil and
+  three tilt arms at 120 degrees that tip the whole surface. The sensor renders a MONO8 spotfield image with one
+  Gaussian spot per lenslet, displaced by the local wavefront slope, scaled with exposure and clipped at full scale.
+  Centroids come from the centroiding engine and Zernikes from the projection fit, as on the real path. Slopes of the
+  aberration and of every influence function are tabulated per lenslet once, so a frame costs a few microseconds plus
+  drawing the spots.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_SIM_H
+#define WFS_DMH_SIM_H
+
+#include "hal.h"
+#include "centroid.h"
+#include "zfit.h"
+#include <pthread.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  SIM_BIAS_VOLTAGE              (50.0) // same mid-range bias as mirrorPattern in main()
+#define  SIM_SEGMENTS                  (40)   // MAX_SEGMENTS of the DMH40
+#define  SIM_TILT_ARMS                 (3)
+#define  SIM_ABERRATION_MODES          (15)   // static aberration Z2 .. Z15 (4th order)
+#define  SIM_FULL_SCALE                (255)
+#define  SIM_GAIN_MAX                  (5.0)  // master gain range 1 .. SIM_GAIN_MAX
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	int           n_modes;
+	int           n_act;
+	double        noise_um;      // rms measurement noise added to each mode
+	double        *im;           // true interaction matrix, n_modes x n_act, um per volt
+	double        *aberration;   // static aberration seen at bias voltage, n_modes
+	unsigned int  rng;
+} sim_plant_t;
+
+typedef struct
+{
+	int           width;                // camera image, pixels
+	int           height;
+	double        cam_pitch_um;
+	double        lenslet_pitch_um;
+	double        lenslet_f_um;
+	double        pupil_diameter_mm;    // pupil the Zernikes and the mirror are defined on, centred on the camera
+	double        beam_diameter_mm;     // illuminated disc, lenslets outside it have no spot
+	double        spot_sigma_px;
+	double        counts_per_ms;        // spot peak per ms of exposure at gain 1
+	double        dark_counts;
+	double        noise_counts;         // uniform noise amplitude on the spot pixels
+	double        aberration_um;        // rms of the random static aberration of each mode
+	double        seg_um_per_v;         // peak of a segment's influence function per volt from the bias
+	double        seg_width;            // sigma of the influence function, pupil radii
+	double        tilt_urad_per_v;      // wavefront tilt of one tilt arm per volt from the bias
+	double        seg_min, seg_max;     // V
+	double        tilt_min, tilt_max;
+	unsigned int  seed;
+} sim_optics_config_t;
+
+typedef struct
+{
+	sim_optics_config_t  cfg;
+	cent_grid_t          grid;
+	zfit_t               zfit;
+	zfit_geometry_t      geo;
+	float                scale_x[CENT_MAX_SPOTS];      // lenslet positions, mm
+	float                scale_y[CENT_MAX_SPOTS];
+	double               aberration[SIM_ABERRATION_MODES + 1]; // um, index as in the driver's Zernike arrays
+	int                  n_lit;                        // lenslets inside the beam
+	int                  *lit;                         // their grid index j * HAL_SPOTS_STRIDE + i
+	double               *slope0;                      // aberration slope of each lit lenslet, x then y, px
+	double               *infl;                        // 2 * n_lit x SIM_SEGMENTS, px per volt
+	double               tilt_px_per_v[2][SIM_TILT_ARMS];
+
+	pthread_mutex_t      lock;                         // the mirror may be written while the sensor renders
+	double               voltage[SIM_SEGMENTS];
+	double               tilt[SIM_TILT_ARMS];
+
+	double               exposure_ms, exp_min, exp_max, exp_incr, gain;
+	int                  status;                       // HAL_STATUS_* of the last frame
+	long                 frames;
+	unsigned int         rng;
+	unsigned char        *image;
+	float                *dev_x;                       // scratch for the Zernike fit, HAL_SPOTS_STRIDE rows
+	float                *dev_y;
+
+	hal_sensor_t         sensor;
+	hal_mirror_t         mirror;
+} sim_optics_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int    sim_plant_init (sim_plant_t *p, int n_modes, int n_act, double noise_um, unsigned int seed);
+void   sim_plant_free (sim_plant_t *p);
+void   sim_plant_measure (sim_plant_t *p, const double voltage[], double zernike[]);
+
+double sim_gauss (unsigned int *state);
+
+void   sim_optics_defaults (sim_optics_config_t *cfg);
+int    sim_optics_init (sim_optics_t *so, const sim_optics_config_t *cfg);
+void   sim_optics_free (sim_optics_t *so);
+
+#endif // WFS_DMH_SIM_H
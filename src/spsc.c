@@ -0,0 +1,135 @@
+/*===============================================================================================================================
+  spsc.c
+
+  Lock-free single-producer / single-consumer channel, see spsc.h.
+===============================================================================================================================*/
+
+#include "spsc.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+
+
+/*---------------------------------------------------------------------------
+  Index loads and stores with acquire / release ordering
+---------------------------------------------------------------------------*/
+static unsigned int spsc_load_acquire (volatile unsigned int *p)
+{
+#if defined(_MSC_VER)
+	unsigned int v = *p;   // volatile loads have acquire semantics on MSVC
+	_ReadWriteBarrier();
+	return v;
+#else
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
+static void spsc_store_release (volatile unsigned int *p, unsigned int v)
+{
+#if defined(_MSC_VER)
+	_ReadWriteBarrier();
+	*p = v;                // volatile stores have release semantics on MSVC
+#else
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+#endif
+}
+
+
+/*---------------------------------------------------------------------------
+  Ring of at least capacity messages of msg_size bytes each
+---------------------------------------------------------------------------*/
+int spsc_init (spsc_t *q, unsigned int capacity, unsigned int msg_size)
+{
+	unsigned int n = 1;
+
+	memset(q, 0, sizeof(*q));
+	while(n < capacity)
+		n <<= 1;
+	q->mask     = n - 1;
+	q->msg_size = msg_size;
+	q->buf      = calloc(n, msg_size);
+	return q->buf ? 0 : -1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Release the ring, neither side may use it any more
+---------------------------------------------------------------------------*/
+void spsc_free (spsc_t *q)
+{
+	free(q->buf);
+	q->buf = NULL;
+}
+
+
+/*---------------------------------------------------------------------------
+  Producer: copy one message in, returns -1 if the ring is full
+---------------------------------------------------------------------------*/
+int spsc_push (spsc_t *q, const void *msg)
+{
+	unsigned int head = q->head;
+
+	if(head - q->tail_cache > q->mask)
+	{
+		q->tail_cache = spsc_load_acquire(&q->tail);
+		if(head - q->tail_cache > q->mask)
+		{
+			q->full++;
+			return -1;
+		}
+	}
+	memcpy(q->buf + (size_t)(head & q->mask) * q->msg_size, msg, q->msg_size);
+	spsc_store_release(&q->head, head + 1);   // publishes the whole message
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Consumer: copy the oldest message out, returns -1 if the ring is empty
+---------------------------------------------------------------------------*/
+int spsc_pop (spsc_t *q, void *msg)
+{
+	unsigned int tail = q->tail;
+
+	if(tail == q->head_cache)
+	{
+		q->head_cache = spsc_load_acquire(&q->head);
+		if(tail == q->head_cache)
+			return -1;
+	}
+	memcpy(msg, q->buf + (size_t)(tail & q->mask) * q->msg_size, q->msg_size);
+	spsc_store_release(&q->tail, tail + 1);   // hands the slot back to the producer
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  A flag one thread sets and another polls, with the same acquire / release
+  ordering as the ring indices
+---------------------------------------------------------------------------*/
+int spsc_flag_load (const int *flag)
+{
+#if defined(_MSC_VER)
+	int v = *(const volatile int *)flag;
+	_ReadWriteBarrier();
+	return v;
+#else
+	return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
+void spsc_flag_store (int *flag, int v)
+{
+#if defined(_MSC_VER)
+	_ReadWriteBarrier();
+	*(volatile int *)flag = v;
+#else
+	__atomic_store_n(flag, v, __ATOMIC_RELEASE);
+#endif
+}
@@ -0,0 +1,51 @@
+/*===============================================================================================================================
+  spsc.h
+
+  Lock-free single-producer / single-consumer channel of fixed-size messages. One thread pushes and one thread pops.
+  A message is copied in whole before the producer publishes it, so the consumer never sees a half-written one. Push
+  and pop never block and never take a lock: they return -1 when the ring is full or empty and the caller decides
+  what to do. Head and tail sit on their own cache lines, and each side keeps a cached copy of the other's index, so
+  the two cores only exchange a line when the cached view runs out.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_SPSC_H
+#define WFS_DMH_SPSC_H
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  SPSC_CACHE_LINE               (64)
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	volatile unsigned int  head;         // messages pushed, written by the producer only
+	unsigned int           tail_cache;   // producer's last view of tail
+	long                   full;         // pushes refused because the ring was full
+	char                   pad0[SPSC_CACHE_LINE - 2 * sizeof(unsigned int) - sizeof(long)];
+
+	volatile unsigned int  tail;         // messages popped, written by the consumer only
+	unsigned int           head_cache;   // consumer's last view of head
+	char                   pad1[SPSC_CACHE_LINE - 2 * sizeof(unsigned int)];
+
+	unsigned int           mask;         // capacity - 1, capacity is a power of two
+	unsigned int           msg_size;
+	unsigned char          *buf;
+} spsc_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  spsc_init (spsc_t *q, unsigned int capacity, unsigned int msg_size);
+void spsc_free (spsc_t *q);
+
+int  spsc_push (spsc_t *q, const void *msg);
+int  spsc_pop (spsc_t *q, void *msg);
+
+int  spsc_flag_load (const int *flag);
+void spsc_flag_store (int *flag, int v);
+
+#endif // WFS_DMH_SPSC_H
@@ -0,0 +1,158 @@
+/*===============================================================================================================================
+  startup.c
+
+  Startup dependency graph, see startup.h.
+===============================================================================================================================*/
+
+#include "startup.h"
+#include "rtloop.h"
+#include <string.h>
+
+
+
+typedef struct
+{
+	startup_t  *su;
+	int        index;
+} startup_worker_t;
+
+
+
+/*---------------------------------------------------------------------------
+  Empty graph
+---------------------------------------------------------------------------*/
+void startup_init (startup_t *su)
+{
+	memset(su, 0, sizeof(*su));
+}
+
+
+/*---------------------------------------------------------------------------
+  Add a step that runs after the steps in after (STARTUP_AFTER of earlier
+  steps only, so the graph has no cycles). Returns its index, -1 if the
+  graph is full or after names a later step.
+---------------------------------------------------------------------------*/
+int startup_add (startup_t *su, const char *name, startup_fn_t fn, void *ctx, unsigned int after)
+{
+	startup_step_t *s;
+
+	if(su->n_steps >= STARTUP_MAX_STEPS || (after >> su->n_steps))
+		return -1;
+	s = &su->step[su->n_steps];
+	memset(s, 0, sizeof(*s));
+	s->name  = name;
+	s->fn    = fn;
+	s->ctx   = ctx;
+	s->after = after;
+	s->state = STARTUP_PENDING;
+	return su->n_steps++;
+}
+
+
+/*---------------------------------------------------------------------------
+  Wait for the steps before index, run it and wake the steps after it
+---------------------------------------------------------------------------*/
+static void startup_step (startup_t *su, int index)
+{
+	startup_step_t *s = &su->step[index];
+	int            d, ready, failed;
+
+	pthread_mutex_lock(&su->lock);
+	for(;;)
+	{
+		ready = 1;
+		failed = 0;
+		for(d = 0; d < index; d++)
+			if(s->after & STARTUP_AFTER(d))
+			{
+				if(su->step[d].state == STARTUP_PENDING)
+					ready = 0;
+				else if(su->step[d].state != STARTUP_DONE)
+					failed = 1;
+			}
+		if(failed || ready)
+			break;
+		pthread_cond_wait(&su->changed, &su->lock);
+	}
+	pthread_mutex_unlock(&su->lock);
+
+	s->t_start_ns = rt_now_ns() - su->t0_ns;
+	if(!failed)
+		s->err = s->fn(s->ctx);
+	s->t_end_ns = rt_now_ns() - su->t0_ns;
+
+	pthread_mutex_lock(&su->lock);
+	s->state = failed ? STARTUP_SKIPPED : (s->err ? STARTUP_FAILED : STARTUP_DONE);
+	pthread_cond_broadcast(&su->changed);
+	pthread_mutex_unlock(&su->lock);
+}
+
+
+static void *startup_thread (void *arg)
+{
+	startup_worker_t *w = (startup_worker_t *)arg;
+
+	startup_step(w->su, w->index);
+	return NULL;
+}
+
+
+/*---------------------------------------------------------------------------
+  Run the graph to its end. A step whose thread does not start runs on the
+  calling thread. Returns the index of the first failed step, -1 if all
+  steps succeeded.
+---------------------------------------------------------------------------*/
+int startup_run (startup_t *su)
+{
+	pthread_t         thread[STARTUP_MAX_STEPS];
+	startup_worker_t  worker[STARTUP_MAX_STEPS];
+	int               started[STARTUP_MAX_STEPS];
+	int               i;
+
+	pthread_mutex_init(&su->lock, NULL);
+	pthread_cond_init(&su->changed, NULL);
+	su->t0_ns = rt_now_ns();
+	for(i = 0; i < su->n_steps; i++)
+	{
+		worker[i].su    = su;
+		worker[i].index = i;
+		started[i] = (pthread_create(&thread[i], NULL, startup_thread, &worker[i]) == 0);
+	}
+	// steps only wait for earlier ones, so running the leftovers in order cannot block
+	for(i = 0; i < su->n_steps; i++)
+		if(!started[i])
+			startup_step(su, i);
+	for(i = 0; i < su->n_steps; i++)
+		if(started[i])
+			pthread_join(thread[i], NULL);
+	su->total_ns = rt_now_ns() - su->t0_ns;
+	pthread_cond_destroy(&su->changed);
+	pthread_mutex_destroy(&su->lock);
+
+	for(i = 0; i < su->n_steps; i++)
+		if(su->step[i].state == STARTUP_FAILED)
+			return i;
+	return -1;
+}
+
+
+/*---------------------------------------------------------------------------
+  Timeline of the steps, the graph time and the sum of the step times
+---------------------------------------------------------------------------*/
+void startup_report (const startup_t *su, FILE *fp)
+{
+	static const char *state_name[] = { "pending", "ok", "FAILED", "skipped" };
+	double serial_ns = 0.0;
+	int    i;
+
+	fprintf(fp, "Startup step            start ms    end ms   time ms\n");
+	for(i = 0; i < su->n_steps; i++)
+	{
+		const startup_step_t *s = &su->step[i];
+
+		fprintf(fp, "  %-20s %9.1f %9.1f %9.1f   %s\n", s->name, s->t_start_ns * 1e-6, s->t_end_ns * 1e-6,
+		        (s->t_end_ns - s->t_start_ns) * 1e-6, state_name[s->state]);
+		serial_ns += s->t_end_ns - s->t_start_ns;
+	}
+	fprintf(fp, "Startup took %.1f ms, the steps one after the other %.1f ms.\n", su->total_ns * 1e-6, serial_ns * 1e-6);
+}
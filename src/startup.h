@@ -0,0 +1,64 @@
+/*===============================================================================================================================
+  startup.h
+
+  Startup as a dependency graph. Every step names the earlier steps it needs, and every step runs on its own thread as
+  soon as they are done, so the steps of independent devices (the WFS and the DMH sit on separate USB links) overlap.
+  A step that fails stops everything that depends on it, the others run to their end. Start and end of every step
+  are kept, the report shows where the time went and what the serial sequence would have taken.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_STARTUP_H
+#define WFS_DMH_STARTUP_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  STARTUP_MAX_STEPS             (16)
+
+#define  STARTUP_PENDING               (0)
+#define  STARTUP_DONE                  (1)
+#define  STARTUP_FAILED                (2)
+#define  STARTUP_SKIPPED               (3)   // a step it depends on failed
+
+#define  STARTUP_AFTER(step)           (1u << (step))  // dependency mask of one step, masks combine with |
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef int (*startup_fn_t) (void *ctx);  // 0 on success, the error code otherwise
+
+typedef struct
+{
+	const char      *name;
+	startup_fn_t    fn;
+	void            *ctx;
+	unsigned int    after;           // STARTUP_AFTER() of the steps that run first
+	int             state;
+	int             err;
+	double          t_start_ns;      // relative to the start of the graph
+	double          t_end_ns;
+} startup_step_t;
+
+typedef struct
+{
+	int              n_steps;
+	startup_step_t   step[STARTUP_MAX_STEPS];
+	double           t0_ns;
+	double           total_ns;
+	pthread_mutex_t  lock;
+	pthread_cond_t   changed;
+} startup_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+void startup_init (startup_t *su);
+int  startup_add (startup_t *su, const char *name, startup_fn_t fn, void *ctx, unsigned int after);
+int  startup_run (startup_t *su);
+void startup_report (const startup_t *su, FILE *fp);
+
+#endif // WFS_DMH_STARTUP_H
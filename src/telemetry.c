@@ -0,0 +1,149 @@
+/*===============================================================================================================================
+  telemetry.c
+
+  Memory-mapped telemetry ring, see telemetry.h.
+===============================================================================================================================*/
+
+#include "telemetry.h"
+#include "rtloop.h"
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+
+
+/*---------------------------------------------------------------------------
+  Create the file at its full size and map it
+---------------------------------------------------------------------------*/
+static int tlm_map (tlm_t *tl, const char *path)
+{
+#if defined(_WIN32)
+	tl->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(tl->file == INVALID_HANDLE_VALUE)
+		return -1;
+	tl->mapping = CreateFileMappingA(tl->file, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)tl->size >> 32), (DWORD)tl->size, NULL);
+	if(!tl->mapping)
+	{
+		CloseHandle(tl->file);
+		return -1;
+	}
+	tl->header = MapViewOfFile(tl->mapping, FILE_MAP_WRITE, 0, 0, tl->size);
+	if(!tl->header)
+	{
+		CloseHandle(tl->mapping);
+		CloseHandle(tl->file);
+		return -1;
+	}
+#else
+	void *p;
+
+	tl->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(tl->fd < 0)
+		return -1;
+	if(ftruncate(tl->fd, (off_t)tl->size))
+	{
+		close(tl->fd);
+		return -1;
+	}
+	p = mmap(NULL, tl->size, PROT_READ | PROT_WRITE, MAP_SHARED, tl->fd, 0);
+	if(p == MAP_FAILED)
+	{
+		close(tl->fd);
+		return -1;
+	}
+	tl->header = p;
+#endif
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Ring of capacity records in a new file at path, any old file is replaced.
+  stage_name lists the n_stages stage names stored with the header.
+---------------------------------------------------------------------------*/
+int tlm_open (tlm_t *tl, const char *path, uint32_t capacity, int n_stages, const char *stage_name[])
+{
+	tlm_header_t *h;
+
+	memset(tl, 0, sizeof(*tl));
+	if(capacity == 0 || n_stages > TLM_MAX_STAGES)
+		return -1;
+	tl->capacity = capacity;
+	tl->size     = TLM_HEADER_SIZE + (size_t)capacity * sizeof(tlm_record_t);
+	if(tlm_map(tl, path))
+		return -1;
+
+	// touch every page now, the first write into a fresh page would otherwise fault on the loop thread
+	memset(tl->header, 0, tl->size);
+	tl->record = (tlm_record_t *)((char *)tl->header + TLM_HEADER_SIZE);
+
+	h = tl->header;
+	memcpy(h->magic, TLM_MAGIC, sizeof(h->magic));
+	h->version     = TLM_VERSION;
+	h->header_size = TLM_HEADER_SIZE;
+	h->record_size = sizeof(tlm_record_t);
+	h->capacity    = capacity;
+	h->n_stages    = n_stages;
+	for(int i = 0; i < n_stages; i++)
+		strncpy(h->stage_name[i], stage_name[i], TLM_STAGE_NAME - 1);
+	h->t0_ns     = rt_now_ns();
+	h->t0_unix_s = (double)time(NULL);
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Write the mapping back and release it
+---------------------------------------------------------------------------*/
+void tlm_close (tlm_t *tl)
+{
+	if(!tl->header)
+		return;
+#if defined(_WIN32)
+	FlushViewOfFile(tl->header, 0);
+	UnmapViewOfFile(tl->header);
+	CloseHandle(tl->mapping);
+	CloseHandle(tl->file);
+#else
+	msync(tl->header, tl->size, MS_SYNC);
+	munmap(tl->header, tl->size);
+	close(tl->fd);
+#endif
+	tl->header = NULL;
+	tl->record = NULL;
+}
+
+
+/*---------------------------------------------------------------------------
+  Slot of the next record, filled in place by the caller. Every field is
+  overwritten with the last contents of the slot until the caller sets it.
+---------------------------------------------------------------------------*/
+tlm_record_t *tlm_begin (tlm_t *tl)
+{
+	tlm_record_t *r = &tl->record[tl->next % tl->capacity];
+
+	r->seq = tl->next;
+	return r;
+}
+
+
+/*---------------------------------------------------------------------------
+  Publish the record filled since tlm_begin
+---------------------------------------------------------------------------*/
+void tlm_commit (tlm_t *tl)
+{
+	tl->next++;
+#if defined(_MSC_VER)
+	_ReadWriteBarrier();
+	tl->header->written = tl->next;
+#else
+	__atomic_store_n(&tl->header->written, tl->next, __ATOMIC_RELEASE); // a live reader never sees a count ahead of the data
+#endif
+}
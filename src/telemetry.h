@@ -0,0 +1,103 @@
+/*===============================================================================================================================
+  telemetry.h
+
+  Binary telemetry of every loop iteration in a memory-mapped ring file. The file is created at its full size and
+  prefaulted when it is opened, so writing a record is a plain memory copy into the mapping: no system call and no
+  page fault on the loop thread. When the ring is full the oldest records are overwritten. The kernel writes the dirty
+  pages back in the background, and the file is complete after tlm_close().
+
+  File layout (little endian, as written by the host):
+    header    TLM_HEADER_SIZE bytes, tlm_header_t at offset 0
+    records   capacity x tlm_record_t, record seq is stored at index seq % capacity
+  The newest record is seq = written - 1. A reader takes records with seq >= written - capacity and sorts them by seq.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_TELEMETRY_H
+#define WFS_DMH_TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  TLM_MAGIC                     "WFSTLM\0\0"
+#define  TLM_VERSION                   (2)       // 2: tilt arm voltages and tilt error, tip/tilt only and held records
+#define  TLM_HEADER_SIZE               (4096)    // one page, records start page aligned
+#define  TLM_MAX_STAGES                (8)       // RT_MAX_STAGES
+#define  TLM_STAGE_NAME                (16)
+#define  TLM_ZERNIKES                  (16)      // driver index 0 .. 15, as in the loop's Zernike arrays
+#define  TLM_RESIDUALS                 (12)      // Z4 .. Z15
+#define  TLM_SEGMENTS                  (40)      // MAX_SEGMENTS
+#define  TLM_TILT_ARMS                 (3)       // HAL_MAX_TILT
+#define  TLM_TILT_AXES                 (2)       // TT_AXES
+
+#define  TLM_FLAG_PAUSED               (0x01)    // mirror held by the operator, no correction this iteration
+#define  TLM_FLAG_CONVERGED            (0x02)    // residual inside the lock band
+#define  TLM_FLAG_HIGHSPEED            (0x04)    // frame taken in highspeed mode
+#define  TLM_FLAG_ZONAL                (0x08)    // zonal path, zernike[] was not measured and is 0
+#define  TLM_FLAG_TILT_ONLY            (0x10)    // tip/tilt only frame, no high-order correction: zernike[] and residual[] are 0
+#define  TLM_FLAG_HELD                 (0x20)    // multi-rate: no mode group due, the segments held, residual[] is 0
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	char               magic[8];
+	uint32_t           version;
+	uint32_t           header_size;
+	uint32_t           record_size;
+	uint32_t           capacity;                                // records in the ring
+	uint32_t           n_stages;
+	uint32_t           reserved;
+	char               stage_name[TLM_MAX_STAGES][TLM_STAGE_NAME];
+	double             t0_ns;                                   // monotonic clock at tlm_open, record times are relative to it
+	double             t0_unix_s;                               // wall clock at tlm_open
+	volatile uint64_t  written;                                 // records committed since tlm_open
+} tlm_header_t;
+
+typedef struct
+{
+	uint64_t  seq;
+	double    t_ns;                         // acquisition start of the frame, since t0_ns
+	float     zernike[TLM_ZERNIKES];        // measured, um
+	float     target[TLM_ZERNIKES];         // um
+	float     residual[TLM_RESIDUALS];      // Z4 .. Z15 after subtracting the target, um
+	float     voltage[TLM_SEGMENTS];        // segment voltages sent to the mirror, V
+	float     exposure_ms;
+	float     gain;                         // camera master gain
+	float     stage_us[TLM_MAX_STAGES];     // stage durations in the order of tlm_header_t.stage_name
+	uint32_t  flags;                        // TLM_FLAG_*
+	uint32_t  clamped;                      // segments clamped to the voltage range
+	float     tilt_voltage[TLM_TILT_ARMS];  // tilt arm voltages sent to the mirror, V, 0 without tip/tilt
+	float     tilt_error[TLM_TILT_AXES];    // tip/tilt signal - setpoint of this frame, NaN without a tilt measurement
+	uint32_t  reserved;
+} tlm_record_t;
+
+typedef struct
+{
+	tlm_header_t  *header;
+	tlm_record_t  *record;
+	uint32_t      capacity;
+	uint64_t      next;                     // seq of the record being filled
+	size_t        size;
+#if defined(_WIN32)
+	void          *file;
+	void          *mapping;
+#else
+	int           fd;
+#endif
+} tlm_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int           tlm_open (tlm_t *tl, const char *path, uint32_t capacity, int n_stages, const char *stage_name[]);
+void          tlm_close (tlm_t *tl);
+
+tlm_record_t *tlm_begin (tlm_t *tl);
+void          tlm_commit (tlm_t *tl);
+
+#endif // WFS_DMH_TELEMETRY_H
@@ -0,0 +1,91 @@
+/*===============================================================================================================================
+  tiptilt.c
+
+  Tip/tilt offload, see tiptilt.h.
+===============================================================================================================================*/
+
+#include "tiptilt.h"
+#include <string.h>
+#include <math.h>
+
+
+
+/*---------------------------------------------------------------------------
+  Controller of n_tilt arms around bias, no response measured yet. Returns
+  -1 if the mirror has fewer arms than axes or more than HAL_MAX_TILT.
+---------------------------------------------------------------------------*/
+int tt_init (tt_t *tt, int n_tilt, int source, const double bias[], double v_min, double v_max, ctrl_param_t param)
+{
+	memset(tt, 0, sizeof(*tt));
+	if(n_tilt < TT_AXES || n_tilt > HAL_MAX_TILT)
+		return -1;
+	tt->n_tilt = n_tilt;
+	tt->source = source;
+	tt->v_min  = v_min;
+	tt->v_max  = v_max;
+	memcpy(tt->bias, bias, sizeof(double) * n_tilt);
+	memcpy(tt->voltage, bias, sizeof(double) * n_tilt);
+	return ctrl_init(&tt->ctrl, TT_AXES, n_tilt, param);
+}
+
+
+/*---------------------------------------------------------------------------
+  Take the measured response im (TT_AXES x n_tilt) and compute the arm
+  voltages per unit of signal, cm = im' (im im')^-1. Returns -1 if the arms
+  do not move the signal along both axes, the old matrices stay then.
+---------------------------------------------------------------------------*/
+int tt_set_response (tt_t *tt, const double im[])
+{
+	const double  *ax = im, *ay = im + tt->n_tilt;
+	double        a = 0.0, b = 0.0, c = 0.0, det, mean, diff, l_min, l_max;
+	int           k;
+
+	for(k = 0; k < tt->n_tilt; k++)
+	{
+		a += ax[k] * ax[k];
+		b += ax[k] * ay[k];
+		c += ay[k] * ay[k];
+	}
+	// eigenvalues of the 2 x 2 normal matrix are the squared singular values of im
+	mean  = 0.5 * (a + c);
+	diff  = sqrt(0.25 * (a - c) * (a - c) + b * b);
+	l_max = mean + diff;
+	l_min = mean - diff;
+	if(!(l_max > 0.0) || l_min < TT_RCOND * TT_RCOND * l_max)
+		return -1;
+
+	det = a * c - b * b;
+	for(k = 0; k < tt->n_tilt; k++)
+	{
+		tt->cm[k * TT_AXES + 0] = ( c * ax[k] - b * ay[k]) / det;
+		tt->cm[k * TT_AXES + 1] = (-b * ax[k] + a * ay[k]) / det;
+	}
+	memcpy(tt->im, im, sizeof(double) * TT_AXES * tt->n_tilt);
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  One step from the signal of the latest frame, the new arm voltages are in
+  tt->voltage. Returns the number of arms at a voltage limit.
+---------------------------------------------------------------------------*/
+int tt_update (tt_t *tt, const double signal[])
+{
+	int i;
+
+	for(i = 0; i < TT_AXES; i++)
+		tt->error[i] = signal[i] - tt->setpoint[i];
+	tt->updates++;
+	return ctrl_apply(&tt->ctrl, tt->error, tt->cm, tt->im, tt->bias, tt->v_min, tt->v_max, tt->voltage);
+}
+
+
+/*---------------------------------------------------------------------------
+  Back to the bias voltages, the integrators start from zero
+---------------------------------------------------------------------------*/
+void tt_reset (tt_t *tt)
+{
+	ctrl_reset(&tt->ctrl);
+	memcpy(tt->voltage, tt->bias, sizeof(double) * tt->n_tilt);
+	memset(tt->error, 0, sizeof(tt->error));
+}
@@ -0,0 +1,56 @@
+/*===============================================================================================================================
+  tiptilt.h
+
+  Tip/tilt offload to the tilt arms of the DMH40. The high-order loop sees spot deviations with the average tilt taken
+  out, so its segments spend no stroke on beam pointing. This controller drives the tilt arms from a cheap two-axis
+  signal instead: the mean spot deviation (the wavefront tilt, px) or the beam centroid on the sensor (mm). It runs on
+  every frame, also on the frames the high-order correction skips, with its own gain and leak.
+
+  The response of the signal to every arm is measured push-pull at startup. The arms are driven through the
+  minimum-norm inverse of that 2 x n_tilt matrix, so they never move together and keep their common stroke. The
+  integrators are those of control.h, with the same anti-windup against the arm voltage range.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_TIPTILT_H
+#define WFS_DMH_TIPTILT_H
+
+#include "hal.h"
+#include "control.h"
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  TT_AXES                       (2)
+#define  TT_RCOND                      (0.05)    // smallest singular value of the response relative to the largest
+
+#define  TT_SOURCE_SPOTS               (0)       // mean spot deviation to the reference, px
+#define  TT_SOURCE_BEAM                (1)       // intensity centroid of the frame, mm (WFS_CalcBeamCentroidDia)
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	int      n_tilt;
+	int      source;                         // TT_SOURCE_*
+	double   im[TT_AXES * HAL_MAX_TILT];     // signal per volt of each arm, TT_AXES x n_tilt
+	double   cm[HAL_MAX_TILT * TT_AXES];     // n_tilt x TT_AXES
+	double   bias[HAL_MAX_TILT];             // arm voltages the response was measured around
+	double   setpoint[TT_AXES];              // signal the loop holds
+	double   v_min, v_max;
+	ctrl_t   ctrl;
+	double   voltage[HAL_MAX_TILT];          // last command
+	double   error[TT_AXES];                 // last signal - setpoint
+	long     updates;
+} tt_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  tt_init (tt_t *tt, int n_tilt, int source, const double bias[], double v_min, double v_max, ctrl_param_t param);
+int  tt_set_response (tt_t *tt, const double im[]);
+int  tt_update (tt_t *tt, const double signal[]);
+void tt_reset (tt_t *tt);
+
+#endif // WFS_DMH_TIPTILT_H
@@ -0,0 +1,259 @@
+/*===============================================================================================================================
+  vbox.c
+
+  Constrained projection onto the segment voltage range, see vbox.h.
+===============================================================================================================================*/
+
+#include "vbox.h"
+#include "linalg.h"
+#include <string.h>
+
+
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  VBOX_TOLERANCE_V              (1e-9)    // steps below this are the optimum
+
+
+
+/*---------------------------------------------------------------------------
+  Projection for n segments. im is the n_modes x n interaction matrix, NULL
+  to clip. iterations is the budget per frame, 0 clips as well. Returns -1
+  for too many segments.
+---------------------------------------------------------------------------*/
+int vbox_init (vbox_t *vb, int n, const double im[], int n_modes, int iterations)
+{
+	int     i, j, k;
+	double  acc, diag = 0.0;
+
+	if(n < 1 || n > VBOX_MAX_SEGMENTS)
+		return -1;
+	memset(vb, 0, sizeof(*vb));
+	vb->n          = n;
+	vb->iterations = (iterations > 0) ? iterations : 0;
+	if(!im)
+		return 0;
+
+	for(i = 0; i < n; i++)
+		for(j = 0; j < n; j++)
+		{
+			acc = 0.0;
+			for(k = 0; k < n_modes; k++)
+				acc += im[k * n + i] * im[k * n + j];
+			vb->h[i * n + j] = acc;
+		}
+	for(i = 0; i < n; i++)
+		diag += vb->h[i * n + i] / n;
+	if(diag <= 0.0)
+		return 0;   // no response measured, clipping is all there is
+	for(i = 0; i < n; i++)
+		vb->h[i * n + i] += VBOX_RIDGE * diag;
+	vb->weighted = 1;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Forget the counters
+---------------------------------------------------------------------------*/
+void vbox_reset (vbox_t *vb)
+{
+	vb->frames         = 0;
+	vb->unfinished     = 0;
+	vb->iterations_run = 0;
+	memset(vb->saturated, 0, sizeof(vb->saturated));
+}
+
+
+/*---------------------------------------------------------------------------
+  Cost of the voltages v for the command c, r is scratch
+---------------------------------------------------------------------------*/
+static double vbox_cost (const vbox_t *vb, const double v[], const double c[], double r[], double hr[])
+{
+	int     i;
+	double  acc = 0.0;
+
+	for(i = 0; i < vb->n; i++)
+		r[i] = v[i] - c[i];
+	la_gemv(vb->h, vb->n, vb->n, r, hr);
+	for(i = 0; i < vb->n; i++)
+		acc += r[i] * hr[i];
+	return acc;
+}
+
+
+/*---------------------------------------------------------------------------
+  Voltages in [vmin, vmax] that deliver cmd best, cmd and voltage may be the
+  same array. Returns the number of segments left at a limit, these are the
+  first held on the next call.
+---------------------------------------------------------------------------*/
+int vbox_project (vbox_t *vb, const double cmd[], double vmin, double vmax, double voltage[])
+{
+	double       c[VBOX_MAX_SEGMENTS], g[VBOX_MAX_SEGMENTS], p[VBOX_MAX_SEGMENTS], hr[VBOX_MAX_SEGMENTS];
+	signed char  at[VBOX_MAX_SEGMENTS];   // -1 held at vmin, +1 at vmax, 0 free
+	int          idx[VBOX_MAX_SEGMENTS];
+	int          i, j, k, it, n = vb->n, n_free, block, out = 0, done = 0, solve = vb->weighted && vb->iterations;
+	double       alpha, a, step, pull, best;
+
+	// clipping is the answer when nothing is outside
+	for(i = 0; i < n; i++)
+	{
+		c[i] = cmd[i];
+		out += (c[i] < vmin || c[i] > vmax);
+	}
+	if(!out)
+	{
+		memcpy(voltage, c, sizeof(double) * n);
+		memset(vb->held, 0, sizeof(vb->held));
+		return 0;
+	}
+	vb->frames++;
+
+	// start from the clipped command with the segments of the last frame's answer held as well, from one frame to
+	// the next the same segments usually end at a limit
+	for(i = 0; i < n; i++)
+	{
+		at[i] = (c[i] < vmin) ? -1 : (c[i] > vmax) ? 1 : (solve ? vb->held[i] : 0);
+		voltage[i] = (at[i] < 0) ? vmin : (at[i] > 0) ? vmax : c[i];
+	}
+
+	for(it = 0; solve && it < vb->iterations; it++)
+	{
+		vb->iterations_run++;
+
+		// gradient h (v - cmd), then the step of the free segments with the held ones fixed: h_ff p = -g_f
+		for(i = 0; i < n; i++)
+			p[i] = voltage[i] - c[i];
+		la_gemv(vb->h, n, n, p, g);
+		n_free = 0;
+		for(i = 0; i < n; i++)
+			if(!at[i])
+				idx[n_free++] = i;
+		step = 0.0;
+		if(n_free)
+		{
+			for(j = 0; j < n_free; j++)
+			{
+				for(k = 0; k < n_free; k++)
+					vb->work[j * n_free + k] = vb->h[idx[j] * n + idx[k]];
+				p[j] = -g[idx[j]];
+			}
+			if(la_cholesky_solve(vb->work, n_free, p))
+				break;
+			for(j = 0; j < n_free; j++)
+				if(p[j] > step || -p[j] > step)
+					step = (p[j] > 0.0) ? p[j] : -p[j];
+		}
+
+		if(step > VBOX_TOLERANCE_V)
+		{
+			// as far as the box allows, the segment that stops the step is held from now on
+			alpha = 1.0;
+			block = -1;
+			for(j = 0; j < n_free; j++)
+			{
+				i = idx[j];
+				if(voltage[i] + p[j] > vmax)
+					a = (vmax - voltage[i]) / p[j];
+				else if(voltage[i] + p[j] < vmin)
+					a = (vmin - voltage[i]) / p[j];
+				else
+					continue;
+				if(a < alpha)
+				{
+					alpha = a;
+					block = j;
+				}
+			}
+			for(j = 0; j < n_free; j++)
+			{
+				i = idx[j];
+				voltage[i] += alpha * p[j];
+				if(voltage[i] < vmin)
+					voltage[i] = vmin;
+				else if(voltage[i] > vmax)
+					voltage[i] = vmax;
+			}
+			if(block >= 0)
+			{
+				i = idx[block];
+				at[i] = (p[block] > 0.0) ? 1 : -1;
+				voltage[i] = (at[i] > 0) ? vmax : vmin;
+			}
+			continue;
+		}
+
+		// best with these segments held: let go of the one the gradient pulls into the box the hardest
+		block = -1;
+		best  = 0.0;
+		for(i = 0; i < n; i++)
+		{
+			if(!at[i])
+				continue;
+			pull = ((at[i] < 0) ? -g[i] : g[i]) / vb->h[i * n + i];
+			if(pull > VBOX_TOLERANCE_V && pull > best)
+			{
+				best  = pull;
+				block = i;
+			}
+		}
+		if(block < 0)
+		{
+			done = 1;
+			break;
+		}
+		at[block] = 0;
+	}
+	if(solve && !done)
+	{
+		// out of budget: keep the voltages only if they beat clipping
+		vb->unfinished++;
+		for(i = 0; i < n; i++)
+			p[i] = (c[i] < vmin) ? vmin : (c[i] > vmax) ? vmax : c[i];
+		if(vbox_cost(vb, p, c, g, hr) < vbox_cost(vb, voltage, c, g, hr))
+			for(i = 0; i < n; i++)
+			{
+				voltage[i] = p[i];
+				at[i] = (c[i] < vmin) ? -1 : (c[i] > vmax) ? 1 : 0;
+			}
+	}
+
+	out = 0;
+	for(i = 0; i < n; i++)
+	{
+		vb->held[i] = at[i];
+		if(at[i])
+		{
+			vb->saturated[i]++;
+			out++;
+		}
+	}
+	return out;
+}
+
+
+void vbox_report (const vbox_t *vb, FILE *fp)
+{
+	int i, any = 0;
+
+	if(!vb->frames)
+	{
+		fprintf(fp, "Voltage limits never reached\n");
+		return;
+	}
+	fprintf(fp, "Voltage limits: %ld frames outside, ", vb->frames);
+	if(vb->weighted && vb->iterations)
+		fprintf(fp, "%.1f iterations per frame, %ld past the budget of %d, ", (double)vb->iterations_run / vb->frames, vb->unfinished, vb->iterations);
+	else
+		fprintf(fp, "clipped, ");
+	fprintf(fp, "frames at a limit per segment:");
+	for(i = 0; i < vb->n; i++)
+		if(vb->saturated[i])
+		{
+			fprintf(fp, " %d:%ld", i + 1, vb->saturated[i]);
+			any = 1;
+		}
+	fprintf(fp, "%s\n", any ? "" : " none");
+}
@@ -0,0 +1,60 @@
+/*===============================================================================================================================
+  vbox.h
+
+  Constrained projection of a voltage command onto the segment range [vmin, vmax]. Clipping each segment on its own
+  moves the correction into modes nobody asked for: the clipped segment's share of a mode is lost, the other modes
+  see its response, and the integrators wind up on a residual the mirror cannot reach. The projection instead looks
+  for the voltages inside the box that deliver the command's Zernikes best,
+
+      minimize  |im (v - cmd)|^2 + ridge |v - cmd|^2   over  vmin <= v <= vmax
+
+  im is the interaction matrix of the native reconstructor. The ridge term keeps the segments that no mode sees
+  near their command and makes the problem strictly convex. Without an interaction matrix the metric is the
+  identity, and clipping is the exact answer.
+
+  The solver is a primal active-set method with a fixed budget of iterations per frame. It starts from the clipped
+  command with the segments that ended at a limit on the last frame held there as well, which from one frame to the
+  next is mostly the answer already. Each iteration is one Cholesky solve over the free segments. The voltages stay
+  inside the box after every iteration, and when the budget runs out they are kept only if they deliver the command
+  better than clipping. A command inside the box costs one pass over the segments, as before.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_VBOX_H
+#define WFS_DMH_VBOX_H
+
+#include <stdio.h>
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  VBOX_MAX_SEGMENTS             (64)
+#define  VBOX_RIDGE                    (1e-3)    // weight of the voltage change, relative to the mean diagonal of im^T im
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	int     n;                                              // segments
+	int     iterations;                                     // active-set iterations per frame, 0 clips
+	int     weighted;                                       // h is im^T im + ridge, else the identity
+	double  h[VBOX_MAX_SEGMENTS * VBOX_MAX_SEGMENTS];
+	double  work[VBOX_MAX_SEGMENTS * VBOX_MAX_SEGMENTS];    // free block of h for the solve
+	signed char held[VBOX_MAX_SEGMENTS];                    // limit of every segment in the last answer, -1, 0 or +1
+
+	long    frames;                                         // frames with the command outside the box
+	long    unfinished;                                     // of these, frames the budget ended before the optimum
+	long    iterations_run;
+	long    saturated[VBOX_MAX_SEGMENTS];                   // frames each segment ended at a limit
+} vbox_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  vbox_init (vbox_t *vb, int n, const double im[], int n_modes, int iterations);
+void vbox_reset (vbox_t *vb);
+int  vbox_project (vbox_t *vb, const double cmd[], double vmin, double vmax, double voltage[]);
+void vbox_report (const vbox_t *vb, FILE *fp);
+
+#endif // WFS_DMH_VBOX_H
@@ -0,0 +1,241 @@
+/*===============================================================================================================================
+  zfit.c
+
+  Zernike fit by a precomputed projection matrix, see zfit.h.
+===============================================================================================================================*/
+
+#include "zfit.h"
+#include "linalg.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+
+/*---------------------------------------------------------------------------
+  Allocate for up to max_sub lenslets and any order up to ZFIT_MAX_ORDER
+---------------------------------------------------------------------------*/
+int zfit_init (zfit_t *zf, int max_sub, int stride)
+{
+	memset(zf, 0, sizeof(*zf));
+	zf->max_sub    = max_sub;
+	zf->stride     = stride;
+	zf->generation = -1;
+	zf->idx        = calloc(max_sub, sizeof(int));
+	zf->basis      = calloc((size_t)2 * max_sub * (ZFIT_MAX_MODES - 1), sizeof(double));
+	zf->proj       = calloc((size_t)2 * max_sub * (ZFIT_MAX_MODES - 1), sizeof(double));
+	zf->slopes     = calloc((size_t)2 * max_sub, sizeof(double));
+	zf->coef       = calloc(ZFIT_MAX_MODES, sizeof(double));
+
+	if(!zf->idx || !zf->basis || !zf->proj || !zf->slopes || !zf->coef)
+	{
+		zfit_free(zf);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Release all buffers
+---------------------------------------------------------------------------*/
+void zfit_free (zfit_t *zf)
+{
+	free(zf->idx);
+	free(zf->basis);
+	free(zf->proj);
+	free(zf->slopes);
+	free(zf->coef);
+	zf->idx    = NULL;
+	zf->basis  = zf->proj = zf->slopes = zf->coef = NULL;
+	zf->n_sub  = zf->n_slopes = 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Radial order n and azimuthal frequency m of ANSI mode j (1-indexed), m < 0 for the sine terms
+---------------------------------------------------------------------------*/
+void zfit_mode_nm (int j, int *n, int *m)
+{
+	int k = j - 1;
+
+	*n = (int)ceil((-3.0 + sqrt(9.0 + 8.0 * k)) / 2.0);
+	*m = 2 * k - *n * (*n + 2);
+}
+
+
+/*---------------------------------------------------------------------------
+  R_n^m(rho), dR/drho and R/rho for m > 0
+---------------------------------------------------------------------------*/
+static void zfit_radial (int n, int m, double rho, double *r, double *dr, double *r_over_rho)
+{
+	double f, c;
+
+	*r = *dr = *r_over_rho = 0.0;
+	for(int k = 0; k <= (n - m) / 2; k++)
+	{
+		int p = n - 2 * k;
+
+		// (-1)^k (n-k)! / (k! ((n+m)/2-k)! ((n-m)/2-k)!)
+		c = (k & 1) ? -1.0 : 1.0;
+		for(f = 2.0; f <= n - k; f += 1.0)
+			c *= f;
+		for(f = 2.0; f <= k; f += 1.0)
+			c /= f;
+		for(f = 2.0; f <= (n + m) / 2 - k; f += 1.0)
+			c /= f;
+		for(f = 2.0; f <= (n - m) / 2 - k; f += 1.0)
+			c /= f;
+
+		*r += c * pow(rho, p);
+		if(p > 0)
+		{
+			*dr         += c * p * pow(rho, p - 1);
+			*r_over_rho += c * pow(rho, p - 1);
+		}
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+  Gradient of ANSI mode j at the normalised pupil position (x, y)
+---------------------------------------------------------------------------*/
+void zfit_mode_gradient (int j, double x, double y, double *dzdx, double *dzdy)
+{
+	int    n, m, am;
+	double rho = sqrt(x * x + y * y), ct = 1.0, st = 0.0, r, dr, rr, cm, sm;
+
+	zfit_mode_nm(j, &n, &m);
+	am = abs(m);
+	if(rho > 0.0)
+	{
+		ct = x / rho;
+		st = y / rho;
+	}
+	zfit_radial(n, am, rho, &r, &dr, &rr);
+	cm = cos(am * atan2(st, ct));
+	sm = sin(am * atan2(st, ct));
+
+	// d/dx = cos(t) d/drho - sin(t)/rho d/dt, d/dy = sin(t) d/drho + cos(t)/rho d/dt
+	if(m >= 0)
+	{
+		*dzdx = dr * cm * ct + rr * am * sm * st;
+		*dzdy = dr * cm * st - rr * am * sm * ct;
+	}
+	else
+	{
+		*dzdx = dr * sm * ct - rr * am * cm * st;
+		*dzdy = dr * sm * st + rr * am * cm * ct;
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+  Build and factor the projection for the lenslets inside the pupil that have a spot in dev_x/dev_y.
+  scale_x/scale_y are the lenslet positions in mm (WFS_GetXYScale). generation tags the geometry the
+  projection belongs to. Returns the rank of the basis, -1 on bad input.
+---------------------------------------------------------------------------*/
+int zfit_build (zfit_t *zf, int order, const zfit_geometry_t *geo, const float scale_x[], const float scale_y[],
+                const float dev_x[], const float dev_y[], int spots_x, int spots_y, int generation)
+{
+	double rx_mm = geo->diameter_x_mm / 2.0, ry_mm = geo->diameter_y_mm / 2.0, u, v, gx, gy;
+	int    x, y, j, n_fit;
+
+	if(order < 1 || order > ZFIT_MAX_ORDER || rx_mm <= 0.0 || ry_mm <= 0.0 || geo->slope_per_px <= 0.0)
+		return -1;
+
+	zf->order   = order;
+	zf->n_modes = (order + 1) * (order + 2) / 2;
+	zf->geo     = *geo;
+	zf->n_sub   = 0;
+	n_fit       = zf->n_modes - 1;
+
+	for(y = 0; y < spots_y; y++)
+		for(x = 0; x < spots_x && zf->n_sub < zf->max_sub; x++)
+		{
+			int k = y * zf->stride + x;
+			u = (scale_x[x] - geo->center_x_mm) / rx_mm;
+			v = (scale_y[y] - geo->center_y_mm) / ry_mm;
+			if(u * u + v * v <= 1.0 && !isnan(dev_x[k]) && !isnan(dev_y[k]))
+				zf->idx[zf->n_sub++] = k;
+		}
+	zf->n_slopes = 2 * zf->n_sub;
+	if(zf->n_slopes < n_fit)
+		return -1;
+
+	// slope of each mode in pixels of spot deviation per um of coefficient
+	for(int i = 0; i < zf->n_sub; i++)
+	{
+		x = zf->idx[i] % zf->stride;
+		y = zf->idx[i] / zf->stride;
+		u = (scale_x[x] - geo->center_x_mm) / rx_mm;
+		v = (scale_y[y] - geo->center_y_mm) / ry_mm;
+		for(j = 2; j <= zf->n_modes; j++)
+		{
+			zfit_mode_gradient(j, u, v, &gx, &gy);
+			zf->basis[(size_t)i * n_fit + j - 2]               = gx / (rx_mm * 1000.0) / geo->slope_per_px;
+			zf->basis[(size_t)(zf->n_sub + i) * n_fit + j - 2] = gy / (ry_mm * 1000.0) / geo->slope_per_px;
+		}
+	}
+
+	zf->rank = la_pinv(zf->basis, zf->n_slopes, n_fit, ZFIT_DEFAULT_RCOND, zf->proj);
+	zf->generation = (zf->rank > 0) ? generation : -1;
+	return zf->rank;
+}
+
+
+/*---------------------------------------------------------------------------
+  Slopes of the active lenslets of one frame (n_slopes, x then y) into the
+  scratch vector, which is returned
+---------------------------------------------------------------------------*/
+const double *zfit_slopes (zfit_t *zf, const float dev_x[], const float dev_y[])
+{
+	int   i, k;
+	float sx, sy;
+
+	for(i = 0; i < zf->n_sub; i++)
+	{
+		k  = zf->idx[i];
+		sx = dev_x[k];
+		sy = dev_y[k];
+		zf->slopes[i]             = isnan(sx) ? 0.0 : sx; // lost spots contribute nothing
+		zf->slopes[zf->n_sub + i] = isnan(sy) ? 0.0 : sy;
+	}
+	return zf->slopes;
+}
+
+
+/*---------------------------------------------------------------------------
+  Fit one frame of deviations, zernike[1 .. n_modes] receives the coefficients in um (index 0 is not touched)
+---------------------------------------------------------------------------*/
+void zfit_apply (zfit_t *zf, const float dev_x[], const float dev_y[], float zernike[])
+{
+	int   i, n_fit = zf->n_modes - 1;
+
+	zfit_slopes(zf, dev_x, dev_y);
+	la_gemv(zf->proj, n_fit, zf->n_slopes, zf->slopes, zf->coef);
+	zernike[1] = 0.0f;
+	for(i = 0; i < n_fit; i++)
+		zernike[i + 2] = (float)zf->coef[i];
+}
+
+
+/*---------------------------------------------------------------------------
+  Modes first .. last (2 .. n_modes) of the slope vector, e.g. a mean of
+  zfit_slopes over several frames, one row of the projection per mode. The
+  other entries of zernike are not touched.
+---------------------------------------------------------------------------*/
+void zfit_fit_modes (zfit_t *zf, const double slopes[], float zernike[], int first, int last)
+{
+	int   i;
+
+	if(first < 2)
+		first = 2;
+	if(last > zf->n_modes)
+		last = zf->n_modes;
+	if(last < first)
+		return;
+	la_gemv(zf->proj + (size_t)(first - 2) * zf->n_slopes, last - first + 1, zf->n_slopes, slopes, zf->coef);
+	for(i = first; i <= last; i++)
+		zernike[i] = (float)zf->coef[i - first];
+}
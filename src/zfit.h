@@ -0,0 +1,70 @@
+/*===============================================================================================================================
+  zfit.h
+
+  Zernike fit by a precomputed projection matrix. For a fixed pupil and lenslet grid the least-squares fit from spot
+  deviations to Zernike coefficients is a constant linear map. The basis of Zernike derivatives at the active lenslets
+  is built and factored once (SVD pseudo-inverse), and every frame then costs one gather and one GEMV.
+
+  Modes follow the ANSI order, 1-indexed like WFS_ZernikeLsf (1 piston, 2 tip y, 3 tilt x, 5 defocus, ...), as
+  polynomials R_n^m(rho) cos/sin(m theta) over the pupil ellipse without normalisation factors. Coefficients are in um.
+  Piston cannot be seen in slopes and is always returned as 0.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_ZFIT_H
+#define WFS_DMH_ZFIT_H
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  ZFIT_MAX_ORDER                (10)      // MAX_ZERNIKE_ORDERS of the driver
+#define  ZFIT_MAX_MODES                (66)      // modes up to ZFIT_MAX_ORDER, piston included
+#define  ZFIT_DEFAULT_RCOND            (1e-6)
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	double  center_x_mm;      // pupil as set with WFS_SetPupil
+	double  center_y_mm;
+	double  diameter_x_mm;
+	double  diameter_y_mm;
+	double  slope_per_px;     // camera pixel pitch / lenslet focal length, deviation in pixels to wavefront slope
+} zfit_geometry_t;
+
+typedef struct
+{
+	int              order;
+	int              n_modes;      // modes fitted including piston, zernike[1 .. n_modes] is written
+	int              n_sub;        // active lenslets
+	int              n_slopes;     // 2 * n_sub, x slopes first then y slopes
+	int              max_sub;
+	int              stride;       // row stride of the deviation arrays
+	int              rank;
+	int              generation;   // geometry generation the projection was built for, -1 if none
+	zfit_geometry_t  geo;
+
+	int              *idx;         // flat index y * stride + x of each active lenslet
+	double           *basis;       // n_slopes x (n_modes - 1), slope per um of each mode
+	double           *proj;        // (n_modes - 1) x n_slopes, pseudo-inverse of basis
+	double           *slopes;      // per-frame scratch, n_slopes
+	double           *coef;        // per-frame scratch, n_modes - 1
+} zfit_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  zfit_init (zfit_t *zf, int max_sub, int stride);
+void zfit_free (zfit_t *zf);
+
+int  zfit_build (zfit_t *zf, int order, const zfit_geometry_t *geo, const float scale_x[], const float scale_y[],
+                 const float dev_x[], const float dev_y[], int spots_x, int spots_y, int generation);
+void zfit_apply (zfit_t *zf, const float dev_x[], const float dev_y[], float zernike[]);
+const double *zfit_slopes (zfit_t *zf, const float dev_x[], const float dev_y[]);
+void zfit_fit_modes (zfit_t *zf, const double slopes[], float zernike[], int first, int last);
+
+void zfit_mode_nm (int j, int *n, int *m);
+void zfit_mode_gradient (int j, double x, double y, double *dzdx, double *dzdy);
+
+#endif // WFS_DMH_ZFIT_H
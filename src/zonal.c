@@ -0,0 +1,266 @@
+/*===============================================================================================================================
+  zonal.c
+
+  Slope-domain reconstructor, see zonal.h.
+===============================================================================================================================*/
+
+#include "zonal.h"
+#include "linalg.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+
+
+/*===============================================================================================================================
+  Defines
+===============================================================================================================================*/
+
+#define  ZONAL_FILE_MAGIC              (0x5a524457u) // "WDRZ"
+#define  ZONAL_FILE_VERSION            (1)
+
+typedef struct
+{
+	unsigned int  magic;
+	int           version;
+	int           n_act;
+	int           n_sub;
+	int           stride;
+	int           rank;
+	double        rcond;
+} zonal_file_header_t;
+
+
+
+/*---------------------------------------------------------------------------
+  Allocate for up to max_sub lenslets, stride is the row length of the deviation arrays
+---------------------------------------------------------------------------*/
+int zonal_init (zonal_t *zn, int n_act, int max_sub, int stride)
+{
+	memset(zn, 0, sizeof(*zn));
+	zn->n_act   = n_act;
+	zn->max_sub = max_sub;
+	zn->stride  = stride;
+	zn->idx     = calloc(max_sub, sizeof(int));
+	zn->im      = calloc((size_t)2 * max_sub * n_act, sizeof(double));
+	zn->cm      = calloc((size_t)2 * max_sub * n_act, sizeof(double));
+	zn->target  = calloc((size_t)2 * max_sub, sizeof(double));
+	zn->slopes  = calloc((size_t)2 * max_sub, sizeof(double));
+
+	if(!zn->idx || !zn->im || !zn->cm || !zn->target || !zn->slopes)
+	{
+		zonal_free(zn);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Release all buffers
+---------------------------------------------------------------------------*/
+void zonal_free (zonal_t *zn)
+{
+	free(zn->idx);
+	free(zn->im);
+	free(zn->cm);
+	free(zn->target);
+	free(zn->slopes);
+	zn->idx = NULL;
+	zn->im = zn->cm = zn->target = zn->slopes = NULL;
+}
+
+
+/*---------------------------------------------------------------------------
+  Select the lenslets with a detected spot (the driver reports NaN deviations for missing spots).
+  Returns the number of valid subapertures.
+---------------------------------------------------------------------------*/
+int zonal_set_mask (zonal_t *zn, const float dev_x[], const float dev_y[], int spots_x, int spots_y)
+{
+	int x, y, k;
+
+	zn->n_sub = 0;
+	for(y = 0; y < spots_y; y++)
+		for(x = 0; x < spots_x && zn->n_sub < zn->max_sub; x++)
+		{
+			k = y * zn->stride + x;
+			if(!isnan(dev_x[k]) && !isnan(dev_y[k]))
+				zn->idx[zn->n_sub++] = k;
+		}
+	zn->n_slopes = 2 * zn->n_sub;
+	memset(zn->target, 0, sizeof(double) * zn->n_slopes);
+	return zn->n_sub;
+}
+
+
+/*---------------------------------------------------------------------------
+  Store the slope response of segment act, (poked - reference) / poke
+---------------------------------------------------------------------------*/
+void zonal_set_response (zonal_t *zn, int act, const float dev_x[], const float dev_y[], const float ref_x[], const float ref_y[], double poke)
+{
+	int     i, k;
+	double  sx, sy;
+
+	for(i = 0; i < zn->n_sub; i++)
+	{
+		k  = zn->idx[i];
+		sx = (double)dev_x[k] - ref_x[k];
+		sy = (double)dev_y[k] - ref_y[k];
+		zn->im[i * zn->n_act + act]               = isnan(sx) ? 0.0 : sx / poke;
+		zn->im[(zn->n_sub + i) * zn->n_act + act] = isnan(sy) ? 0.0 : sy / poke;
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+  Store the slope response of segment act given as n_slopes values per volt,
+  x slopes first, NaN where the lenslet lost its spot
+---------------------------------------------------------------------------*/
+void zonal_set_column (zonal_t *zn, int act, const double resp[])
+{
+	for(int i = 0; i < zn->n_slopes; i++)
+		zn->im[i * zn->n_act + act] = isnan(resp[i]) ? 0.0 : resp[i];
+}
+
+
+/*---------------------------------------------------------------------------
+  Invert the slope interaction matrix, returns the rank kept or -1
+---------------------------------------------------------------------------*/
+int zonal_compute (zonal_t *zn, double rcond)
+{
+	zn->rcond = rcond;
+	zn->rank  = la_pinv(zn->im, zn->n_slopes, zn->n_act, rcond, zn->cm);
+	return zn->rank;
+}
+
+
+/*---------------------------------------------------------------------------
+  Slope offsets the loop should hold instead of the reference, NULL for flat
+---------------------------------------------------------------------------*/
+void zonal_set_target (zonal_t *zn, const double target[])
+{
+	if(target)
+		memcpy(zn->target, target, sizeof(double) * zn->n_slopes);
+	else
+		memset(zn->target, 0, sizeof(double) * zn->n_slopes);
+}
+
+
+/*---------------------------------------------------------------------------
+  Pack the valid deviations into a slope vector, lost spots contribute nothing
+---------------------------------------------------------------------------*/
+void zonal_gather (const zonal_t *zn, const float dev_x[], const float dev_y[], double slopes[])
+{
+	int    i, k;
+	float  sx, sy;
+
+	for(i = 0; i < zn->n_sub; i++)
+	{
+		k  = zn->idx[i];
+		sx = dev_x[k];
+		sy = dev_y[k];
+		slopes[i]             = isnan(sx) ? 0.0 : sx - zn->target[i];
+		slopes[zn->n_sub + i] = isnan(sy) ? 0.0 : sy - zn->target[zn->n_sub + i];
+	}
+}
+
+
+/*---------------------------------------------------------------------------
+  Voltage step dv that cancels the slope residual, one gather plus one GEMV per frame
+---------------------------------------------------------------------------*/
+void zonal_apply (zonal_t *zn, const float dev_x[], const float dev_y[], double dv[])
+{
+	zonal_gather(zn, dev_x, dev_y, zn->slopes);
+	la_gemv(zn->cm, zn->n_act, zn->n_slopes, zn->slopes, dv);
+}
+
+
+/*---------------------------------------------------------------------------
+  Write lenslet mask, interaction and control matrix at the current position
+  of fp, so they can be part of a larger file
+---------------------------------------------------------------------------*/
+int zonal_write (const zonal_t *zn, FILE *fp)
+{
+	zonal_file_header_t  hdr;
+	size_t               cnt = (size_t)zn->n_slopes * zn->n_act;
+
+	hdr.magic   = ZONAL_FILE_MAGIC;
+	hdr.version = ZONAL_FILE_VERSION;
+	hdr.n_act   = zn->n_act;
+	hdr.n_sub   = zn->n_sub;
+	hdr.stride  = zn->stride;
+	hdr.rank    = zn->rank;
+	hdr.rcond   = zn->rcond;
+
+	if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+	|| fwrite(zn->idx, sizeof(int), zn->n_sub, fp) != (size_t)zn->n_sub
+	|| fwrite(zn->im, sizeof(double), cnt, fp) != cnt
+	|| fwrite(zn->cm, sizeof(double), cnt, fp) != cnt)
+		return -1;
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Read what zonal_write wrote, zn must be initialised with the same segment
+  count and stride
+---------------------------------------------------------------------------*/
+int zonal_read (zonal_t *zn, FILE *fp)
+{
+	zonal_file_header_t  hdr;
+	size_t               cnt;
+
+	if(fread(&hdr, sizeof(hdr), 1, fp) != 1
+	|| hdr.magic != ZONAL_FILE_MAGIC || hdr.version != ZONAL_FILE_VERSION
+	|| hdr.n_act != zn->n_act || hdr.stride != zn->stride
+	|| hdr.n_sub <= 0 || hdr.n_sub > zn->max_sub)
+		return -1;
+
+	cnt = (size_t)2 * hdr.n_sub * zn->n_act;
+	if(fread(zn->idx, sizeof(int), hdr.n_sub, fp) != (size_t)hdr.n_sub
+	|| fread(zn->im, sizeof(double), cnt, fp) != cnt
+	|| fread(zn->cm, sizeof(double), cnt, fp) != cnt)
+		return -1;
+
+	zn->n_sub    = hdr.n_sub;
+	zn->n_slopes = 2 * hdr.n_sub;
+	zn->rank     = hdr.rank;
+	zn->rcond    = hdr.rcond;
+	zonal_set_target(zn, NULL);
+	return 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Store lenslet mask, interaction and control matrix in a binary file
+---------------------------------------------------------------------------*/
+int zonal_save (const zonal_t *zn, const char *path)
+{
+	FILE  *fp;
+
+	if((fp = fopen(path, "wb")) == NULL)
+		return -1;
+	if(zonal_write(zn, fp))
+	{
+		fclose(fp);
+		return -1;
+	}
+	return fclose(fp) ? -1 : 0;
+}
+
+
+/*---------------------------------------------------------------------------
+  Load a file written by zonal_save, zn must be initialised with the same segment count and stride
+---------------------------------------------------------------------------*/
+int zonal_load (zonal_t *zn, const char *path)
+{
+	FILE  *fp;
+	int   err;
+
+	if((fp = fopen(path, "rb")) == NULL)
+		return -1;
+	err = zonal_read(zn, fp);
+	fclose(fp);
+	return err;
+}
@@ -0,0 +1,55 @@
+/*===============================================================================================================================
+  zonal.h
+
+  Slope-domain (zonal) reconstructor. Spot deviations of all valid lenslets are multiplied straight into a
+  slope-to-voltage control matrix measured by poking each segment, so the loop skips the Zernike fit entirely.
+  Deviation arrays are the float[MAX_SPOTS_Y][MAX_SPOTS_X] layout of WFS_GetSpotDeviations, passed with their row stride.
+===============================================================================================================================*/
+
+#ifndef WFS_DMH_ZONAL_H
+#define WFS_DMH_ZONAL_H
+
+#include <stdio.h>
+
+/*===============================================================================================================================
+  Data type definitions
+===============================================================================================================================*/
+typedef struct
+{
+	int     n_act;      // mirror segments
+	int     n_sub;      // valid subapertures (lenslets)
+	int     n_slopes;   // 2 * n_sub, x slopes first then y slopes
+	int     max_sub;
+	int     stride;     // row stride of the deviation arrays
+	int     rank;
+	double  rcond;
+
+	int     *idx;       // flat index y * stride + x of each valid lenslet
+	double  *im;        // interaction matrix, n_slopes x n_act, pixel per volt
+	double  *cm;        // control matrix, n_act x n_slopes, volt per pixel
+	double  *target;    // slope offsets the loop drives to, n_slopes
+	double  *slopes;    // per-frame scratch, n_slopes
+} zonal_t;
+
+/*===============================================================================================================================
+  Function Prototypes
+===============================================================================================================================*/
+int  zonal_init (zonal_t *zn, int n_act, int max_sub, int stride);
+void zonal_free (zonal_t *zn);
+
+int  zonal_set_mask (zonal_t *zn, const float dev_x[], const float dev_y[], int spots_x, int spots_y);
+void zonal_set_response (zonal_t *zn, int act, const float dev_x[], const float dev_y[], const float ref_x[], const float ref_y[], double poke);
+void zonal_set_column (zonal_t *zn, int act, const double resp[]);
+int  zonal_compute (zonal_t *zn, double rcond);
+void zonal_set_target (zonal_t *zn, const double target[]);
+
+void zonal_gather (const zonal_t *zn, const float dev_x[], const float dev_y[], double slopes[]);
+void zonal_apply (zonal_t *zn, const float dev_x[], const float dev_y[], double dv[]);
+
+int  zonal_write (const zonal_t *zn, FILE *fp);
+int  zonal_read (zonal_t *zn, FILE *fp);
+
+int  zonal_save (const zonal_t *zn, const char *path);
+int  zonal_load (zonal_t *zn, const char *path);
+
+#endif // WFS_DMH_ZONAL_H